@@ -25,6 +25,8 @@
 
 #include "../../core.h"
 #include "../../settings.h"
+#include "../../thread_config.h"
+#include "../../common/frame_pacer.h"
 #include "../../common/nds_icon.h"
 #include "../../common/screen_layout.h"
 
@@ -41,8 +43,8 @@ std::string ndsPath = "", gbaPath = "";
 int ndsRomFd = -1, gbaRomFd = -1;
 int ndsSaveFd = -1, gbaSaveFd = -1;
 Core *core = nullptr;
+FramePacer pacer;
 ScreenLayout layout;
-uint32_t framebuffer[256 * 192 * 8];
 
 SLEngineItf audioEngine;
 SLObjectItf audioEngineObj;
@@ -58,19 +60,17 @@ int16_t audioRecorderBuffer[1024];
 
 void audioPlayerCallback(SLAndroidSimpleBufferQueueItf bq, void *context)
 {
-    // Get 699 samples at 32768Hz, which is equal to approximately 1024 samples at 48000Hz
-    uint32_t *original = core->spu.getSamples(699);
+    // Get 1024 samples, resampled from 32768Hz to 48000Hz by the core
+    uint32_t *original = core->spu.getSamples(1024, 48000);
 
-    // Stretch the 699 samples out to 1024 samples in the audio buffer
+    // Copy the samples to the audio buffer
     for (int i = 0; i < 1024; i++)
     {
-        uint32_t sample = original[i * 699 / 1024];
-        audioPlayerBuffer[i * 2 + 0] = sample >>  0;
-        audioPlayerBuffer[i * 2 + 1] = sample >> 16;
+        audioPlayerBuffer[i * 2 + 0] = original[i] >>  0;
+        audioPlayerBuffer[i * 2 + 1] = original[i] >> 16;
     }
 
     (*audioPlayerQueue)->Enqueue(audioPlayerQueue, audioPlayerBuffer, sizeof(audioPlayerBuffer));
-    delete[] original;
 }
 
 void audioRecorderCallback(SLAndroidSimpleBufferQueueItf bq, void *context)
@@ -145,7 +145,7 @@ extern "C" JNIEXPORT jint JNICALL Java_com_hydra_noods_FileBrowser_startCore(JNI
     try
     {
         if (core) delete core;
-        core = new Core(ndsPath, gbaPath, "", "", 0, ndsRomFd, gbaRomFd, ndsSaveFd, gbaSaveFd);
+        core = Core::create(ndsPath, gbaPath, "", "", 0, ndsRomFd, gbaRomFd, ndsSaveFd, gbaSaveFd);
         return 0;
     }
     catch (CoreError e)
@@ -295,19 +295,11 @@ extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_stopAudioReco
     (*audioRecorderObj)->Destroy(audioRecorderObj);
 }
 
-extern "C" JNIEXPORT jboolean JNICALL Java_com_hydra_noods_NooRenderer_copyFramebuffer(JNIEnv *env, jobject obj, jobject bitmap, jboolean gbaCrop)
+extern "C" JNIEXPORT jboolean JNICALL Java_com_hydra_noods_NooRenderer_copyFramebuffer(JNIEnv *env, jobject obj, jobject buffer, jboolean gbaCrop)
 {
-    // Get a new frame if one is ready
-    if (!core->gpu.getFrame(framebuffer, gbaCrop))
-        return false;
-
-    // Copy the frame to the bitmap
-    uint32_t *data;
-    AndroidBitmap_lockPixels(env, bitmap, (void**)&data);
-    size_t count = (gbaCrop ? (240 * 160) : (256 * 192 * 2)) << (Settings::highRes3D * 2);
-    memcpy(data, framebuffer, count * sizeof(uint32_t));
-    AndroidBitmap_unlockPixels(env, bitmap);
-    return true;
+    // Convert a new frame straight into the renderer's direct buffer if one is ready
+    uint32_t *data = (uint32_t*)env->GetDirectBufferAddress(buffer);
+    return data && core->gpu.getFrame(data, gbaCrop);
 }
 
 // The below functions are pretty much direct forwarders to core functions
@@ -527,9 +519,17 @@ extern "C" JNIEXPORT jboolean JNICALL Java_com_hydra_noods_NooActivity_isGbaMode
     return core->gbaMode;
 }
 
+extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_startCoreThread(JNIEnv *env, jobject obj)
+{
+    // Place the core thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_EMU);
+}
+
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_runFrame(JNIEnv *env, jobject obj)
 {
+    // Run a frame and hold it to the frame rate
     core->runFrame();
+    pacer.pace(core->gbaMode ? GBA_FRAME_RATE : NDS_FRAME_RATE);
 }
 
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_writeSave(JNIEnv *env, jobject obj)
@@ -541,21 +541,19 @@ extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_writeSave(JNI
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_restartCore(JNIEnv *env, jobject obj)
 {
     if (core) delete core;
-    core = new Core(ndsPath, gbaPath, "", "", 0, ndsRomFd, gbaRomFd, ndsSaveFd, gbaSaveFd);
+    core = Core::create(ndsPath, gbaPath, "", "", 0, ndsRomFd, gbaRomFd, ndsSaveFd, gbaSaveFd);
 }
 
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_pressScreen(JNIEnv *env, jobject obj, jint x, jint y)
 {
     if (core->gbaMode) return;
-    core->input.pressScreen();
-    core->spi.setTouch(layout.getTouchX(x, y), layout.getTouchY(x, y));
+    core->input.queueScreen(true, layout.getTouchX(x, y), layout.getTouchY(x, y));
 }
 
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_releaseScreen(JNIEnv *env, jobject obj)
 {
     if (core->gbaMode) return;
-    core->input.releaseScreen();
-    core->spi.clearTouch();
+    core->input.queueScreen(false);
 }
 
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooActivity_resizeGbaSave(JNIEnv *env, jobject obj, jint size)
@@ -615,10 +613,10 @@ extern "C" JNIEXPORT jint JNICALL Java_com_hydra_noods_NooRenderer_getBotHeight(
 
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooButton_pressKey(JNIEnv *env, jobject obj, jint key)
 {
-    core->input.pressKey(key);
+    core->input.queueKey(key, true);
 }
 
 extern "C" JNIEXPORT void JNICALL Java_com_hydra_noods_NooButton_releaseKey(JNIEnv *env, jobject obj, jint key)
 {
-    core->input.releaseKey(key);
+    core->input.queueKey(key, false);
 }
@@ -384,7 +384,8 @@ public class NooActivity extends AppCompatActivity
         {
             @Override
             public void run()
-            {             
+            {
+                startCoreThread();
                 while (running)
                     runFrame();
             }
@@ -481,6 +482,7 @@ public class NooActivity extends AppCompatActivity
     public static native void stopAudioRecorder();
     public static native int getFps();
     public static native boolean isGbaMode();
+    public static native void startCoreThread();
     public static native void runFrame();
     public static native void writeSave();
     public static native void restartCore();
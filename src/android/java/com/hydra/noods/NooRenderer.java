@@ -19,10 +19,8 @@
 
 package com.hydra.noods;
 
-import android.graphics.Bitmap;
 import android.opengl.GLES20;
 import android.opengl.GLSurfaceView;
-import android.opengl.GLUtils;
 
 import javax.microedition.khronos.egl.EGLConfig;
 import javax.microedition.khronos.opengles.GL10;
@@ -39,7 +37,11 @@ public class NooRenderer implements GLSurfaceView.Renderer
     private NooActivity activity;
     private int program;
     private int textures[];
-    private Bitmap bitmap;
+    private ByteBuffer frame;
+    private int frameWidth;
+    private int frameHeight;
+    private int vertexBuffer;
+    private int rotation;
     private int highRes3D;
     private boolean gbaMode;
 
@@ -103,9 +105,23 @@ public class NooRenderer implements GLSurfaceView.Renderer
         GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D, GLES20.GL_TEXTURE_MIN_FILTER, filter);
         GLES20.glTexParameteri(GLES20.GL_TEXTURE_2D, GLES20.GL_TEXTURE_MAG_FILTER, filter);
 
-        bitmap = Bitmap.createBitmap(256, 192 * 2, Bitmap.Config.ARGB_8888);
         highRes3D = 0;
         gbaMode = false;
+        createFrame();
+
+        // Set up a vertex buffer for the screens, which only has to be filled when the layout changes
+        int buffers[] = new int[1];
+        GLES20.glGenBuffers(1, buffers, 0);
+        vertexBuffer = buffers[0];
+        GLES20.glBindBuffer(GLES20.GL_ARRAY_BUFFER, vertexBuffer);
+
+        // Pass the position and texture coordinate data from the buffer to the shaders
+        final int position = GLES20.glGetAttribLocation(program, "aPosition");
+        GLES20.glVertexAttribPointer(position, 2, GLES20.GL_FLOAT, false, 4 * 4, 0);
+        GLES20.glEnableVertexAttribArray(position);
+        final int texCoord = GLES20.glGetAttribLocation(program, "aTexCoord");
+        GLES20.glVertexAttribPointer(texCoord, 2, GLES20.GL_FLOAT, false, 4 * 4, 2 * 4);
+        GLES20.glEnableVertexAttribArray(texCoord);
     }
 
     @Override
@@ -131,6 +147,7 @@ public class NooRenderer implements GLSurfaceView.Renderer
         this.height = height;
         GLES20.glViewport(0, 0, width, height);
         updateLayout(width, height);
+        updateVertices();
 
         // Update the button layout
         activity.runOnUiThread(new Runnable()
@@ -150,8 +167,7 @@ public class NooRenderer implements GLSurfaceView.Renderer
         if (highRes3D != SettingsMenu.getHighRes3D())
         {
             highRes3D = SettingsMenu.getHighRes3D();
-            bitmap = Bitmap.createBitmap((gbaMode ? 240 : 256) << highRes3D,
-                (gbaMode ? 160 : (192 * 2)) << highRes3D, Bitmap.Config.ARGB_8888);
+            createFrame();
         }
 
         // Update the layout if GBA mode changed
@@ -159,35 +175,67 @@ public class NooRenderer implements GLSurfaceView.Renderer
         {
             gbaMode = !gbaMode;
             updateLayout(width, height);
-            bitmap = Bitmap.createBitmap((gbaMode ? 240 : 256) << highRes3D,
-                (gbaMode ? 160 : (192 * 2)) << highRes3D, Bitmap.Config.ARGB_8888);
+            updateVertices();
+            createFrame();
         }
 
+        // Update the vertices if the screen rotation changed
+        if (rotation != SettingsMenu.getScreenRotation())
+            updateVertices();
+
         // Clear the display
         GLES20.glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         GLES20.glClear(GLES20.GL_COLOR_BUFFER_BIT);
 
         // Wait until a new frame is ready to prevent stuttering
         // This sucks, but buffers are automatically swapped, so returning would cause even worse stutter
-        while (!copyFramebuffer(bitmap, gbaMode) && activity.isRunning());
-        GLUtils.texImage2D(GLES20.GL_TEXTURE_2D, 0, bitmap, 0);
+        // The frame is converted straight into a direct buffer and uploaded from there, without going through a bitmap
+        while (!copyFramebuffer(frame, gbaMode) && activity.isRunning());
+        GLES20.glTexSubImage2D(GLES20.GL_TEXTURE_2D, 0, 0, 0, frameWidth, frameHeight,
+            GLES20.GL_RGBA, GLES20.GL_UNSIGNED_BYTE, frame);
 
+        // Draw the GBA screen, or the DS top and bottom screens, from the prebuilt vertices
+        GLES20.glDrawArrays(GLES20.GL_TRIANGLE_STRIP, 0, 4);
+        if (!gbaMode)
+            GLES20.glDrawArrays(GLES20.GL_TRIANGLE_STRIP, 4, 4);
+    }
+
+    private void updateVertices()
+    {
+        // Build the vertices for the GBA screen, or the DS top and bottom screens
+        rotation = SettingsMenu.getScreenRotation();
+        final float[] vertices = new float[gbaMode ? 16 : 32];
         if (gbaMode)
         {
-            // Draw the GBA screen
-            drawScreen(getTopX(), getTopY(), getTopWidth(), getTopHeight(), 0.0f, 0.0f, 1.0f, 1.0f);
+            putScreen(vertices, 0, getTopX(), getTopY(), getTopWidth(), getTopHeight(), 0.0f, 0.0f, 1.0f, 1.0f);
         }
         else
         {
-            // Draw the DS top and bottom screens
-            drawScreen(getTopX(), getTopY(), getTopWidth(), getTopHeight(), 0.0f, 0.0f, 1.0f, 0.5f);
-            drawScreen(getBotX(), getBotY(), getBotWidth(), getBotHeight(), 0.0f, 0.5f, 1.0f, 1.0f);
+            putScreen(vertices, 0, getTopX(), getTopY(), getTopWidth(), getTopHeight(), 0.0f, 0.0f, 1.0f, 0.5f);
+            putScreen(vertices, 16, getBotX(), getBotY(), getBotWidth(), getBotHeight(), 0.0f, 0.5f, 1.0f, 1.0f);
         }
+
+        // Upload the vertices to the buffer
+        FloatBuffer data = ByteBuffer.allocateDirect(vertices.length * 4).order(ByteOrder.nativeOrder()).asFloatBuffer();
+        data.put(vertices);
+        data.position(0);
+        GLES20.glBufferData(GLES20.GL_ARRAY_BUFFER, vertices.length * 4, data, GLES20.GL_STATIC_DRAW);
     }
 
-    private void drawScreen(float x, float y, float w, float h, float s1, float t1, float s2, float t2)
+    private void createFrame()
     {
-        final int rot = SettingsMenu.getScreenRotation();
+        // Allocate a buffer for the native side to convert frames into, and texture storage to upload them to
+        // This only has to be done when the frame size changes, so each frame is just a sub-image upload
+        frameWidth = (gbaMode ? 240 : 256) << highRes3D;
+        frameHeight = (gbaMode ? 160 : (192 * 2)) << highRes3D;
+        frame = ByteBuffer.allocateDirect(frameWidth * frameHeight * 4).order(ByteOrder.nativeOrder());
+        GLES20.glTexImage2D(GLES20.GL_TEXTURE_2D, 0, GLES20.GL_RGBA, frameWidth, frameHeight, 0,
+            GLES20.GL_RGBA, GLES20.GL_UNSIGNED_BYTE, null);
+    }
+
+    private void putScreen(float[] vertices, int offset, float x, float y, float w, float h, float s1, float t1, float s2, float t2)
+    {
+        final int rot = rotation;
 
         // Arrange the S coordinates for rotation
         final float s[][] =
@@ -206,7 +254,7 @@ public class NooRenderer implements GLSurfaceView.Renderer
         };
 
         // Define the vertices
-        final float[] vertices =
+        final float[] screen =
         {
             x,     y,     s[rot][0], t[rot][0],
             x,     y + h, s[rot][1], t[rot][1],
@@ -214,25 +262,11 @@ public class NooRenderer implements GLSurfaceView.Renderer
             x + w, y + h, s[rot][3], t[rot][3]
         };
 
-        FloatBuffer data = ByteBuffer.allocateDirect(vertices.length * 4).order(ByteOrder.nativeOrder()).asFloatBuffer();
-        data.put(vertices);
-
-        // Pass the position data to the shaders
-        data.position(0);
-        final int position = GLES20.glGetAttribLocation(program, "aPosition");
-        GLES20.glVertexAttribPointer(position, 2, GLES20.GL_FLOAT, false, 4 * 4, data);
-        GLES20.glEnableVertexAttribArray(position);
-
-        // Pass the texture coordinate data to the shaders
-        data.position(2);
-        final int texCoord = GLES20.glGetAttribLocation(program, "aTexCoord");
-        GLES20.glVertexAttribPointer(texCoord, 2, GLES20.GL_FLOAT, false, 4 * 4, data);
-        GLES20.glEnableVertexAttribArray(texCoord);
-
-        GLES20.glDrawArrays(GLES20.GL_TRIANGLE_STRIP, 0, 4);
+        // Copy the screen's vertices into its spot in the list
+        System.arraycopy(screen, 0, vertices, offset, screen.length);
     }
 
-    public static native boolean copyFramebuffer(Bitmap bitmap, boolean gbaCrop);
+    public static native boolean copyFramebuffer(ByteBuffer buffer, boolean gbaCrop);
     public static native void updateLayout(int width, int height);
     public static native int getTopX();
     public static native int getBotX();
@@ -0,0 +1,442 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../core.h"
+#include "../movie.h"
+#include "../settings.h"
+
+typedef std::chrono::steady_clock Clock;
+
+#ifdef PROFILE
+const char *taskNames[MAX_TASKS] =
+{
+    "RESET_CYCLES", "CART9_WORD_READY", "CART7_WORD_READY",
+    "DMA9_TRANSFER0", "DMA9_TRANSFER1", "DMA9_TRANSFER2", "DMA9_TRANSFER3",
+    "DMA7_TRANSFER0", "DMA7_TRANSFER1", "DMA7_TRANSFER2", "DMA7_TRANSFER3",
+    "NDS_SCANLINE256", "NDS_SCANLINE355", "GBA_SCANLINE240", "GBA_SCANLINE308",
+    "GPU3D_COMMAND", "ARM9_INTERRUPT", "ARM7_INTERRUPT", "NDS_SPU_SAMPLE", "GBA_SPU_SAMPLE",
+    "TIMER9_OVERFLOW0", "TIMER9_OVERFLOW1", "TIMER9_OVERFLOW2", "TIMER9_OVERFLOW3",
+    "TIMER7_OVERFLOW0", "TIMER7_OVERFLOW1", "TIMER7_OVERFLOW2", "TIMER7_OVERFLOW3",
+    "WIFI_COUNT_MS"
+};
+#endif
+
+double seconds(Clock::duration duration)
+{
+    // Convert a clock duration to seconds
+    return std::chrono::duration<double>(duration).count();
+}
+
+uint64_t hashFrame(uint64_t hash, uint32_t *data, int size)
+{
+    // Fold a frame into a 64-bit FNV-1a hash
+    for (int i = 0; i < size; i++)
+    {
+        for (int j = 0; j < 32; j += 8)
+            hash = (hash ^ ((data[i] >> j) & 0xFF)) * 0x100000001B3;
+    }
+    return hash;
+}
+
+#ifdef PROFILE
+void printProfile(ProfileStats &stats, int frames)
+{
+    // Report the opcodes run by each CPU
+    printf("\nOpcodes per frame:\n");
+    for (int i = 0; i < 2; i++)
+        printf("  ARM%d: %.0f ARM, %.0f THUMB\n", i ? 7 : 9, (double)stats.opcodes[i][0] / frames,
+            (double)stats.opcodes[i][1] / frames);
+
+    // Report the memory accesses that missed the fast path, by address region
+    printf("\nMemory fallbacks per frame (reads/writes):\n");
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 16; j++)
+        {
+            if (!stats.readFallbacks[i][j] && !stats.writeFallbacks[i][j]) continue;
+            printf("  ARM%d 0x%X000000: %.0f/%.0f\n", i ? 7 : 9, j, (double)stats.readFallbacks[i][j] / frames,
+                (double)stats.writeFallbacks[i][j] / frames);
+        }
+    }
+
+    // Report the scheduler tasks that ran
+    printf("\nScheduler tasks (count, total time):\n");
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if (!stats.eventCounts[i]) continue;
+        printf("  %-17s %10llu %9.3fms\n", taskNames[i], (unsigned long long)stats.eventCounts[i], stats.eventTimes[i] / 1000000.0);
+    }
+
+    // Report the time spent drawing and mixing
+    printf("\nSubsystem times:\n");
+    printf("  GPU 2D engine A: %.3fms\n", stats.gpu2DTimes[0] / 1000000.0);
+    printf("  GPU 2D engine B: %.3fms\n", stats.gpu2DTimes[1] / 1000000.0);
+    printf("  GPU 3D renderer: %.3fms\n", stats.gpu3DTime / 1000000.0);
+    printf("  SPU:             %.3fms\n", stats.spuTime / 1000000.0);
+}
+#endif
+
+#ifdef EXEC_TRACE
+void printExecProfile(Core *core)
+{
+    // Report the guest addresses recorded most often by each CPU, as a share of everything recorded
+    for (int i = 0; i < 2; i++)
+    {
+        std::vector<ExecCount> profile = core->interpreter[i].execTrace.getSessionProfile();
+        uint64_t total = 0;
+        for (size_t j = 0; j < profile.size(); j++)
+            total += profile[j].count;
+        if (!total) continue;
+
+        printf("\nARM%d %s (%llu recorded):\n", core->gbaMode ? 7 : (i ? 7 : 9),
+            (core->interpreter[i].execTrace.getMode() == EXEC_BRANCH) ? "jump destinations" : "PC samples",
+            (unsigned long long)total);
+        for (size_t j = 0; j < profile.size() && j < 16; j++)
+        {
+            printf("  0x%08X %-5s %10llu %6.2f%%\n", profile[j].address & ~BIT(0), (profile[j].address & BIT(0)) ?
+                "THUMB" : "ARM", (unsigned long long)profile[j].count, profile[j].count * 100.0 / total);
+        }
+    }
+}
+#endif
+
+struct BenchRun
+{
+    Core *core = nullptr;
+    Movie movie;
+    Clock::duration firstTime = Clock::duration::zero();
+    Clock::duration emuTime = Clock::duration::zero();
+    Clock::duration outTime = Clock::duration::zero();
+    uint64_t hash = 0xCBF29CE484222325;
+    int outFrames = 0;
+    FrameTiming worst = {};
+    std::vector<uint32_t> framebuffer = std::vector<uint32_t>(256 * 192 * 8);
+};
+
+void runBench(BenchRun *run, int frames)
+{
+    Core *core = run->core;
+
+    for (int i = 0; i < frames; i++)
+    {
+        // Emulate a frame, with input from the movie if one is playing
+        Clock::time_point start = Clock::now();
+        core->runFrame();
+        Clock::time_point middle = Clock::now();
+        if (i == 0) run->firstTime = middle - start;
+
+        // Convert the finished frame like a frontend would, and add it to the hash
+        if (core->gpu.getFrame(&run->framebuffer[0], core->gbaMode))
+        {
+            int size = (core->gbaMode ? (240 * 160) : (256 * 192 * 2)) << (Settings::highRes3D * 2);
+            run->hash = hashFrame(run->hash, &run->framebuffer[0], size);
+            run->outFrames++;
+        }
+
+        run->emuTime += middle - start;
+        run->outTime += Clock::now() - middle;
+
+        // Keep the worst times of each kind from the frame records if tracing
+        FrameTiming timing;
+        while (core->frameTrace.readTimings(&timing, 1))
+        {
+            run->worst.emulation = std::max(run->worst.emulation, timing.emulation);
+            run->worst.render2D[0] = std::max(run->worst.render2D[0], timing.render2D[0]);
+            run->worst.render2D[1] = std::max(run->worst.render2D[1], timing.render2D[1]);
+            run->worst.render3D = std::max(run->worst.render3D, timing.render3D);
+        }
+    }
+}
+
+template <typename T> double memoryRate(Core *core, bool cpu, uint32_t base, bool write)
+{
+    // Hide the CPU from the optimizer, since the interpreter only knows it at runtime
+    volatile bool hidden = cpu;
+    cpu = hidden;
+
+    // Access 64KB of memory sequentially like code fetches, many times over, and time it
+    uint32_t sum = 0;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < 1024; i++)
+    {
+        for (uint32_t address = base; address < base + 0x10000; address += sizeof(T))
+        {
+            if (write)
+                core->memory.write<T>(cpu, address, address);
+            else
+                sum += core->memory.read<T>(cpu, address);
+        }
+    }
+
+    // Return the rate in millions of accesses per second, keeping the sum so the reads aren't optimized out
+    volatile uint32_t sink = sum;
+    (void)sink;
+    return 1024.0 * 0x10000 / sizeof(T) / seconds(Clock::now() - start) / 1000000;
+}
+
+double schedulerRate(Core *core)
+{
+    // Keep the timer overflow tasks scheduled at scattered times, running the soonest and rescheduling one each time
+    // The timers are disabled, so their tasks return right away and this mostly measures the scheduler itself
+    uint64_t start = core->eventsRun;
+    Clock::time_point time = Clock::now();
+    for (uint32_t i = 0; i < 0x2000000; i++)
+    {
+        core->schedule(SchedTask(TIMER9_OVERFLOW0 + (i & 7)), 1 + ((i * 2654435761U) >> 26));
+        core->runEvent();
+    }
+
+    // Return the rate in millions of events per second
+    return (core->eventsRun - start) / seconds(Clock::now() - time) / 1000000;
+}
+
+void runMicro(Core *core)
+{
+    // Measure the memory fast paths on a freshly booted core, which is left in an unusable state afterwards
+    printf("Memory (millions of accesses per second):\n");
+    printf("  ARM9 main RAM 32-bit reads:  %.0f\n", memoryRate<uint32_t>(core, 0, 0x2100000, false));
+    printf("  ARM9 main RAM 16-bit reads:  %.0f\n", memoryRate<uint16_t>(core, 0, 0x2100000, false));
+    printf("  ARM9 ITCM 32-bit reads:      %.0f\n", memoryRate<uint32_t>(core, 0, 0x0000000, false));
+    printf("  ARM7 WRAM 32-bit reads:      %.0f\n", memoryRate<uint32_t>(core, 1, 0x3800000, false));
+    printf("  ARM9 main RAM 32-bit writes: %.0f\n", memoryRate<uint32_t>(core, 0, 0x2100000, true));
+
+    // Measure scheduling and dispatching events
+    printf("Scheduler:  %.1f million events per second\n", schedulerRate(core));
+}
+
+static int histogramPercentile(uint32_t *counts, double percentile)
+{
+    // Find the 1ms bucket of the frame time histogram that the given fraction of frames fit within
+    uint32_t total = 0, sum = 0;
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+        total += counts[i];
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+        if ((sum += counts[i]) >= total * percentile)
+            return i;
+    return TRACE_BUCKETS - 1;
+}
+
+int main(int argc, char **argv)
+{
+    // Split the options from the positional arguments
+    std::vector<std::string> args;
+    std::string tracePath, playPath, recordPath, heatmapPath;
+    int execRate = -1;
+    bool micro = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (arg == "--play" && i + 1 < argc)
+            playPath = argv[++i];
+        else if (arg == "--record" && i + 1 < argc)
+            recordPath = argv[++i];
+        else if (arg == "--heatmap" && i + 1 < argc)
+            heatmapPath = argv[++i];
+        else if (arg == "--exec" && i + 1 < argc)
+            execRate = atoi(argv[++i]);
+        else if (arg == "--micro")
+            micro = true;
+        else
+            args.push_back(arg);
+    }
+
+    if (args.empty())
+    {
+        printf("Usage: %s <rom> [frames] [instances] [--trace <trace.json>] [--play <movie>] [--record <movie>] [--exec <rate>] [--heatmap <file>] [--micro]\n", argv[0]);
+        return 1;
+    }
+
+    // Load the settings, but always run as fast as possible
+    Settings::load();
+    Settings::fpsLimiter = 0;
+
+    // Boot the ROM, treating it as a GBA ROM if it has a GBA extension
+    // Extra instances run the same ROM alongside the first one, to measure how well cores scale in one process
+    std::string path = args[0];
+    bool gba = (path.size() >= 4 && path.substr(path.size() - 4) == ".gba");
+    int frames = (args.size() > 1) ? atoi(args[1].c_str()) : 600;
+    int instances = std::max((args.size() > 2) ? atoi(args[2].c_str()) : 1, 1);
+    std::vector<BenchRun> runs(instances);
+
+    // Load a movie before the cores are created, since it brings the settings it was recorded with
+    // Each instance plays its own copy, and runs for the length of the movie unless told otherwise
+    if (playPath != "")
+    {
+        for (int i = 0; i < instances; i++)
+        {
+            if (!runs[i].movie.load(playPath))
+            {
+                printf("Error: couldn't load the movie\n");
+                return 1;
+            }
+        }
+        if (args.size() < 2) frames = runs[0].movie.getLength();
+    }
+
+    Clock::time_point boot = Clock::now();
+    Clock::duration bootTime;
+
+    try
+    {
+        for (int i = 0; i < instances; i++)
+        {
+            runs[i].core = Core::create(gba ? "" : path, gba ? path : "");
+            runs[i].core->movie = &runs[i].movie;
+            if (i == 0) bootTime = Clock::now() - boot;
+            if (playPath != "") runs[i].movie.play(runs[i].core);
+        }
+    }
+    catch (CoreError e)
+    {
+        // Report the error and give up
+        switch (e)
+        {
+            case ERROR_BIOS: printf("Error: couldn't load the BIOS files\n"); break;
+            case ERROR_FIRM: printf("Error: couldn't boot the firmware\n");   break;
+            case ERROR_ROM:  printf("Error: couldn't load the ROM\n");        break;
+        }
+        return 1;
+    }
+
+    // Run the microbenchmarks instead of emulating frames if asked
+    if (micro)
+    {
+        runMicro(runs[0].core);
+        for (int i = 0; i < instances; i++)
+            delete runs[i].core;
+        return 0;
+    }
+
+    // Trace the frames of the first instance if a trace file was given
+    if (tracePath != "" && !runs[0].core->frameTrace.startTrace(tracePath))
+        printf("Warning: couldn't open the trace file\n");
+
+#ifdef EXEC_TRACE
+    // Profile the guest code of the first instance if asked, sampling every Nth instruction or recording jumps for 0
+    if (execRate >= 0)
+    {
+        for (int i = 0; i < 2; i++)
+            runs[0].core->interpreter[i].execTrace.setMode(execRate ? EXEC_SAMPLE : EXEC_BRANCH, execRate);
+    }
+#else
+    if (execRate >= 0)
+        printf("Warning: execution tracing needs a build with EXEC_TRACE defined\n");
+#endif
+
+    // Record the first instance to a movie if one was given, which only makes sense without a movie playing
+    if (recordPath != "" && playPath == "" && !runs[0].movie.record(recordPath, runs[0].core))
+        printf("Warning: couldn't open the movie file\n");
+
+    // Run the extra instances on their own threads, and the first one on this thread
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread*> threads;
+    for (int i = 1; i < instances; i++)
+        threads.push_back(new std::thread(runBench, &runs[i], frames));
+    runBench(&runs[0], frames);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+    double wall = seconds(Clock::now() - start);
+
+    // Report the results of the first instance
+    BenchRun &run = runs[0];
+    Core *core = run.core;
+    double total = seconds(run.emuTime + run.outTime);
+    printf("Frames:     %d (%d output)\n", frames, run.outFrames);
+    printf("Startup:    %.3fms (%.3fms to the first frame)\n", seconds(bootTime) * 1000,
+        seconds(bootTime + run.firstTime) * 1000);
+    printf("Time:       %.3fs\n", total);
+    printf("FPS:        %.2f\n", frames / total);
+    printf("Emulation:  %.3fs (%.3fms/frame)\n", seconds(run.emuTime), seconds(run.emuTime) * 1000 / frames);
+    printf("Output:     %.3fs (%.3fms/frame)\n", seconds(run.outTime), seconds(run.outTime) * 1000 / frames);
+    printf("Events:     %llu (%.0f/s)\n", (unsigned long long)core->eventsRun, core->eventsRun / seconds(run.emuTime));
+    printf("Idle skip:  %u/%u cycles (last frame)\n", core->idleCycles[0], core->idleCycles[1]);
+    printf("Frame hash: %016llx\n", (unsigned long long)run.hash);
+
+    if (core->frameTrace.isEnabled())
+    {
+        // Report the frame time distribution and the worst frames seen while tracing
+        uint32_t counts[TRACE_BUCKETS];
+        core->frameTrace.stopTrace();
+        core->frameTrace.getHistogram(counts);
+        printf("Frame time: <%dms (p50), <%dms (p99), <%dms (max)\n", histogramPercentile(counts, 0.5) + 1,
+            histogramPercentile(counts, 0.99) + 1, histogramPercentile(counts, 1.0) + 1);
+        printf("Worst:      %.3fms emulation, %.3fms/%.3fms 2D, %.3fms 3D\n", run.worst.emulation / 1000.0,
+            run.worst.render2D[0] / 1000.0, run.worst.render2D[1] / 1000.0, run.worst.render3D / 1000.0);
+    }
+
+    if (instances > 1)
+    {
+        // Report the combined speed, and whether every instance produced the same frames
+        int matching = 0;
+        for (int i = 0; i < instances; i++)
+            matching += (runs[i].hash == run.hash);
+        printf("Instances:  %d (%.2f FPS combined, %d/%d matching hashes)\n", instances,
+            frames * instances / wall, matching, instances);
+    }
+
+    int result = 0;
+    if (playPath != "")
+    {
+        // Report whether the output of every instance matched the movie, failing the run if not
+        for (int i = 0; i < instances; i++)
+        {
+            Movie &movie = runs[i].movie;
+            if (movie.getMismatches() > 0)
+            {
+                printf("Movie:      instance %d mismatched on %d frames, starting at frame %d\n", i,
+                    movie.getMismatches(), movie.getFirstMismatch());
+                result = 1;
+            }
+        }
+        if (!result)
+            printf("Movie:      %d frames matched\n", std::min<int>(frames, run.movie.getLength()));
+    }
+
+#ifdef PROFILE
+    printProfile(core->profileTotals, frames);
+#endif
+
+#ifdef EXEC_TRACE
+    printExecProfile(core);
+#endif
+
+    // Save the memory access counts of the first instance if asked
+    if (heatmapPath != "" && !core->dumpHeatmap(heatmapPath))
+        printf("Warning: couldn't save the heatmap, which needs a build with HEATMAP defined\n");
+
+    for (int i = 0; i < instances; i++)
+    {
+        runs[i].movie.stop();
+        delete runs[i].core;
+    }
+    return result;
+}
@@ -271,6 +271,60 @@ int Bios::swiArcTan2(uint32_t **registers)
     return 3;
 }
 
+bool Bios::copyDirect(uint32_t src, uint32_t dst, uint32_t size, bool word, bool fixed)
+{
+    // Only copy directly between aligned addresses, since the memory system aligns each access otherwise
+    uint32_t unit = 2 << word;
+    if ((src | dst) & (unit - 1))
+        return false;
+
+    // Require both ranges to be plain host memory, and leave forward overlaps to the unit loop since they repeat data
+    uint8_t *srcData = core->memory.getMappedRange(arm7, src, fixed ? unit : size, false);
+    uint8_t *dstData = core->memory.getMappedRange(arm7, dst, size, true);
+    if (!srcData || !dstData || (!fixed && dstData > srcData && dstData < srcData + size))
+        return false;
+
+    if (fixed)
+    {
+        // Fill the destination with the source value
+        if (word)
+        {
+            uint32_t value = loadLsbFirst<uint32_t>(srcData);
+            for (uint32_t i = 0; i < size; i += 4)
+                storeLsbFirst<uint32_t>(&dstData[i], value);
+        }
+        else
+        {
+            uint16_t value = loadLsbFirst<uint16_t>(srcData);
+            for (uint32_t i = 0; i < size; i += 2)
+                storeLsbFirst<uint16_t>(&dstData[i], value);
+        }
+    }
+    else
+    {
+        // Copy the source to the destination, which matches a forward unit copy when the destination is behind
+        memmove(dstData, srcData, size);
+    }
+
+    core->memory.markWritten(dstData, size);
+    return true;
+}
+
+template <typename T> FORCE_INLINE T Bios::readData(uint8_t *data, uint32_t address, uint32_t offset)
+{
+    // Read from a resolved host pointer if there is one, or through the memory system otherwise
+    return data ? loadLsbFirst<T>(&data[offset]) : core->memory.read<T>(arm7, address + offset);
+}
+
+template <typename T> FORCE_INLINE void Bios::writeData(uint8_t *data, uint32_t address, uint32_t offset, T value)
+{
+    // Write to a resolved host pointer if there is one, or through the memory system otherwise
+    if (data)
+        storeLsbFirst<T>(&data[offset], value);
+    else
+        core->memory.write<T>(arm7, address + offset, value);
+}
+
 int Bios::swiCpuSet(uint32_t **registers)
 {
     // Decode some parameters
@@ -278,6 +332,10 @@ int Bios::swiCpuSet(uint32_t **registers)
     bool fixed = (*registers[2] & BIT(24));
     uint32_t size = (*registers[2] & 0xFFFFF) << (1 + word);
 
+    // Copy/fill memory directly when possible
+    if (size == 0 || copyDirect(*registers[0], *registers[1], size, word, fixed))
+        return 3;
+
     if (word)
     {
         // Copy/fill memory from the source to the destination (32-bit)
@@ -307,6 +365,10 @@ int Bios::swiCpuFastSet(uint32_t **registers)
     bool fixed = (*registers[2] & BIT(24));
     uint32_t size = (*registers[2] & 0xFFFFF) << 2;
 
+    // Copy/fill memory directly when possible
+    if (size == 0 || copyDirect(*registers[0], *registers[1], size, true, fixed))
+        return 3;
+
     // Copy/fill memory from the source to the destination
     for (uint32_t i = 0; i < size; i += 4)
     {
@@ -483,37 +545,46 @@ int Bios::swiLz77Uncomp(uint32_t **registers)
     uint32_t src = 4;
     uint32_t dst = 0;
 
+    // Resolve the most the source and destination can span to host memory, falling back to memory accesses if not plain
+    // Each section produces at least as many bytes as it consumes, and the last one can overshoot the size by 17 bytes
+    uint8_t *srcData = core->memory.getMappedRange(arm7, *registers[0], 4 + size + (size >> 3) + 20, false);
+    uint8_t *dstData = core->memory.getMappedRange(arm7, *registers[1], size + 17, true);
+
     while (true)
     {
         // Read the flags for the next 8 sections
-        uint16_t flags = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
+        uint16_t flags = readData<uint8_t>(srcData, *registers[0], src++);
 
         for (uint32_t i = 0; i < 8; i++)
         {
             // Finish once the destination size is reached
             if (dst >= size)
+            {
+                if (dstData) core->memory.markWritten(dstData, dst);
                 return 3;
+            }
 
             if ((flags <<= 1) & BIT(8)) // Next flag
             {
                 // Decode some parameters
-                uint8_t val1 = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
-                uint8_t val2 = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
+                uint8_t val1 = readData<uint8_t>(srcData, *registers[0], src++);
+                uint8_t val2 = readData<uint8_t>(srcData, *registers[0], src++);
                 uint8_t size = 3 + ((val1 >> 4) & 0xF);
                 uint16_t offset = 1 + ((val1 & 0xF) << 8) + val2;
 
                 // Repeat a group of bytes from a previous offset in the destination
                 for (uint32_t j = 0; j < size; j++)
                 {
-                    uint8_t value = core->memory.read<uint8_t>(arm7, *registers[1] + dst - offset);
-                    core->memory.write<uint8_t>(arm7, *registers[1] + dst++, value);
+                    uint8_t value = (offset <= dst) ? readData<uint8_t>(dstData, *registers[1], dst - offset) :
+                        core->memory.read<uint8_t>(arm7, *registers[1] + dst - offset);
+                    writeData<uint8_t>(dstData, *registers[1], dst++, value);
                 }
             }
             else
             {
                 // Copy a new byte from the source to the destination
-                uint8_t value = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
-                core->memory.write<uint8_t>(arm7, *registers[1] + dst++, value);
+                uint8_t value = readData<uint8_t>(srcData, *registers[0], src++);
+                writeData<uint8_t>(dstData, *registers[1], dst++, value);
             }
         }
     }
@@ -535,6 +606,13 @@ int Bios::swiHuffUncomp(uint32_t **registers)
     uint32_t endAddress = *registers[1] + (header >> 8);
     uint32_t buffer = 0;
 
+    // Resolve the tree and an aligned destination to host memory, falling back to memory accesses if not plain
+    // Nodes outside the tree can only come from bad data, so they're read through the memory system
+    uint32_t treeEnd = (treeSize << 1) + 7;
+    uint8_t *treeData = core->memory.getMappedRange(arm7, *registers[0], treeEnd, false);
+    uint8_t *outData = (outAddress & 0x3) ? nullptr :
+        core->memory.getMappedRange(arm7, outAddress, std::max(4U, ((header >> 8) + 3) & ~0x3), true);
+
     while (true)
     {
         // Read the next set of node bits
@@ -546,20 +624,26 @@ int Bios::swiHuffUncomp(uint32_t **registers)
         {
             // Move to the next node based on the current node and bit
             uint8_t bit = (bits >> 31);
-            uint8_t node = core->memory.read<uint8_t>(arm7, nodeAddress);
+            uint32_t offset = nodeAddress - *registers[0];
+            uint8_t node = readData<uint8_t>((offset < treeEnd) ? treeData : nullptr, *registers[0], offset);
             nodeAddress = (nodeAddress & ~0x1) + bit + ((node & 0x3F) << 1) + 2;
             bits <<= 1;
 
             // Push data to the buffer when reached and return to the root node
             if (~node & BIT(7 - bit)) continue;
-            node = core->memory.read<uint8_t>(arm7, nodeAddress);
+            offset = nodeAddress - *registers[0];
+            node = readData<uint8_t>((offset < treeEnd) ? treeData : nullptr, *registers[0], offset);
             buffer = (buffer >> dataSize) | (node << (32 - dataSize));
             nodeAddress = *registers[0] + 5;
 
             // Write the buffer to memory when it's full and stop when finished
             if (++count != wordCount) continue;
-            core->memory.write<uint32_t>(arm7, outAddress, buffer);
-            if ((outAddress += 4) >= endAddress) return 3;
+            writeData<uint32_t>(outData, *registers[1], outAddress - *registers[1], buffer);
+            if ((outAddress += 4) >= endAddress)
+            {
+                if (outData) core->memory.markWritten(outData, outAddress - *registers[1]);
+                return 3;
+            }
             count = 0;
         }
     }
@@ -572,28 +656,35 @@ int Bios::swiRunlenUncomp(uint32_t **registers)
     uint32_t src = 4;
     uint32_t dst = 0;
 
+    // Resolve the most the source and destination can span to host memory, falling back to memory accesses if not plain
+    // Each section consumes at most twice what it produces, and the last one can overshoot the size by 129 bytes
+    uint8_t *srcData = core->memory.getMappedRange(arm7, *registers[0], 4 + (size << 1) + 129, false);
+    uint8_t *dstData = core->memory.getMappedRange(arm7, *registers[1], size + 129, true);
+
     while (dst < size)
     {
         // Read the flags for the next section
-        uint8_t flags = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
+        uint8_t flags = readData<uint8_t>(srcData, *registers[0], src++);
 
         if (flags & BIT(7)) // Compressed
         {
             // Fill a length of destination data with the same source value
-            uint8_t value = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
+            uint8_t value = readData<uint8_t>(srcData, *registers[0], src++);
             for (uint32_t j = 0; j < (flags & 0x7F) + 3; j++)
-                core->memory.write<uint8_t>(arm7, *registers[1] + dst++, value);
+                writeData<uint8_t>(dstData, *registers[1], dst++, value);
         }
         else
         {
             // Copy a length of uncompressed data from the source to the destination
             for (uint32_t j = 0; j < (flags & 0x7F) + 1; j++)
             {
-                uint8_t value = core->memory.read<uint8_t>(arm7, *registers[0] + src++);
-                core->memory.write<uint8_t>(arm7, *registers[1] + dst++, value);
+                uint8_t value = readData<uint8_t>(srcData, *registers[0], src++);
+                writeData<uint8_t>(dstData, *registers[1], dst++, value);
             }
         }
     }
+
+    if (dstData) core->memory.markWritten(dstData, dst);
     return 3;
 }
 
@@ -871,3 +962,9 @@ int Bios::swiUnknown(uint32_t **registers)
         LOG("Unknown ARM%d BIOS SWI: 0x%02X\n", (arm7 ? 7 : 9), comment);
     return 3;
 }
+
+void Bios::syncState(SaveState &state)
+{
+    // Sync the interrupt flags being waited on
+    state.sync(waitFlags);
+}
@@ -23,6 +23,7 @@
 #include <cstdint>
 
 class Core;
+class SaveState;
 
 class Bios
 {
@@ -34,6 +35,8 @@ class Bios
         Bios(Core *core, bool arm7, int (Bios::**swiTable)(uint32_t**)):
             core(core), arm7(arm7), swiTable(swiTable) {}
 
+        void syncState(SaveState &state);
+
         int execute(uint8_t vector, uint32_t **registers);
         void checkWaitFlags();
         bool shouldCheck() { return waitFlags; }
@@ -74,6 +77,10 @@ class Bios
 
         static const uint16_t affineTable[0x100];
         uint32_t waitFlags = 0;
+
+        bool copyDirect(uint32_t src, uint32_t dst, uint32_t size, bool word, bool fixed);
+        template <typename T> T readData(uint8_t *data, uint32_t address, uint32_t offset);
+        template <typename T> void writeData(uint8_t *data, uint32_t address, uint32_t offset, T value);
 };
 
 #endif // BIOS_H
@@ -17,21 +17,28 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstring>
+#include <map>
+#include <sys/stat.h>
 
 #include "cartridge.h"
 #include "core.h"
 #include "settings.h"
 
+// ROM images that cores currently have loaded, by path, size, and modification time
+static std::mutex sharedMutex;
+static std::map<std::string, std::weak_ptr<SharedRom>> sharedRoms;
+
 Cartridge::~Cartridge()
 {
     // Update the save file before exiting
     writeSave();
 
     // Free the ROM and save memory
-    if (romFile) fclose(romFile);
-    if (rom)  delete[] rom;
+    closeRomFile();
     if (save) delete[] save;
+    freeRom();
 }
 
 bool Cartridge::setRom(std::string romPath, std::string savePath)
@@ -58,9 +65,18 @@ bool Cartridge::loadRom()
     // Attempt to open a ROM file
     romFile = (romFd == -1) ? fopen(romPath.c_str(), "rb") : fdopen(dup(romFd), "rb");
     if (!romFile) return false;
-    fseek(romFile, 0, SEEK_END);
-    romSize = ftell(romFile);
-    fseek(romFile, 0, SEEK_SET);
+
+    // Get the ROM size, which comes from the header if the file is compressed
+    if ((romCompressed = compressedRom.open(romFile)))
+    {
+        romSize = compressedRom.getSize();
+    }
+    else
+    {
+        fseek(romFile, 0, SEEK_END);
+        romSize = ftell(romFile);
+        fseek(romFile, 0, SEEK_SET);
+    }
 
     // Attempt to load the ROM's save into memory
     if (FILE *saveFile = (saveFd == -1) ? fopen(savePath.c_str(), "rb") : fdopen(dup(saveFd), "rb"))
@@ -75,47 +91,209 @@ bool Cartridge::loadRom()
 
     // Verify the save size; invalid sizes fall back to auto-detection
     for (size_t i = 0; i < saveSizes.size(); i++)
-        if (saveSize == saveSizes[i]) return true;
+    {
+        if (saveSize == saveSizes[i])
+        {
+            // Track changes to the save relative to the file it was loaded from
+            savePages.assign((saveSize + SAVE_PAGE_SIZE - 1) / SAVE_PAGE_SIZE, 0);
+            saveFileSize = saveSize;
+            return true;
+        }
+    }
     saveSize = -1;
     return true;
 }
 
+bool Cartridge::mapRom()
+{
+#ifdef USE_MMAP
+    // Compressed ROMs have to be decompressed, so they can't be mapped
+    if (romCompressed) return false;
+
+    // Map the whole ROM file into memory, so pages are only read when accessed and can be dropped by the system
+    // The mapping is private, so patches applied to it never reach the file
+    void *data = mmap(nullptr, romSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(romFile), 0);
+    if (data == MAP_FAILED) return false;
+
+    // Switch to the mapped ROM, which stays valid after the file is closed
+    freeRom();
+    rom = (uint8_t*)data;
+    romMapSize = romSize;
+    closeRomFile();
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t Cartridge::readRomFile(uint8_t *data, size_t offset, size_t size)
+{
+    // Read data from the current ROM file, decompressing it if needed
+    if (romCompressed)
+        return compressedRom.read(data, offset, size);
+    fseek(romFile, offset, SEEK_SET);
+    return fread(data, sizeof(uint8_t), size, romFile);
+}
+
 void Cartridge::loadRomSection(size_t offset, size_t size)
 {
-    // Load a section of the current ROM file into memory
-    if (rom) delete[] rom;
+    // Load a section of the current ROM file into memory, sharing whole ROMs loaded by path
+    freeRom();
+    if (offset == 0 && size == (size_t)romSize && romFd == -1)
+        return loadSharedRom();
     rom = new uint8_t[size];
-    fseek(romFile, offset, SEEK_SET);
-    fread(rom, sizeof(uint8_t), size, romFile);
+    readRomFile(rom, offset, size);
     core->dldi.patchRom(rom, offset, size);
 }
 
+void Cartridge::loadSharedRom()
+{
+    // Identify the file, so a ROM is only shared while it stays the same
+    struct stat info;
+    std::string key = romPath;
+    if (stat(romPath.c_str(), &info) == 0)
+        key += "/" + std::to_string(info.st_size) + "/" + std::to_string(info.st_mtime);
+
+    // Reuse the ROM if another core has it loaded, copying its DLDI state since it was patched there
+    std::lock_guard<std::mutex> guard(sharedMutex);
+    if ((sharedRom = sharedRoms[key].lock()))
+    {
+        if (sharedRom->patched) core->dldi.setPatched();
+        rom = &sharedRom->data[0];
+        return;
+    }
+
+    // Drop entries for ROMs that are no longer loaded
+    for (auto it = sharedRoms.begin(); it != sharedRoms.end();)
+        it = it->second.expired() ? sharedRoms.erase(it) : std::next(it);
+
+    // Load and patch the ROM, which is read-only from then on so other cores can use it
+    sharedRom = std::make_shared<SharedRom>();
+    sharedRom->data.resize(romSize);
+    rom = &sharedRom->data[0];
+    readRomFile(rom, 0, romSize);
+    core->dldi.patchRom(rom, 0, romSize);
+    sharedRom->patched = core->dldi.isPatched();
+    sharedRoms[key] = sharedRom;
+}
+
+void Cartridge::closeRomFile()
+{
+    // Close the ROM file once it's no longer needed
+    if (!romFile) return;
+    compressedRom.close();
+    fclose(romFile);
+    romFile = nullptr;
+}
+
+void Cartridge::freeRom()
+{
+    // Free the ROM memory, whether it was mapped, shared, or allocated
+    if (!rom) return;
+#ifdef USE_MMAP
+    if (romMapSize)
+        munmap(rom, romMapSize);
+    else
+#endif
+    if (sharedRom)
+        sharedRom.reset();
+    else
+        delete[] rom;
+    rom = nullptr;
+    romMapSize = 0;
+}
+
 void Cartridge::writeSave()
 {
-    // Update the save file if the data changed
+    // Only let one thread write the save file at a time
+    std::lock_guard<std::mutex> guard(writeMutex);
+
+    // Copy the pages that changed, or everything if the file doesn't match the save size
+    // The emulator can keep changing the save once this is done, and it will be caught next time
     mutex.lock();
-    if (saveDirty)
+    if (!saveDirty)
     {
-        if (FILE *saveFile = (saveFd == -1) ? fopen(savePath.c_str(), "wb") : fdopen(dup(saveFd), "wb"))
+        mutex.unlock();
+        return;
+    }
+
+    int size = saveSize;
+    bool full = (saveFileSize != size);
+    writeBuffer.resize(size);
+    writePages.assign(savePages.size(), full);
+    for (size_t i = 0; i < savePages.size(); i++)
+    {
+        if (!full && !savePages[i]) continue;
+        uint32_t offset = i * SAVE_PAGE_SIZE;
+        memcpy(&writeBuffer[offset], &save[offset], std::min<uint32_t>(SAVE_PAGE_SIZE, size - offset));
+        writePages[i] = 1;
+        savePages[i] = 0;
+    }
+    saveDirty = false;
+    mutex.unlock();
+
+    // Open the save file, replacing it when writing in full and updating it in place otherwise
+    const char *mode = full ? "wb" : "r+b";
+    FILE *saveFile = (saveFd == -1) ? fopen(savePath.c_str(), mode) : fdopen(dup(saveFd), mode);
+    if (!saveFile)
+    {
+        // Mark the pages as changed again so they're retried, in full if the file couldn't be updated
+        mutex.lock();
+        saveFileSize = -1;
+        if (saveSize == size)
         {
-            // Overwrite and resize without closing the file descriptor
-            if (saveFd != -1)
-            {
-                fseek(saveFile, 0, SEEK_SET);
-                ftruncate(saveFd, saveSize);
-            }
+            for (size_t i = 0; i < savePages.size(); i++)
+                savePages[i] |= writePages[i];
+        }
+        saveDirty = true;
+        mutex.unlock();
+        return;
+    }
+
+    if (full)
+    {
+        // Overwrite and resize without closing the file descriptor
+        if (saveFd != -1)
+        {
+            fseek(saveFile, 0, SEEK_SET);
+            ftruncate(saveFd, size);
+        }
 
-            LOG("Writing save file to disk\n");
-            fwrite(save, sizeof(uint8_t), saveSize, saveFile);
-            fclose(saveFile);
-            saveDirty = false;
+        LOG("Writing save file to disk\n");
+        fwrite(writeBuffer.data(), sizeof(uint8_t), size, saveFile);
+        saveFileSize = size;
+    }
+    else
+    {
+        // Write each run of changed pages at its place in the file
+        LOG("Updating save file on disk\n");
+        for (size_t i = 0; i < writePages.size(); i++)
+        {
+            if (!writePages[i]) continue;
+            size_t end = i;
+            while (end < writePages.size() && writePages[end]) end++;
+            uint32_t offset = i * SAVE_PAGE_SIZE;
+            fseek(saveFile, offset, SEEK_SET);
+            fwrite(&writeBuffer[offset], sizeof(uint8_t), std::min<uint32_t>(end * SAVE_PAGE_SIZE, size) - offset, saveFile);
+            i = end;
         }
     }
-    mutex.unlock();
+
+    // Make sure everything written in this batch reaches storage before closing the file
+    fflush(saveFile);
+    fsync(fileno(saveFile));
+    fclose(saveFile);
 }
 
 void Cartridge::trimRom()
 {
+    // Trimming needs the whole ROM in memory, and shouldn't replace a compressed file with an uncompressed one
+    if (romFile || romCompressed)
+    {
+        LOG("Can't trim a streamed or compressed ROM\n");
+        return;
+    }
+
     // Starting from the end, reduce the ROM size until a non-filler word is found
     int newSize;
     for (newSize = romSize & ~3; newSize > 0; newSize -= 4)
@@ -130,7 +308,7 @@ void Cartridge::trimRom()
         romSize = newSize;
         uint8_t *newRom = new uint8_t[newSize];
         memcpy(newRom, rom, newSize * sizeof(uint8_t));
-        delete[] rom;
+        freeRom();
         rom = newRom;
 
         // Update the ROM file
@@ -164,13 +342,23 @@ void Cartridge::resizeSave(int newSize, bool dirty)
     }
 
     // Swap the old save for the new one
+    // The file no longer matches the save size, so it will be rewritten in full
     delete[] save;
     save = newSave;
     saveSize = newSize;
+    savePages.assign((newSize + SAVE_PAGE_SIZE - 1) / SAVE_PAGE_SIZE, 0);
     if (dirty) saveDirty = true;
     mutex.unlock();
 }
 
+void Cartridge::markSave(uint32_t offset, uint32_t size)
+{
+    // Mark the pages covering part of the save as changed; this should be called while holding the mutex
+    for (uint32_t i = offset / SAVE_PAGE_SIZE; i <= (offset + size - 1) / SAVE_PAGE_SIZE; i++)
+        savePages[i] = 1;
+    saveDirty = true;
+}
+
 bool CartridgeNds::loadRom()
 {
     // Set the valid NDS save sizes
@@ -188,27 +376,54 @@ bool CartridgeNds::loadRom()
         saveSizes.push_back(0x800000); // FLASH 8192KB
     }
 
-    // If the ROM is 512MB or smaller, try to load it into memory; otherwise fall back to file-based loading
+    // Map the ROM into memory if possible, or load it if it's 512MB or smaller; otherwise fall back to file-based loading
     if (!Cartridge::loadRom())
     {
         return false;
     }
+    else if (mapRom())
+    {
+        // Patch DLDI drivers like loading would; they only exist in homebrew, so only scan the initial code of big ROMs
+        if (romSize <= 0x2000000) // 32MB
+        {
+            core->dldi.patchRom(rom, 0, romSize);
+        }
+        else
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                uint32_t offset = U8TO32(rom, 0x20 + i * 0x10);
+                uint32_t size = U8TO32(rom, 0x2C + i * 0x10);
+                if (offset < (uint32_t)romSize)
+                    core->dldi.patchRom(&rom[offset], offset, std::min<uint32_t>(size, romSize - offset));
+            }
+        }
+    }
+    else if (Settings::romCacheSize > 0 && (uint64_t)romSize > ((uint64_t)Settings::romCacheSize << 20))
+    {
+        // Stream ROMs that are bigger than the configured cache through it
+        startStreaming(Settings::romCacheSize);
+    }
+    else if (romCompressed && Settings::romCacheSize == 0)
+    {
+        // Decompress ROMs on demand by default, rather than unpacking them all at once
+        startStreaming(ROM_CACHE_DEFAULT);
+    }
     else if (romSize <= 0x20000000) // 512MB
     {
         try
         {
             loadRomSection(0, romSize);
-            fclose(romFile);
-            romFile = nullptr;
+            closeRomFile();
         }
         catch (std::bad_alloc &ba)
         {
-            loadRomSection(0, 0x5000);
+            startStreaming(ROM_CACHE_DEFAULT);
         }
     }
     else
     {
-        loadRomSection(0, 0x5000);
+        startStreaming(ROM_CACHE_DEFAULT);
     }
 
     // Get logo data from the ROM header
@@ -220,6 +435,8 @@ bool CartridgeNds::loadRom()
 
     // Save the ROM code, which is mainly used for encryption
     romCode = U8TO32(rom, 0x0C);
+    keysCached = false;
+    secureArea.clear();
 
     // Check if the ROM is encrypted
     if (romSize >= 0x8000) // ROM has secure area
@@ -241,12 +458,85 @@ bool CartridgeNds::loadRom()
     return true;
 }
 
-void CartridgeNds::directBoot()
+void CartridgeNds::startStreaming(int cacheSize)
+{
+    // Keep the header and secure area in memory, since they're accessed often and patched
+    loadRomSection(0, std::min(romSize, 0x8000));
+
+    // Set up a cache of ROM blocks for the rest, which is read from file when needed
+    uint32_t slots = std::max<uint64_t>(1, ((uint64_t)cacheSize << 20) / ROM_BLOCK_SIZE);
+    romCache.assign((size_t)slots * (ROM_BLOCK_SIZE + 0x200), 0);
+    cacheBlocks.assign(slots, -1);
+    cacheUses.assign(slots, 0);
+    cacheSlots.clear();
+    lastBlock = -1;
+    LOG("Streaming ROM from file with a %dMB block cache\n", cacheSize);
+}
+
+uint8_t *CartridgeNds::getRomBlock(uint32_t address)
+{
+    // Reuse the last block if it's requested again, which is the case for most sequential reads
+    uint32_t block = address / ROM_BLOCK_SIZE;
+    if (block == lastBlock)
+        return lastBlockData;
+
+    uint32_t slot;
+    auto cached = cacheSlots.find(block);
+    if (cached != cacheSlots.end())
+    {
+        // Use the slot that already holds the block
+        slot = cached->second;
+    }
+    else
+    {
+        // Replace the least recently used block
+        slot = std::min_element(cacheUses.begin(), cacheUses.end()) - cacheUses.begin();
+        if (cacheBlocks[slot] != (uint32_t)-1)
+            cacheSlots.erase(cacheBlocks[slot]);
+        cacheBlocks[slot] = block;
+        cacheSlots[block] = slot;
+
+        // Read the block from file along with 0x100 bytes on either side, with 0xFFs outside of the ROM
+        // DLDI headers are 0x100 bytes or less, so this lets ones that cross into or out of the block be patched whole
+        uint8_t *data = &romCache[(size_t)slot * (ROM_BLOCK_SIZE + 0x200)];
+        size_t start = (size_t)block * ROM_BLOCK_SIZE;
+        size_t before = std::min<size_t>(start, 0x100);
+        memset(data, 0xFF, ROM_BLOCK_SIZE + 0x200);
+        readRomFile(&data[0x100 - before], start - before, ROM_BLOCK_SIZE + 0x100 + before);
+        core->dldi.patchRom(&data[0x100 - before], start - before, ROM_BLOCK_SIZE + before);
+    }
+
+    // Mark the block as used and remember it for the next read
+    cacheUses[slot] = ++cacheTick;
+    lastBlock = block;
+    return lastBlockData = &romCache[(size_t)slot * (ROM_BLOCK_SIZE + 0x200) + 0x100];
+}
+
+uint32_t CartridgeNds::readRomWord(uint32_t address)
 {
-    // Load the ROM header from file if needed
-    if (romFile)
-        loadRomSection(0, 0x170);
+    // Read a word from memory if it's loaded there
+    if (!romFile || address + 4 <= 0x8000)
+        return U8TO32(rom, address);
+
+    // Read a word from the block cache, splitting it if it crosses blocks
+    uint32_t offset = address % ROM_BLOCK_SIZE;
+    if (offset <= ROM_BLOCK_SIZE - 4)
+        return U8TO32(getRomBlock(address), offset);
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= getRomBlock(address + i)[(address + i) % ROM_BLOCK_SIZE] << (i * 8);
+    return value;
+}
 
+uint64_t CartridgeNds::readRomDouble(uint32_t address)
+{
+    // Read 64 bits from the ROM as two words
+    return ((uint64_t)readRomWord(address + 4) << 32) | readRomWord(address);
+}
+
+void CartridgeNds::directBoot()
+{
     // Extract some information about the initial ARM9 code from the header
     uint32_t offset9    = U8TO32(rom, 0x20);
     uint32_t entryAddr9 = U8TO32(rom, 0x24);
@@ -271,17 +561,17 @@ void CartridgeNds::directBoot()
     for (uint32_t i = 0; i < 0x170; i += 4)
         core->memory.write<uint32_t>(0, 0x27FFE00 + i, U8TO32(rom, i));
 
-    uint32_t offset;
-
-    // Load the initial ARM9 code from file if needed
-    if (romFile)
+    // Decrypt the first 2KB of the secure area in one go, for initial code that covers it
+    uint32_t secure[0x200] = {};
+    if (romEncrypted)
     {
-        loadRomSection(offset9, size9);
-        offset = 0;
-    }
-    else
-    {
-        offset = offset9;
+        initKeycode(3);
+        for (uint32_t i = 8; i < 0x800; i += 8)
+        {
+            uint64_t data = decrypt64(readRomDouble(0x4000 + i));
+            secure[(i >> 2) + 0] = data;
+            secure[(i >> 2) + 1] = data >> 32;
+        }
     }
 
     // Load the initial ARM9 code into memory
@@ -296,29 +586,16 @@ void CartridgeNds::directBoot()
             }
             else
             {
-                // Decrypt the first 2KB of the secure area
-                initKeycode(3);
-                uint64_t data = decrypt64(U8TO64(rom, (offset + i) & ~7));
-                core->memory.write<uint32_t>(0, ramAddr9 + i, data >> (((offset + i) & 4) ? 32 : 0));
+                // Load from the decrypted secure area
+                core->memory.write<uint32_t>(0, ramAddr9 + i, secure[(offset9 + i - 0x4000) >> 2]);
             }
         }
         else
         {
-            core->memory.write<uint32_t>(0, ramAddr9 + i, U8TO32(rom, offset + i));
+            core->memory.write<uint32_t>(0, ramAddr9 + i, readRomWord(offset9 + i));
         }
     }
 
-    // Load the initial ARM7 code from file if needed
-    if (romFile)
-    {
-        loadRomSection(offset7, size7);
-        offset = 0;
-    }
-    else
-    {
-        offset = offset7;
-    }
-
     // Load the initial ARM7 code into memory
     for (uint32_t i = 0; i < size7; i += 4)
     {
@@ -331,15 +608,13 @@ void CartridgeNds::directBoot()
             }
             else
             {
-                // Decrypt the first 2KB of the secure area
-                initKeycode(3);
-                uint64_t data = decrypt64(U8TO64(rom, (offset + i) & ~7));
-                core->memory.write<uint32_t>(1, ramAddr7 + i, data >> (((offset + i) & 4) ? 32 : 0));
+                // Load from the decrypted secure area
+                core->memory.write<uint32_t>(1, ramAddr7 + i, secure[(offset7 + i - 0x4000) >> 2]);
             }
         }
         else
         {
-            core->memory.write<uint32_t>(1, ramAddr7 + i, U8TO32(rom, offset + i));
+            core->memory.write<uint32_t>(1, ramAddr7 + i, readRomWord(offset7 + i));
         }
     }
 }
@@ -389,6 +664,27 @@ uint64_t CartridgeNds::decrypt64(uint64_t value)
 }
 
 void CartridgeNds::initKeycode(int level)
+{
+    // Build the encryption states for levels 2 and 3 the first time they're needed
+    if (!keysCached)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            buildKeycode(i + 2);
+            memcpy(keyTables[i], encTable, sizeof(encTable));
+            memcpy(keyCodes[i], encCode, sizeof(encCode));
+        }
+        keysCached = true;
+    }
+
+    // Load a cached encryption state, or build it for levels that aren't cached
+    if (level < 2 || level > 3)
+        return buildKeycode(level);
+    memcpy(encTable, keyTables[level - 2], sizeof(encTable));
+    memcpy(encCode, keyCodes[level - 2], sizeof(encCode));
+}
+
+void CartridgeNds::buildKeycode(int level)
 {
     // Initialize the Blowfish encryption table
     // This is a translation of the pseudocode from GBATEK to C++
@@ -441,6 +737,26 @@ void CartridgeNds::applyKeycode()
     }
 }
 
+void CartridgeNds::encryptSecureArea()
+{
+    // Encrypt the first 2KB of the secure area, supplying the 'encryObj' string for the first 8 bytes
+    // It only depends on the ROM, so this is done once instead of for every word that's read
+    secureArea.resize(0x200);
+    initKeycode(3);
+    for (uint32_t i = 0; i < 0x800; i += 8)
+    {
+        uint64_t data = encrypt64((i == 0) ? 0x6A624F7972636E65 : readRomDouble(0x4000 + i));
+        secureArea[(i >> 2) + 0] = data;
+        secureArea[(i >> 2) + 1] = data >> 32;
+    }
+
+    // Double-encrypt the 'encryObj' string
+    initKeycode(2);
+    uint64_t data = encrypt64(((uint64_t)secureArea[1] << 32) | secureArea[0]);
+    secureArea[0] = data;
+    secureArea[1] = data >> 32;
+}
+
 void CartridgeNds::wordReady(bool cpu)
 {
     // Indicate that a word is ready
@@ -567,7 +883,7 @@ void CartridgeNds::writeAuxSpiData(bool cpu, uint8_t value)
                             {
                                 mutex.lock();
                                 save[auxAddress[cpu]] = value;
-                                saveDirty = true;
+                                markSave(auxAddress[cpu], 1);
                                 mutex.unlock();
                             }
 
@@ -592,7 +908,7 @@ void CartridgeNds::writeAuxSpiData(bool cpu, uint8_t value)
                             {
                                 mutex.lock();
                                 save[auxAddress[cpu]] = value;
-                                saveDirty = true;
+                                markSave(auxAddress[cpu], 1);
                                 mutex.unlock();
                             }
 
@@ -650,7 +966,7 @@ void CartridgeNds::writeAuxSpiData(bool cpu, uint8_t value)
                             {
                                 mutex.lock();
                                 save[auxAddress[cpu]] = value;
-                                saveDirty = true;
+                                markSave(auxAddress[cpu], 1);
                                 mutex.unlock();
                             }
 
@@ -706,7 +1022,7 @@ void CartridgeNds::writeAuxSpiData(bool cpu, uint8_t value)
                             {
                                 mutex.lock();
                                 save[auxAddress[cpu]] = value;
-                                saveDirty = true;
+                                markSave(auxAddress[cpu], 1);
                                 mutex.unlock();
                             }
 
@@ -799,10 +1115,6 @@ void CartridgeNds::writeRomCtrl(bool cpu, uint32_t mask, uint32_t value)
         if (command == 0x0000000000000000) // Get header
         {
             cmdMode = CMD_HEADER;
-
-            // Load the header from file if needed
-            if (romFile)
-                loadRomSection(0, blockSize[cpu]);
         }
         else if (command == 0x9000000000000000 || (command >> 60) == 0x1 || command == 0xB800000000000000) // Get chip ID
         {
@@ -817,17 +1129,6 @@ void CartridgeNds::writeRomCtrl(bool cpu, uint32_t mask, uint32_t value)
         {
             cmdMode = CMD_SECURE;
             romAddrReal[cpu] = ((command & 0x0FFFF00000000000) >> 44) * 0x1000;
-
-            // Load the secure area block from file if needed
-            if (romFile)
-            {
-                loadRomSection(romAddrReal[cpu], blockSize[cpu]);
-                romAddrVirt[cpu] = 0;
-            }
-            else
-            {
-                romAddrVirt[cpu] = romAddrReal[cpu];
-            }
         }
         else if ((command >> 60) == 0xA) // Enter main data mode
         {
@@ -839,26 +1140,6 @@ void CartridgeNds::writeRomCtrl(bool cpu, uint32_t mask, uint32_t value)
         {
             cmdMode = CMD_DATA;
             romAddrReal[cpu] = (command >> 24) & romMask;
-
-            // Load the ROM data from file if needed
-            if (romFile)
-            {
-                if (romAddrReal[cpu] < 0x8000)
-                {
-                    // Workaround for address redirection when loading from file
-                    loadRomSection(0, 0x8200 + blockSize[cpu]);
-                    romAddrVirt[cpu] = romAddrReal[cpu];
-                }
-                else
-                {
-                    loadRomSection(romAddrReal[cpu], blockSize[cpu]);
-                    romAddrVirt[cpu] = 0;
-                }
-            }
-            else
-            {
-                romAddrVirt[cpu] = romAddrReal[cpu];
-            }
         }
         else if (command != 0x9F00000000000000) // Unknown (not dummy)
         {
@@ -927,29 +1208,15 @@ uint32_t CartridgeNds::readRomDataIn(bool cpu)
 
         case CMD_SECURE:
         {
-            // Encrypt the first 2KB of the secure area
+            // Send the first 2KB of the secure area encrypted
             if (!romEncrypted && romAddrReal[cpu] == 0x4000 && readCount[cpu] <= 0x800)
             {
-                // Supply the 'encryObj' string for the first 8 bytes (overwritten during decryption)
-                uint64_t data = (readCount[cpu] <= 8) ? 0x6A624F7972636E65 :
-                    U8TO64(rom, (romAddrVirt[cpu] + readCount[cpu] - 4) & ~7);
-
-                // Encrypt the data
-                initKeycode(3);
-                data = encrypt64(data);
-
-                // Double-encrypt the 'encryObj' string
-                if (readCount[cpu] <= 8)
-                {
-                    initKeycode(2);
-                    data = encrypt64(data);
-                }
-
-                return data >> (((romAddrReal[cpu] + readCount[cpu]) & 4) ? 0 : 32);
+                if (secureArea.empty()) encryptSecureArea();
+                return secureArea[(readCount[cpu] - 4) >> 2];
             }
 
             // Read data from the selected secure area block
-            return U8TO32(rom, romAddrVirt[cpu] + readCount[cpu] - 4);
+            return readRomWord(romAddrReal[cpu] + readCount[cpu] - 4);
         }
 
         case CMD_DATA:
@@ -957,9 +1224,9 @@ uint32_t CartridgeNds::readRomDataIn(bool cpu)
             // Read ROM data from the given address
             // This command can't read the first 32KB of a ROM, so it redirects the address
             // Some games verify that the first 32KB are unreadable as an anti-piracy measure
-            uint32_t address = romAddrVirt[cpu] + readCount[cpu] - 4;
+            uint32_t address = romAddrReal[cpu] + readCount[cpu] - 4;
             if (romAddrReal[cpu] + readCount[cpu] <= 0x8000) address = 0x8000 + (address & 0x1FF);
-            if (address < romSize) return U8TO32(rom, address);
+            if (address < romSize) return readRomWord(address);
         }
     }
 
@@ -1003,11 +1270,17 @@ bool CartridgeGba::loadRom()
         saveSizes.push_back(0x20000); // FLASH 128KB
     }
 
-    // Load the ROM into memory
+    // Map the ROM into memory if possible, or load it otherwise
     if (!Cartridge::loadRom()) return false;
-    loadRomSection(0, romSize);
-    fclose(romFile);
-    romFile = nullptr;
+    if (mapRom())
+    {
+        core->dldi.patchRom(rom, 0, romSize);
+    }
+    else
+    {
+        loadRomSection(0, romSize);
+        closeRomFile();
+    }
 
     // Calculate the mask for ROM mirroring
     if (romSize > 0xAC && rom[0xAC] == 'F') // NES classic
@@ -1158,7 +1431,7 @@ void CartridgeGba::eepromWrite(uint8_t value)
             uint16_t addr = (saveSize == 0x200) ? ((eepromCmd & 0x3F00) >> 8) : (eepromCmd & 0x03FF);
             for (unsigned int i = 0; i < 8; i++)
                 save[addr * 8 + i] = eepromData >> (i * 8);
-            saveDirty = true;
+            markSave(addr * 8, 8);
             mutex.unlock();
 
             // Reset the transfer
@@ -1208,7 +1481,7 @@ void CartridgeGba::sramWrite(uint32_t address, uint8_t value)
         // Write a single byte because the data bus is only 8 bits
         mutex.lock();
         save[address - 0xE000000] = value;
-        saveDirty = true;
+        markSave(address - 0xE000000, 1);
         mutex.unlock();
     }
     else if ((saveSize == 0x10000 || saveSize == 0x20000) && address < 0xE010000) // FLASH
@@ -1220,7 +1493,7 @@ void CartridgeGba::sramWrite(uint32_t address, uint8_t value)
             if (bankSwap) address += 0x10000;
             mutex.lock();
             save[address - 0xE000000] = value;
-            saveDirty = true;
+            markSave(address - 0xE000000, 1);
             mutex.unlock();
             flashCmd = 0xF0;
         }
@@ -1230,7 +1503,7 @@ void CartridgeGba::sramWrite(uint32_t address, uint8_t value)
             if (bankSwap) address += 0x10000;
             mutex.lock();
             memset(&save[address - 0xE000000], 0xFF, 0x1000 * sizeof(uint8_t));
-            saveDirty = true;
+            markSave(address - 0xE000000, 0x1000);
             mutex.unlock();
             flashErase = false;
         }
@@ -1258,9 +1531,76 @@ void CartridgeGba::sramWrite(uint32_t address, uint8_t value)
             {
                 mutex.lock();
                 memset(save, 0xFF, saveSize * sizeof(uint8_t));
-                saveDirty = true;
+                markSave(0, saveSize);
                 mutex.unlock();
             }
         }
     }
 }
+
+void Cartridge::syncState(SaveState &state)
+{
+    // Sync the save size, resizing the save to match when loading
+    int size = saveSize;
+    state.sync(size);
+    if (state.isLoading() && size != saveSize)
+    {
+        if (size > 0x2000000) return state.fail();
+        if (size > 0) resizeSave(size, false);
+    }
+
+    // Sync the save data, marking it to be written back to the file after loading a full state
+    if (saveSize > 0 && size == saveSize)
+    {
+        mutex.lock();
+        state.sync(save, saveSize);
+        if (state.isLoading() && !state.isSnapshot()) markSave(0, saveSize);
+        mutex.unlock();
+    }
+}
+
+void CartridgeNds::syncState(SaveState &state)
+{
+    // Sync the save data
+    Cartridge::syncState(state);
+
+    // Sync the encryption state
+    state.sync(romEncrypted);
+    state.sync(cmdMode);
+    state.sync(encTable);
+    state.sync(encCode);
+
+    // Sync the ROM and save transfer state
+    state.sync(romAddrReal);
+
+    // Skip where file-loaded section offsets used to be, keeping the layout
+    uint32_t unused[2] = {};
+    state.sync(unused);
+
+    state.sync(blockSize);
+    state.sync(readCount);
+    state.sync(wordCycles);
+    state.sync(encrypted);
+    state.sync(auxCommand);
+    state.sync(auxAddress);
+    state.sync(auxWriteCount);
+    state.sync(auxSpiCnt);
+    state.sync(auxSpiData);
+    state.sync(romCtrl);
+    state.sync(romCmdOut);
+}
+
+void CartridgeGba::syncState(SaveState &state)
+{
+    // Sync the save data
+    Cartridge::syncState(state);
+
+    // Sync the EEPROM and FLASH command state
+    state.sync(eepromCount);
+    state.sync(eepromCmd);
+    state.sync(eepromData);
+    state.sync(eepromDone);
+    state.sync(flashCmd);
+    state.sync(bankSwap);
+    state.sync(flashErase);
+}
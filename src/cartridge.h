@@ -21,13 +21,31 @@
 #define CARTRIDGE_H
 
 #include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "compressed_rom.h"
 #include "defines.h"
 
+// Size of the blocks that ROMs too big to load are read from file in, and the cache size used if none is set
+#define ROM_BLOCK_SIZE 0x10000
+#define ROM_CACHE_DEFAULT 16
+
+// Size of the pages that changes to saves are tracked in, so only those parts of the file are rewritten
+#define SAVE_PAGE_SIZE 0x1000
+
 class Core;
+class SaveState;
+
+// ROM image loaded in memory, which cores that load the same file share instead of keeping copies
+struct SharedRom
+{
+    std::vector<uint8_t> data;
+    bool patched;
+};
 
 enum NdsCmdMode
 {
@@ -50,6 +68,7 @@ class Cartridge
 
         void trimRom();
         void resizeSave(int newSize, bool dirty = true);
+        void syncState(SaveState &state);
 
         int getRomSize()  { return romSize;  }
         int getSaveSize() { return saveSize; }
@@ -58,16 +77,33 @@ class Cartridge
         Core *core;
 
         FILE *romFile = nullptr;
+        CompressedRom compressedRom;
         uint8_t *rom = nullptr, *save = nullptr;
+        std::shared_ptr<SharedRom> sharedRom;
         int romSize = 0, saveSize = -1;
+        size_t romMapSize = 0;
+        bool romCompressed = false;
         bool saveDirty = false;
         std::mutex mutex;
 
+        // Save pages changed since the last write, and the state of the file they'll be written to
+        // Pages are copied out while holding the mutex, so the file can be written without it
+        std::vector<uint8_t> savePages, writePages;
+        std::vector<uint8_t> writeBuffer;
+        int saveFileSize = -1;
+        std::mutex writeMutex;
+
         std::vector<uint32_t> saveSizes;
         uint32_t romMask = 0;
 
         virtual bool loadRom();
+        bool mapRom();
+        size_t readRomFile(uint8_t *data, size_t offset, size_t size);
         void loadRomSection(size_t offset, size_t size);
+        void loadSharedRom();
+        void closeRomFile();
+        void freeRom();
+        void markSave(uint32_t offset, uint32_t size);
 
     private:
         std::string romPath, savePath;
@@ -79,6 +115,8 @@ class CartridgeNds: public Cartridge
     public:
         CartridgeNds(Core *core): Cartridge(core) {}
 
+        void syncState(SaveState &state);
+
         void directBoot();
         void wordReady(bool cpu);
 
@@ -101,7 +139,15 @@ class CartridgeNds: public Cartridge
         uint32_t encTable[0x412] = {};
         uint32_t encCode[3] = {};
 
-        uint32_t romAddrReal[2] = {}, romAddrVirt[2] = {};
+        // Encryption states for keycode levels 2 and 3, built once since they only depend on the ROM code and BIOS
+        uint32_t keyTables[2][0x412] = {};
+        uint32_t keyCodes[2][3] = {};
+        bool keysCached = false;
+
+        // The first 2KB of the secure area as a real cartridge would send it, encrypted once for decrypted ROMs
+        std::vector<uint32_t> secureArea;
+
+        uint32_t romAddrReal[2] = {};
         uint16_t blockSize[2] = {}, readCount[2] = {};
         uint32_t wordCycles[2] = {};
         bool encrypted[2] = {};
@@ -115,12 +161,27 @@ class CartridgeNds: public Cartridge
         uint32_t romCtrl[2] = {};
         uint64_t romCmdOut[2] = {};
 
+        // Cache of ROM blocks read from file when the whole ROM isn't in memory, replaced least recently used first
+        std::vector<uint8_t> romCache;
+        std::vector<uint32_t> cacheBlocks;
+        std::vector<uint32_t> cacheUses;
+        std::unordered_map<uint32_t, uint32_t> cacheSlots;
+        uint32_t cacheTick = 0;
+        uint32_t lastBlock = -1;
+        uint8_t *lastBlockData = nullptr;
+
         virtual bool loadRom();
+        void startStreaming(int cacheSize);
+        uint8_t *getRomBlock(uint32_t address);
+        uint32_t readRomWord(uint32_t address);
+        uint64_t readRomDouble(uint32_t address);
 
         uint64_t encrypt64(uint64_t value);
         uint64_t decrypt64(uint64_t value);
         void initKeycode(int level);
+        void buildKeycode(int level);
         void applyKeycode();
+        void encryptSecureArea();
 };
 
 class CartridgeGba: public Cartridge
@@ -128,6 +189,8 @@ class CartridgeGba: public Cartridge
     public:
         CartridgeGba(Core *core): Cartridge(core) {}
 
+        void syncState(SaveState &state);
+
         uint8_t *getRom(uint32_t address);
         bool isEeprom(uint32_t address);
 
@@ -0,0 +1,81 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <thread>
+
+#include "frame_pacer.h"
+#include "../defines.h"
+#include "../settings.h"
+
+void FramePacer::pace(double rate)
+{
+    PacerClock::time_point now = PacerClock::now();
+    PacerClock::duration period = std::chrono::duration_cast<PacerClock::duration>(std::chrono::duration<double>(1 / rate));
+
+    // Don't hold anything back if the FPS limiter is disabled
+    if (!Settings::fpsLimiter)
+    {
+        started = false;
+        return;
+    }
+
+    // Start timing from the current frame, or restart if a frame took so long that catching up would cause a burst
+    if (!started || now > deadline + period)
+    {
+        started = true;
+        deadline = now + period;
+        lastFrame = now;
+        count = 0;
+        return;
+    }
+
+    // Sleep until shortly before the deadline, since sleeps can run over; the light limiter sleeps all the way
+    PacerClock::duration margin = (Settings::fpsLimiter == 2) ? std::chrono::milliseconds(2) : PacerClock::duration::zero();
+    if (deadline - now > margin)
+        std::this_thread::sleep_for(deadline - now - margin);
+
+    // Spin for the rest of the frame with the accurate limiter
+    if (Settings::fpsLimiter == 2)
+    {
+        while (PacerClock::now() < deadline)
+            std::this_thread::yield();
+    }
+
+    // Schedule the next frame relative to this deadline rather than the current time, so errors don't build up
+    now = PacerClock::now();
+    measure(now, 1 / rate);
+    deadline += period;
+}
+
+void FramePacer::measure(PacerClock::time_point now, double target)
+{
+    // Record how long the last frame took
+    intervals[count++ % PACER_FRAMES] = std::chrono::duration<double>(now - lastFrame).count();
+    lastFrame = now;
+    if (count % PACER_FRAMES != 0)
+        return;
+
+    // Calculate the jitter as the root mean square of the frame times' deviation from the target, in milliseconds
+    double sum = 0;
+    for (int i = 0; i < PACER_FRAMES; i++)
+        sum += (intervals[i] - target) * (intervals[i] - target);
+    jitter = sqrt(sum / PACER_FRAMES) * 1000;
+    LOG("Frame time jitter: %.3fms\n", jitter);
+}
@@ -0,0 +1,56 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <chrono>
+
+// Refresh rates of the DS and GBA screens, in frames per second
+#define NDS_FRAME_RATE 59.8261
+#define GBA_FRAME_RATE 59.7275
+
+// Number of frames that frame time jitter is measured over
+#define PACER_FRAMES 60
+
+typedef std::chrono::steady_clock PacerClock;
+
+// Timer that holds the emulator to a frame rate, used by frontends after running each frame
+// Waits sleep for most of a frame, and with the accurate FPS limiter they spin for the last stretch
+class FramePacer
+{
+    public:
+        void pace(double rate);
+        void reset() { started = false; }
+
+        double getJitter() { return jitter; }
+
+    private:
+        bool started = false;
+        PacerClock::time_point deadline;
+        PacerClock::time_point lastFrame;
+
+        double intervals[PACER_FRAMES] = {};
+        int count = 0;
+        double jitter = 0;
+
+        void measure(PacerClock::time_point now, double target);
+};
+
+#endif // FRAME_PACER_H
@@ -17,6 +17,8 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstring>
+
 #include "screen_layout.h"
 #include "../settings.h"
 
@@ -46,8 +48,16 @@ void ScreenLayout::addSettings()
     Settings::add(layoutSettings);
 }
 
-void ScreenLayout::update(int winWidth, int winHeight, bool gbaMode)
+bool ScreenLayout::update(int winWidth, int winHeight, bool gbaMode)
 {
+    // Skip recalculating the layout if nothing it depends on has changed
+    int current[] = { winWidth, winHeight, gbaMode, screenPosition, screenRotation,
+        screenArrangement, screenSizing, screenGap, integerScale, gbaCrop };
+    if (valid && !memcmp(current, inputs, sizeof(inputs)))
+        return false;
+    memcpy(inputs, current, sizeof(inputs));
+    valid = true;
+
     // Update the window dimensions
     this->winWidth = winWidth;
     this->winHeight = winHeight;
@@ -344,6 +354,8 @@ void ScreenLayout::update(int winWidth, int winHeight, bool gbaMode)
             }
         }
     }
+
+    return true;
 }
 
 int ScreenLayout::getTouchX(int x, int y)
@@ -40,9 +40,14 @@ class ScreenLayout
 
         static void addSettings();
 
-        void update(int winWidth, int winHeight, bool gbaMode);
+        bool update(int winWidth, int winHeight, bool gbaMode);
         int getTouchX(int x, int y);
         int getTouchY(int x, int y);
+
+    private:
+        // Everything the layout was last calculated from, so it's only recalculated when something changes
+        int inputs[10] = {};
+        bool valid = false;
 };
 
 #endif // SCREEN_LAYOUT_H
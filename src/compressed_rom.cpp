@@ -0,0 +1,205 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include "compressed_rom.h"
+#include "defines.h"
+
+bool CompressedRom::open(FILE *file)
+{
+    // Check the file for a ZSO header, and leave it untouched if there isn't one
+    uint8_t header[0x18];
+    fseek(file, 0, SEEK_SET);
+    size_t count = fread(header, sizeof(uint8_t), 0x18, file);
+    fseek(file, 0, SEEK_SET);
+    if (count < 0x18 || memcmp(header, "ZISO", 4) != 0)
+        return false;
+
+    // Parse the header; block sizes must be a power of 2, and ROMs can't be bigger than 2GB
+    // Index entries are shifted by the alignment of blocks in the file, which can't be coarser than a block
+    uint32_t headerSize = U8TO32(header, 0x04);
+    uint64_t size = U8TO64(header, 0x08);
+    uint32_t bSize = U8TO32(header, 0x10);
+    uint8_t shift = header[0x15];
+    if (headerSize < 0x18 || size > 0x7FFFFFFF || bSize < 0x800 || bSize > 0x100000 || (bSize & (bSize - 1)) ||
+        shift > 20 || (1U << shift) > bSize)
+    {
+        LOG("Unsupported ZSO header\n");
+        return false;
+    }
+
+    // Load the block index, which has an extra entry marking the end of the last block
+    uint32_t blocks = (size + bSize - 1) / bSize;
+    std::vector<uint8_t> data((blocks + 1) * 4);
+    fseek(file, headerSize, SEEK_SET);
+    count = fread(&data[0], sizeof(uint8_t), data.size(), file);
+    fseek(file, 0, SEEK_SET);
+    if (count < data.size())
+    {
+        LOG("ZSO block index is incomplete\n");
+        return false;
+    }
+
+    index.resize(blocks + 1);
+    for (uint32_t i = 0; i <= blocks; i++)
+        index[i] = U8TO32(data, i * 4);
+
+    this->file = file;
+    romSize = size;
+    blockSize = bSize;
+    indexShift = shift;
+    block.resize(blockSize);
+    lastBlock = -1;
+    LOG("Detected a ZSO-compressed ROM with %dKB blocks\n", blockSize >> 10);
+    return true;
+}
+
+void CompressedRom::close()
+{
+    // Forget the current file, which is owned and closed by the caller
+    file = nullptr;
+    romSize = 0;
+    index.clear();
+    block.clear();
+    input.clear();
+    lastBlock = -1;
+}
+
+size_t CompressedRom::read(uint8_t *data, size_t offset, size_t size)
+{
+    // Limit the read to the end of the ROM
+    if (offset >= romSize) return 0;
+    size = std::min(size, romSize - offset);
+
+    for (size_t done = 0; done < size;)
+    {
+        uint32_t number = (offset + done) / blockSize;
+        uint32_t start = (offset + done) % blockSize;
+        uint32_t length = std::min<size_t>(blockSize - start, size - done);
+
+        if (start == 0 && length == std::min<size_t>(blockSize, romSize - (offset + done)) && number != lastBlock)
+        {
+            // Decompress blocks that are read in full straight to the destination
+            readBlock(number, &data[done]);
+        }
+        else
+        {
+            // Decompress blocks that are read in part to a buffer, and copy from there
+            if (number != lastBlock)
+            {
+                readBlock(number, &block[0]);
+                lastBlock = number;
+            }
+            memcpy(&data[done], &block[start], length);
+        }
+
+        done += length;
+    }
+
+    return size;
+}
+
+void CompressedRom::readBlock(uint32_t number, uint8_t *data)
+{
+    // Locate a block in the file; the top bit of an index entry marks a block that's stored uncompressed
+    size_t start = (size_t)(index[number] & 0x7FFFFFFF) << indexShift;
+    size_t end = (size_t)(index[number + 1] & 0x7FFFFFFF) << indexShift;
+    size_t length = std::min<size_t>(blockSize, romSize - (size_t)number * blockSize);
+    size_t size = (end > start) ? (end - start) : 0;
+    size_t count = 0;
+    fseek(file, start, SEEK_SET);
+
+    if (index[number] & BIT(31))
+    {
+        // Read an uncompressed block directly
+        count = fread(data, sizeof(uint8_t), std::min(size, length), file);
+    }
+    else if (size > 0)
+    {
+        // Read a compressed block and decompress it
+        input.resize(size);
+        size = fread(&input[0], sizeof(uint8_t), size, file);
+        count = decompressLz4(&input[0], size, data, length);
+    }
+
+    // Fill anything that couldn't be read with 0xFFs, like missing cartridge data
+    if (count < length)
+    {
+        LOG("Failed to read ZSO block %d\n", number);
+        memset(&data[count], 0xFF, length - count);
+    }
+}
+
+size_t CompressedRom::decompressLz4(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize)
+{
+    // Decompress a raw LZ4 block, stopping once the output is full
+    // The input can have alignment padding after the last sequence, so its end isn't relied on
+    size_t in = 0, out = 0;
+
+    while (in < srcSize && out < dstSize)
+    {
+        // Get the literal length from the token, which is extended by extra bytes when maxed out
+        uint8_t token = src[in++];
+        size_t literals = token >> 4;
+        if (literals == 15)
+        {
+            uint8_t value;
+            do
+            {
+                if (in >= srcSize) return out;
+                literals += (value = src[in++]);
+            }
+            while (value == 255);
+        }
+
+        // Copy the literals
+        if (literals > srcSize - in || literals > dstSize - out) return out;
+        memcpy(&dst[out], &src[in], literals);
+        in += literals;
+        out += literals;
+        if (in + 2 > srcSize || out == dstSize) return out;
+
+        // Get the match offset, which must point to data that was already output
+        size_t offset = U8TO16(src, in);
+        in += 2;
+        if (offset == 0 || offset > out) return out;
+
+        // Get the match length, which is also extended and has an implied minimum of 4
+        size_t match = token & 0xF;
+        if (match == 15)
+        {
+            uint8_t value;
+            do
+            {
+                if (in >= srcSize) return out;
+                match += (value = src[in++]);
+            }
+            while (value == 255);
+        }
+        match = std::min<size_t>(match + 4, dstSize - out);
+
+        // Copy the match a byte at a time, since it can overlap the output
+        for (size_t i = 0; i < match; i++, out++)
+            dst[out] = dst[out - offset];
+    }
+
+    return out;
+}
@@ -0,0 +1,56 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPRESSED_ROM_H
+#define COMPRESSED_ROM_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Reader for ROMs stored in the ZSO format, which splits data into LZ4-compressed blocks with an index
+// Blocks are decompressed on demand, so any part of the ROM can be read without unpacking the whole file
+class CompressedRom
+{
+    public:
+        bool open(FILE *file);
+        void close();
+
+        size_t read(uint8_t *data, size_t offset, size_t size);
+
+        bool   isOpen()  { return file;     }
+        size_t getSize() { return romSize;  }
+
+    private:
+        FILE *file = nullptr;
+        size_t romSize = 0;
+        uint32_t blockSize = 0;
+        uint8_t indexShift = 0;
+        std::vector<uint32_t> index;
+
+        // The last decompressed block, for reads that only cover part of one
+        std::vector<uint8_t> block;
+        std::vector<uint8_t> input;
+        uint32_t lastBlock = -1;
+
+        void readBlock(uint32_t number, uint8_t *data);
+        static size_t decompressLz4(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize);
+};
+
+#endif // COMPRESSED_ROM_H
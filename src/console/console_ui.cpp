@@ -19,16 +19,23 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <dirent.h>
 #include <sys/stat.h>
 
 #include "console_ui.h"
 #include "../common/nds_icon.h"
 #include "../settings.h"
+#include "../thread_config.h"
 
 #define SCALEH(x, h) (((x) * (h)) / 720)
 #define SCALE(x) SCALEH(x, uiHeight)
 
+// Icon atlas pages are 512x512, holding 15x15 icons with a 1 pixel border around each to keep filtering from bleeding
+#define ICON_CELL 34
+#define ICONS_PER_ROW 15
+#define ICONS_PER_PAGE (ICONS_PER_ROW * ICONS_PER_ROW)
+
 extern uint8_t _binary_src_console_images_file_dark_bmp_start;
 extern uint8_t _binary_src_console_images_file_light_bmp_start;
 extern uint8_t _binary_src_console_images_folder_dark_bmp_start;
@@ -49,12 +56,15 @@ uint32_t ConsoleUI::lineHeight;
 bool ConsoleUI::touchMode;
 
 Core *ConsoleUI::core;
+Movie ConsoleUI::movie;
 bool ConsoleUI::running;
+bool ConsoleUI::rewinding;
+FramePacer ConsoleUI::pacer;
 std::string ConsoleUI::ndsPath, ConsoleUI::gbaPath;
 std::string ConsoleUI::basePath, ConsoleUI::curPath;
 
 ScreenLayout ConsoleUI::layout;
-uint32_t ConsoleUI::framebuffer[256 * 192 * 8];
+std::shared_ptr<const Frame> ConsoleUI::screens;
 bool ConsoleUI::gbaMode;
 bool ConsoleUI::changed;
 
@@ -62,6 +72,17 @@ std::thread *ConsoleUI::coreThread, *ConsoleUI::saveThread;
 std::condition_variable ConsoleUI::cond;
 std::mutex ConsoleUI::mutex;
 
+std::unordered_map<std::string, int> ConsoleUI::iconSlots;
+std::vector<std::pair<int, std::string>> ConsoleUI::iconQueue;
+std::vector<bool> ConsoleUI::iconsReady;
+std::vector<uint32_t*> ConsoleUI::iconPages;
+std::vector<void*> ConsoleUI::pageTextures;
+std::vector<bool> ConsoleUI::pagesDirty;
+std::thread *ConsoleUI::iconThread;
+std::condition_variable ConsoleUI::iconCond;
+std::mutex ConsoleUI::iconMutex;
+bool ConsoleUI::decoding;
+
 const uint32_t ConsoleUI::themeColors[] =
 {
     0xFF2D2D2D, 0xFFFFFFFF, 0xFF4B4B4B, 0xFF232323, 0xFFE1B955, 0xFFC8FF00, // Dark
@@ -95,17 +116,96 @@ void ConsoleUI::drawString(std::string string, float x, float y, float size, uin
     // Set the initial offset based on alignment
     float offset = alignRight ? -stringWidth(string) : 0;
 
-    // Move along a string and draw each character
+    // Move along a string and draw each character, skipping spaces since they're blank
     for (uint32_t i = 0; i < string.size(); i++)
     {
-        float x1 = x + offset * size / 48;
-        float tx = 48.0f * (((uint8_t)string[i] - 32) % 10);
-        float ty = 48.0f * (((uint8_t)string[i] - 32) / 10);
-        drawTexture(fontTexture, tx, ty, 47, 47, x1, y, size, size, true, 0, color);
+        if (string[i] != ' ')
+        {
+            float x1 = x + offset * size / 48;
+            float tx = 48.0f * (((uint8_t)string[i] - 32) % 10);
+            float ty = 48.0f * (((uint8_t)string[i] - 32) / 10);
+            drawTexture(fontTexture, tx, ty, 47, 47, x1, y, size, size, true, 0, color);
+        }
         offset += charWidths[(uint8_t)string[i] - 32];
     }
 }
 
+bool ConsoleUI::drawIcon(std::string &path, float x, float y, float size)
+{
+    std::lock_guard<std::mutex> guard(iconMutex);
+
+    // Give a ROM a slot in the atlas the first time its icon is needed, and queue it to be decoded
+    auto it = iconSlots.find(path);
+    if (it == iconSlots.end())
+    {
+        int slot = iconSlots.size();
+        iconSlots[path] = slot;
+        iconsReady.push_back(false);
+        if (slot % ICONS_PER_PAGE == 0)
+        {
+            iconPages.push_back(new uint32_t[512 * 512]());
+            pageTextures.push_back(nullptr);
+            pagesDirty.push_back(false);
+        }
+        iconQueue.push_back(std::make_pair(slot, path));
+        iconCond.notify_one();
+        return false;
+    }
+
+    // Fall back to another icon until this one is decoded
+    int slot = it->second;
+    if (!iconsReady[slot]) return false;
+
+    // Upload the icon's page again if icons were added to it since it was last drawn
+    int page = slot / ICONS_PER_PAGE;
+    if (pagesDirty[page])
+    {
+        if (pageTextures[page]) destroyTexture(pageTextures[page]);
+        pageTextures[page] = createTexture(iconPages[page], 512, 512);
+        pagesDirty[page] = false;
+    }
+
+    // Draw the icon from its page
+    float tx = (slot % ICONS_PER_ROW) * ICON_CELL + 1;
+    float ty = ((slot % ICONS_PER_PAGE) / ICONS_PER_ROW) * ICON_CELL + 1;
+    drawTexture(pageTextures[page], tx, ty, 32, 32, x, y, size, size);
+    return true;
+}
+
+void ConsoleUI::decodeIcons()
+{
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_BACKGROUND);
+
+    std::unique_lock<std::mutex> lock(iconMutex);
+    while (true)
+    {
+        // Wait for icons to decode, starting with the newest since it's most likely on screen
+        iconCond.wait(lock, [&]{ return !iconQueue.empty() || !decoding; });
+        if (!decoding) return;
+        std::pair<int, std::string> request = iconQueue.back();
+        iconQueue.pop_back();
+
+        // Decode the icon without holding the lock, since it has to read from the ROM
+        lock.unlock();
+        NdsIcon icon(request.second);
+        lock.lock();
+
+        // Copy the icon into its cell in the atlas, repeating the edge pixels for its border
+        int slot = request.first;
+        uint32_t *cell = &iconPages[slot / ICONS_PER_PAGE][((slot % ICONS_PER_PAGE) / ICONS_PER_ROW)
+            * ICON_CELL * 512 + (slot % ICONS_PER_ROW) * ICON_CELL];
+        for (int y = 0; y < ICON_CELL; y++)
+        {
+            int iy = std::min(std::max(y - 1, 0), 31);
+            for (int x = 0; x < ICON_CELL; x++)
+                cell[y * 512 + x] = icon.getIcon()[iy * 32 + std::min(std::max(x - 1, 0), 31)];
+        }
+        iconsReady[slot] = true;
+        pagesDirty[slot / ICONS_PER_PAGE] = true;
+    }
+}
+
 void ConsoleUI::fillAudioBuffer(uint32_t *buffer, int count, int rate)
 {
     // Fill the buffer with the last played sample if not running
@@ -117,13 +217,10 @@ void ConsoleUI::fillAudioBuffer(uint32_t *buffer, int count, int rate)
         return;
     }
 
-    // Fill the buffer with resampled output from the core
-    int scaled = count * 32768 / rate;
-    uint32_t *original = core->spu.getSamples(scaled);
-    lastSample = original[scaled - 1];
-    for (int i = 0; i < 1024; i++)
-        buffer[i] = original[i * scaled / 1024];
-    delete[] original;
+    // Fill the buffer with output from the core, resampled to the requested rate
+    uint32_t *original = core->spu.getSamples(count, rate);
+    lastSample = original[count - 1];
+    memcpy(buffer, original, count * sizeof(uint32_t));
 }
 
 uint32_t ConsoleUI::getInputPress()
@@ -177,6 +274,10 @@ void ConsoleUI::initialize(int width, int height, std::string root, std::string
     folderTextures[1] = bmpToTexture(&_binary_src_console_images_folder_light_bmp_start);
     fontTexture = bmpToTexture(&_binary_src_console_images_font_bmp_start);
 
+    // Start decoding icons in the background
+    decoding = true;
+    iconThread = new std::thread(decodeIcons);
+
     // Create the settings folder if it doesn't exist
     mkdir(prefix.c_str(), 0777);
 
@@ -233,29 +334,35 @@ void ConsoleUI::mainLoop(MenuTouch (*specialTouch)(), ScreenLayout *touchLayout)
             changed = false;
         }
 
-        // Update the framebuffer and start rendering
+        // Take the next frame if one is ready, keeping the last one otherwise, and start rendering
         void *gbaTexture = nullptr, *topTexture = nullptr, *botTexture = nullptr;
-        int shift = Settings::highRes3D;
-        core->gpu.getFrame(framebuffer, gbaMode);
+        if (std::shared_ptr<const Frame> next = core->gpu.getFrame(gbaMode))
+            screens = next;
         startFrame(0);
 
-        if (gbaMode)
+        if (!screens)
         {
-            // Draw the GBA screen
-            gbaTexture = createTexture(&framebuffer[0], 240 << shift, 160 << shift);
-            drawTexture(gbaTexture, 0, 0, 240 << shift, 160 << shift, layout.topX, layout.topY,
+            // Wait until the first frame is ready
+        }
+        else if (gbaMode)
+        {
+            // Draw the GBA screen straight from the core's frame
+            int w = screens->width, h = screens->height;
+            gbaTexture = createTexture(&screens->data[0], w, h);
+            drawTexture(gbaTexture, 0, 0, w, h, layout.topX, layout.topY,
                 layout.topWidth, layout.topHeight, screenFilter, ScreenLayout::screenRotation);
         }
         else // DS mode
         {
-            // Draw the DS top screen
-            topTexture = createTexture(&framebuffer[0], 256 << shift, 192 << shift);
-            drawTexture(topTexture, 0, 0, 256 << shift, 192 << shift, layout.topX, layout.topY,
+            // Draw the DS top screen straight from the core's frame
+            int w = screens->width, h = screens->height;
+            topTexture = createTexture(&screens->data[0], w, h);
+            drawTexture(topTexture, 0, 0, w, h, layout.topX, layout.topY,
                 layout.topWidth, layout.topHeight, screenFilter, ScreenLayout::screenRotation);
 
             // Draw the DS bottom screen
-            botTexture = createTexture(&framebuffer[(256 * 192) << (shift * 2)], 256 << shift, 192 << shift);
-            drawTexture(botTexture, 0, 0, 256 << shift, 192 << shift, layout.botX, layout.botY,
+            botTexture = createTexture(&screens->data[w * h], w, h);
+            drawTexture(botTexture, 0, 0, w, h, layout.botX, layout.botY,
                 layout.botWidth, layout.botHeight, screenFilter, ScreenLayout::screenRotation);
         }
 
@@ -271,11 +378,14 @@ void ConsoleUI::mainLoop(MenuTouch (*specialTouch)(), ScreenLayout *touchLayout)
         for (int i = 0; i < 12; i++)
         {
             if (pressed & BIT(i))
-                core->input.pressKey(i);
+                core->input.queueKey(i, true);
             else if (~held & BIT(i))
-                core->input.releaseKey(i);
+                core->input.queueKey(i, false);
         }
 
+        // Step back through the rewind history while its button is held
+        rewinding = (held & INPUT_REWIND);
+
         // Scan for touch input, falling back to a special function if provided
         MenuTouch touch = getInputTouch();
         if (!touch.pressed && specialTouch)
@@ -289,14 +399,12 @@ void ConsoleUI::mainLoop(MenuTouch (*specialTouch)(), ScreenLayout *touchLayout)
             int touchY = sl->getTouchY(SCALEH(touch.x, sl->winHeight), SCALEH(touch.y, sl->winHeight));
 
             // Send the touch coordinates to the core
-            core->input.pressScreen();
-            core->spi.setTouch(touchX, touchY);
+            core->input.queueScreen(true, touchX, touchY);
         }
         else // Released
         {
             // Release the touch screen press
-            core->input.releaseScreen();
-            core->spi.clearTouch();
+            core->input.queueScreen(false);
         }
 
         // Finish drawing and free textures
@@ -309,6 +417,15 @@ void ConsoleUI::mainLoop(MenuTouch (*specialTouch)(), ScreenLayout *touchLayout)
         if (held & INPUT_PAUSE)
             pauseMenu();
     }
+
+    // Stop decoding icons, since the emulator is closing
+    {
+        std::lock_guard<std::mutex> guard(iconMutex);
+        decoding = false;
+        iconCond.notify_one();
+    }
+    iconThread->join();
+    delete iconThread;
 }
 
 int ConsoleUI::setPath(std::string path)
@@ -563,8 +680,9 @@ uint32_t ConsoleUI::menu(std::string title, std::vector<MenuItem> &items,
             int x = (items[offset].iconSize > 0) ? 184 : 105;
             drawString(items[offset].name, SCALE(x), SCALE(140 + i * 70), SCALE(38), palette[1]);
 
-            // Draw the current item's icon if it has one
-            if (items[offset].iconSize > 0)
+            // Draw the current item's icon if it has one, using the decoded ROM icon once it's ready
+            if (items[offset].iconSize > 0 && (items[offset].iconPath == "" ||
+                !drawIcon(items[offset].iconPath, SCALE(105), SCALE(127 + i * 70), SCALE(64))))
                 drawTexture(items[offset].iconTex, 0, 0, items[offset].iconSize,
                     items[offset].iconSize, SCALE(105), SCALE(127 + i * 70), SCALE(64), SCALE(64));
 
@@ -685,9 +803,8 @@ void ConsoleUI::fileBrowser()
             }
             else if (name.find(".nds", name.length() - 4) != std::string::npos)
             {
-                // Add an NDS ROM with its decoded icon to the list
-                void *texture = createTexture(NdsIcon(subpath).getIcon(), 32, 32);
-                files.push_back(MenuItem(name, "", texture, 32));
+                // Add an NDS ROM to the list, with a generic icon until its own is decoded
+                files.push_back(MenuItem(name, "", fileTextures[menuTheme], 64, subpath));
             }
             else if (name.find(".gba", name.length() - 4) != std::string::npos)
             {
@@ -835,6 +952,8 @@ void ConsoleUI::pauseMenu()
         MenuItem("Resume"),
         MenuItem("Restart"),
         MenuItem("Change Save Type"),
+        MenuItem(core->movie ? "Stop Movie" : "Record Movie"),
+        MenuItem("Play Movie"),
         MenuItem("Settings"),
         MenuItem("File Browser")
     };
@@ -867,12 +986,50 @@ void ConsoleUI::pauseMenu()
                         return createCore() ? startCore() : fileBrowser();
                     break;
 
-                case 3: // Settings
+                case 3: // Record Movie
+                    // Detach a movie if one is attached, finishing the file if recording
+                    if (core->movie)
+                    {
+                        movie.stop();
+                        core->movie = nullptr;
+                        startCore();
+                        return;
+                    }
+
+                    // Restart and record input from boot to a movie next to the ROM
+                    if (!createCore())
+                        return fileBrowser();
+                    if (movie.record(getMoviePath(), core))
+                        core->movie = &movie;
+                    else
+                        message("Error Recording Movie", "Make sure the ROM folder is writable and try again.");
+                    startCore();
+                    return;
+
+                case 4: // Play Movie
+                    // Load the movie next to the ROM, which brings the settings it was recorded with
+                    if (!movie.load(getMoviePath()))
+                    {
+                        message("Error Loading Movie", "Make sure a movie was recorded for this ROM "
+                            "with this version of NooDS and try again.");
+                        break;
+                    }
+
+                    // Restart and play the movie from boot
+                    if (!createCore())
+                        return fileBrowser();
+                    movie.play(core);
+                    if (movie.isPlaying())
+                        core->movie = &movie;
+                    startCore();
+                    return;
+
+                case 5: // Settings
                     // Open the settings menu
                     settingsMenu();
                     break;
 
-                case 4: // File Browser
+                case 6: // File Browser
                     // Open the file browser and close the pause menu
                     fileBrowser();
                     return;
@@ -974,9 +1131,10 @@ bool ConsoleUI::createCore()
 {
     try
     {
-        // Attempt to create the core
+        // Attempt to create the core, finishing any movie attached to the old one
+        movie.stop();
         if (core) delete core;
-        core = new Core(ndsPath, gbaPath);
+        core = Core::create(ndsPath, gbaPath);
         return true;
     }
     catch (CoreError e)
@@ -1009,6 +1167,14 @@ bool ConsoleUI::createCore()
     }
 }
 
+std::string ConsoleUI::getMoviePath()
+{
+    // Keep movies next to the ROM they were recorded with, or in the base folder when booting firmware
+    std::string path = (ndsPath != "") ? ndsPath : gbaPath;
+    if (path == "") return basePath + "/firmware.ndm";
+    return path.substr(0, path.rfind(".")) + ".ndm";
+}
+
 void ConsoleUI::startCore()
 {
     // Tell the threads to run if stopped
@@ -1040,13 +1206,30 @@ void ConsoleUI::stopCore()
 
 void ConsoleUI::runCore()
 {
-    // Run the emulator
+    // Run the emulator, stepping back through the rewind history while its button is held
+    ThreadConfig::apply(THREAD_EMU);
+    pacer.reset();
     while (running)
-        core->runFrame();
+    {
+        // Rewinding is left out while a movie is attached, since its input has to line up with every frame
+        if (!rewinding || core->movie || !core->rewind())
+        {
+            // Run a frame and hold it to the frame rate
+            core->runFrame();
+            pacer.pace(core->gbaMode ? GBA_FRAME_RATE : NDS_FRAME_RATE);
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(1000000 / 60));
+        }
+    }
 }
 
 void ConsoleUI::checkSave()
 {
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_BACKGROUND);
+
     while (running)
     {
         // Check save files every few seconds and update them if changed
@@ -21,9 +21,12 @@
 #define CONSOLE_UI_H
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "../common/frame_pacer.h"
 #include "../common/screen_layout.h"
 #include "../core.h"
 #include "../defines.h"
@@ -42,7 +45,8 @@ enum MenuInputs
     INPUT_L = BIT(9),
     INPUT_X = BIT(10),
     INPUT_Y = BIT(11),
-    INPUT_PAUSE = BIT(12)
+    INPUT_PAUSE = BIT(12),
+    INPUT_REWIND = BIT(13)
 };
 
 struct MenuTouch
@@ -60,9 +64,11 @@ struct MenuItem
     std::string setting;
     void *iconTex;
     uint8_t iconSize;
+    std::string iconPath; // ROM with an icon that replaces the texture once it's decoded
 
-    MenuItem(std::string name, std::string setting = "", void *iconTex = nullptr, uint8_t iconSize = 0):
-        name(name), setting(setting), iconTex(iconTex), iconSize(iconSize) {}
+    MenuItem(std::string name, std::string setting = "", void *iconTex = nullptr,
+        uint8_t iconSize = 0, std::string iconPath = ""):
+        name(name), setting(setting), iconTex(iconTex), iconSize(iconSize), iconPath(iconPath) {}
     bool operator<(const MenuItem &item) { return (name < item.name); }
 };
 
@@ -111,19 +117,37 @@ class ConsoleUI
 
         static std::string ndsPath, gbaPath;
         static std::string basePath, curPath;
-        static uint32_t framebuffer[256 * 192 * 8];
+        static std::shared_ptr<const Frame> screens;
         static bool changed;
+        static bool rewinding;
+        static Movie movie;
+        static FramePacer pacer;
 
         static std::thread *coreThread, *saveThread;
         static std::condition_variable cond;
         static std::mutex mutex;
 
+        // NDS icons are decoded on a background thread and packed into atlas pages, cached by ROM path
+        // Pages are kept in memory and only re-uploaded as textures when an icon is added to them
+        static std::unordered_map<std::string, int> iconSlots;
+        static std::vector<std::pair<int, std::string>> iconQueue;
+        static std::vector<bool> iconsReady;
+        static std::vector<uint32_t*> iconPages;
+        static std::vector<void*> pageTextures;
+        static std::vector<bool> pagesDirty;
+        static std::thread *iconThread;
+        static std::condition_variable iconCond;
+        static std::mutex iconMutex;
+        static bool decoding;
+
         static const uint32_t themeColors[];
         static const uint8_t charWidths[];
 
         ConsoleUI() {} // Private to prevent instantiation
         static void *bmpToTexture(uint8_t *bmp);
         static int stringWidth(std::string &string);
+        static bool drawIcon(std::string &path, float x, float y, float size);
+        static void decodeIcons();
 
         static uint32_t menu(std::string title, std::vector<MenuItem> &items,
             int &index, std::string actionX = "", std::string actionPlus = "");
@@ -134,6 +158,7 @@ class ConsoleUI
         static bool saveTypeMenu();
 
         static bool createCore();
+        static std::string getMoviePath();
         static void startCore();
         static void stopCore();
         static void runCore();
@@ -25,6 +25,7 @@
 #include <switch.h>
 
 #include "console_ui.h"
+#include "../thread_config.h"
 
 #define GYRO_TOUCH_RANGE 0.08f
 
@@ -203,6 +204,7 @@ uint32_t ConsoleUI::getInputHeld()
     if (held & HidNpadButton_X) value |= INPUT_X;
     if (held & HidNpadButton_Y) value |= INPUT_Y;
     if ((held & (HidNpadButton_L | HidNpadButton_R)) && !toggle) value |= INPUT_PAUSE;
+    if (held & HidNpadButton_StickL) value |= INPUT_REWIND;
     return value;
 }
 
@@ -216,6 +218,9 @@ MenuTouch ConsoleUI::getInputTouch()
 
 void outputAudio()
 {
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_AUDIO);
+
     while (playing)
     {
         // Refill the audio buffers until stopped
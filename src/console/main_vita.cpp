@@ -29,6 +29,7 @@
 #include <psp2/touch.h>
 
 #include "console_ui.h"
+#include "../thread_config.h"
 
 // Reserve 128MB of allocatable memory (can do more, but loading larger ROMs into RAM is slow)
 int _newlib_heap_size_user = 128 * 1024 * 1024;
@@ -119,6 +120,9 @@ MenuTouch ConsoleUI::getInputTouch()
 
 void outputAudio()
 {
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_AUDIO);
+
     while (playing)
     {
         // Refill the audio buffer until stopped
@@ -233,6 +233,7 @@ uint32_t ConsoleUI::getInputHeld()
     if (vpad.hold & VPAD_BUTTON_X) value |= INPUT_X;
     if (vpad.hold & VPAD_BUTTON_Y) value |= INPUT_Y;
     if (vpad.hold & (VPAD_BUTTON_L | VPAD_BUTTON_R)) value |= INPUT_PAUSE;
+    if (vpad.hold & VPAD_BUTTON_STICK_L) value |= INPUT_REWIND;
     return value;
 }
 
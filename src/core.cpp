@@ -18,7 +18,9 @@
 */
 
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <new>
 #include <thread>
 
 #include "core.h"
@@ -26,7 +28,7 @@
 
 Core::Core(std::string ndsRom, std::string gbaRom, std::string ndsSave, std::string gbaSave,
     int id, int ndsRomFd, int gbaRomFd, int ndsSaveFd, int gbaSaveFd):
-    id(id), bios { Bios(this, 0, Bios::swiTable9), Bios(this, 1, Bios::swiTable7), Bios(this, 1, Bios::swiTableGba) },
+    id(id), frameTrace(this), bios { Bios(this, 0, Bios::swiTable9), Bios(this, 1, Bios::swiTable7), Bios(this, 1, Bios::swiTableGba) },
     cartridgeNds(this), cartridgeGba(this), cp15(this), divSqrt(this), dldi(this), dma { Dma(this, 0),
     Dma(this, 1) }, gpu(this), gpu2D { Gpu2D(this, 0), Gpu2D(this, 1) }, gpu3D(this), gpu3DRenderer(this),
     input(this), interpreter { Interpreter(this, 0), Interpreter(this, 1) }, ipc(this), memory(this),
@@ -37,44 +39,19 @@ Core::Core(std::string ndsRom, std::string gbaRom, std::string ndsSave, std::str
     if (!memory.loadBios9() && required) throw ERROR_BIOS;
     if (!memory.loadBios7() && required) throw ERROR_BIOS;
     if (!spi.loadFirmware() && required) throw ERROR_FIRM;
-    realGbaBios = memory.loadGbaBios();
-
-    // Define the tasks that can be scheduled
-    tasks[RESET_CYCLES] = std::bind(&Core::resetCycles, this);
-    tasks[CART9_WORD_READY] = std::bind(&CartridgeNds::wordReady, &cartridgeNds, 0);
-    tasks[CART7_WORD_READY] = std::bind(&CartridgeNds::wordReady, &cartridgeNds, 1);
-    tasks[DMA9_TRANSFER0] = std::bind(&Dma::transfer, &dma[0], 0);
-    tasks[DMA9_TRANSFER1] = std::bind(&Dma::transfer, &dma[0], 1);
-    tasks[DMA9_TRANSFER2] = std::bind(&Dma::transfer, &dma[0], 2);
-    tasks[DMA9_TRANSFER3] = std::bind(&Dma::transfer, &dma[0], 3);
-    tasks[DMA7_TRANSFER0] = std::bind(&Dma::transfer, &dma[1], 0);
-    tasks[DMA7_TRANSFER1] = std::bind(&Dma::transfer, &dma[1], 1);
-    tasks[DMA7_TRANSFER2] = std::bind(&Dma::transfer, &dma[1], 2);
-    tasks[DMA7_TRANSFER3] = std::bind(&Dma::transfer, &dma[1], 3);
-    tasks[NDS_SCANLINE256] = std::bind(&Gpu::scanline256, &gpu);
-    tasks[NDS_SCANLINE355] = std::bind(&Gpu::scanline355, &gpu);
-    tasks[GBA_SCANLINE240] = std::bind(&Gpu::gbaScanline240, &gpu);
-    tasks[GBA_SCANLINE308] = std::bind(&Gpu::gbaScanline308, &gpu);
-    tasks[GPU3D_COMMAND] = std::bind(&Gpu3D::runCommand, &gpu3D);
-    tasks[ARM9_INTERRUPT] = std::bind(&Interpreter::interrupt, &interpreter[0]);
-    tasks[ARM7_INTERRUPT] = std::bind(&Interpreter::interrupt, &interpreter[1]);
-    tasks[NDS_SPU_SAMPLE] = std::bind(&Spu::runSample, &spu);
-    tasks[GBA_SPU_SAMPLE] = std::bind(&Spu::runGbaSample, &spu);
-    tasks[TIMER9_OVERFLOW0] = std::bind(&Timers::overflow, &timers[0], 0);
-    tasks[TIMER9_OVERFLOW1] = std::bind(&Timers::overflow, &timers[0], 1);
-    tasks[TIMER9_OVERFLOW2] = std::bind(&Timers::overflow, &timers[0], 2);
-    tasks[TIMER9_OVERFLOW3] = std::bind(&Timers::overflow, &timers[0], 3);
-    tasks[TIMER7_OVERFLOW0] = std::bind(&Timers::overflow, &timers[1], 0);
-    tasks[TIMER7_OVERFLOW1] = std::bind(&Timers::overflow, &timers[1], 1);
-    tasks[TIMER7_OVERFLOW2] = std::bind(&Timers::overflow, &timers[1], 2);
-    tasks[TIMER7_OVERFLOW3] = std::bind(&Timers::overflow, &timers[1], 3);
-    tasks[WIFI_COUNT_MS] = std::bind(&Wifi::countMs, &wifi);
+
+    // Choose whether the CPUs run from cached blocks or fetch and decode every opcode
+    if (Settings::cachedInterpreter)
+        runFunc = &Interpreter::runNdsFrame<true>;
+
+    // Start with an empty scheduler
+    clearEvents();
 
     // Schedule initial tasks for NDS mode
     schedule(RESET_CYCLES, 0x7FFFFFFF);
     schedule(NDS_SCANLINE256, 256 * 6);
     schedule(NDS_SCANLINE355, 355 * 6);
-    schedule(NDS_SPU_SAMPLE, 512 * 2);
+    schedule(NDS_SPU_SAMPLE, 512 * 2 * SPU_BLOCK);
 
     // Initialize the memory and CPUs
     memory.updateMap9<false>(0x00000000, 0xFFFFFFFF);
@@ -137,34 +114,233 @@ Core::Core(std::string ndsRom, std::string gbaRom, std::string ndsSave, std::str
     running.store(true);
 }
 
+Core *Core::create(std::string ndsRom, std::string gbaRom, std::string ndsSave, std::string gbaSave,
+    int id, int ndsRomFd, int gbaRomFd, int ndsSaveFd, int gbaSaveFd)
+{
+    // Create a core in zeroed memory from the page allocator
+    return new Core(ndsRom, gbaRom, ndsSave, gbaSave, id, ndsRomFd, gbaRomFd, ndsSaveFd, gbaSaveFd);
+}
+
+void *Core::allocPages(size_t size)
+{
+#ifdef USE_MMAP
+    // Map fresh zeroed pages, and let them be backed by huge pages if enabled to cut down on TLB misses
+    void *pointer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pointer == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+    if (Settings::hugePages) madvise(pointer, size, MADV_HUGEPAGE);
+#endif
+    return pointer;
+#else
+    // Allocate zeroed memory with a page of slack, and align it while keeping the original pointer in front
+    uint8_t *base = (uint8_t*)calloc(1, size + 0x1000);
+    if (!base) throw std::bad_alloc();
+    uint8_t *pointer = (uint8_t*)(((uintptr_t)base + 0x1000) & ~0xFFF);
+    ((uint8_t**)pointer)[-1] = base;
+    return pointer;
+#endif
+}
+
+void Core::freePages(void *pointer, size_t size)
+{
+    // Free memory from allocPages
+    if (!pointer) return;
+#ifdef USE_MMAP
+    munmap(pointer, size);
+#else
+    free(((uint8_t**)pointer)[-1]);
+#endif
+}
+
+void Core::runFrame()
+{
+    // Apply input that was queued since the last frame, and then record it or replace it if a movie is attached
+    input.applyQueue();
+    if (movie) movie->beginFrame();
+
+    // Run a frame, emulating ahead of it if enabled
+    frameTrace.beginFrame();
+    if (Settings::runAhead > 0)
+        runAhead(Settings::runAhead);
+    else
+        (*runFunc)(*this);
+    frameTrace.endFrame();
+    if (movie) movie->endFrame();
+
+    // Add to the rewind history every few frames if enabled
+    if (Settings::rewindLength > 0 && ++rewindTimer >= REWIND_INTERVAL)
+        recordRewind();
+}
+
+void Core::runAhead(int frames)
+{
+    // Emulate the real frame without showing it, and take a snapshot of the state after it
+    gpu.setOutput(false);
+    (*runFunc)(*this);
+    saveSnapshot();
+
+    // Emulate ahead and show the last frame, hiding the effects of the game's input lag
+    // The audio and WiFi traffic are discarded, since these frames will be emulated again
+    spu.setOutput(false);
+    wifi.setOutput(false);
+    for (int i = 0; i < frames; i++)
+    {
+        if (i == frames - 1) gpu.setOutput(true);
+        (*runFunc)(*this);
+    }
+    wifi.setOutput(true);
+    spu.setOutput(true);
+
+    // Roll back to the real frame, without counting the extra frames towards the FPS
+    loadSnapshot();
+    fpsCount = std::max(fpsCount - frames, 0);
+}
+
 void Core::resetCycles()
 {
     // Reset the global cycle count periodically to prevent overflow
-    for (size_t i = 0; i < events.size(); i++)
+    for (int i = 0; i < eventCount; i++)
         events[i].cycles -= globalCycles;
     for (int i = 0; i < 2; i++)
         interpreter[i].resetCycles(), timers[i].resetCycles();
+    spu.resetCycles();
     globalCycles -= globalCycles;
     schedule(RESET_CYCLES, 0x7FFFFFFF);
 }
 
 void Core::schedule(SchedTask task, uint32_t cycles)
 {
-    // Add a task to the scheduler, sorted by least to most cycles until execution
-    SchedEvent event(&tasks[task], globalCycles + cycles);
-    auto it = std::upper_bound(events.cbegin(), events.cend(), event);
-    events.insert(it, event);
+    // Add a task to the scheduler, or move it to the new time if it's already scheduled
+    int slot = eventSlots[task];
+    if (slot < 0)
+    {
+        slot = eventSlots[task] = eventCount++;
+        events[slot].task = task;
+    }
+    events[slot].cycles = globalCycles + cycles;
+    events[slot].order = eventOrder++;
+
+    // Move the event to its sorted position in the heap
+    siftUp(slot);
+    siftDown(eventSlots[task]);
+}
+
+void Core::unschedule(SchedTask task)
+{
+    // Remove a task from the scheduler if it's scheduled
+    if (eventSlots[task] >= 0)
+        removeEvent(eventSlots[task]);
+}
+
+void Core::runEvent()
+{
+    // Remove the soonest event from the scheduler
+    // The event is removed first so that the task is free to schedule itself again
+    SchedTask task = events[0].task;
+    removeEvent(0);
+    eventsRun++;
+
+    // Count the task and measure how long it takes if profiling
+    PROFILE_COUNT(profileTotals.eventCounts[task]);
+    PROFILE_TIME(profileTotals.eventTimes[task]);
+
+    // Run the event's task
+    switch (task)
+    {
+        case RESET_CYCLES:     return resetCycles();
+        case CART9_WORD_READY: return cartridgeNds.wordReady(0);
+        case CART7_WORD_READY: return cartridgeNds.wordReady(1);
+        case DMA9_TRANSFER0:   return dma[0].transfer(0);
+        case DMA9_TRANSFER1:   return dma[0].transfer(1);
+        case DMA9_TRANSFER2:   return dma[0].transfer(2);
+        case DMA9_TRANSFER3:   return dma[0].transfer(3);
+        case DMA7_TRANSFER0:   return dma[1].transfer(0);
+        case DMA7_TRANSFER1:   return dma[1].transfer(1);
+        case DMA7_TRANSFER2:   return dma[1].transfer(2);
+        case DMA7_TRANSFER3:   return dma[1].transfer(3);
+        case NDS_SCANLINE256:  return gpu.scanline256();
+        case NDS_SCANLINE355:  return gpu.scanline355();
+        case GBA_SCANLINE240:  return gpu.gbaScanline240();
+        case GBA_SCANLINE308:  return gpu.gbaScanline308();
+        case GPU3D_COMMAND:    return gpu3D.runCommand();
+        case ARM9_INTERRUPT:   return interpreter[0].interrupt();
+        case ARM7_INTERRUPT:   return interpreter[1].interrupt();
+        case NDS_SPU_SAMPLE:   return spu.runSample();
+        case GBA_SPU_SAMPLE:   return spu.runGbaSample();
+        case TIMER9_OVERFLOW0: return timers[0].overflow(0);
+        case TIMER9_OVERFLOW1: return timers[0].overflow(1);
+        case TIMER9_OVERFLOW2: return timers[0].overflow(2);
+        case TIMER9_OVERFLOW3: return timers[0].overflow(3);
+        case TIMER7_OVERFLOW0: return timers[1].overflow(0);
+        case TIMER7_OVERFLOW1: return timers[1].overflow(1);
+        case TIMER7_OVERFLOW2: return timers[1].overflow(2);
+        case TIMER7_OVERFLOW3: return timers[1].overflow(3);
+        case WIFI_COUNT_MS:    return wifi.countMs();
+        default:               return;
+    }
+}
+
+void Core::clearEvents()
+{
+    // Remove all events from the scheduler
+    for (int i = 0; i < MAX_TASKS; i++)
+        eventSlots[i] = -1;
+    eventCount = 0;
+}
+
+void Core::removeEvent(int slot)
+{
+    // Remove an event from the heap, filling its slot with the last event
+    eventSlots[events[slot].task] = -1;
+    if (slot == --eventCount) return;
+    SchedTask task = events[eventCount].task;
+    events[slot] = events[eventCount];
+    eventSlots[task] = slot;
+
+    // Move the replacement event to its sorted position in the heap
+    siftUp(slot);
+    siftDown(eventSlots[task]);
+}
+
+void Core::siftUp(int slot)
+{
+    // Swap an event with its parent until the parent is due sooner
+    while (slot > 0)
+    {
+        int parent = (slot - 1) >> 1;
+        if (!(events[slot] < events[parent])) break;
+        SWAP(events[slot], events[parent]);
+        eventSlots[events[slot].task] = slot;
+        eventSlots[events[parent].task] = parent;
+        slot = parent;
+    }
+}
+
+void Core::siftDown(int slot)
+{
+    // Swap an event with its soonest child until both children are due later
+    while (true)
+    {
+        int child = (slot << 1) + 1;
+        if (child >= eventCount) break;
+        if (child + 1 < eventCount && events[child + 1] < events[child]) child++;
+        if (!(events[child] < events[slot])) break;
+        SWAP(events[slot], events[child]);
+        eventSlots[events[slot].task] = slot;
+        eventSlots[events[child].task] = child;
+        slot = child;
+    }
 }
 
 void Core::enterGbaMode()
 {
     // Switch to GBA mode
     gbaMode = true;
-    runFunc = &Interpreter::runGbaFrame;
+    runFunc = Settings::cachedInterpreter ? &Interpreter::runGbaFrame<true> : &Interpreter::runGbaFrame<false>;
     running.store(false);
 
     // Reset the scheduler and schedule initial tasks for GBA mode
-    events.clear();
+    clearEvents();
     schedule(RESET_CYCLES, 1);
     schedule(GBA_SCANLINE240, 240 * 4);
     schedule(GBA_SCANLINE308, 308 * 4);
@@ -180,8 +356,8 @@ void Core::enterGbaMode()
     memory.write<uint8_t>(0, 0x4000240, 0x80); // VRAMCNT_A
     memory.write<uint8_t>(0, 0x4000241, 0x80); // VRAMCNT_B
 
-    // Disable HLE BIOS if a real one was loaded
-    if (realGbaBios)
+    // Load the GBA BIOS now that it's needed, and disable HLE BIOS if a real one was found
+    if ((realGbaBios = memory.loadGbaBios()))
         return interpreter[1].setBios(nullptr);
 
     // Enable HLE BIOS and boot the GBA ROM directly
@@ -190,12 +366,44 @@ void Core::enterGbaMode()
     memory.write<uint16_t>(1, 0x4000088, 0x200); // SOUNDBIAS
 }
 
+void Core::setGpu3DBackend(Gpu3DBackend *backend)
+{
+    // Switch to a different 3D backend, or back to the software renderer if null, once the current one is done
+    // This should only be called from the emulation thread, or while emulation is stopped
+    gpu3DBackend->finishFrame();
+    gpu3DBackend = backend ? backend : &gpu3DRenderer;
+
+    // Draw the frame with the new backend up to this point, since it doesn't have the scanlines from the old one
+    gpu.redraw3D();
+}
+
 void Core::endFrame()
 {
     // Break execution at the end of a frame and count it
     running.store(false);
     fpsCount++;
 
+    // Save how many cycles each CPU skipped in idle loops during the frame
+    for (int i = 0; i < 2; i++)
+        idleCycles[i] = interpreter[i].takeIdleCycles();
+
+#ifdef EXEC_TRACE
+    // Finish the execution profiles for the frame
+    for (int i = 0; i < 2; i++)
+        interpreter[i].execTrace.endFrame();
+#endif
+
+#ifdef PROFILE
+    // Collect the render times, then save the profiling counters for the frame as the change in their totals
+    for (int i = 0; i < 2; i++)
+        profileTotals.gpu2DTimes[i] = renderProfile.gpu2DTimes[i].load(std::memory_order_relaxed);
+    profileTotals.gpu3DTime = renderProfile.gpu3DTime.load(std::memory_order_relaxed);
+    uint64_t *totals = (uint64_t*)&profileTotals, *last = (uint64_t*)&lastTotals, *frame = (uint64_t*)&profile;
+    for (size_t i = 0; i < sizeof(ProfileStats) / sizeof(uint64_t); i++)
+        frame[i] = totals[i] - last[i];
+    lastTotals = profileTotals;
+#endif
+
     // Update the FPS and reset the counter every second
     std::chrono::duration<double> fpsTime = std::chrono::steady_clock::now() - lastFpsTime;
     if (fpsTime.count() >= 1.0f)
@@ -209,3 +417,195 @@ void Core::endFrame()
     if (wifi.shouldSchedule())
         wifi.scheduleInit();
 }
+
+bool Core::dumpHeatmap(std::string path)
+{
+#ifdef HEATMAP
+    // Write the memory access counts to a text file
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    memory.heatmap.dump(file);
+    fclose(file);
+    return true;
+#else
+    // Memory accesses are only counted when built with HEATMAP defined
+    return false;
+#endif
+}
+
+void Core::resetHeatmap()
+{
+#ifdef HEATMAP
+    // Start counting memory accesses over
+    memory.heatmap.reset();
+#endif
+}
+
+bool Core::saveState(std::string path)
+{
+    // Stream the state of each component to a file
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    SaveState state(file, false);
+    bool success = syncState(state);
+    fclose(file);
+    return success;
+}
+
+bool Core::loadState(std::string path)
+{
+    // Stream the state of each component from a file
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    SaveState state(file, true);
+    bool success = syncState(state);
+    fclose(file);
+    return success;
+}
+
+bool Core::saveSnapshot()
+{
+    // Keep the state in memory, reusing the buffer from the last snapshot
+    // Memory contents are tracked separately, so only pages that changed since the last snapshot are copied
+    snapshot.clear();
+    SaveState state(&snapshot, false, true);
+    return syncState(state);
+}
+
+bool Core::loadSnapshot()
+{
+    // Roll back to the state from the last snapshot
+    if (snapshot.empty()) return false;
+    SaveState state(&snapshot, true, true);
+    return syncState(state);
+}
+
+void Core::recordRewind()
+{
+    // Save a full state, since snapshots only track memory changes against a single previous snapshot
+    rewindTimer = 0;
+    rewindTemp.clear();
+    SaveState state(&rewindTemp, false);
+    if (!syncState(state)) return;
+
+    // Store the previous state as a delta against the new one, which is kept in full
+    if (!rewindState.empty())
+    {
+        rewindDeltas.emplace_back();
+        SaveState::encodeDelta(rewindTemp, rewindState, rewindDeltas.back());
+        rewindSize += rewindDeltas.back().size();
+    }
+    rewindState.swap(rewindTemp);
+
+    // Drop the oldest deltas once the history is longer than the setting or too large
+    size_t limit = Settings::rewindLength * 60 / REWIND_INTERVAL;
+    while (!rewindDeltas.empty() && (rewindDeltas.size() > limit || rewindSize + rewindState.size() > REWIND_MAX_SIZE))
+    {
+        rewindSize -= rewindDeltas.front().size();
+        rewindDeltas.pop_front();
+    }
+}
+
+bool Core::rewind()
+{
+    // Step back to the previous state in the rewind history, if there is one
+    if (rewindDeltas.empty()) return false;
+    if (!SaveState::applyDelta(rewindState, rewindDeltas.back(), rewindTemp)) return false;
+    rewindSize -= rewindDeltas.back().size();
+    rewindDeltas.pop_back();
+    rewindState.swap(rewindTemp);
+
+    // Load the state and emulate a frame from it to show, without playing the audio
+    SaveState state(&rewindState, true);
+    if (!syncState(state)) return false;
+    spu.setOutput(false);
+    (*runFunc)(*this);
+    spu.setOutput(true);
+    rewindTimer = 0;
+    return true;
+}
+
+bool Core::syncState(SaveState &state)
+{
+    // Sync a header, and refuse to load states from another version, mode, or ROM before anything changes
+    uint32_t magic = STATE_MAGIC, version = STATE_VERSION;
+    bool mode = gbaMode;
+    int romSizes[2] = { cartridgeNds.getRomSize(), cartridgeGba.getRomSize() };
+    state.sync(magic);
+    state.sync(version);
+    state.sync(mode);
+    state.sync(romSizes);
+    if (state.isLoading() && (state.isFailed() || magic != STATE_MAGIC || version != STATE_VERSION || mode != gbaMode ||
+        romSizes[0] != cartridgeNds.getRomSize() || romSizes[1] != cartridgeGba.getRomSize()))
+        return false;
+    if (!state.isLoading() || !state.isFile())
+        return syncComponents(state);
+
+    // Keep the current state to fall back on, since components take their loaded values as they go
+    // Otherwise a truncated or corrupt file would leave the core half-loaded when it's found to be bad
+    // In-memory states like snapshots and rewind history were saved by this core, so they're trusted and skip this
+    stateBackup.clear();
+    SaveState backup(&stateBackup, false);
+    if (!syncComponents(backup)) return false;
+    if (syncComponents(state)) return true;
+    SaveState restore(&stateBackup, true);
+    syncComponents(restore);
+    return false;
+}
+
+bool Core::syncComponents(SaveState &state)
+{
+    // Sync the GPU first, so its threads stop drawing before anything they read is loaded
+    gpu.syncState(state);
+    gpu3DBackend->finishFrame();
+    gpu3DRenderer.syncState(state);
+
+    // Sync the rest of the components
+    // CP15 and the cartridges come before memory, since the memory maps are rebuilt from them
+    for (int i = 0; i < 3; i++)
+        bios[i].syncState(state);
+    cartridgeNds.syncState(state);
+    cartridgeGba.syncState(state);
+    cp15.syncState(state);
+    divSqrt.syncState(state);
+    gpu3D.syncState(state);
+    ipc.syncState(state);
+    memory.syncState(state);
+    rtc.syncState(state);
+    spi.syncState(state);
+    spu.syncState(state);
+    wifi.syncState(state);
+    for (int i = 0; i < 2; i++)
+    {
+        dma[i].syncState(state);
+        gpu2D[i].syncState(state);
+        interpreter[i].syncState(state);
+        timers[i].syncState(state);
+    }
+
+    // Sync the scheduler last, since loading components can schedule tasks
+    state.sync(events);
+    state.sync(eventSlots);
+    state.sync(eventCount);
+    state.sync(eventOrder);
+    state.sync(globalCycles);
+    state.sync(sliceEnd);
+    if (!state.isLoading() || state.isFailed())
+        return !state.isFailed();
+
+    // Make sure every event in the heap and its tracked position match, since a bad heap could index out of bounds
+    int count = 0;
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        int slot = eventSlots[i];
+        if (slot < -1 || slot >= eventCount || (slot >= 0 && events[slot].task != i))
+            return false;
+        count += (slot >= 0);
+    }
+    if (count != eventCount)
+        return false;
+
+    // Redraw the 3D now that everything it depends on is loaded
+    gpu.redraw3D();
+    return true;
+}
@@ -20,9 +20,10 @@
 #ifndef CORE_H
 #define CORE_H
 
+#include <atomic>
 #include <chrono>
 #include <cstdint>
-#include <functional>
+#include <deque>
 #include <string>
 #include <vector>
 
@@ -33,6 +34,7 @@
 #include "div_sqrt.h"
 #include "dldi.h"
 #include "dma.h"
+#include "frame_trace.h"
 #include "gpu.h"
 #include "gpu_2d.h"
 #include "gpu_3d.h"
@@ -41,12 +43,18 @@
 #include "interpreter.h"
 #include "ipc.h"
 #include "memory.h"
+#include "movie.h"
 #include "rtc.h"
+#include "save_state.h"
 #include "spi.h"
 #include "spu.h"
 #include "timers.h"
 #include "wifi.h"
 
+// Rewind history is recorded every few frames, with its total size capped regardless of the length setting
+#define REWIND_INTERVAL 6
+#define REWIND_MAX_SIZE (64 << 20)
+
 enum CoreError
 {
     ERROR_BIOS,
@@ -90,11 +98,50 @@ enum SchedTask
 
 struct SchedEvent
 {
-    std::function<void()> *task;
+    SchedTask task;
     uint32_t cycles;
+    uint32_t order;
+
+    // Sort by cycles, falling back to scheduling order so same-cycle events run first-in first-out
+    bool operator<(const SchedEvent &event) const
+        { return (cycles != event.cycles) ? (cycles < event.cycles) : ((int32_t)(order - event.order) < 0); }
+};
+
+// Hot-path counters, which are only updated when built with PROFILE defined
+// Times are measured in nanoseconds
+struct ProfileStats
+{
+    uint64_t opcodes[2][2];         // Opcodes run by each CPU, in ARM and THUMB mode
+    uint64_t readFallbacks[2][16];  // Memory reads by each CPU that missed the read map, by address region
+    uint64_t writeFallbacks[2][16]; // Memory writes by each CPU that missed the write map, by address region
+    uint64_t eventCounts[MAX_TASKS];
+    uint64_t eventTimes[MAX_TASKS];
+    uint64_t gpu2DTimes[2];
+    uint64_t gpu3DTime;
+    uint64_t spuTime;
+};
+
+// Render times, which are kept apart because the 2D and 3D render threads update them concurrently
+// They're atomic so no updates are lost, and are copied into the totals at the end of each frame
+struct RenderProfile
+{
+    std::atomic<uint64_t> gpu2DTimes[2];
+    std::atomic<uint64_t> gpu3DTime;
+};
 
-    SchedEvent(std::function<void()> *task, uint32_t cycles): task(task), cycles(cycles) {}
-    bool operator<(const SchedEvent &event) const { return cycles < event.cycles; }
+static inline void addProfileTime(uint64_t &counter, uint64_t time) { counter += time; }
+static inline void addProfileTime(std::atomic<uint64_t> &counter, uint64_t time)
+    { counter.fetch_add(time, std::memory_order_relaxed); }
+
+// Adds the time between construction and destruction to a profiling counter
+template <typename T> struct ProfileTimer
+{
+    T &counter;
+    std::chrono::steady_clock::time_point start;
+
+    ProfileTimer(T &counter): counter(counter), start(std::chrono::steady_clock::now()) {}
+    ~ProfileTimer()
+        { addProfileTime(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()); }
 };
 
 class Core
@@ -103,6 +150,12 @@ class Core
         int id = 0;
         bool gbaMode = false;
         int fps = 0;
+        uint32_t idleCycles[2] = {};
+        ProfileStats profile = {};
+        ProfileStats profileTotals = {};
+        RenderProfile renderProfile = {};
+        FrameTrace frameTrace;
+        Movie *movie = nullptr;
 
         Bios bios[3];
         CartridgeNds cartridgeNds;
@@ -112,9 +165,12 @@ class Core
         Dldi dldi;
         Dma dma[2];
         Gpu gpu;
-        Gpu2D gpu2D[2];
-        Gpu3D gpu3D;
-        Gpu3DRenderer gpu3DRenderer;
+
+        // Components used by the render threads start on their own pages, apart from the emulation thread's data
+        alignas(0x1000) Gpu2D gpu2D[2];
+        alignas(0x1000) Gpu3D gpu3D;
+        alignas(0x1000) Gpu3DRenderer gpu3DRenderer;
+        Gpu3DBackend *gpu3DBackend = &gpu3DRenderer;
         Input input;
         Interpreter interpreter[2];
         Ipc ipc;
@@ -126,25 +182,72 @@ class Core
         Wifi wifi;
 
         std::atomic<bool> running;
-        std::vector<SchedEvent> events;
+        SchedEvent events[MAX_TASKS];
         uint32_t globalCycles = 0;
+        uint32_t sliceEnd = 0;
+        uint64_t eventsRun = 0;
+
+        // Cores can only be created on the heap through this, since the constructor relies on zeroed allocations
+        static Core *create(std::string ndsRom = "", std::string gbaRom = "", std::string ndsSave = "", std::string gbaSave = "",
+            int id = 0, int ndsRomFd = -1, int gbaRomFd = -1, int ndsSaveFd = -1, int gbaSaveFd = -1);
+        static void operator delete(void *pointer, size_t size) { freePages(pointer, size); }
 
-        Core(std::string ndsRom = "", std::string gbaRom = "", std::string ndsSave = "", std::string gbaSave = "",
-             int id = 0, int ndsRomFd = -1, int gbaRomFd = -1, int ndsSaveFd = -1, int gbaSaveFd = -1);
+        static void *allocPages(size_t size);
+        static void freePages(void *pointer, size_t size);
 
-        void runFrame() { (*runFunc)(*this); }
+        void runFrame();
         void schedule(SchedTask task, uint32_t cycles);
+        void unschedule(SchedTask task);
+        void runEvent();
+        void endSlice() { sliceEnd = globalCycles; }
         void enterGbaMode();
+        void setGpu3DBackend(Gpu3DBackend *backend);
         void endFrame();
 
+        bool saveState(std::string path);
+        bool loadState(std::string path);
+        bool saveSnapshot();
+        bool loadSnapshot();
+        bool rewind();
+        bool dumpHeatmap(std::string path);
+        void resetHeatmap();
+        bool syncState(SaveState &state);
+
     private:
+        Core(std::string ndsRom, std::string gbaRom, std::string ndsSave, std::string gbaSave,
+             int id, int ndsRomFd, int gbaRomFd, int ndsSaveFd, int gbaSaveFd);
+
+        // Allocate cores already zeroed, which the big memory buffers and maps rely on instead of member initializers
+        // Fresh pages from the system are zero anyway, so this is cheaper than clearing them one by one
+        static void *operator new(size_t size) { return allocPages(size); }
+
         bool realGbaBios;
-        std::function<void()> tasks[MAX_TASKS];
-        void (*runFunc)(Core&) = &Interpreter::runNdsFrame;
+        // Scheduled events are kept in a binary heap, with each task's position tracked for rescheduling
+        int eventSlots[MAX_TASKS];
+        int eventCount = 0;
+        uint32_t eventOrder = 0;
+        void (*runFunc)(Core&) = &Interpreter::runNdsFrame<false>;
         std::chrono::steady_clock::time_point lastFpsTime;
         int fpsCount = 0;
-
+        ProfileStats lastTotals = {};
+        std::vector<uint8_t> snapshot;
+        std::vector<uint8_t> stateBackup;
+
+        // Rewind history, kept as the latest full state and deltas that step back from it
+        std::vector<uint8_t> rewindState;
+        std::vector<uint8_t> rewindTemp;
+        std::deque<std::vector<uint8_t>> rewindDeltas;
+        size_t rewindSize = 0;
+        int rewindTimer = 0;
+
+        void runAhead(int frames);
+        void recordRewind();
+        bool syncComponents(SaveState &state);
         void resetCycles();
+        void clearEvents();
+        void removeEvent(int slot);
+        void siftUp(int slot);
+        void siftDown(int slot);
 };
 
 #endif // CORE_H
@@ -46,6 +46,9 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
     {
         case 0x010000: // Control
         {
+            // Save the TCM enable bits, to check if they change
+            uint32_t tcmBitsOld = ctrlReg & 0x000F0000;
+
             // Some control bits are read only, so only set the writeable ones
             ctrlReg = (ctrlReg & ~0x000FF085) | (value & 0x000FF085);
             exceptionAddr = (ctrlReg & BIT(13)) ? 0xFFFF0000 : 0x00000000;
@@ -54,9 +57,12 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
             itcmReadEnabled = (ctrlReg & BIT(18)) && !(ctrlReg & BIT(19));
             itcmWriteEnabled = (ctrlReg & BIT(18));
 
-            // Update the memory map at the current TCM locations
-            core->memory.updateMap9<true>(dtcmAddr, dtcmAddr + dtcmSize);
-            core->memory.updateMap9<true>(0x00000000, itcmSize);
+            // Update the memory map at the current TCM locations, skipping TCM that wasn't toggled
+            uint32_t tcmBits = (ctrlReg & 0x000F0000) ^ tcmBitsOld;
+            if (tcmBits & 0x00030000)
+                core->memory.updateMap9<true>(dtcmAddr, dtcmAddr + dtcmSize);
+            if (tcmBits & 0x000C0000)
+                core->memory.updateMap9<true>(0x00000000, itcmSize);
 
             return;
         }
@@ -65,6 +71,7 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
         {
             uint32_t dtcmAddrOld = dtcmAddr;
             uint32_t dtcmSizeOld = dtcmSize;
+            uint32_t dtcmRegOld = dtcmReg;
 
             // DTCM size is calculated as 512 shifted left N bits, with a minimum of 4KB
             dtcmReg = value;
@@ -72,9 +79,14 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
             dtcmSize = 0x200 << ((dtcmReg & 0x0000003E) >> 1);
             if (dtcmSize < 0x1000) dtcmSize = 0x1000;
 
-            // Update the memory map at the old and new DTCM locations
-            core->memory.updateMap9<true>(dtcmAddrOld, dtcmAddrOld + dtcmSizeOld);
-            core->memory.updateMap9<true>(dtcmAddr,    dtcmAddr    + dtcmSize);
+            // Update the memory map at the old and new DTCM locations if they changed
+            // Only the parts of the old range that the new one doesn't cover need to be unmapped
+            if (dtcmReg == dtcmRegOld) return;
+            if (dtcmAddrOld < dtcmAddr)
+                core->memory.updateMap9<true>(dtcmAddrOld, std::min(dtcmAddrOld + dtcmSizeOld, dtcmAddr));
+            if (dtcmAddrOld + dtcmSizeOld > dtcmAddr + dtcmSize)
+                core->memory.updateMap9<true>(std::max(dtcmAddrOld, dtcmAddr + dtcmSize), dtcmAddrOld + dtcmSizeOld);
+            core->memory.updateMap9<true>(dtcmAddr, dtcmAddr + dtcmSize);
 
             return;
         }
@@ -95,8 +107,9 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
             itcmSize = 0x200 << ((itcmReg & 0x0000003E) >> 1);
             if (itcmSize < 0x1000) itcmSize = 0x1000;
 
-            // Update the memory map at the old and new ITCM locations
-            core->memory.updateMap9<true>(0x00000000, std::max(itcmSizeOld, itcmSize));
+            // Update the memory map at the old and new ITCM locations if they changed
+            if (itcmSize != itcmSizeOld)
+                core->memory.updateMap9<true>(0x00000000, std::max(itcmSizeOld, itcmSize));
 
             return;
         }
@@ -108,3 +121,34 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
         }
     }
 }
+
+void Cp15::syncState(SaveState &state)
+{
+    // Save the TCM layout, to check if it changes
+    uint32_t ctrlRegOld = ctrlReg;
+    uint32_t dtcmAddrOld = dtcmAddr;
+    uint32_t dtcmSizeOld = dtcmSize;
+    uint32_t itcmSizeOld = itcmSize;
+
+    // Sync the CP15 registers and the values decoded from them
+    state.sync(ctrlReg);
+    state.sync(dtcmReg);
+    state.sync(itcmReg);
+    state.sync(exceptionAddr);
+    state.sync(dtcmReadEnabled);
+    state.sync(dtcmWriteEnabled);
+    state.sync(itcmReadEnabled);
+    state.sync(itcmWriteEnabled);
+    state.sync(dtcmAddr);
+    state.sync(dtcmSize);
+    state.sync(itcmSize);
+
+    // Update the memory map at the old and new TCM locations if they changed
+    if (state.isLoading() && (ctrlReg != ctrlRegOld || dtcmAddr != dtcmAddrOld ||
+        dtcmSize != dtcmSizeOld || itcmSize != itcmSizeOld))
+    {
+        core->memory.updateMap9<true>(dtcmAddrOld, dtcmAddrOld + dtcmSizeOld);
+        core->memory.updateMap9<true>(dtcmAddr,    dtcmAddr    + dtcmSize);
+        core->memory.updateMap9<true>(0x00000000, std::max(itcmSizeOld, itcmSize));
+    }
+}
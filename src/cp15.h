@@ -23,12 +23,15 @@
 #include <cstdint>
 
 class Core;
+class SaveState;
 
 class Cp15
 {
     public:
         Cp15(Core *core): core(core) {}
 
+        void syncState(SaveState &state);
+
         uint32_t read(int cn, int cm, int cp);
         void write(int cn, int cm, int cp, uint32_t value);
 
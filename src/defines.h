@@ -29,12 +29,51 @@
 #define LOG(...) (0)
 #endif
 
+// Enable or disable hot-path profiling counters
+#ifdef PROFILE
+#include <type_traits>
+#define PROFILE_COUNT(counter) ((counter)++)
+#define PROFILE_TIME(counter) ProfileTimer<std::remove_reference<decltype(counter)>::type> profileTimer(counter)
+#else
+#define PROFILE_COUNT(counter) (0)
+#define PROFILE_TIME(counter) (0)
+#endif
+
+// Enable or disable guest execution tracing in the interpreter
+#ifdef EXEC_TRACE
+#define TRACE_OPCODE(address) (execTrace.sample(address))
+#define TRACE_BRANCH(address) (execTrace.branch(address))
+#else
+#define TRACE_OPCODE(address) (0)
+#define TRACE_BRANCH(address) (0)
+#endif
+
+// Enable or disable counting of guest memory accesses by page and I/O register
+#ifdef HEATMAP
+#define HEATMAP_PAGE(cpu, type, address) (heatmap.countPage(cpu, type, address))
+#define HEATMAP_IO(cpu, write, address) (((address) >> 24) == 0x04 ? heatmap.countIo(cpu, write, address) : (void)0)
+#else
+#define HEATMAP_PAGE(cpu, type, address) (0)
+#define HEATMAP_IO(cpu, write, address) (0)
+#endif
+
 // Compatibility toggle for systems that don't have fdopen
 #ifdef NO_FDOPEN
 #define fdopen(...) (0)
 #define ftruncate(...) (0)
+#define fsync(...) (0)
 #else
 #include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#endif
+#endif
+
+// Map ROM files into memory on systems that support it, instead of reading them up front
+#if !defined(NO_FDOPEN) && !defined(_WIN32)
+#define USE_MMAP
+#include <sys/mman.h>
 #endif
 
 // Macro to force inlining
@@ -44,6 +83,11 @@
 #define FORCE_INLINE inline __attribute__((always_inline))
 #endif
 
+// Detect hosts that store values LSB-first like the emulated CPUs, so memory can be accessed directly
+#if defined(_MSC_VER) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LITTLE_ENDIAN_HOST
+#endif
+
 // Simple bit macro
 #define BIT(i) (1 << (i))
 
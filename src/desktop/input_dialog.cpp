@@ -41,6 +41,7 @@ enum InputEvent
     REMAP_FULL_SCREEN,
     REMAP_ENLARGE_SWAP,
     REMAP_SYSTEM_PAUSE,
+    REMAP_REWIND_HOLD,
     CLEAR_MAP,
     UPDATE_JOY
 };
@@ -63,6 +64,7 @@ EVT_BUTTON(REMAP_FAST_TOGGLE,  InputDialog::remapFastToggle)
 EVT_BUTTON(REMAP_FULL_SCREEN,  InputDialog::remapFullScreen)
 EVT_BUTTON(REMAP_ENLARGE_SWAP, InputDialog::remapEnlargeSwap)
 EVT_BUTTON(REMAP_SYSTEM_PAUSE, InputDialog::remapSystemPause)
+EVT_BUTTON(REMAP_REWIND_HOLD,  InputDialog::remapRewindHold)
 EVT_BUTTON(CLEAR_MAP,          InputDialog::clearMap)
 EVT_TIMER(UPDATE_JOY,          InputDialog::updateJoystick)
 EVT_BUTTON(wxID_OK,            InputDialog::confirm)
@@ -318,6 +320,11 @@ InputDialog::InputDialog(wxJoystick *joystick): wxDialog(nullptr, wxID_ANY, "Inp
     systemPauseSizer->Add(new wxStaticText(hotkeyTab, wxID_ANY, "System Pause Toggle:"), 1, wxALIGN_CENTRE | wxRIGHT, size / 16);
     systemPauseSizer->Add(keySystemPause = new wxButton(hotkeyTab, REMAP_SYSTEM_PAUSE, keyToString(keyBinds[16]), wxDefaultPosition, wxSize(size * 4, size)), 0, wxLEFT, size / 16);
 
+    // Set up the rewind hold hotkey setting
+    wxBoxSizer *rewindHoldSizer = new wxBoxSizer(wxHORIZONTAL);
+    rewindHoldSizer->Add(new wxStaticText(hotkeyTab, wxID_ANY, "Rewind Hold:"), 1, wxALIGN_CENTRE | wxRIGHT, size / 16);
+    rewindHoldSizer->Add(keyRewindHold = new wxButton(hotkeyTab, REMAP_REWIND_HOLD, keyToString(keyBinds[17]), wxDefaultPosition, wxSize(size * 4, size)), 0, wxLEFT, size / 16);
+
     // Combine all of the hotkey tab contents
     wxBoxSizer *hotkeyContents = new wxBoxSizer(wxVERTICAL);
     hotkeyContents->Add(fastHoldSizer,    1, wxEXPAND | wxALL, size / 8);
@@ -325,6 +332,7 @@ InputDialog::InputDialog(wxJoystick *joystick): wxDialog(nullptr, wxID_ANY, "Inp
     hotkeyContents->Add(fullScreenSizer,  1, wxEXPAND | wxALL, size / 8);
     hotkeyContents->Add(enlargeSwapSizer, 1, wxEXPAND | wxALL, size / 8);
     hotkeyContents->Add(systemPauseSizer, 1, wxEXPAND | wxALL, size / 8);
+    hotkeyContents->Add(rewindHoldSizer,  1, wxEXPAND | wxALL, size / 8);
     hotkeyContents->Add(new wxStaticText(hotkeyTab, wxID_ANY, ""), 1);
 
     // Add a final border around the hotkey tab
@@ -390,6 +398,7 @@ void InputDialog::resetLabels()
     keyFullScreen->SetLabel(keyToString(keyBinds[14]));
     keyEnlargeSwap->SetLabel(keyToString(keyBinds[15]));
     keySystemPause->SetLabel(keyToString(keyBinds[16]));
+    keyRewindHold->SetLabel(keyToString(keyBinds[17]));
     current = nullptr;
 }
 
@@ -546,6 +555,15 @@ void InputDialog::remapSystemPause(wxCommandEvent &event)
     keyIndex = 16;
 }
 
+void InputDialog::remapRewindHold(wxCommandEvent &event)
+{
+    // Prepare the rewind hold hotkey for remapping
+    resetLabels();
+    keyRewindHold->SetLabel("Press a key");
+    current = keyRewindHold;
+    keyIndex = 17;
+}
+
 void InputDialog::clearMap(wxCommandEvent &event)
 {
     if (current)
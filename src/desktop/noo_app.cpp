@@ -36,7 +36,7 @@ wxEND_EVENT_TABLE()
 
 int NooApp::screenFilter = 1;
 int NooApp::micEnable = 0;
-int NooApp::keyBinds[] = { 'L', 'K', 'G', 'H', 'D', 'A', 'W', 'S', 'P', 'Q', 'O', 'I', WXK_TAB, 0, WXK_ESCAPE, 0, WXK_BACK };
+int NooApp::keyBinds[] = { 'L', 'K', 'G', 'H', 'D', 'A', 'W', 'S', 'P', 'Q', 'O', 'I', WXK_TAB, 0, WXK_ESCAPE, 0, WXK_BACK, 0 };
 
 bool NooApp::OnInit()
 {
@@ -63,7 +63,8 @@ bool NooApp::OnInit()
         Setting("keyFastToggle",  &keyBinds[13], false),
         Setting("keyFullScreen",  &keyBinds[14], false),
         Setting("keyEnlargeSwap", &keyBinds[15], false),
-        Setting("keySystemPause", &keyBinds[16], false)
+        Setting("keySystemPause", &keyBinds[16], false),
+        Setting("keyRewindHold",  &keyBinds[17], false)
     };
 
     // Add the platform settings
@@ -223,25 +224,20 @@ int NooApp::audioCallback(const void *in, void *out, unsigned long count,
         if (!frames[i]) continue;
         if (Core *core = frames[i]->getCore())
         {
-            uint32_t *samples = core->spu.getSamples(699);
+            uint32_t *samples = core->spu.getSamples(count, 48000);
             if (!original)
                 original = samples;
-            else
-                delete[] samples;
         }
     }
 
     if (original)
     {
-        // The NDS sample rate is 32768Hz, but it causes issues on some systems, so 48000Hz is used instead
-        // Stretch 699 samples at 32768Hz to approximately 1024 samples at 48000Hz
+        // The NDS sample rate is 32768Hz, but it causes issues on some systems, so the core resamples to 48000Hz
         for (int i = 0; i < count; i++)
         {
-            uint32_t sample = original[i * 699 / 1024];
-            buffer[i * 2 + 0] = sample >>  0;
-            buffer[i * 2 + 1] = sample >> 16;
+            buffer[i * 2 + 0] = original[i] >>  0;
+            buffer[i * 2 + 1] = original[i] >> 16;
         }
-        delete[] original;
     }
     else
     {
@@ -24,7 +24,7 @@
 #include <wx/wx.h>
 
 #define MAX_FRAMES 8
-#define MAX_KEYS  17
+#define MAX_KEYS  18
 
 class NooFrame;
 
@@ -17,6 +17,7 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstring>
 #include <wx/rawbmp.h>
 
 #include "noo_canvas.h"
@@ -27,6 +28,133 @@
 #if defined(_WIN32) && defined(USE_GL_CANVAS)
 #include <GL/gl.h>
 #include <GL/glext.h>
+
+// Functions past OpenGL 1.1 aren't exported by the Windows OpenGL library, so they're loaded at runtime
+#define GL_FUNCTIONS(F) \
+    F(PFNGLACTIVETEXTUREPROC, glActiveTexture) \
+    F(PFNGLGENBUFFERSPROC, glGenBuffers) \
+    F(PFNGLBINDBUFFERPROC, glBindBuffer) \
+    F(PFNGLBUFFERDATAPROC, glBufferData) \
+    F(PFNGLMAPBUFFERPROC, glMapBuffer) \
+    F(PFNGLUNMAPBUFFERPROC, glUnmapBuffer) \
+    F(PFNGLCREATESHADERPROC, glCreateShader) \
+    F(PFNGLSHADERSOURCEPROC, glShaderSource) \
+    F(PFNGLCOMPILESHADERPROC, glCompileShader) \
+    F(PFNGLGETSHADERIVPROC, glGetShaderiv) \
+    F(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog) \
+    F(PFNGLDELETESHADERPROC, glDeleteShader) \
+    F(PFNGLCREATEPROGRAMPROC, glCreateProgram) \
+    F(PFNGLATTACHSHADERPROC, glAttachShader) \
+    F(PFNGLLINKPROGRAMPROC, glLinkProgram) \
+    F(PFNGLGETPROGRAMIVPROC, glGetProgramiv) \
+    F(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog) \
+    F(PFNGLDELETEPROGRAMPROC, glDeleteProgram) \
+    F(PFNGLUSEPROGRAMPROC, glUseProgram) \
+    F(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation) \
+    F(PFNGLUNIFORM1IPROC, glUniform1i) \
+    F(PFNGLUNIFORM2FPROC, glUniform2f)
+
+#define DECLARE_FUNCTION(type, name) static type name;
+GL_FUNCTIONS(DECLARE_FUNCTION)
+#endif
+
+#ifdef USE_GL_CANVAS
+static const char *vertexShader =
+R"(
+    #version 120
+
+    varying vec2 texCoord;
+
+    void main()
+    {
+        gl_Position = ftransform();
+        texCoord = gl_MultiTexCoord0.xy;
+    }
+)";
+
+static const char *fragmentShader =
+R"(
+    #version 120
+
+    uniform sampler2D screenTex;
+    uniform sampler2D hiResTex;
+    uniform vec2 texSize; // Size of the screen texture in texels
+    uniform vec2 rows;    // First and last output rows of the screen being drawn
+    uniform int mode;     // 0 for RGB8, 1 for native RGB6, 2 for native RGB6 with high-res 3D
+    uniform int scale;    // Output pixels per texel
+    uniform int filter;   // Bilinear filtering
+    varying vec2 texCoord;
+
+    vec4 fetchBytes(sampler2D tex, vec2 size, vec2 pos)
+    {
+        // Get the raw bytes of a texel
+        return floor(texture2D(tex, (pos + 0.5) / size) * 255.0 + 0.5);
+    }
+
+    vec3 fetch(vec2 pos)
+    {
+        // RGB8 frames are already converted and scaled
+        if (mode == 0)
+            return texture2D(screenTex, (pos + 0.5) / texSize).rgb;
+
+        // Replace 3D pixels with high-res output where it was drawn, like the CPU conversion does
+        vec4 b = fetchBytes(screenTex, texSize, floor(pos / float(scale)));
+        if (mode == 2 && mod(floor(b.a / 4.0), 2.0) == 1.0)
+        {
+            vec4 h = fetchBytes(hiResTex, vec2(512.0, 384.0), mod(pos, vec2(512.0, 384.0)));
+            if (h.b >= 4.0) b = h;
+        }
+
+        // Unpack the RGB6 channels and convert them to floats
+        float r = mod(b.r, 64.0);
+        float g = floor(b.r / 64.0) + mod(b.g, 16.0) * 4.0;
+        float u = floor(b.g / 16.0) + mod(b.b, 4.0) * 16.0;
+        return vec3(r, g, u) / 63.0;
+    }
+
+    void main()
+    {
+        // Find the position in output pixels, staying within the screen being drawn
+        vec2 limit = vec2(texSize.x * float(scale) - 1.0, rows.y);
+        vec2 pos = texCoord * texSize * float(scale) - 0.5;
+
+        if (filter == 0)
+        {
+            // Use the nearest pixel
+            gl_FragColor = vec4(fetch(clamp(floor(pos + 0.5), vec2(0.0, rows.x), limit)), 1.0);
+            return;
+        }
+
+        // Blend the 4 nearest pixels
+        vec2 base = floor(pos);
+        vec2 f = pos - base;
+        vec2 p0 = clamp(base, vec2(0.0, rows.x), limit);
+        vec2 p1 = clamp(base + 1.0, vec2(0.0, rows.x), limit);
+        vec3 top = mix(fetch(p0), fetch(vec2(p1.x, p0.y)), f.x);
+        vec3 bot = mix(fetch(vec2(p0.x, p1.y)), fetch(p1), f.x);
+        gl_FragColor = vec4(mix(top, bot, f.y), 1.0);
+    }
+)";
+#endif
+
+#ifdef USE_GL_CANVAS
+static GLuint compileShader(GLenum type, const char *source)
+{
+    // Compile a shader, logging why and returning 0 if it fails
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status) return shader;
+
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+    LOG("Failed to compile the screen shader: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+}
 #endif
 
 wxBEGIN_EVENT_TABLE(NooCanvas, CANVAS_CLASS)
@@ -46,13 +174,81 @@ NooCanvas::NooCanvas(NooFrame *frame): CANVAS_CLASS(frame, wxID_ANY, CANVAS_PARA
     context = new wxGLContext(this);
     SetCurrent(*context);
 
-    // Prepare a texture for the framebuffer
-    GLuint texture;
+#ifdef _WIN32
+    // Load the functions that aren't exported now that there's a context
+#define LOAD_FUNCTION(type, name) name = (type)wglGetProcAddress(#name);
+    GL_FUNCTIONS(LOAD_FUNCTION)
+#endif
+
+    // Prepare textures for the screens and high-res 3D, which the shader samples texels from directly
     glEnable(GL_TEXTURE_2D);
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenTextures(2, textures);
+    for (int i = 0; i < 2; i++)
+    {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    // Allocate the high-res 3D texture up front; the screen texture is allocated once the frame size is known
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 512, 384, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+    // Prepare the pixel buffers that frames are streamed through
+    glGenBuffers(2, pixelBuffers);
+
+    // Compile the vertex and fragment shaders
+    GLuint vertShader = compileShader(GL_VERTEX_SHADER, vertexShader);
+    GLuint fragShader = compileShader(GL_FRAGMENT_SHADER, fragmentShader);
+
+    if (vertShader && fragShader)
+    {
+        // Attach the shaders to the program
+        program = glCreateProgram();
+        glAttachShader(program, vertShader);
+        glAttachShader(program, fragShader);
+        glLinkProgram(program);
+
+        // Check that the program linked, logging why if it didn't
+        GLint status;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (!status)
+        {
+            char log[1024];
+            glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+            LOG("Failed to link the screen shader: %s\n", log);
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+
+    if (vertShader) glDeleteShader(vertShader);
+    if (fragShader) glDeleteShader(fragShader);
+
+    if (program)
+    {
+        // Bind the textures to their samplers and look up the per-draw uniforms
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "screenTex"), 0);
+        glUniform1i(glGetUniformLocation(program, "hiResTex"), 1);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, textures[1]);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, textures[0]);
+        static const char *names[] = { "texSize", "rows", "mode", "scale", "filter" };
+        for (int i = 0; i < 5; i++)
+            uniforms[i] = glGetUniformLocation(program, names[i]);
+    }
+    else
+    {
+        // Fall back to drawing frames converted by the core with fixed-function texturing
+        glBindTexture(GL_TEXTURE_2D, textures[0]);
+    }
+
+    // Draw screens from the prebuilt quads
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_VERTEX_ARRAY);
 #endif
 
     // Set focus so that key presses will be registered
@@ -60,26 +256,141 @@ NooCanvas::NooCanvas(NooFrame *frame): CANVAS_CLASS(frame, wxID_ANY, CANVAS_PARA
     frame->SendSizeEvent();
 }
 
-void NooCanvas::drawScreen(int x, int y, int w, int h, int wb, int hb, uint32_t *buf)
+bool NooCanvas::takeFrame()
+{
+    Core *core = frame->getCore();
+
+#ifdef USE_GL_CANVAS
+    if (!core->gbaMode && program)
+    {
+        // Upload the renderers' native output, leaving conversion and upscaling to the shader
+        RawFrame raw;
+        if (!core->gpu.getRawFrame(raw))
+            return false;
+        uploadScreens(raw.framebuffer, 256, 192 * 2, raw.hiRes3D);
+        frameMode = raw.hiRes3D ? 2 : 1;
+        frameScale = Settings::highRes3D ? 2 : 1;
+        return frameReady = true;
+    }
+#endif
+
+    // Take a frame converted by the core, which GBA mode needs for its border
+    std::shared_ptr<const Frame> next = core->gpu.getFrame(gbaMode);
+    if (!next)
+        return false;
+    screens = next;
+
+#ifdef USE_GL_CANVAS
+    uploadScreens(screens->data, screens->width, screens->height * (gbaMode ? 1 : 2), nullptr);
+    frameMode = 0;
+    frameScale = 1;
+#endif
+    return frameReady = true;
+}
+
+void NooCanvas::uploadScreens(const uint32_t *data, int width, int height, const uint32_t *hiRes3D)
+{
+#ifdef USE_GL_CANVAS
+    // Reallocate the screen texture only when the frame size changes
+    glBindTexture(GL_TEXTURE_2D, textures[0]);
+    if (texWidth != width || texHeight != height)
+    {
+        texWidth = width;
+        texHeight = height;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texWidth, texHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    // Copy the frame into the next pixel buffer, orphaning its old storage so a previous transfer can't stall it
+    size_t size = texWidth * texHeight * sizeof(uint32_t);
+    size_t hiResSize = hiRes3D ? (512 * 384 * sizeof(uint32_t)) : 0;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[bufferIndex]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size + hiResSize, nullptr, GL_STREAM_DRAW);
+    if (uint8_t *buffer = (uint8_t*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY))
+    {
+        memcpy(buffer, data, size);
+        if (hiRes3D) memcpy(buffer + size, hiRes3D, hiResSize);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // Update the textures from the buffer, which the driver can do asynchronously
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texWidth, texHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        if (hiRes3D)
+        {
+            glActiveTexture(GL_TEXTURE1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 512, 384, GL_RGBA, GL_UNSIGNED_BYTE, (void*)size);
+            glActiveTexture(GL_TEXTURE0);
+        }
+    }
+
+    // Alternate buffers so the next frame can be written while this one is still being transferred
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    bufferIndex = !bufferIndex;
+#endif
+}
+
+void NooCanvas::buildQuads()
 {
 #ifdef USE_GL_CANVAS
     // Set texture coordinates based on rotation
     static const uint8_t texCoords[] = { 0x4B, 0x2D, 0xD2 };
     uint8_t coords = texCoords[ScreenLayout::screenRotation];
 
-    // Draw a screen with the given information
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, wb, hb, 0, GL_RGBA, GL_UNSIGNED_BYTE, buf);
-    glBegin(GL_QUADS);
-    glTexCoord2i((coords >> 0) & 1, (coords >> 1) & 1);
-    glVertex2i(x + w, y + h);
-    glTexCoord2i((coords >> 2) & 1, (coords >> 3) & 1);
-    glVertex2i(x, y + h);
-    glTexCoord2i((coords >> 4) & 1, (coords >> 5) & 1);
-    glVertex2i(x, y);
-    glTexCoord2i((coords >> 6) & 1, (coords >> 7) & 1);
-    glVertex2i(x + w, y);
-    glEnd();
+    for (int i = 0; i < (gbaMode ? 1 : 2); i++)
+    {
+        // Select the screen's rows of the texture
+        float t0 = float(i) / (gbaMode ? 1 : 2);
+        float t1 = float(i + 1) / (gbaMode ? 1 : 2);
+
+        // Place the screen's corners based on the layout
+        float x = i ? layout.botX : layout.topX, w = i ? layout.botWidth : layout.topWidth;
+        float y = i ? layout.botY : layout.topY, h = i ? layout.botHeight : layout.topHeight;
+        float vertices[] = { x + w, y + h, x, y + h, x, y, x + w, y };
+
+        // Interleave the texture coordinates with the corners
+        for (int j = 0; j < 4; j++)
+        {
+            quads[i][j * 4 + 0] = (coords >> (j * 2 + 0)) & 1;
+            quads[i][j * 4 + 1] = ((coords >> (j * 2 + 1)) & 1) ? t1 : t0;
+            quads[i][j * 4 + 2] = vertices[j * 2 + 0];
+            quads[i][j * 4 + 3] = vertices[j * 2 + 1];
+        }
+    }
+#endif
+    quadsDirty = false;
+}
+
+void NooCanvas::drawScreen(int x, int y, int w, int h, int screen)
+{
+#ifdef USE_GL_CANVAS
+    // Select the screen's rows of the texture
+    int count = gbaMode ? 1 : 2;
+    int rows = texHeight * frameScale / count;
+
+    if (program)
+    {
+        // Set up the shader for the current frame
+        glUniform2f(uniforms[0], texWidth, texHeight);
+        glUniform2f(uniforms[1], screen * rows, (screen + 1) * rows - 1);
+        glUniform1i(uniforms[2], frameMode);
+        glUniform1i(uniforms[3], frameScale);
+        glUniform1i(uniforms[4], NooApp::screenFilter);
+    }
+    else
+    {
+        // Filter the converted frame with the texture sampler instead
+        GLint filter = NooApp::screenFilter ? GL_LINEAR : GL_NEAREST;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    }
+
+    // Draw the screen's quad, which was built from the same layout
+    glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(float), &quads[screen][0]);
+    glVertexPointer(2, GL_FLOAT, 4 * sizeof(float), &quads[screen][2]);
+    glDrawArrays(GL_QUADS, 0, 4);
 #else
+    // Get the screen's data from the frame
+    int wb = screens->width, hb = screens->height;
+    const uint32_t *buf = &screens->data[screen * wb * hb];
+
     // Create a bitmap for the screen
     wxBitmap bmp(wb, hb, 24);
     wxNativePixelData data(bmp);
@@ -130,31 +441,32 @@ void NooCanvas::draw(wxPaintEvent &event)
         if (gbaMode != gba)
         {
             gbaMode = gba;
+            quadsDirty = true;
             frame->SendSizeEvent();
         }
+        if (quadsDirty)
+            buildQuads();
 
         // Emulation is limited by audio, so frames aren't always generated at a consistent rate
         // This can mess up frame pacing at higher refresh rates when frames are ready too soon
         // To solve this, use a software-based swap interval to wait before getting the next frame
-        if (++frameCount >= swapInterval && frame->getCore()->gpu.getFrame(framebuffer, gba))
+        if (++frameCount >= swapInterval && takeFrame())
             frameCount = 0;
 
-        // Shift the screen resolutions if high-res is enabled
-        bool resShift = Settings::highRes3D;
-
-        if (gbaMode)
+        if (!frameReady)
+        {
+            // Wait until the first frame is ready
+        }
+        else if (gbaMode)
         {
             // Draw the GBA screen
-            drawScreen(layout.topX, layout.topY, layout.topWidth, layout.topHeight,
-               240 << resShift, 160 << resShift, &framebuffer[0]);
+            drawScreen(layout.topX, layout.topY, layout.topWidth, layout.topHeight, 0);
         }
         else
         {
             // Draw the DS top and bottom screens
-            drawScreen(layout.topX, layout.topY, layout.topWidth, layout.topHeight,
-               256 << resShift, 192 << resShift, &framebuffer[0]);
-            drawScreen(layout.botX, layout.botY, layout.botWidth, layout.botHeight,
-               256 << resShift, 192 << resShift, &framebuffer[(256 * 192) << (resShift * 2)]);
+            drawScreen(layout.topX, layout.topY, layout.topWidth, layout.topHeight, 0);
+            drawScreen(layout.botX, layout.botY, layout.botWidth, layout.botHeight, 1);
         }
     }
 
@@ -179,7 +491,8 @@ void NooCanvas::resize(wxSizeEvent &event)
 {
     // Update the screen layout
     wxSize size = GetSize();
-    layout.update(size.x, size.y, gbaMode);
+    if (layout.update(size.x, size.y, gbaMode))
+        quadsDirty = true;
 
     // Full screen breaks the minimum frame size, but changing to a different value fixes it
     // As a workaround, clear the minimum size on full screen and reset it shortly after
@@ -193,10 +506,6 @@ void NooCanvas::resize(wxSizeEvent &event)
     glLoadIdentity();
     glOrtho(0, size.x, size.y, 0, -1, 1);
     glViewport(0, 0, size.x, size.y);
-
-    // Set filtering
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, NooApp::screenFilter ? GL_LINEAR : GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, NooApp::screenFilter ? GL_LINEAR : GL_NEAREST);
 #endif
 }
 
@@ -230,16 +539,12 @@ void NooCanvas::pressScreen(wxMouseEvent &event)
     int touchY = layout.getTouchY(event.GetX(), event.GetY());
 
     // Send the touch coordinates to the core
-    frame->getCore()->input.pressScreen();
-    frame->getCore()->spi.setTouch(touchX, touchY);
+    frame->getCore()->input.queueScreen(true, touchX, touchY);
 }
 
 void NooCanvas::releaseScreen(wxMouseEvent &event)
 {
     // Send a touch release to the core
     if (frame->isRunning())
-    {
-        frame->getCore()->input.releaseScreen();
-        frame->getCore()->spi.clearTouch();
-    }
+        frame->getCore()->input.queueScreen(false);
 }
@@ -21,13 +21,16 @@
 #define NOO_CANVAS_H
 
 #include <chrono>
+#include <memory>
 #include <wx/wx.h>
 
 #include "../common/screen_layout.h"
+#include "../gpu.h"
 
 class NooFrame;
 
 #ifdef USE_GL_CANVAS
+#define GL_GLEXT_PROTOTYPES // Declare the buffer object functions where they're linked directly
 #include <wx/glcanvas.h>
 #define CANVAS_CLASS wxGLCanvas
 #define CANVAS_PARAM nullptr
@@ -50,7 +53,7 @@ class NooCanvas: public CANVAS_CLASS
         wxGLContext *context;
 
         ScreenLayout layout;
-        uint32_t framebuffer[256 * 192 * 8] = {};
+        std::shared_ptr<const Frame> screens;
         bool gbaMode = false;
         uint8_t sizeReset = 0;
         bool finished = false;
@@ -60,7 +63,27 @@ class NooCanvas: public CANVAS_CLASS
         int refreshRate = 0;
         std::chrono::steady_clock::time_point lastRateTime;
 
-        void drawScreen(int x, int y, int w, int h, int wb, int hb, uint32_t *buf);
+        // Screens are streamed into persistent textures through alternating pixel buffers
+        // Outside of GBA mode, the textures hold the renderers' native output and a shader converts it
+        unsigned int textures[2] = {};
+        unsigned int pixelBuffers[2] = {};
+        unsigned int program = 0;
+        int uniforms[5] = {};
+        int bufferIndex = 0;
+        int texWidth = 0, texHeight = 0;
+        int frameMode = 0;
+        int frameScale = 1;
+        bool frameReady = false;
+
+        // Screen quads are built when the layout changes, so presenting a frame only has to draw them
+        // Each quad has 4 vertices of texture coordinates followed by positions
+        float quads[2][16] = {};
+        bool quadsDirty = true;
+
+        bool takeFrame();
+        void uploadScreens(const uint32_t *data, int width, int height, const uint32_t *hiRes3D);
+        void buildQuads();
+        void drawScreen(int x, int y, int w, int h, int screen);
 
         void draw(wxPaintEvent &event);
         void resize(wxSizeEvent &event);
@@ -26,6 +26,7 @@
 #include "save_dialog.h"
 #include "../common/screen_layout.h"
 #include "../settings.h"
+#include "../thread_config.h"
 #include "../../icon/icon.xpm"
 
 enum FrameEvent
@@ -34,6 +35,9 @@ enum FrameEvent
     BOOT_FIRMWARE,
     TRIM_ROM,
     CHANGE_SAVE,
+    RECORD_MOVIE,
+    PLAY_MOVIE,
+    STOP_MOVIE,
     QUIT,
     PAUSE,
     RESTART,
@@ -51,6 +55,7 @@ enum FrameEvent
     THREADED_3D_1,
     THREADED_3D_2,
     THREADED_3D_3,
+    THREADED_3D_4,
     HIGH_RES_3D,
     MIC_ENABLE,
     UPDATE_JOY
@@ -61,6 +66,9 @@ EVT_MENU(LOAD_ROM,       NooFrame::loadRom)
 EVT_MENU(BOOT_FIRMWARE,  NooFrame::bootFirmware)
 EVT_MENU(TRIM_ROM,       NooFrame::trimRom)
 EVT_MENU(CHANGE_SAVE,    NooFrame::changeSave)
+EVT_MENU(RECORD_MOVIE,   NooFrame::recordMovie)
+EVT_MENU(PLAY_MOVIE,     NooFrame::playMovie)
+EVT_MENU(STOP_MOVIE,     NooFrame::stopMovie)
 EVT_MENU(QUIT,           NooFrame::quit)
 EVT_MENU(PAUSE,          NooFrame::pause)
 EVT_MENU(RESTART,        NooFrame::restart)
@@ -78,6 +86,7 @@ EVT_MENU(THREADED_3D_0,  NooFrame::threaded3D0)
 EVT_MENU(THREADED_3D_1,  NooFrame::threaded3D1)
 EVT_MENU(THREADED_3D_2,  NooFrame::threaded3D2)
 EVT_MENU(THREADED_3D_3,  NooFrame::threaded3D3)
+EVT_MENU(THREADED_3D_4,  NooFrame::threaded3D4)
 EVT_MENU(HIGH_RES_3D,    NooFrame::highRes3D)
 EVT_MENU(MIC_ENABLE,     NooFrame::micEnable)
 EVT_TIMER(UPDATE_JOY,    NooFrame::updateJoystick)
@@ -100,6 +109,10 @@ NooFrame::NooFrame(NooApp *app, int id, std::string path):
     fileMenu->Append(TRIM_ROM,      "&Trim ROM");
     fileMenu->Append(CHANGE_SAVE,   "&Change Save Type");
     fileMenu->AppendSeparator();
+    fileMenu->Append(RECORD_MOVIE,  "&Record Movie");
+    fileMenu->Append(PLAY_MOVIE,    "&Play Movie");
+    fileMenu->Append(STOP_MOVIE,    "&Stop Movie");
+    fileMenu->AppendSeparator();
     fileMenu->Append(QUIT,          "&Quit");
 
     // Set up the System menu
@@ -111,8 +124,11 @@ NooFrame::NooFrame(NooApp *app, int id, std::string path):
     systemMenu->Append(ADD_SYSTEM, "&Add System");
 
     // Disable some menu items until the core is running
-    fileMenu->Enable(TRIM_ROM,    false);
-    fileMenu->Enable(CHANGE_SAVE, false);
+    fileMenu->Enable(TRIM_ROM,     false);
+    fileMenu->Enable(CHANGE_SAVE,  false);
+    fileMenu->Enable(RECORD_MOVIE, false);
+    fileMenu->Enable(PLAY_MOVIE,   false);
+    fileMenu->Enable(STOP_MOVIE,   false);
     systemMenu->Enable(PAUSE,     false);
     systemMenu->Enable(RESTART,   false);
     systemMenu->Enable(STOP,      false);
@@ -137,6 +153,7 @@ NooFrame::NooFrame(NooApp *app, int id, std::string path):
     threaded3D->AppendRadioItem(THREADED_3D_1, "&1 Thread");
     threaded3D->AppendRadioItem(THREADED_3D_2, "&2 Threads");
     threaded3D->AppendRadioItem(THREADED_3D_3, "&3 Threads");
+    threaded3D->AppendRadioItem(THREADED_3D_4, "&4 Threads");
 
     // Set the current value of the threaded 3D setting
     switch (Settings::threaded3D)
@@ -144,7 +161,8 @@ NooFrame::NooFrame(NooApp *app, int id, std::string path):
         case 0:  threaded3D->Check(THREADED_3D_0, true); break;
         case 1:  threaded3D->Check(THREADED_3D_1, true); break;
         case 2:  threaded3D->Check(THREADED_3D_2, true); break;
-        default: threaded3D->Check(THREADED_3D_3, true); break;
+        case 3:  threaded3D->Check(THREADED_3D_3, true); break;
+        default: threaded3D->Check(THREADED_3D_4, true); break;
     }
 
     // Set up the Settings menu
@@ -233,13 +251,33 @@ void NooFrame::Refresh()
 
 void NooFrame::runCore()
 {
-    // Run the emulator
+    // Run the emulator, stepping back through the rewind history while its hotkey is held
+    ThreadConfig::apply(THREAD_EMU);
+    pacer.reset();
     while (running)
-        core->runFrame();
+    {
+        // Rewinding is left out while a movie is attached, since its input has to line up with every frame
+        if (!rewinding || core->movie || !core->rewind())
+        {
+            // Skip rendering some frames while fast-forwarding, which is when the FPS limiter is backed up
+            core->gpu.setFrameSkip(fpsLimiterBackup ? Settings::frameSkip : 0);
+
+            // Run a frame and hold it to the frame rate
+            core->runFrame();
+            pacer.pace(core->gbaMode ? GBA_FRAME_RATE : NDS_FRAME_RATE);
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(1000000 / 60));
+        }
+    }
 }
 
 void NooFrame::checkSave()
 {
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_BACKGROUND);
+
     while (running)
     {
         // Check save files every few seconds and update them if changed
@@ -260,8 +298,20 @@ void NooFrame::startCore(bool full)
         try
         {
             // Attempt to boot the core
-            core = new Core(ndsPath, gbaPath, "", "", id);
+            core = Core::create(ndsPath, gbaPath, "", "", id);
             app->connectCore(id);
+
+            // Start a movie that was chosen for this boot, either recording a new one or playing a loaded one
+            if (moviePath != "" || moviePlay)
+            {
+                if (moviePlay)
+                    movie.play(core);
+                else if (!movie.record(moviePath, core))
+                    wxMessageDialog(this, "Make sure the movie file is writable and try again.",
+                        "Error Recording Movie", wxICON_NONE).ShowModal();
+                if (movie.isPlaying() || movie.isRecording())
+                    core->movie = &movie;
+            }
         }
         catch (CoreError e)
         {
@@ -296,6 +346,9 @@ void NooFrame::startCore(bool full)
             fileMenu->Enable(TRIM_ROM,    true);
             fileMenu->Enable(CHANGE_SAVE, true);
         }
+        fileMenu->Enable(RECORD_MOVIE, true);
+        fileMenu->Enable(PLAY_MOVIE,   true);
+        fileMenu->Enable(STOP_MOVIE,   core->movie != nullptr);
         systemMenu->Enable(PAUSE,   true);
         systemMenu->Enable(RESTART, true);
         systemMenu->Enable(STOP,    true);
@@ -337,15 +390,19 @@ void NooFrame::stopCore(bool full)
     if (full)
     {
         // Disable some menu items
-        fileMenu->Enable(TRIM_ROM,    false);
-        fileMenu->Enable(CHANGE_SAVE, false);
+        fileMenu->Enable(TRIM_ROM,     false);
+        fileMenu->Enable(CHANGE_SAVE,  false);
+        fileMenu->Enable(RECORD_MOVIE, false);
+        fileMenu->Enable(PLAY_MOVIE,   false);
+        fileMenu->Enable(STOP_MOVIE,   false);
         systemMenu->Enable(PAUSE,     false);
         systemMenu->Enable(RESTART,   false);
         systemMenu->Enable(STOP,      false);
 
-        // Shut down the core
+        // Shut down the core, finishing any movie attached to it
         if (core)
         {
+            movie.stop();
             app->disconnCore(id);
             delete core;
             core = nullptr;
@@ -413,10 +470,15 @@ void NooFrame::pressKey(int key)
             }
             break;
 
+        case 17: // Rewind Hold
+            // Start stepping back through the rewind history
+            rewinding = true;
+            break;
+
         default: // Core input
             // Send a key press to the core
             if (running)
-                core->input.pressKey(key);
+                core->input.queueKey(key, true);
             break;
     }
 }
@@ -442,10 +504,15 @@ void NooFrame::releaseKey(int key)
             hotkeyToggles &= ~BIT(key - 13);
             break;
 
+        case 17: // Rewind Hold
+            // Return to normal emulation
+            rewinding = false;
+            break;
+
         default: // Core input
             // Send a key release to the core
             if (running)
-                core->input.releaseKey(key);
+                core->input.queueKey(key, false);
             break;
     }
 }
@@ -532,6 +599,47 @@ void NooFrame::changeSave(wxCommandEvent &event)
     saveDialog.ShowModal();
 }
 
+void NooFrame::recordMovie(wxCommandEvent &event)
+{
+    // Show the file browser
+    wxFileDialog movieSelect(this, "Record Movie", "", "", "NooDS movie files (*.ndm)|*.ndm", wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (movieSelect.ShowModal() == wxID_CANCEL) return;
+
+    // Restart the core, recording its input from boot
+    moviePath = (const char*)movieSelect.GetPath().mb_str(wxConvUTF8);
+    startCore(true);
+    moviePath = "";
+}
+
+void NooFrame::playMovie(wxCommandEvent &event)
+{
+    // Show the file browser
+    wxFileDialog movieSelect(this, "Play Movie", "", "", "NooDS movie files (*.ndm)|*.ndm", wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+    if (movieSelect.ShowModal() == wxID_CANCEL) return;
+
+    // Load the movie, which brings the settings it was recorded with, and restart the core to play it from boot
+    if (!movie.load((const char*)movieSelect.GetPath().mb_str(wxConvUTF8)))
+    {
+        wxMessageDialog(this, "Make sure the movie file was recorded with this version of NooDS and try again.",
+            "Error Loading Movie", wxICON_NONE).ShowModal();
+        return;
+    }
+    moviePlay = true;
+    startCore(true);
+    moviePlay = false;
+}
+
+void NooFrame::stopMovie(wxCommandEvent &event)
+{
+    // Pause the core for safety and detach the movie, finishing the file if recording
+    bool resume = running;
+    stopCore(false);
+    movie.stop();
+    core->movie = nullptr;
+    fileMenu->Enable(STOP_MOVIE, false);
+    if (resume) startCore(false);
+}
+
 void NooFrame::quit(wxCommandEvent &event)
 {
     // Close the program
@@ -651,6 +759,13 @@ void NooFrame::threaded3D3(wxCommandEvent &event)
     Settings::save();
 }
 
+void NooFrame::threaded3D4(wxCommandEvent &event)
+{
+    // Set the threaded 3D setting to 4 threads
+    Settings::threaded3D = 4;
+    Settings::save();
+}
+
 void NooFrame::highRes3D(wxCommandEvent &event)
 {
     // Toggle the high-resolution 3D setting
@@ -20,9 +20,11 @@
 #ifndef NOO_FRAME_H
 #define NOO_FRAME_H
 
+#include <atomic>
 #include <wx/wx.h>
 #include <wx/joystick.h>
 
+#include "../common/frame_pacer.h"
 #include "../core.h"
 
 class NooApp;
@@ -53,8 +55,14 @@ class NooFrame: public wxFrame
 
         int id = 0;
         Core *core = nullptr;
+        FramePacer pacer;
         bool running = false;
 
+        // Movie attached to the core, and whether the next boot should record it to a path or play it
+        Movie movie;
+        std::string moviePath;
+        bool moviePlay = false;
+
         std::string ndsPath, gbaPath;
         std::thread *coreThread = nullptr, *saveThread = nullptr;
         std::condition_variable cond;
@@ -62,8 +70,9 @@ class NooFrame: public wxFrame
 
         std::vector<int> axisBases;
         uint8_t hotkeyToggles = 0;
-        int fpsLimiterBackup = 0;
+        std::atomic<int> fpsLimiterBackup{0};
         bool fastForward = false;
+        bool rewinding = false;
         bool fullScreen = false;
 
         void runCore();
@@ -74,6 +83,9 @@ class NooFrame: public wxFrame
         void bootFirmware(wxCommandEvent &event);
         void trimRom(wxCommandEvent &event);
         void changeSave(wxCommandEvent &event);
+        void recordMovie(wxCommandEvent &event);
+        void playMovie(wxCommandEvent &event);
+        void stopMovie(wxCommandEvent &event);
         void quit(wxCommandEvent &event);
         void pause(wxCommandEvent &event);
         void restart(wxCommandEvent &event);
@@ -91,6 +103,7 @@ class NooFrame: public wxFrame
         void threaded3D1(wxCommandEvent &event);
         void threaded3D2(wxCommandEvent &event);
         void threaded3D3(wxCommandEvent &event);
+        void threaded3D4(wxCommandEvent &event);
         void highRes3D(wxCommandEvent &event);
         void micEnable(wxCommandEvent &event);
         void updateJoystick(wxTimerEvent &event);
@@ -24,6 +24,8 @@
 
 void DivSqrt::divide()
 {
+    divDirty = false;
+
     // Set the division by zero error bit
     // The bit only gets set if the full 64-bit denominator is zero, even in 32-bit mode
     if (divDenom == 0) divCnt |= BIT(14); else divCnt &= ~BIT(14);
@@ -95,6 +97,8 @@ void DivSqrt::divide()
 
 void DivSqrt::squareRoot()
 {
+    sqrtDirty = false;
+
     // Calculate the square root result
     switch (sqrtCnt & 0x0001) // Square root mode
     {
@@ -114,7 +118,7 @@ void DivSqrt::writeDivCnt(uint16_t mask, uint16_t value)
     mask &= 0x0003;
     divCnt = (divCnt & ~mask) | (value & mask);
 
-    divide();
+    divDirty = true;
 }
 
 void DivSqrt::writeDivNumerL(uint32_t mask, uint32_t value)
@@ -122,7 +126,7 @@ void DivSqrt::writeDivNumerL(uint32_t mask, uint32_t value)
     // Write to the DIVNUMER register
     divNumer = (divNumer & ~((uint64_t)mask)) | (value & mask);
 
-    divide();
+    divDirty = true;
 }
 
 void DivSqrt::writeDivNumerH(uint32_t mask, uint32_t value)
@@ -130,7 +134,7 @@ void DivSqrt::writeDivNumerH(uint32_t mask, uint32_t value)
     // Write to the DIVNUMER register
     divNumer = (divNumer & ~((uint64_t)mask << 32)) | ((uint64_t)(value & mask) << 32);
 
-    divide();
+    divDirty = true;
 }
 
 void DivSqrt::writeDivDenomL(uint32_t mask, uint32_t value)
@@ -138,7 +142,7 @@ void DivSqrt::writeDivDenomL(uint32_t mask, uint32_t value)
     // Write to the DIVDENOM register
     divDenom = (divDenom & ~((uint64_t)mask)) | (value & mask);
 
-    divide();
+    divDirty = true;
 }
 
 void DivSqrt::writeDivDenomH(uint32_t mask, uint32_t value)
@@ -146,7 +150,7 @@ void DivSqrt::writeDivDenomH(uint32_t mask, uint32_t value)
     // Write to the DIVDENOM register
     divDenom = (divDenom & ~((uint64_t)mask << 32)) | ((uint64_t)(value & mask) << 32);
 
-    divide();
+    divDirty = true;
 }
 
 void DivSqrt::writeSqrtCnt(uint16_t mask, uint16_t value)
@@ -155,7 +159,7 @@ void DivSqrt::writeSqrtCnt(uint16_t mask, uint16_t value)
     mask &= 0x0001;
     sqrtCnt = (sqrtCnt & ~mask) | (value & mask);
 
-    squareRoot();
+    sqrtDirty = true;
 }
 
 void DivSqrt::writeSqrtParamL(uint32_t mask, uint32_t value)
@@ -163,7 +167,7 @@ void DivSqrt::writeSqrtParamL(uint32_t mask, uint32_t value)
     // Write to the DIVDENOM register
     sqrtParam = (sqrtParam & ~((uint64_t)mask)) | (value & mask);
 
-    squareRoot();
+    sqrtDirty = true;
 }
 
 void DivSqrt::writeSqrtParamH(uint32_t mask, uint32_t value)
@@ -171,5 +175,22 @@ void DivSqrt::writeSqrtParamH(uint32_t mask, uint32_t value)
     // Write to the SQRTPARAM register
     sqrtParam = (sqrtParam & ~((uint64_t)mask << 32)) | ((uint64_t)(value & mask) << 32);
 
-    squareRoot();
+    sqrtDirty = true;
+}
+
+void DivSqrt::syncState(SaveState &state)
+{
+    // Calculate any pending results so they're saved, or so they don't overwrite loaded ones
+    if (divDirty) divide();
+    if (sqrtDirty) squareRoot();
+
+    // Sync the division and square root registers
+    state.sync(divCnt);
+    state.sync(divNumer);
+    state.sync(divDenom);
+    state.sync(divResult);
+    state.sync(divRemResult);
+    state.sync(sqrtCnt);
+    state.sync(sqrtResult);
+    state.sync(sqrtParam);
 }
@@ -17,15 +17,19 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
 #include "dldi.h"
 #include "core.h"
 #include "settings.h"
+#include "thread_config.h"
 
 Dldi::~Dldi()
 {
     // Ensure the SD image is closed
-    if (sdImage)
-        fclose(sdImage);
+    closeImage();
 }
 
 void Dldi::patchRom(uint8_t *rom, size_t offset, size_t size)
@@ -71,9 +75,38 @@ void Dldi::patchRom(uint8_t *rom, size_t offset, size_t size)
 
 int Dldi::startup()
 {
-    // Try to open the SD image
+    // Try to open the SD image, unless it's already open
+    if (sdImage) return 1;
     sdImage = fopen(Settings::sdImagePath.c_str(), "rb+");
-    return (sdImage ? 1 : 0);
+    if (!sdImage) return 0;
+    fseek(sdImage, 0, SEEK_END);
+    sdSize = ftell(sdImage);
+    fseek(sdImage, 0, SEEK_SET);
+
+#ifdef USE_MMAP
+    // Map the SD image into memory if enabled and possible, so sectors are accessed directly and written back by the system
+    void *data = (Settings::mapSdImage && sdSize > 0) ? mmap(nullptr, sdSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(sdImage), 0) : MAP_FAILED;
+    if (data != MAP_FAILED)
+    {
+        sdMap = (uint8_t*)data;
+        return 1;
+    }
+#endif
+
+    // Cache the SD image in chunks otherwise, with a thread that writes back changes
+    cache.assign(SD_CACHE_CHUNKS * SD_CHUNK_SIZE, 0);
+    for (int i = 0; i < SD_CACHE_CHUNKS; i++)
+    {
+        chunkIds[i] = -1;
+        chunkUses[i] = 0;
+        chunkDirty[i] = false;
+    }
+    chunkSlots.clear();
+    evictedChunks.clear();
+    dirtyCount = 0;
+    flushRunning = true;
+    flushThread = new std::thread(&Dldi::flushChunks, this);
+    return 1;
 }
 
 int Dldi::isInserted()
@@ -89,10 +122,17 @@ int Dldi::readSectors(bool cpu, uint32_t sector, uint32_t numSectors, uint32_t b
     const uint64_t offset = uint64_t(sector) << 9;
     const uint64_t size = uint64_t(numSectors) << 9;
 
+    // Read data from the SD image straight to memory if the buffer is all mapped
+    if (uint8_t *data = (size <= 0x10000000) ? core->memory.getMappedRange(cpu, buf, size, true) : nullptr)
+    {
+        accessImage(false, offset, data, size);
+        core->memory.markWritten(data, size);
+        return 1;
+    }
+
     // Read data from the SD image
     uint8_t *data = new uint8_t[size];
-    fseek(sdImage, offset, SEEK_SET);
-    fread(data, sizeof(uint8_t), size, sdImage);
+    accessImage(false, offset, data, size);
 
     // Write the data to memory
     for (int i = 0; i < size; i++)
@@ -108,14 +148,20 @@ int Dldi::writeSectors(bool cpu, uint32_t sector, uint32_t numSectors, uint32_t
     const uint64_t offset = uint64_t(sector) << 9;
     const uint64_t size = uint64_t(numSectors) << 9;
 
+    // Write data to the SD image straight from memory if the buffer is all mapped
+    if (uint8_t *data = (size <= 0x10000000) ? core->memory.getMappedRange(cpu, buf, size, false) : nullptr)
+    {
+        accessImage(true, offset, data, size);
+        return 1;
+    }
+
     // Read data from memory
     uint8_t *data = new uint8_t[size];
     for (int i = 0; i < size; i++)
         data[i] = core->memory.read<uint8_t>(cpu, buf + i);
 
     // Write the data to the SD image
-    fseek(sdImage, offset, SEEK_SET);
-    fwrite(data, sizeof(uint8_t), size, sdImage);
+    accessImage(true, offset, data, size);
     delete[] data;
     return 1;
 }
@@ -130,7 +176,222 @@ int Dldi::shutdown()
 {
     // Close the SD image
     if (!sdImage) return 0;
+    closeImage();
+    return 1;
+}
+
+void Dldi::closeImage()
+{
+    if (!sdImage) return;
+
+    if (flushThread)
+    {
+        // Stop the flush thread and write back anything it didn't get to
+        cacheMutex.lock();
+        flushRunning = false;
+        cacheMutex.unlock();
+        flushCond.notify_one();
+        flushThread->join();
+        delete flushThread;
+        flushThread = nullptr;
+
+        // Replaced chunks go first, since a cached copy of the same chunk would be newer
+        for (auto it = evictedChunks.begin(); it != evictedChunks.end(); it++)
+        {
+            fseek(sdImage, it->first * SD_CHUNK_SIZE, SEEK_SET);
+            fwrite(it->second.data(), sizeof(uint8_t), it->second.size(), sdImage);
+        }
+        for (int i = 0; i < SD_CACHE_CHUNKS; i++)
+            if (chunkDirty[i]) writeChunk(i);
+        cache.clear();
+        chunkSlots.clear();
+        evictedChunks.clear();
+    }
+
+#ifdef USE_MMAP
+    // Unmap the SD image, leaving the system to finish writing it back
+    if (sdMap)
+    {
+        munmap(sdMap, sdSize);
+        sdMap = nullptr;
+    }
+#endif
+
     fclose(sdImage);
     sdImage = nullptr;
-    return 1;
+}
+
+void Dldi::accessImage(bool write, uint64_t offset, uint8_t *data, size_t size)
+{
+    if (sdMap)
+    {
+        // Access the mapped SD image directly; it can't grow, so data past the end reads as zero and can't be written
+        size_t count = (offset < sdSize) ? std::min<uint64_t>(size, sdSize - offset) : 0;
+        if (write)
+        {
+            memcpy(&sdMap[offset], data, count);
+            if (count < size) LOG("DLDI write past the end of the SD image\n");
+        }
+        else
+        {
+            memcpy(data, &sdMap[offset], count);
+            memset(&data[count], 0, size - count);
+        }
+        return;
+    }
+
+    // Access the SD image through the cache, a chunk at a time
+    std::lock_guard<std::mutex> guard(cacheMutex);
+    for (size_t done = 0; done < size;)
+    {
+        int slot = getChunk((offset + done) / SD_CHUNK_SIZE);
+        uint8_t *chunk = &cache[slot * SD_CHUNK_SIZE];
+        uint32_t start = (offset + done) % SD_CHUNK_SIZE;
+        size_t length = std::min<size_t>(SD_CHUNK_SIZE - start, size - done);
+
+        if (write)
+        {
+            // Update the cached chunk and mark it to be written back, which combines writes made before then
+            memcpy(&chunk[start], &data[done], length);
+            if (!chunkDirty[slot])
+            {
+                chunkDirty[slot] = true;
+                dirtyCount++;
+            }
+        }
+        else
+        {
+            memcpy(&data[done], &chunk[start], length);
+        }
+
+        done += length;
+    }
+
+    // Let the flush thread know about new changes, and track the image growing like it would when written directly
+    if (write)
+    {
+        sdSize = std::max<uint64_t>(sdSize, offset + size);
+        flushCond.notify_one();
+    }
+}
+
+int Dldi::getChunk(uint64_t index)
+{
+    // Find the cache slot holding a chunk, loading it if needed; this should be called while holding the cache mutex
+    auto cached = chunkSlots.find(index);
+    int slot;
+
+    if (cached != chunkSlots.end())
+    {
+        slot = cached->second;
+    }
+    else
+    {
+        // Replace the least recently used chunk, handing it to the flush thread if it was changed
+        slot = std::min_element(chunkUses, chunkUses + SD_CACHE_CHUNKS) - chunkUses;
+        uint8_t *chunk = &cache[slot * SD_CHUNK_SIZE];
+        if (chunkDirty[slot])
+        {
+            uint64_t offset = chunkIds[slot] * SD_CHUNK_SIZE;
+            evictedChunks[chunkIds[slot]].assign(chunk, chunk + std::min<uint64_t>(SD_CHUNK_SIZE, sdSize - offset));
+            chunkDirty[slot] = false;
+            dirtyCount--;
+            flushCond.notify_one();
+        }
+        if (chunkIds[slot] != (uint64_t)-1) chunkSlots.erase(chunkIds[slot]);
+        chunkIds[slot] = index;
+        chunkSlots[index] = slot;
+
+        // Reload a chunk that's still waiting to be written back from its copy, since the image is out of date
+        // Data past the end of the image is filled with zeros
+        auto evicted = evictedChunks.find(index);
+        if (evicted != evictedChunks.end())
+        {
+            std::vector<uint8_t> &data = evicted->second;
+            memcpy(chunk, data.data(), data.size());
+            memset(&chunk[data.size()], 0, SD_CHUNK_SIZE - data.size());
+        }
+        else
+        {
+            // Read the whole chunk, so the sectors after the requested ones are ready ahead of time
+            std::lock_guard<std::mutex> guard(fileMutex);
+            fseek(sdImage, index * SD_CHUNK_SIZE, SEEK_SET);
+            size_t count = fread(chunk, sizeof(uint8_t), SD_CHUNK_SIZE, sdImage);
+            memset(&chunk[count], 0, SD_CHUNK_SIZE - count);
+        }
+    }
+
+    chunkUses[slot] = ++cacheTick;
+    return slot;
+}
+
+void Dldi::writeChunk(int slot)
+{
+    // Write a changed chunk back to the image, without going past its current size
+    // This should be called while holding the cache mutex
+    std::lock_guard<std::mutex> guard(fileMutex);
+    uint64_t offset = chunkIds[slot] * SD_CHUNK_SIZE;
+    size_t size = std::min<uint64_t>(SD_CHUNK_SIZE, sdSize - offset);
+    fseek(sdImage, offset, SEEK_SET);
+    fwrite(&cache[slot * SD_CHUNK_SIZE], sizeof(uint8_t), size, sdImage);
+    fflush(sdImage);
+    chunkDirty[slot] = false;
+    dirtyCount--;
+}
+
+void Dldi::flushChunks()
+{
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_BACKGROUND);
+
+    std::unique_lock<std::mutex> lock(cacheMutex);
+
+    while (true)
+    {
+        // Wait for chunks to be changed, then give a little time for more writes to be combined with them
+        flushCond.wait(lock, [&]{ return dirtyCount || !evictedChunks.empty() || !flushRunning; });
+        flushCond.wait_for(lock, std::chrono::milliseconds(50), [&]{ return !flushRunning; });
+        if (!flushRunning) return;
+
+        while (!evictedChunks.empty())
+        {
+            // Take a chunk that was replaced in the cache; the file is locked before it's dropped from the list,
+            // so it can't be reloaded with older data until it's written
+            auto evicted = evictedChunks.begin();
+            uint64_t offset = evicted->first * SD_CHUNK_SIZE;
+            flushBuffer.swap(evicted->second);
+            fileMutex.lock();
+            evictedChunks.erase(evicted);
+
+            // Write the chunk with the cache unlocked, so emulation can keep using it
+            lock.unlock();
+            fseek(sdImage, offset, SEEK_SET);
+            fwrite(flushBuffer.data(), sizeof(uint8_t), flushBuffer.size(), sdImage);
+            fflush(sdImage);
+            fileMutex.unlock();
+            lock.lock();
+        }
+
+        for (int i = 0; i < SD_CACHE_CHUNKS; i++)
+        {
+            if (!chunkDirty[i]) continue;
+
+            // Copy a changed chunk and mark it as written back
+            uint64_t offset = chunkIds[i] * SD_CHUNK_SIZE;
+            size_t size = std::min<uint64_t>(SD_CHUNK_SIZE, sdSize - offset);
+            flushBuffer.assign(&cache[i * SD_CHUNK_SIZE], &cache[i * SD_CHUNK_SIZE] + size);
+            chunkDirty[i] = false;
+            dirtyCount--;
+
+            // Write the copy with the cache unlocked, so emulation can keep using it
+            // The file stays locked until it's written, so the chunk can't be reloaded with older data before then
+            fileMutex.lock();
+            lock.unlock();
+            fseek(sdImage, offset, SEEK_SET);
+            fwrite(flushBuffer.data(), sizeof(uint8_t), size, sdImage);
+            fflush(sdImage);
+            fileMutex.unlock();
+            lock.lock();
+        }
+    }
 }
@@ -20,8 +20,17 @@
 #ifndef DLDI_H
 #define DLDI_H
 
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Size of the chunks that SD images are cached and read ahead in, and the number of chunks that are cached
+#define SD_CHUNK_SIZE 0x8000
+#define SD_CACHE_CHUNKS 64
 
 class Core;
 
@@ -42,7 +51,8 @@ class Dldi
         ~Dldi();
 
         void patchRom(uint8_t *rom, size_t offset, size_t size);
-        bool isPatched() { return patched; }
+        void setPatched() { patched = true;  }
+        bool isPatched()  { return patched; }
 
         int startup();
         int isInserted();
@@ -56,6 +66,36 @@ class Dldi
 
         bool patched = false;
         FILE *sdImage = nullptr;
+
+        uint64_t sdSize = 0;
+
+        // Memory-mapped view of the SD image, used instead of the cache when enabled and supported
+        uint8_t *sdMap = nullptr;
+
+        // Cache of SD image chunks, replaced least recently used first
+        // Changed chunks are written back to the image by a separate thread, so writes don't stall emulation
+        std::vector<uint8_t> cache;
+        uint64_t chunkIds[SD_CACHE_CHUNKS] = {};
+        uint32_t chunkUses[SD_CACHE_CHUNKS] = {};
+        bool chunkDirty[SD_CACHE_CHUNKS] = {};
+        std::unordered_map<uint64_t, int> chunkSlots;
+        uint32_t cacheTick = 0;
+        int dirtyCount = 0;
+
+        // Changed chunks that were replaced in the cache, waiting for the flush thread to write them back
+        std::unordered_map<uint64_t, std::vector<uint8_t>> evictedChunks;
+
+        std::thread *flushThread = nullptr;
+        std::condition_variable flushCond;
+        std::mutex cacheMutex, fileMutex;
+        std::vector<uint8_t> flushBuffer;
+        bool flushRunning = false;
+
+        void closeImage();
+        void accessImage(bool write, uint64_t offset, uint8_t *data, size_t size);
+        int getChunk(uint64_t index);
+        void writeChunk(int slot);
+        void flushChunks();
 };
 
 #endif // DLDI_H
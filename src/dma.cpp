@@ -46,7 +46,7 @@ void Dma::transfer(int channel)
     }
     else if (dmaCnt[channel] & BIT(26)) // Whole word transfer
     {
-        for (unsigned int i = 0; i < wordCounts[channel]; i++)
+        for (unsigned int i = copyBulk(channel, 4); i < wordCounts[channel]; i++)
         {
             // Transfer a word
             uint32_t value = core->memory.read<uint32_t>(cpu, srcAddrs[channel], false);
@@ -71,7 +71,7 @@ void Dma::transfer(int channel)
     }
     else // Half-word transfer
     {
-        for (unsigned int i = 0; i < wordCounts[channel]; i++)
+        for (unsigned int i = copyBulk(channel, 2); i < wordCounts[channel]; i++)
         {
             // Transfer a half-word
             uint16_t value = core->memory.read<uint16_t>(cpu, srcAddrs[channel], false);
@@ -102,7 +102,7 @@ void Dma::transfer(int channel)
         if (wordCounts[channel] > 0)
         {
             // Schedule another transfer immediately if the FIFO is still half empty
-            if (core->gpu3D.readGxStat() & BIT(25))
+            if (core->gpu3D.getFifoStat() & BIT(25))
                 core->schedule(SchedTask(DMA9_TRANSFER0 + (cpu << 2) + channel), 1);
             return;
         }
@@ -116,7 +116,7 @@ void Dma::transfer(int channel)
             dstAddrs[channel] = dmaDad[channel];
 
         // In GXFIFO mode, schedule another transfer immediately if the FIFO is still half empty
-        if (mode == 7 && core->gpu3D.readGxStat() & BIT(25))
+        if (mode == 7 && core->gpu3D.getFifoStat() & BIT(25))
             core->schedule(SchedTask(DMA9_TRANSFER0 + (cpu << 2) + channel), 1);
     }
     else
@@ -130,6 +130,27 @@ void Dma::transfer(int channel)
         core->interpreter[cpu].sendInterrupt(8 + channel);
 }
 
+uint32_t Dma::copyBulk(int channel, int size)
+{
+    int dstAddrCnt = (dmaCnt[channel] & 0x00600000) >> 21;
+    int srcAddrCnt = (dmaCnt[channel] & 0x01800000) >> 23;
+    int mode       = (dmaCnt[channel] & 0x38000000) >> 27;
+
+    // Only copy in bulk when both addresses increment, outside of GXFIFO mode where transfers are split
+    if (srcAddrCnt != 0 || (dstAddrCnt != 0 && dstAddrCnt != 3) || mode == 7)
+        return 0;
+
+    // Keep misaligned addresses on the unit path, where each access is aligned separately
+    if ((srcAddrs[channel] | dstAddrs[channel]) & (size - 1))
+        return 0;
+
+    // Copy as many units as possible directly through the memory maps, and advance the addresses past them
+    uint32_t count = core->memory.copyMapped(cpu, dstAddrs[channel], srcAddrs[channel], wordCounts[channel] * size) / size;
+    srcAddrs[channel] += count * size;
+    dstAddrs[channel] += count * size;
+    return count;
+}
+
 void Dma::trigger(int mode, uint8_t channels)
 {
     // ARM7 DMAs don't use the lowest mode bit, so adjust accordingly
@@ -168,7 +189,7 @@ void Dma::writeDmaCnt(int channel, uint32_t mask, uint32_t value)
     // In GXFIFO mode, schedule a transfer on the channel immediately if the FIFO is already half empty
     // All other modes are only triggered at the moment when the event happens
     // For example, if a word from the DS cart is ready before starting a DMA, the DMA will not be triggered
-    if ((dmaCnt[channel] & BIT(31)) && ((dmaCnt[channel] & 0x38000000) >> 27) == 7 && (core->gpu3D.readGxStat() & BIT(25)))
+    if ((dmaCnt[channel] & BIT(31)) && ((dmaCnt[channel] & 0x38000000) >> 27) == 7 && (core->gpu3D.getFifoStat() & BIT(25)))
         core->schedule(SchedTask(DMA9_TRANSFER0 + (cpu << 2) + channel), 1);
 
     // Don't reload the internal registers unless the enable bit changed from 0 to 1
@@ -193,3 +214,14 @@ uint32_t Dma::readDmaCnt(int channel)
     // The lower half-word isn't readable in GBA mode
     return dmaCnt[channel] & ~(core->gbaMode ? 0x0000FFFF : 0x00000000);
 }
+
+void Dma::syncState(SaveState &state)
+{
+    // Sync the internal transfer state and DMA registers
+    state.sync(srcAddrs);
+    state.sync(dstAddrs);
+    state.sync(wordCounts);
+    state.sync(dmaSad);
+    state.sync(dmaDad);
+    state.sync(dmaCnt);
+}
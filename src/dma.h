@@ -23,12 +23,15 @@
 #include <cstdint>
 
 class Core;
+class SaveState;
 
 class Dma
 {
     public:
         Dma(Core *core, bool cpu): core(core), cpu(cpu) {}
 
+        void syncState(SaveState &state);
+
         void transfer(int channel);
         void trigger(int mode, uint8_t channels = 0xF);
 
@@ -51,6 +54,8 @@ class Dma
         uint32_t dmaSad[4] = {};
         uint32_t dmaDad[4] = {};
         uint32_t dmaCnt[4] = {};
+
+        uint32_t copyBulk(int channel, int size);
 };
 
 #endif // DMA_H
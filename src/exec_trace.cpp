@@ -0,0 +1,80 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include "exec_trace.h"
+
+void ExecTrace::setMode(ExecTraceMode mode, uint32_t rate)
+{
+    // Change what gets recorded, starting the counts over
+    this->mode = mode;
+    this->rate = countdown = std::max<uint32_t>(rate, 1);
+    reset();
+}
+
+void ExecTrace::reset()
+{
+    // Discard everything recorded so far
+    count = 0;
+    frameCounts.clear();
+    lastFrame.clear();
+    sessionCounts.clear();
+}
+
+void ExecTrace::endFrame()
+{
+    // Count the rest of the frame's addresses, and add the frame to the session
+    if (mode == EXEC_OFF) return;
+    flush();
+    for (auto it = frameCounts.begin(); it != frameCounts.end(); it++)
+        sessionCounts[it->first] += it->second;
+    lastFrame.swap(frameCounts);
+    frameCounts.clear();
+}
+
+std::vector<ExecCount> ExecTrace::getSessionProfile()
+{
+    // Get the session's counts, including the frame in progress
+    std::unordered_map<uint32_t, uint64_t> counts = sessionCounts;
+    flush();
+    for (auto it = frameCounts.begin(); it != frameCounts.end(); it++)
+        counts[it->first] += it->second;
+    return sortCounts(counts);
+}
+
+void ExecTrace::flush()
+{
+    // Count the buffered addresses for the current frame
+    for (uint32_t i = 0; i < count; i++)
+        frameCounts[buffer[i]]++;
+    count = 0;
+}
+
+std::vector<ExecCount> ExecTrace::sortCounts(std::unordered_map<uint32_t, uint64_t> &counts)
+{
+    // Build a flat profile of the counts, with the most recorded addresses first
+    std::vector<ExecCount> profile;
+    profile.reserve(counts.size());
+    for (auto it = counts.begin(); it != counts.end(); it++)
+        profile.push_back({ it->first, it->second });
+    std::sort(profile.begin(), profile.end(), [](const ExecCount &a, const ExecCount &b)
+        { return (a.count != b.count) ? (a.count > b.count) : (a.address < b.address); });
+    return profile;
+}
@@ -0,0 +1,101 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef EXEC_TRACE_H
+#define EXEC_TRACE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "defines.h"
+
+// Number of addresses that are buffered before being counted, which must be a power of 2
+#define EXEC_TRACE_SIZE 0x4000
+
+enum ExecTraceMode
+{
+    EXEC_OFF = 0,
+    EXEC_SAMPLE, // Record the address of every Nth instruction
+    EXEC_BRANCH  // Record the destination of every jump
+};
+
+// A guest address and how many times it was recorded, with bit 0 set for THUMB code
+struct ExecCount
+{
+    uint32_t address;
+    uint64_t count;
+};
+
+// Recorder of guest execution for one CPU, for finding the routines that take up the most time
+// Addresses are buffered on the hot path and only counted once the buffer fills or a frame ends
+// The hooks that feed it are only built with EXEC_TRACE defined, so it costs nothing otherwise
+class ExecTrace
+{
+    public:
+        void setMode(ExecTraceMode mode, uint32_t rate = 1);
+        ExecTraceMode getMode() { return mode; }
+        void reset();
+
+        void endFrame();
+        std::vector<ExecCount> getFrameProfile() { return sortCounts(lastFrame); }
+        std::vector<ExecCount> getSessionProfile();
+
+        FORCE_INLINE void sample(uint32_t address)
+        {
+            // Record the address of the instruction about to run if it's the next one to sample
+            if (mode == EXEC_SAMPLE && --countdown == 0)
+            {
+                countdown = rate;
+                push(address);
+            }
+        }
+
+        FORCE_INLINE void branch(uint32_t address)
+        {
+            // Record the destination of a jump
+            if (mode == EXEC_BRANCH)
+                push(address);
+        }
+
+    private:
+        ExecTraceMode mode = EXEC_OFF;
+        uint32_t rate = 1;
+        uint32_t countdown = 1;
+
+        uint32_t buffer[EXEC_TRACE_SIZE];
+        uint32_t count = 0;
+
+        std::unordered_map<uint32_t, uint64_t> frameCounts;
+        std::unordered_map<uint32_t, uint64_t> lastFrame;
+        std::unordered_map<uint32_t, uint64_t> sessionCounts;
+
+        FORCE_INLINE void push(uint32_t address)
+        {
+            // Add an address to the buffer, counting everything in it once it's full
+            buffer[count++] = address;
+            if (count == EXEC_TRACE_SIZE)
+                flush();
+        }
+
+        void flush();
+        static std::vector<ExecCount> sortCounts(std::unordered_map<uint32_t, uint64_t> &counts);
+};
+
+#endif // EXEC_TRACE_H
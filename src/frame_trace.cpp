@@ -0,0 +1,185 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include "frame_trace.h"
+#include "core.h"
+
+static uint32_t toMicroseconds(uint64_t nanoseconds)
+{
+    // Convert a nanosecond count to microseconds, saturating instead of wrapping
+    return std::min<uint64_t>(nanoseconds / 1000, 0xFFFFFFFF);
+}
+
+FrameTrace::FrameTrace(Core *core): core(core)
+{
+    // Initialize the atomic variables
+    enabled.store(false);
+    restart.store(false);
+    ringHead.store(0);
+    ringTail.store(0);
+    dropped.store(0);
+    present.store(0);
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+        histogram[i].store(0);
+}
+
+FrameTrace::~FrameTrace()
+{
+    // Finish the trace file if one is open
+    stopTrace();
+}
+
+void FrameTrace::setEnabled(bool enabled)
+{
+    // Start counting frames and time over whenever tracing is enabled, once the next frame begins
+    if (enabled && !isEnabled())
+        restart.store(true);
+    this->enabled.store(enabled);
+}
+
+bool FrameTrace::startTrace(std::string path)
+{
+    // Open a file for trace events, replacing any that was already open
+    stopTrace();
+    std::lock_guard<std::mutex> guard(traceMutex);
+    traceFile = fopen(path.c_str(), "w");
+    if (!traceFile) return false;
+    traceStarted = false;
+    fprintf(traceFile, "[\n");
+    setEnabled(true);
+    return true;
+}
+
+void FrameTrace::stopTrace()
+{
+    // Close the list of trace events and the file
+    std::lock_guard<std::mutex> guard(traceMutex);
+    if (!traceFile) return;
+    fprintf(traceFile, "\n]\n");
+    fclose(traceFile);
+    traceFile = nullptr;
+}
+
+size_t FrameTrace::readTimings(FrameTiming *timings, size_t count)
+{
+    // Take up to the given number of the oldest records from the ring
+    uint32_t tail = ringTail.load(std::memory_order_relaxed);
+    size_t available = ringHead.load(std::memory_order_acquire) - tail;
+    count = std::min(count, available);
+    for (size_t i = 0; i < count; i++)
+        timings[i] = ring[(tail + i) & (TRACE_FRAMES - 1)];
+    ringTail.store(tail + count, std::memory_order_release);
+    return count;
+}
+
+void FrameTrace::getHistogram(uint32_t *counts)
+{
+    // Copy how many frame intervals fell into each 1ms bucket since tracing was enabled
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+        counts[i] = histogram[i].load(std::memory_order_relaxed);
+}
+
+void FrameTrace::beginFrame()
+{
+    // Mark the start of a frame if tracing
+    if (!isEnabled()) return;
+    frameStart = TraceClock::now();
+
+    // Reset everything on the emulation thread if tracing was just enabled
+    if (restart.exchange(false))
+    {
+        epoch = frameStart;
+        frameCount = 0;
+        lastStart = 0;
+        render2D[0] = render2D[1] = render3D = 0;
+        for (int i = 0; i < TRACE_BUCKETS; i++)
+            histogram[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void FrameTrace::endFrame()
+{
+    // Skip frames that weren't started while tracing
+    if (!isEnabled() || restart.load()) return;
+
+    // Fill out a record for the frame, and reset the counters for the next one
+    TraceClock::time_point now = TraceClock::now();
+    FrameTiming timing;
+    timing.frame = frameCount++;
+    timing.start = std::chrono::duration_cast<std::chrono::microseconds>(frameStart - epoch).count();
+    timing.emulation = toMicroseconds(std::chrono::duration_cast<std::chrono::nanoseconds>(now - frameStart).count());
+    timing.render2D[0] = toMicroseconds(render2D[0]);
+    timing.render2D[1] = toMicroseconds(render2D[1]);
+    timing.render3D = toMicroseconds(render3D);
+    timing.present = present.load(std::memory_order_relaxed);
+    timing.audioFill = core->spu.getBufferedSamples();
+    render2D[0] = render2D[1] = render3D = 0;
+
+    // Count the time since the last frame started in the histogram
+    if (timing.frame > 0)
+    {
+        uint64_t bucket = std::min<uint64_t>((timing.start - lastStart) / 1000, TRACE_BUCKETS - 1);
+        histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    lastStart = timing.start;
+
+    // Add the record to the ring, or drop it if the reader has fallen too far behind
+    uint32_t head = ringHead.load(std::memory_order_relaxed);
+    if (head - ringTail.load(std::memory_order_acquire) < TRACE_FRAMES)
+    {
+        ring[head & (TRACE_FRAMES - 1)] = timing;
+        ringHead.store(head + 1, std::memory_order_release);
+    }
+    else
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Write the record to the trace file if one is open
+    std::lock_guard<std::mutex> guard(traceMutex);
+    if (traceFile)
+        writeTrace(timing);
+}
+
+void FrameTrace::markPresent(TraceClock::time_point queued)
+{
+    // Save how long a frame waited between being queued and being taken by the frontend
+    if (!isEnabled()) return;
+    uint64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(TraceClock::now() - queued).count();
+    present.store(toMicroseconds(wait), std::memory_order_relaxed);
+}
+
+void FrameTrace::writeTrace(FrameTiming &timing)
+{
+    // Write the frame as a complete event spanning its emulation time, with the other values attached
+    // The times that don't have one place on the timeline are also written as counters to be graphed
+    fprintf(traceFile, "%s{\"name\":\"Frame %llu\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":%d,\"tid\":0,"
+        "\"ts\":%llu,\"dur\":%u,\"args\":{\"render2DA\":%u,\"render2DB\":%u,\"render3D\":%u,"
+        "\"present\":%u,\"audioFill\":%u}}", traceStarted ? ",\n" : "", (unsigned long long)timing.frame,
+        core->id, (unsigned long long)timing.start, timing.emulation, timing.render2D[0], timing.render2D[1],
+        timing.render3D, timing.present, timing.audioFill);
+    fprintf(traceFile, ",\n{\"name\":\"Render\",\"ph\":\"C\",\"pid\":%d,\"ts\":%llu,\"args\":{\"2D A\":%u,\"2D B\":%u,"
+        "\"3D\":%u,\"present\":%u}}", core->id, (unsigned long long)timing.start, timing.render2D[0],
+        timing.render2D[1], timing.render3D, timing.present);
+    fprintf(traceFile, ",\n{\"name\":\"Audio\",\"ph\":\"C\",\"pid\":%d,\"ts\":%llu,\"args\":{\"samples\":%u}}",
+        core->id, (unsigned long long)timing.start, timing.audioFill);
+    traceStarted = true;
+}
@@ -0,0 +1,115 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// Number of frame records that can be waiting to be read, which must be a power of 2
+#define TRACE_FRAMES 512
+
+// Number of 1ms buckets in the frame time histogram, with the last one counting anything longer
+#define TRACE_BUCKETS 64
+
+class Core;
+
+typedef std::chrono::steady_clock TraceClock;
+
+// Timing of a single emulated frame, with times in microseconds
+struct FrameTiming
+{
+    uint64_t frame;       // Number of the frame, counted from when tracing was enabled
+    uint64_t start;       // Time the frame started, relative to when tracing was enabled
+    uint32_t emulation;   // Time spent running the frame, including any drawing done on the emulation thread
+    uint32_t render2D[2]; // Time spent drawing the scanlines of each 2D engine, on whichever thread drew them
+    uint32_t render3D;    // Time the emulation thread spent in the 3D renderer, including waits for its threads
+    uint32_t present;     // Time the last frame taken by the frontend waited in the queue for it
+    uint32_t audioFill;   // Audio samples buffered for output at the end of the frame
+};
+
+// Per-frame timing records for diagnosing stutters, which cost nothing until tracing is enabled
+// Records are passed to a reader through a single-producer single-consumer ring, and can also be written
+// to a file in the Chrome trace event format, which can be opened in chrome://tracing or Perfetto
+class FrameTrace
+{
+    public:
+        FrameTrace(Core *core);
+        ~FrameTrace();
+
+        void setEnabled(bool enabled);
+        bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+        bool startTrace(std::string path);
+        void stopTrace();
+
+        size_t readTimings(FrameTiming *timings, size_t count);
+        void getHistogram(uint32_t *counts);
+        uint32_t getDropped() { return dropped.load(std::memory_order_relaxed); }
+
+        void beginFrame();
+        void endFrame();
+        void markPresent(TraceClock::time_point queued);
+
+        // Time accumulated for the current frame in nanoseconds, where each counter has one writer at a time
+        uint64_t render2D[2] = {};
+        uint64_t render3D = 0;
+
+    private:
+        Core *core;
+        std::atomic<bool> enabled;
+        std::atomic<bool> restart;
+
+        // Records are dropped instead of overwritten when the reader falls behind
+        FrameTiming ring[TRACE_FRAMES] = {};
+        std::atomic<uint32_t> ringHead, ringTail;
+        std::atomic<uint32_t> dropped;
+
+        std::atomic<uint32_t> histogram[TRACE_BUCKETS];
+        std::atomic<uint32_t> present;
+
+        TraceClock::time_point epoch;
+        TraceClock::time_point frameStart;
+        uint64_t frameCount = 0;
+        uint64_t lastStart = 0;
+
+        std::mutex traceMutex;
+        FILE *traceFile = nullptr;
+        bool traceStarted = false;
+
+        void writeTrace(FrameTiming &timing);
+};
+
+// Adds the time between construction and destruction to a tracing counter, but only while tracing
+struct TraceTimer
+{
+    uint64_t *counter;
+    TraceClock::time_point start;
+
+    TraceTimer(FrameTrace &trace, uint64_t &counter): counter(trace.isEnabled() ? &counter : nullptr)
+        { if (this->counter) start = TraceClock::now(); }
+    ~TraceTimer()
+        { if (counter) *counter += std::chrono::duration_cast<std::chrono::nanoseconds>(TraceClock::now() - start).count(); }
+};
+
+#endif // FRAME_TRACE_H
@@ -17,54 +17,58 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstring>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "gpu.h"
 #include "core.h"
 #include "settings.h"
+#include "thread_config.h"
 
 Gpu::Gpu(Core *core): core(core)
 {
-    // Mark the thread as not drawing to start
-    ready.store(false);
-    drawing.store(0);
+    // Allocate the framebuffers; high-res 3D buffers are only allocated once needed
+    for (int i = 0; i < 3; i++)
+        framebuffers[i].framebuffer = new uint32_t[256 * 192 * 2];
+
+    // Mark the frame queue as empty and the threads as not drawing to start
+    queued.store(0);
+    drawing[0].store(0);
+    drawing[1].store(0);
 }
 
 Gpu::~Gpu()
 {
-    // Clean up the thread
-    if (thread)
-    {
-        running = false;
-        thread->join();
-        delete thread;
-    }
+    // Clean up the threads
+    stopThreads();
 
-    // Clean up any queued framebuffers
-    while (!framebuffers.empty())
+    // Clean up the framebuffers
+    for (int i = 0; i < 3; i++)
     {
-        Buffers &buffers = framebuffers.front();
-        delete[] buffers.framebuffer;
-        delete[] buffers.hiRes3D;
-        framebuffers.pop();
+        delete[] framebuffers[i].framebuffer;
+        delete[] framebuffers[i].hiRes3D;
     }
 }
 
 uint32_t Gpu::rgb5ToRgb8(uint32_t color)
 {
     // Convert an RGB5 value to an RGB8 value, with RGB6 as an intermediate
-    uint8_t r = (((color >>  0) & 0x1F) << 1) * 255 / 63;
-    uint8_t g = (((color >>  5) & 0x1F) << 1) * 255 / 63;
-    uint8_t b = (((color >> 10) & 0x1F) << 1) * 255 / 63;
-    return (0xFF << 24) | (b << 16) | (g << 8) | r;
+    return rgb6ToRgb8(((color & 0x1F) << 1) | ((color & 0x3E0) << 2) | ((color & 0x7C00) << 3));
 }
 
 uint32_t Gpu::rgb6ToRgb8(uint32_t color)
 {
-    // Convert an RGB6 value to an RGB8 value
-    uint8_t r = ((color >>  0) & 0x3F) * 255 / 63;
-    uint8_t g = ((color >>  6) & 0x3F) * 255 / 63;
-    uint8_t b = ((color >> 12) & 0x3F) * 255 / 63;
+    // Convert an RGB6 value to an RGB8 value, scaling each channel by 255/63
+    // The scale is done as an exact multiply and shift rather than a division, so whole rows can be vectorized
+    uint32_t r = (((color >>  0) & 0x3F) * 4145) >> 10;
+    uint32_t g = (((color >>  6) & 0x3F) * 4145) >> 10;
+    uint32_t b = (((color >> 12) & 0x3F) * 4145) >> 10;
     return (0xFF << 24) | (b << 16) | (g << 8) | r;
 }
 
@@ -77,15 +81,133 @@ uint16_t Gpu::rgb6ToRgb5(uint32_t color)
     return BIT(15) | (b << 10) | (g << 5) | r;
 }
 
+#if defined(__SSE2__)
+
+template <int shift> static FORCE_INLINE __m128i blendCaptureChannel(__m128i a, __m128i b, __m128i eva, __m128i evb)
+{
+    // Blend one 5-bit channel of 8 pixels, with products that fit in 16-bit lanes
+    __m128i mask = _mm_set1_epi16(0x1F);
+    a = _mm_and_si128(_mm_srli_epi16(a, shift), mask);
+    b = _mm_and_si128(_mm_srli_epi16(b, shift), mask);
+    __m128i value = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, eva), _mm_mullo_epi16(b, evb)), 4);
+    return _mm_slli_epi16(_mm_min_epi16(value, mask), shift);
+}
+
+#elif defined(__ARM_NEON)
+
+template <int shift> static FORCE_INLINE uint16x8_t blendCaptureChannel(uint16x8_t a, uint16x8_t b, uint16x8_t eva, uint16x8_t evb)
+{
+    // Blend one 5-bit channel of 8 pixels, using register shifts since immediate shifts can't be 0
+    uint16x8_t mask = vdupq_n_u16(0x1F);
+    a = vandq_u16(vshlq_u16(a, vdupq_n_s16(-shift)), mask);
+    b = vandq_u16(vshlq_u16(b, vdupq_n_s16(-shift)), mask);
+    uint16x8_t value = vshrq_n_u16(vmlaq_u16(vmulq_u16(a, eva), b, evb), 4);
+    return vshlq_u16(vminq_u16(value, mask), vdupq_n_s16(shift));
+}
+
+#endif
+
+void Gpu::blendCapture(uint16_t *dst, uint16_t *srcA, uint16_t *srcB, uint8_t eva, uint8_t evb, int width)
+{
+    // Blend a line of 15-bit capture sources, as (A * EVA + B * EVB) / 16 clamped per channel
+    // The width is always a multiple of 8
+#if defined(__SSE2__)
+    __m128i a16 = _mm_set1_epi16(eva), b16 = _mm_set1_epi16(evb);
+    for (int i = 0; i < width; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((__m128i*)&srcA[i]);
+        __m128i b = _mm_loadu_si128((__m128i*)&srcB[i]);
+        __m128i value = _mm_or_si128(_mm_or_si128(blendCaptureChannel<0>(a, b, a16, b16),
+            blendCaptureChannel<5>(a, b, a16, b16)), blendCaptureChannel<10>(a, b, a16, b16));
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(value, _mm_set1_epi16((int16_t)BIT(15))));
+    }
+#elif defined(__ARM_NEON)
+    uint16x8_t a16 = vdupq_n_u16(eva), b16 = vdupq_n_u16(evb);
+    for (int i = 0; i < width; i += 8)
+    {
+        uint16x8_t a = vld1q_u16(&srcA[i]);
+        uint16x8_t b = vld1q_u16(&srcB[i]);
+        uint16x8_t value = vorrq_u16(vorrq_u16(blendCaptureChannel<0>(a, b, a16, b16),
+            blendCaptureChannel<5>(a, b, a16, b16)), blendCaptureChannel<10>(a, b, a16, b16));
+        vst1q_u16(&dst[i], vorrq_u16(value, vdupq_n_u16(BIT(15))));
+    }
+#else
+    for (int i = 0; i < width; i++)
+    {
+        uint8_t r = std::min((((srcA[i] >>  0) & 0x1F) * eva + ((srcB[i] >>  0) & 0x1F) * evb) / 16, 31);
+        uint8_t g = std::min((((srcA[i] >>  5) & 0x1F) * eva + ((srcB[i] >>  5) & 0x1F) * evb) / 16, 31);
+        uint8_t b = std::min((((srcA[i] >> 10) & 0x1F) * eva + ((srcB[i] >> 10) & 0x1F) * evb) / 16, 31);
+        dst[i] = BIT(15) | (b << 10) | (g << 5) | r;
+    }
+#endif
+}
+
+Gpu::Buffers *Gpu::takeFrame()
+{
+    // Check if a new frame is ready
+    if (!queued.load())
+        return nullptr;
+
+    // Take the next queued buffers, which stay untouched by the emulation thread until the next frame is taken
+    Buffers *buffers = &framebuffers[queueTail];
+    queueTail = (queueTail + 1) % 3;
+    queued--;
+    core->frameTrace.markPresent(buffers->queueTime);
+    return buffers;
+}
+
 bool Gpu::getFrame(uint32_t *out, bool gbaCrop)
+{
+    // Convert the next frame into the given buffer if one is ready
+    Buffers *buffers = takeFrame();
+    if (!buffers)
+        return false;
+    convertFrame(*buffers, out, gbaCrop);
+    return true;
+}
+
+std::shared_ptr<const Frame> Gpu::getFrame(bool gbaCrop)
+{
+    // Check if a new frame is ready
+    Buffers *buffers = takeFrame();
+    if (!buffers)
+        return nullptr;
+
+    // Reuse a frame that the frontend no longer references, or add a new one to the pool
+    std::shared_ptr<Frame> frame;
+    for (size_t i = 0; i < framePool.size() && !frame; i++)
+    {
+        if (framePool[i].use_count() == 1)
+            frame = framePool[i];
+    }
+    if (!frame)
+    {
+        frame = std::make_shared<Frame>();
+        framePool.push_back(frame);
+    }
+
+    // Convert the frame and hand it over
+    frame->width = (gbaCrop ? 240 : 256) << Settings::highRes3D;
+    frame->height = (gbaCrop ? 160 : 192) << Settings::highRes3D;
+    convertFrame(*buffers, frame->data, gbaCrop);
+    return frame;
+}
+
+bool Gpu::getRawFrame(RawFrame &frame)
 {
     // Check if a new frame is ready
-    if (!ready.load())
+    Buffers *buffers = takeFrame();
+    if (!buffers)
         return false;
 
-    // Get the next queued buffers
-    Buffers &buffers = framebuffers.front();
+    // Hand over the queued buffers as they are, leaving conversion to the frontend
+    frame.framebuffer = buffers->framebuffer;
+    frame.hiRes3D = buffers->hiRes ? buffers->hiRes3D : nullptr;
+    return true;
+}
 
+void Gpu::convertFrame(Buffers &buffers, uint32_t *out, bool gbaCrop)
+{
     if (gbaCrop)
     {
         // Output the frame in RGB8 format, cropped for GBA
@@ -131,7 +253,7 @@ bool Gpu::getFrame(uint32_t *out, bool gbaCrop)
                 {
                     uint32_t color = rgb5ToRgb8((x >= 8 && x < 256 - 8 && y >= 16 && y < 192 - 16) ?
                         buffers.framebuffer[(y - 16) * 256 + (x - 8)] :
-                        core->memory.read<uint16_t>(0, base + (y * 256 + x) * 2));
+                        core->memory.readVram<uint16_t>(base + (y * 256 + x) * 2));
                     int i = (offset * 4) + (y * 2) * (256 * 2) + (x * 2);
                     out[i + 0] = color;
                     out[i + 1] = color;
@@ -152,7 +274,7 @@ bool Gpu::getFrame(uint32_t *out, bool gbaCrop)
                 {
                     out[offset + y * 256 + x] = rgb5ToRgb8((x >= 8 && x < 256 - 8 && y >= 16 && y < 192 - 16) ?
                         buffers.framebuffer[(y - 16) * 256 + (x - 8)] :
-                        core->memory.read<uint16_t>(0, base + (y * 256 + x) * 2));
+                        core->memory.readVram<uint16_t>(base + (y * 256 + x) * 2));
                 }
             }
 
@@ -165,7 +287,7 @@ bool Gpu::getFrame(uint32_t *out, bool gbaCrop)
         // Output the full frame in RGB8 format
         if (Settings::highRes3D)
         {
-            if (buffers.hiRes3D)
+            if (buffers.hiRes)
             {
                 // Draw the screens upscaled, replacing any 3D pixels with high-res output
                 for (int y = 0; y < 192 * 2; y++)
@@ -220,28 +342,21 @@ bool Gpu::getFrame(uint32_t *out, bool gbaCrop)
                 out[i] = rgb6ToRgb8(buffers.framebuffer[i]);
         }
     }
-
-    // Free the used buffers
-    delete[] buffers.framebuffer;
-    delete[] buffers.hiRes3D;
-
-    // Remove the frame from the queue
-    mutex.lock();
-    framebuffers.pop();
-    ready.store(!framebuffers.empty());
-    mutex.unlock();
-    return true;
 }
 
 void Gpu::gbaScanline240()
 {
     if (vCount < 160)
     {
-        if (thread)
+        if (threads[0])
         {
-            // Wait for the thread to finish the scanline
-            while (drawing.load() != 0)
-                std::this_thread::yield();
+            // Make sure the scanline is finished, drawing it here if the thread hasn't started it
+            finishScanline(0);
+        }
+        else if (skipFrame)
+        {
+            // Advance the current scanline without drawing it
+            core->gpu2D[0].skipScanline();
         }
         else
         {
@@ -274,13 +389,7 @@ void Gpu::gbaScanline308()
     {
         case 160: // End of visible scanlines
             // Stop the thread now that the frame has been drawn
-            if (thread)
-            {
-                running = false;
-                thread->join();
-                delete thread;
-                thread = nullptr;
-            }
+            stopThreads();
 
             // Set the V-blank flag
             dispStat[1] |= BIT(0);
@@ -293,18 +402,19 @@ void Gpu::gbaScanline308()
             core->dma[1].trigger(1);
 
             // Allow up to 2 framebuffers to be queued, to preserve frame pacing if emulation runs ahead
-            if (framebuffers.size() < 2)
+            // Frames aren't queued at all while output is disabled, like when they'll be emulated again, or when skipped
+            if (queued.load() < 2 && output && !skipFrame)
             {
-                // Copy the completed sub-framebuffer to a new framebuffer
-                Buffers buffers;
-                buffers.framebuffer = new uint32_t[256 * 160];
+                // Copy the completed sub-framebuffer to the next free framebuffer
+                Buffers &buffers = framebuffers[queueHead];
                 memcpy(buffers.framebuffer, core->gpu2D[0].getFramebuffer(), 256 * 160 * sizeof(uint32_t));
+                buffers.hiRes = false;
 
-                // Add the frame to the queue
-                mutex.lock();
-                framebuffers.push(buffers);
-                ready.store(true);
-                mutex.unlock();
+                // Add the frame to the queue, noting when for tracing
+                if (core->frameTrace.isEnabled())
+                    buffers.queueTime = TraceClock::now();
+                queueHead = (queueHead + 1) % 3;
+                queued++;
             }
             break;
 
@@ -318,19 +428,17 @@ void Gpu::gbaScanline308()
             // Start the next frame
             vCount = 0;
             core->gpu2D[0].reloadRegisters();
+            skipFrame = decideSkip();
 
-            // Start the 2D thread if enabled
-            if (Settings::threaded2D && !thread)
-            {
-                running = true;
-                thread = new std::thread(&Gpu::drawGbaThreaded, this);
-            }
+            // Start the 2D thread if enabled, unless there's nothing to draw
+            if (Settings::threaded2D && !skipFrame)
+                startThreads();
             break;
     }
 
     // Signal that the next scanline should start drawing
-    if (vCount < 160 && thread)
-        drawing.store(1);
+    if (vCount < 160 && threads[0])
+        drawing[0].store(1);
 
     // Check if the current scanline matches the V-counter
     if (vCount == (dispStat[1] >> 8))
@@ -356,24 +464,21 @@ void Gpu::scanline256()
 {
     if (vCount < 192)
     {
-        if (thread)
-        {
-            // Make sure the thread has started before changing the state
-            while (drawing.load() == 1)
-                std::this_thread::yield();
+        // Render a frame that was going to be skipped if a display capture needs it
+        if (vCount == 0 && skipFrame && (dispCapCnt & BIT(31)))
+            cancelSkip();
 
-            switch (drawing.exchange(3))
-            {
-                case 2:
-                    // Draw engine B's scanline if it hasn't started yet (and purposely fall through)
-                    core->gpu2D[1].drawScanline(vCount);
-
-                case 3:
-                    // Wait for the thread to finish the scanlines
-                    while (drawing.load() != 0)
-                        std::this_thread::yield();
-                    break;
-            }
+        if (threads[0])
+        {
+            // Wait for both engines to finish the scanline before anything reads it, like display capture
+            finishScanline(0);
+            finishScanline(1);
+        }
+        else if (skipFrame)
+        {
+            // Advance the current scanlines without drawing them
+            core->gpu2D[0].skipScanline();
+            core->gpu2D[1].skipScanline();
         }
         else
         {
@@ -402,85 +507,71 @@ void Gpu::scanline256()
                 case 3: width = 256; height = 192; break;
             }
 
-            // Get the VRAM destination address for the current scanline
+            // Get the VRAM destination and source addresses for the current scanline
+            // Lines never cross the end of a bank, since the offsets are multiples of the line size
             uint32_t base = 0x6800000 + ((dispCapCnt & 0x00030000) >> 16) * 0x20000;
-            uint32_t writeOffset = ((dispCapCnt & 0x000C0000) >> 3) + vCount * width * 2;
+            uint32_t writeAddr = base + ((((dispCapCnt & 0x000C0000) >> 3) + vCount * width * 2) & 0x1FFFF);
+            uint32_t readAddr = base + ((((dispCapCnt & 0x0C000000) >> 11) + vCount * width * 2) & 0x1FFFF);
 
-            // Copy the source contents to memory as a 15-bit bitmap
+            // Determine which sources the line is built from, with bit 0 for source A and bit 1 for source B
+            uint8_t sources;
             switch ((dispCapCnt & 0x60000000) >> 29) // Capture source
             {
-                case 0: // Source A
-                {
-                    // Choose from 2D engine A or the 3D engine
-                    // In high-res mode, skip every other pixel when capturing 3D
-                    uint32_t *source = (dispCapCnt & BIT(24)) ? core->gpu3DRenderer.getLine(vCount) : core->gpu2D[0].getRawLine();
-                    bool resShift = (Settings::highRes3D && (dispCapCnt & BIT(24)));
+                case 0:  sources = BIT(0);          break; // Source A
+                case 1:  sources = BIT(1);          break; // Source B
+                default: sources = BIT(0) | BIT(1); break; // Blended
+            }
+            if ((sources & BIT(1)) && (dispCapCnt & BIT(25)))
+            {
+                LOG("Unimplemented display capture source: display FIFO\n");
+                sources = 0;
+            }
 
-                    // Copy a scanline to memory
-                    for (int i = 0; i < width; i++)
-                        core->memory.write<uint16_t>(0, base + ((writeOffset + i * 2) & 0x1FFFF), rgb6ToRgb5(source[i << resShift]));
+            // Convert source A from 18-bit color to a 15-bit line, choosing from 2D engine A or the 3D engine
+            // In high-res mode, skip every other pixel when capturing 3D
+            uint16_t lineA[256], lineB[256];
+            if (sources & BIT(0))
+            {
+                uint32_t *source = (dispCapCnt & BIT(24)) ? core->gpu3DBackend->getLine(vCount) : core->gpu2D[0].getRawLine();
+                bool resShift = ((dispCapCnt & BIT(24)) && core->gpu3DBackend->isHighRes());
+                for (int i = 0; i < width; i++)
+                    lineA[i] = rgb6ToRgb5(source[i << resShift]);
+            }
 
-                    break;
+            // Read source B from VRAM, through a direct pointer if the line is in one block of the flattened view
+            if (sources & BIT(1))
+            {
+                if ((readAddr & 0x3FFF) + width * 2 <= 0x4000)
+                {
+                    uint8_t *data = core->memory.getVramBlock(readAddr);
+                    for (int i = 0; i < width; i++)
+                        lineB[i] = U8TO16(data, i * 2);
                 }
-
-                case 1: // Source B
+                else
                 {
-                    if (dispCapCnt & BIT(25))
-                    {
-                        LOG("Unimplemented display capture source: display FIFO\n");
-                        break;
-                    }
+                    for (int i = 0; i < width; i++)
+                        lineB[i] = core->memory.readVram<uint16_t>(readAddr + i * 2);
+                }
+            }
 
-                    // Get the VRAM source address for the current scanline
-                    uint32_t readOffset = ((dispCapCnt & 0x0C000000) >> 11) + vCount * width * 2;
+            // Blend the two sources into the line of source A if both are used
+            uint16_t *line = (sources & BIT(0)) ? lineA : lineB;
+            if (sources == (BIT(0) | BIT(1)))
+                blendCapture(lineA, lineA, lineB, std::min((dispCapCnt >> 0) & 0x1F, 16U), std::min((dispCapCnt >> 8) & 0x1F, 16U), width);
 
-                    // Copy a scanline to memory
+            if (sources)
+            {
+                // Store the line directly if the destination is contiguous in host memory, or fall back to mapped writes
+                if (uint8_t *data = core->memory.getMappedRange(0, writeAddr, width * 2, true))
+                {
                     for (int i = 0; i < width; i++)
-                    {
-                        uint16_t color = core->memory.read<uint16_t>(0, base + ((readOffset + i * 2) & 0x1FFFF));
-                        core->memory.write<uint16_t>(0, base + ((writeOffset + i * 2) & 0x1FFFF), color);
-                    }
-
-                    break;
+                        storeLsbFirst<uint16_t>(&data[i * 2], line[i]);
+                    core->memory.markWritten(data, width * 2);
                 }
-
-                default: // Blended
+                else
                 {
-                    if (dispCapCnt & BIT(25))
-                    {
-                        LOG("Unimplemented display capture source: display FIFO\n");
-                        break;
-                    }
-
-                    // Choose from 2D engine A or the 3D engine
-                    // In high-res mode, skip every other pixel when capturing 3D
-                    uint32_t *source = (dispCapCnt & BIT(24)) ? core->gpu3DRenderer.getLine(vCount) : core->gpu2D[0].getRawLine();
-                    bool resShift = (Settings::highRes3D && (dispCapCnt & BIT(24)));
-
-                    // Get the VRAM source address for the current scanline
-                    uint32_t readOffset = ((dispCapCnt & 0x0C000000) >> 11) + vCount * width * 2;
-
-                    // Get the blending factors for the two sources
-                    uint8_t eva = std::min((dispCapCnt >> 0) & 0x1F, 16U);
-                    uint8_t evb = std::min((dispCapCnt >> 8) & 0x1F, 16U);
-
-                    // Copy a scanline to memory
                     for (int i = 0; i < width; i++)
-                    {
-                        // Get colors from the two sources
-                        uint16_t c1 = rgb6ToRgb5(source[i << resShift]);
-                        uint16_t c2 = core->memory.read<uint16_t>(0, base + ((readOffset + i * 2) & 0x1FFFF));
-
-                        // Blend the color values
-                        uint8_t r = std::min((((c1 >>  0) & 0x1F) * eva + ((c2 >>  0) & 0x1F) * evb) / 16, 31);
-                        uint8_t g = std::min((((c1 >>  5) & 0x1F) * eva + ((c2 >>  5) & 0x1F) * evb) / 16, 31);
-                        uint8_t b = std::min((((c1 >> 10) & 0x1F) * eva + ((c2 >> 10) & 0x1F) * evb) / 16, 31);
-
-                        uint16_t color = BIT(15) | (b << 10) | (g << 5) | r;
-                        core->memory.write<uint16_t>(0, base + ((writeOffset + i * 2) & 0x1FFFF), color);
-                    }
-
-                    break;
+                        core->memory.write<uint16_t>(0, writeAddr + i * 2, line[i]);
                 }
             }
 
@@ -496,10 +587,14 @@ void Gpu::scanline256()
     // Draw 3D scanlines 48 lines in advance, if the current 3D is dirty
     // If the 3D parameters haven't changed since the last frame, there's no need to draw it again
     // Bit 0 of the dirty variable represents invalidation, and bit 1 represents a frame currently drawing
-    if (dirty3D && (core->gpu2D[0].readDispCnt() & BIT(3)) && ((vCount + 48) % 263) < 192)
+    // Skipped frames leave the 3D dirty, so it gets drawn for the next frame that isn't skipped
+    if (vCount == 215) skipNext = decideSkip();
+    bool skip3D = (vCount < 192) ? skipFrame : skipNext;
+    if (dirty3D && !skip3D && (core->gpu2D[0].readDispCnt() & BIT(3)) && ((vCount + 48) % 263) < 192)
     {
         if (vCount == 215) dirty3D = BIT(1);
-        core->gpu3DRenderer.drawScanline((vCount + 48) % 263);
+        TraceTimer traceTimer(core->frameTrace, core->frameTrace.render3D);
+        core->gpu3DBackend->drawScanline((vCount + 48) % 263);
         if (vCount == 143) dirty3D &= ~BIT(1);
     }
 
@@ -523,14 +618,8 @@ void Gpu::scanline355()
     switch (++vCount)
     {
         case 192: // End of visible scanlines
-            // Stop the thread now that the frame has been drawn
-            if (thread)
-            {
-                running = false;
-                thread->join();
-                delete thread;
-                thread = nullptr;
-            }
+            // Stop the threads now that the frame has been drawn
+            stopThreads();
 
             for (int i = 0; i < 2; i++)
             {
@@ -545,17 +634,20 @@ void Gpu::scanline355()
                 core->dma[i].trigger(1);
             }
 
-            // Swap the buffers of the 3D engine if needed
+            // Swap the buffers of the 3D engine if needed, once the renderer is done with them
             if (core->gpu3D.shouldSwap())
+            {
+                TraceTimer traceTimer(core->frameTrace, core->frameTrace.render3D);
+                core->gpu3DBackend->finishFrame();
                 core->gpu3D.swapBuffers();
+            }
 
             // Allow up to 2 framebuffers to be queued, to preserve frame pacing if emulation runs ahead
-            if (framebuffers.size() < 2)
+            // Frames aren't queued at all while output is disabled, like when they'll be emulated again, or when skipped
+            if (queued.load() < 2 && output && !skipFrame)
             {
-                Buffers buffers;
-
-                // Copy the completed sub-framebuffers to a new framebuffer
-                buffers.framebuffer = new uint32_t[256 * 192 * 2];
+                // Copy the completed sub-framebuffers to the next free framebuffer
+                Buffers &buffers = framebuffers[queueHead];
                 if (powCnt1 & BIT(0)) // LCDs enabled
                 {
                     if (powCnt1 & BIT(15)) // Display swap
@@ -574,19 +666,21 @@ void Gpu::scanline355()
                     memset(buffers.framebuffer, 0, 256 * 192 * 2 * sizeof(uint32_t));
                 }
 
-                // Copy the upscaled 3D output to a new buffer if enabled
-                if (Settings::highRes3D && (core->gpu2D[0].readDispCnt() & BIT(3)))
+                // Copy the upscaled 3D output to the framebuffer's 3D buffer if enabled, allocating it on first use
+                buffers.hiRes = (core->gpu3DBackend->isHighRes() && (core->gpu2D[0].readDispCnt() & BIT(3)));
+                if (buffers.hiRes)
                 {
-                    buffers.hiRes3D = new uint32_t[256 * 192 * 4];
-                    memcpy(buffers.hiRes3D, core->gpu3DRenderer.getLine(0), 256 * 192 * 4 * sizeof(uint32_t));
+                    if (!buffers.hiRes3D)
+                        buffers.hiRes3D = new uint32_t[256 * 192 * 4];
+                    memcpy(buffers.hiRes3D, core->gpu3DBackend->getLine(0), 256 * 192 * 4 * sizeof(uint32_t));
                     buffers.top3D = (powCnt1 & BIT(15));
                 }
 
-                // Add the frame to the queue
-                mutex.lock();
-                framebuffers.push(buffers);
-                ready.store(true);
-                mutex.unlock();
+                // Add the frame to the queue, noting when for tracing
+                if (core->frameTrace.isEnabled())
+                    buffers.queueTime = TraceClock::now();
+                queueHead = (queueHead + 1) % 3;
+                queued++;
             }
             break;
 
@@ -598,23 +692,25 @@ void Gpu::scanline355()
             break;
 
         case 263: // End of frame
-            // Start the next frame
+            // Start the next frame, refreshing any VRAM that has overlapping banks for the renderers
             vCount = 0;
             core->gpu2D[0].reloadRegisters();
             core->gpu2D[1].reloadRegisters();
+            core->memory.updateComposites();
+            skipFrame = skipNext;
 
-            // Start the 2D thread if enabled
-            if (Settings::threaded2D && !thread)
-            {
-                running = true;
-                thread = new std::thread(&Gpu::drawThreaded, this);
-            }
+            // Start the 2D threads if enabled, unless there's nothing to draw
+            if (Settings::threaded2D && !skipFrame)
+                startThreads();
             break;
     }
 
-    // Signal that the next scanline should start drawing
-    if (vCount < 192 && thread)
-        drawing.store(1);
+    // Signal that the next scanline should start drawing on both engines
+    if (vCount < 192 && threads[0])
+    {
+        drawing[0].store(1);
+        drawing[1].store(1);
+    }
 
     for (int i = 0; i < 2; i++)
     {
@@ -642,46 +738,90 @@ void Gpu::scanline355()
     core->schedule(NDS_SCANLINE355, 355 * 6);
 }
 
-void Gpu::drawGbaThreaded()
+bool Gpu::decideSkip()
 {
-    while (running)
+    // Skip all but every Nth frame if frame skipping is enabled
+    if (frameSkip <= 0) return false;
+    skipCount = (skipCount + 1) % (frameSkip + 1);
+    return skipCount != 0;
+}
+
+void Gpu::cancelSkip()
+{
+    // Render the current frame after all, drawing the 3D scanlines that were skipped before it started
+    skipFrame = false;
+    if (dirty3D && (core->gpu2D[0].readDispCnt() & BIT(3)))
     {
-        // Wait until the next scanline should start
-        while (drawing.load() != 1)
-        {
-            if (!running) return;
-            std::this_thread::yield();
-        }
+        redraw3D();
+        dirty3D = 0;
+    }
+}
 
-        // Draw the current scanline
-        core->gpu2D[0].drawGbaScanline(vCount);
+void Gpu::startThreads()
+{
+    // Start a thread for each 2D engine in use, if they aren't running yet
+    if (threads[0]) return;
+    running = true;
+    for (int i = 0; i < (core->gbaMode ? 1 : 2); i++)
+        threads[i] = new std::thread(&Gpu::drawThreaded, this, i);
+}
 
-        // Signal that the scanline is finished
-        drawing.store(0);
+void Gpu::stopThreads()
+{
+    // Stop the 2D threads and clear any scanlines they didn't take
+    running = false;
+    for (int i = 0; i < 2; i++)
+    {
+        if (!threads[i]) continue;
+        threads[i]->join();
+        delete threads[i];
+        threads[i] = nullptr;
+        drawing[i].store(0);
     }
 }
 
-void Gpu::drawThreaded()
+void Gpu::finishScanline(bool engine)
 {
+    // Draw an engine's scanline on the emulation thread if its thread hasn't started it yet
+    int expected = 1;
+    if (drawing[engine].compare_exchange_strong(expected, 3))
+    {
+        if (core->gbaMode)
+            core->gpu2D[0].drawGbaScanline(vCount);
+        else
+            core->gpu2D[engine].drawScanline(vCount);
+        drawing[engine].store(0);
+        return;
+    }
+
+    // Otherwise, wait for the thread to finish it
+    while (drawing[engine].load() != 0)
+        std::this_thread::yield();
+}
+
+void Gpu::drawThreaded(bool engine)
+{
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_RENDER);
+
     while (running)
     {
-        // Wait until the next scanline should start
-        while (drawing.load() != 1)
+        // Wait until the next scanline should start, unless the emulation thread takes it first
+        int expected = 1;
+        if (!drawing[engine].compare_exchange_weak(expected, 2))
         {
-            if (!running) return;
             std::this_thread::yield();
+            continue;
         }
 
-        // Draw engine A's scanline
-        drawing.store(2);
-        core->gpu2D[0].drawScanline(vCount);
-
-        // Draw engine B's scanline if it hasn't started yet
-        if (drawing.exchange(3) == 2)
-            core->gpu2D[1].drawScanline(vCount);
+        // Draw the current scanline
+        if (core->gbaMode)
+            core->gpu2D[0].drawGbaScanline(vCount);
+        else
+            core->gpu2D[engine].drawScanline(vCount);
 
-        // Signal that the scanlines are finished
-        drawing.store(0);
+        // Signal that the scanline is finished
+        drawing[engine].store(0);
     }
 }
 
@@ -705,3 +845,30 @@ void Gpu::writePowCnt1(uint16_t mask, uint16_t value)
     mask &= 0x820F;
     powCnt1 = (powCnt1 & ~mask) | (value & mask);
 }
+
+void Gpu::syncState(SaveState &state)
+{
+    // Stop the 2D threads before loading, since they read state as they draw
+    // They restart at the beginning of the next frame
+    if (state.isLoading())
+        stopThreads();
+
+    // Sync the display state and registers
+    state.sync(displayCapture);
+    state.sync(dirty3D);
+    state.sync(dispStat);
+    state.sync(vCount);
+    state.sync(dispCapCnt);
+    state.sync(powCnt1);
+}
+
+void Gpu::redraw3D()
+{
+    // Redraw the 3D scanlines that should have been drawn by this point in the frame
+    // If a frame isn't being drawn, the last one would be shown again, so the whole thing is redrawn
+    if (core->gbaMode) return;
+    int count = (dirty3D & BIT(1)) ? std::min((vCount + 263 - 215) % 263 + 1, 192) : 192;
+    TraceTimer traceTimer(core->frameTrace, core->frameTrace.render3D);
+    for (int i = 0; i < count; i++)
+        core->gpu3DBackend->drawScanline(i);
+}
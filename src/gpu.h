@@ -22,13 +22,35 @@
 
 #include <atomic>
 #include <cstdint>
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 #include "defines.h"
+#include "frame_trace.h"
 
 class Core;
+class SaveState;
+
+// A finished frame in RGB8 format, shared read-only with the frontend for as long as it holds a reference
+struct Frame
+{
+    uint32_t *data = new uint32_t[256 * 192 * 8];
+    int width = 0, height = 0; // Dimensions of a single screen
+
+    Frame() {}
+    Frame(const Frame&) = delete;
+    ~Frame() { delete[] data; }
+};
+
+// A finished frame in the renderers' native RGB6 format, valid until the next frame is taken
+struct RawFrame
+{
+    const uint32_t *framebuffer = nullptr; // Both screens at 256x192, with bit 26 marking 3D pixels
+    const uint32_t *hiRes3D = nullptr;     // High-res 3D at 512x384, if it was drawn
+};
 
 class Gpu
 {
@@ -36,8 +58,15 @@ class Gpu
         Gpu(Core *core);
         ~Gpu();
 
+        void syncState(SaveState &state);
+
         bool getFrame(uint32_t *out, bool gbaCrop);
+        std::shared_ptr<const Frame> getFrame(bool gbaCrop);
+        bool getRawFrame(RawFrame &frame);
         void invalidate3D() { dirty3D |= BIT(0); }
+        void redraw3D();
+        void setOutput(bool enabled) { output = enabled; }
+        void setFrameSkip(int frames) { frameSkip = frames; }
 
         void gbaScanline240();
         void gbaScanline308();
@@ -60,16 +89,35 @@ class Gpu
         {
             uint32_t *framebuffer = nullptr;
             uint32_t *hiRes3D = nullptr;
+            bool hiRes = false;
             bool top3D = false;
+            TraceClock::time_point queueTime;
         };
 
-        std::queue<Buffers> framebuffers;
-        std::atomic<bool> ready;
-        std::mutex mutex;
+        // Finished frames are passed to the frontend through a ring of preallocated buffers
+        // The emulation thread owns the head and the frontend owns the tail, so only the count needs to be shared
+        // Up to 2 frames can be queued while a third is being read
+        Buffers framebuffers[3];
+        int queueHead = 0;
+        int queueTail = 0;
+        std::atomic<int> queued;
+
+        // Frames handed to the frontend are recycled once it stops referencing them
+        std::vector<std::shared_ptr<Frame>> framePool;
 
+        // Each 2D engine can draw on its own thread, with a state for handing scanlines over
+        // 0 means idle, 1 means requested, 2 means drawing on the thread, and 3 means drawing on the emulation thread
+        bool output = true;
         bool running = false;
-        std::atomic<int> drawing;
-        std::thread *thread = nullptr;
+        std::atomic<int> drawing[2];
+        std::thread *threads[2] = {};
+
+        // Frames can be skipped to run faster, like when fast-forwarding, by not rendering anything for them
+        // The decision is made early for the next frame, since its 3D starts drawing during the current one
+        int frameSkip = 0;
+        int skipCount = 0;
+        bool skipNext = false;
+        bool skipFrame = false;
 
         bool gbaBlock = true;
         bool displayCapture = false;
@@ -83,9 +131,18 @@ class Gpu
         static uint32_t rgb5ToRgb8(uint32_t color);
         static uint32_t rgb6ToRgb8(uint32_t color);
         static uint16_t rgb6ToRgb5(uint32_t color);
+        static void blendCapture(uint16_t *dst, uint16_t *srcA, uint16_t *srcB, uint8_t eva, uint8_t evb, int width);
+
+        bool decideSkip();
+        void cancelSkip();
+
+        Buffers *takeFrame();
+        void convertFrame(Buffers &buffers, uint32_t *out, bool gbaCrop);
 
-        void drawGbaThreaded();
-        void drawThreaded();
+        void startThreads();
+        void stopThreads();
+        void finishScanline(bool engine);
+        void drawThreaded(bool engine);
 };
 
 #endif // GPU_H
@@ -19,9 +19,14 @@
 
 #include <cstring>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "gpu_2d.h"
 #include "core.h"
-#include "settings.h"
 
 Gpu2D::Gpu2D(Core *core, bool engine): core(core), engine(engine)
 {
@@ -55,6 +60,86 @@ uint32_t Gpu2D::rgb5ToRgb6(uint32_t color)
     return (color & 0xFFFC0000) | (b << 12) | (g << 6) | r;
 }
 
+#if defined(__SSE2__)
+
+template <int shift> static FORCE_INLINE __m128i blendChannel(__m128i src, __m128i target, __m128i eva, __m128i evb)
+{
+    // Blend one 6-bit channel of 4 pixels, with products that fit in the low 16 bits of each lane
+    __m128i mask = _mm_set1_epi32(0x3F);
+    __m128i a = _mm_and_si128(_mm_srli_epi32(src, shift), mask);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(target, shift), mask);
+    __m128i value = _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi16(a, eva), _mm_mullo_epi16(b, evb)), 6);
+    return _mm_slli_epi32(_mm_min_epi16(value, mask), shift);
+}
+
+#elif defined(__ARM_NEON)
+
+template <int shift> static FORCE_INLINE uint32x4_t blendChannel(uint32x4_t src, uint32x4_t target, uint32x4_t eva, uint32x4_t evb)
+{
+    // Blend one 6-bit channel of 4 pixels, using register shifts since immediate shifts can't be 0
+    uint32x4_t mask = vdupq_n_u32(0x3F);
+    uint32x4_t a = vandq_u32(vshlq_u32(src, vdupq_n_s32(-shift)), mask);
+    uint32x4_t b = vandq_u32(vshlq_u32(target, vdupq_n_s32(-shift)), mask);
+    uint32x4_t value = vshrq_n_u32(vmlaq_u32(vmulq_u32(a, eva), b, evb), 6);
+    return vshlq_u32(vminq_u32(value, mask), vdupq_n_s32(shift));
+}
+
+#endif
+
+void Gpu2D::blendPixels(uint32_t *dst, uint32_t *src, uint32_t *targets, uint32_t *weights)
+{
+    // Blend a line of 18-bit pixels with their targets, as (src * eva + target * evb) / 64 clamped per channel
+    // Weights hold EVA in the low half and EVB in the high half, and only targets with bit 31 set are blended
+#if defined(__SSE2__)
+    for (int i = 0; i < 256; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((__m128i*)&src[i]);
+        __m128i t = _mm_loadu_si128((__m128i*)&targets[i]);
+        __m128i w = _mm_loadu_si128((__m128i*)&weights[i]);
+        __m128i eva = _mm_and_si128(w, _mm_set1_epi32(0xFFFF));
+        __m128i evb = _mm_srli_epi32(w, 16);
+        __m128i value = _mm_or_si128(_mm_or_si128(blendChannel<0>(s, t, eva, evb),
+            blendChannel<6>(s, t, eva, evb)), blendChannel<12>(s, t, eva, evb));
+        __m128i blend = _mm_srai_epi32(t, 31);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(_mm_and_si128(blend, value), _mm_andnot_si128(blend, s)));
+    }
+#elif defined(__ARM_NEON)
+    for (int i = 0; i < 256; i += 4)
+    {
+        uint32x4_t s = vld1q_u32(&src[i]);
+        uint32x4_t t = vld1q_u32(&targets[i]);
+        uint32x4_t w = vld1q_u32(&weights[i]);
+        uint32x4_t eva = vandq_u32(w, vdupq_n_u32(0xFFFF));
+        uint32x4_t evb = vshrq_n_u32(w, 16);
+        uint32x4_t value = vorrq_u32(vorrq_u32(blendChannel<0>(s, t, eva, evb),
+            blendChannel<6>(s, t, eva, evb)), blendChannel<12>(s, t, eva, evb));
+        uint32x4_t blend = vreinterpretq_u32_s32(vshrq_n_s32(vreinterpretq_s32_u32(t), 31));
+        vst1q_u32(&dst[i], vbslq_u32(blend, value, s));
+    }
+#else
+    for (int i = 0; i < 256; i++)
+    {
+        if (!(targets[i] & BIT(31)))
+        {
+            dst[i] = src[i];
+            continue;
+        }
+
+        uint32_t eva = weights[i] & 0xFFFF, evb = weights[i] >> 16;
+        uint8_t r = std::min((((src[i] >>  0) & 0x3F) * eva + ((targets[i] >>  0) & 0x3F) * evb) / 64, 63U);
+        uint8_t g = std::min((((src[i] >>  6) & 0x3F) * eva + ((targets[i] >>  6) & 0x3F) * evb) / 64, 63U);
+        uint8_t b = std::min((((src[i] >> 12) & 0x3F) * eva + ((targets[i] >> 12) & 0x3F) * evb) / 64, 63U);
+        dst[i] = (b << 12) | (g << 6) | r;
+    }
+#endif
+}
+
+template <bool gbaMode, typename T> FORCE_INLINE T Gpu2D::readVram(uint32_t address)
+{
+    // Read from the flattened view of VRAM in DS mode, or through the ARM7's memory map in GBA mode
+    return gbaMode ? core->memory.read<T>(1, address) : core->memory.readVram<T>(address);
+}
+
 void Gpu2D::reloadRegisters()
 {
     // Reload internal registers at the start of a frame
@@ -66,6 +151,9 @@ void Gpu2D::reloadRegisters()
 
 void Gpu2D::drawGbaScanline(int line)
 {
+    PROFILE_TIME(core->renderProfile.gpu2DTimes[engine]);
+    TraceTimer traceTimer(core->frameTrace, core->frameTrace.render2D[engine]);
+
     // Clear layers with the backdrop (first palette index)
     uint32_t backdrop = U8TO16(palette, 0) & ~BIT(15);
     for (int i = 0; i < 240; i++) layers[0][i] = backdrop;
@@ -76,6 +164,7 @@ void Gpu2D::drawGbaScanline(int line)
     // Draw the objects, object window first if enabled
     if (dispCnt & BIT(12))
     {
+        binObjects();
         if (dispCnt & BIT(15)) drawObjects<1>(line, true);
         drawObjects<1>(line, false);
     }
@@ -188,6 +277,9 @@ void Gpu2D::drawGbaScanline(int line)
 
 void Gpu2D::drawScanline(int line)
 {
+    PROFILE_TIME(core->renderProfile.gpu2DTimes[engine]);
+    TraceTimer traceTimer(core->frameTrace, core->frameTrace.render2D[engine]);
+
     // Clear layers with the backdrop (first palette index)
     uint32_t backdrop = U8TO16(palette, 0) & ~BIT(15);
     for (int i = 0; i < 256; i++) layers[0][i] = backdrop;
@@ -198,6 +290,7 @@ void Gpu2D::drawScanline(int line)
     // Draw the objects, object window first if enabled
     if (dispCnt & BIT(12))
     {
+        binObjects();
         if (dispCnt & BIT(15)) drawObjects<0>(line, true);
         drawObjects<0>(line, false);
     }
@@ -256,11 +349,22 @@ void Gpu2D::drawScanline(int line)
             break;
     }
 
+    // Set up the weights and targets for each kind of blending, in 64ths with 18-bit colors
+    // Brightness changes are done as blends with white, or with a rounding bias that matches the hardware's decrease
     uint8_t mode = (bldCnt >> 6) & 0x3;
+    uint32_t alphaWeight = (std::min((bldAlpha >> 0) & 0x1F, 16) * 4) | ((std::min((bldAlpha >> 8) & 0x1F, 16) * 4) << 16);
+    uint32_t brightWeight = ((16 - bldY) * 4) | (((mode == 2) ? (bldY * 4) : 1) << 16);
+    uint32_t brightTarget = BIT(31) | ((mode == 2) ? 0x3FFFF : 0x3CF3C);
+    uint32_t weights[256];
 
-    // Blend the layers to form the final image
+    // Decide how each pixel should be blended, replacing the lower layer with the blend target
+    // Pixels that should be blended have bit 31 set in their target, and are blended together afterwards
     for (int i = 0; i < 256; i++)
     {
+        uint32_t below = layers[1][i];
+        layers[1][i] = 0;
+        weights[i] = 0;
+
         // Check if blending can/should be performed
         if (layers[0][i] & BIT(26)) // 3D pixel
         {
@@ -268,14 +372,10 @@ void Gpu2D::drawScanline(int line)
             {
                 // Override the default blending rules and apply special alpha blending
                 // If 3D alpha is max, skip blending; high-res 3D is transposed on these pixels
-                uint8_t eva = ((layers[0][i] >> 18) & 0x3F) + 1;
+                uint32_t eva = ((layers[0][i] >> 18) & 0x3F) + 1;
                 if (eva == 64) continue;
-                uint32_t blend = rgb5ToRgb6(layers[1][i]);
-                uint8_t evb = 64 - eva;
-                uint8_t r = std::min((((layers[0][i] >>  0) & 0x3F) * eva + ((blend >>  0) & 0x3F) * evb) / 64, 63U);
-                uint8_t g = std::min((((layers[0][i] >>  6) & 0x3F) * eva + ((blend >>  6) & 0x3F) * evb) / 64, 63U);
-                uint8_t b = std::min((((layers[0][i] >> 12) & 0x3F) * eva + ((blend >> 12) & 0x3F) * evb) / 64, 63U);
-                layers[0][i] = (b << 12) | (g << 6) | r;
+                layers[1][i] = BIT(31) | rgb5ToRgb6(below);
+                weights[i] = eva | ((64 - eva) << 16);
                 continue;
             }
             else if (mode < 2 || !(bldCnt & BIT(blendBits[0][i])))
@@ -319,44 +419,23 @@ void Gpu2D::drawScanline(int line)
             if (!(enabled & BIT(5))) continue;
         }
 
-        // Apply blending, using 18-bit colors in DS mode
-        switch (mode)
+        // Set the blend target and weights
+        if (mode == 1) // Alpha blending
         {
-            case 1: // Alpha blending
-            alpha:
-            {
-                uint32_t blend = (layers[1][i] & BIT(26)) ? layers[1][i] : rgb5ToRgb6(layers[1][i]);
-                uint8_t eva = std::min((bldAlpha >> 0) & 0x1F, 16);
-                uint8_t evb = std::min((bldAlpha >> 8) & 0x1F, 16);
-                uint8_t r = std::min((((layers[0][i] >>  0) & 0x3F) * eva + ((blend >>  0) & 0x3F) * evb) / 16, 63U);
-                uint8_t g = std::min((((layers[0][i] >>  6) & 0x3F) * eva + ((blend >>  6) & 0x3F) * evb) / 16, 63U);
-                uint8_t b = std::min((((layers[0][i] >> 12) & 0x3F) * eva + ((blend >> 12) & 0x3F) * evb) / 16, 63U);
-                layers[0][i] = (b << 12) | (g << 6) | r;
-                continue;
-            }
-
-            case 2: // Brightness increase
-                if (bldY)
-                {
-                    uint8_t r = (layers[0][i] >>  0) & 0x3F; r += (63 - r) * bldY / 16;
-                    uint8_t g = (layers[0][i] >>  6) & 0x3F; g += (63 - g) * bldY / 16;
-                    uint8_t b = (layers[0][i] >> 12) & 0x3F; b += (63 - b) * bldY / 16;
-                    layers[0][i] = (b << 12) | (g << 6) | r;
-                }
-                continue;
-
-            case 3: // Brightness decrease
-                if (bldY)
-                {
-                    uint8_t r = (layers[0][i] >>  0) & 0x3F; r -= r * bldY / 16;
-                    uint8_t g = (layers[0][i] >>  6) & 0x3F; g -= g * bldY / 16;
-                    uint8_t b = (layers[0][i] >> 12) & 0x3F; b -= b * bldY / 16;
-                    layers[0][i] = (b << 12) | (g << 6) | r;
-                }
-                continue;
+        alpha:
+            layers[1][i] = BIT(31) | ((below & BIT(26)) ? below : rgb5ToRgb6(below));
+            weights[i] = alphaWeight;
+        }
+        else if (bldY) // Brightness increase/decrease
+        {
+            layers[1][i] = brightTarget;
+            weights[i] = brightWeight;
         }
     }
 
+    // Blend the layers to form the final image
+    blendPixels(layers[0], layers[0], layers[1], weights);
+
     // Copy the final image to the framebuffer
     switch ((dispCnt >> 16) & 0x3) // Display mode
     {
@@ -378,7 +457,7 @@ void Gpu2D::drawScanline(int line)
             // Draw raw bitmap data from a VRAM block
             uint32_t address = 0x6800000 + ((dispCnt & 0x000C0000) >> 18) * 0x20000 + line * 256 * 2;
             for (int i = 0; i < 256; i++)
-                framebuffer[line * 256 + i] = rgb5ToRgb6(core->memory.read<uint16_t>(0, address + i * 2));
+                framebuffer[line * 256 + i] = rgb5ToRgb6(core->memory.readVram<uint16_t>(address + i * 2));
             break;
         }
 
@@ -390,35 +469,37 @@ void Gpu2D::drawScanline(int line)
     }
 
     // Apply master brightness (DS-only, 18-bit)
-    switch ((masterBright >> 14) & 0x3) // Mode
+    // This is done as a blend over the whole line, the same way as the layer brightness effects
+    // The layer weights were already used above, so their buffer is reused for the brightness weights
+    uint8_t factor = std::min(masterBright & 0x1F, 16);
+    uint8_t brightMode = (masterBright >> 14) & 0x3;
+    if (factor && (brightMode == 1 || brightMode == 2))
     {
-        case 1: // Increase
-            if (uint8_t factor = std::min(masterBright & 0x1F, 16))
-            {
-                for (int i = 0; i < 256; i++)
-                {
-                    uint32_t *pixel = &framebuffer[line * 256 + i];
-                    uint8_t r = (*pixel >>  0) & 0x3F; r += (63 - r) * factor / 16;
-                    uint8_t g = (*pixel >>  6) & 0x3F; g += (63 - g) * factor / 16;
-                    uint8_t b = (*pixel >> 12) & 0x3F; b += (63 - b) * factor / 16;
-                    *pixel = (b << 12) | (g << 6) | r;
-                }
-            }
-            break;
+        uint32_t targetLine[256];
+        for (int i = 0; i < 256; i++)
+        {
+            targetLine[i] = BIT(31) | ((brightMode == 1) ? 0x3FFFF : 0x3CF3C);
+            weights[i] = ((16 - factor) * 4) | (((brightMode == 1) ? (factor * 4) : 1) << 16);
+        }
+        blendPixels(&framebuffer[line * 256], &framebuffer[line * 256], targetLine, weights);
+    }
+}
 
-        case 2: // Decrease
-            if (uint8_t factor = std::min(masterBright & 0x1F, 16))
-            {
-                for (int i = 0; i < 256; i++)
-                {
-                    uint32_t *pixel = &framebuffer[line * 256 + i];
-                    uint8_t r = (*pixel >>  0) & 0x3F; r -= r * factor / 16;
-                    uint8_t g = (*pixel >>  6) & 0x3F; g -= g * factor / 16;
-                    uint8_t b = (*pixel >> 12) & 0x3F; b -= b * factor / 16;
-                    *pixel = (b << 12) | (g << 6) | r;
-                }
-            }
-            break;
+void Gpu2D::skipScanline()
+{
+    // Get the affine backgrounds that are drawn in the current BG mode, as bits for BG2 and BG3
+    // The DS and GBA have different modes, and mode 6 on the DS uses the large bitmap for BG2
+    static const uint8_t ndsAffine[8] = { 0x0, 0x2, 0x3, 0x2, 0x3, 0x3, 0x1, 0x0 };
+    static const uint8_t gbaAffine[8] = { 0x0, 0x1, 0x3, 0x1, 0x1, 0x1, 0x0, 0x0 };
+    uint8_t affine = (core->gbaMode ? gbaAffine : ndsAffine)[dispCnt & 0x7];
+
+    // Increment the internal registers of enabled affine backgrounds without drawing the scanline
+    // This keeps the state the same as if the scanline had been drawn
+    for (int i = 0; i < 2; i++)
+    {
+        if (!(affine & BIT(i)) || !(dispCnt & BIT(10 + i))) continue;
+        internalX[i] += bgPB[i];
+        internalY[i] += bgPD[i];
     }
 }
 
@@ -461,6 +542,50 @@ void Gpu2D::drawBgPixel(int bg, int line, int x, uint32_t pixel)
     }
 }
 
+template <bool gbaMode> void Gpu2D::drawBgPixels(int bg, int line, int x, uint32_t *pixels)
+{
+    // Clip the 8 pixels of a tile line to the screen
+    int start = std::max(0, -x);
+    int end = std::min(8, (gbaMode ? 240 : 256) - x);
+
+    // Fall back to drawing pixels individually if windows need to be checked
+    if (dispCnt & 0x0000E000) // Windows enabled
+    {
+        for (int i = start; i < end; i++)
+        {
+            if (pixels[i])
+                drawBgPixel(bg, line, x + i, pixels[i]);
+        }
+        return;
+    }
+
+    // Draw the visible pixels to the layers, depending on priority, with the layer values looked up once
+    int8_t priority = bgCnt[bg] & 0x3;
+    for (int i = start; i < end; i++)
+    {
+        if (!pixels[i]) continue;
+        int p = x + i;
+
+        if (priority <= priorities[0][p]) // Higher than topmost
+        {
+            // Move the topmost pixel to the second topmost, and update the topmost pixel
+            layers[1][p] = layers[0][p];
+            priorities[1][p] = priorities[0][p];
+            blendBits[1][p] = blendBits[0][p];
+            layers[0][p] = pixels[i];
+            priorities[0][p] = priority;
+            blendBits[0][p] = bg;
+        }
+        else if (priority <= priorities[1][p]) // Higher than second topmost
+        {
+            // Update the second topmost pixel
+            layers[1][p] = pixels[i];
+            priorities[1][p] = priority;
+            blendBits[1][p] = bg;
+        }
+    }
+}
+
 void Gpu2D::drawObjPixel(int line, int x, uint32_t pixel, int8_t priority)
 {
     // Skip the pixel if it's in the bounds of a window that has objects disabled
@@ -494,8 +619,8 @@ template <bool gbaMode> void Gpu2D::drawText(int bg, int line)
     if (!gbaMode && bg == 0 && (dispCnt & BIT(3)))
     {
         // In high-res 3D mode, skip every other pixel
-        uint32_t *data = core->gpu3DRenderer.getLine(line);
-        bool resShift = Settings::highRes3D;
+        uint32_t *data = core->gpu3DBackend->getLine(line);
+        bool resShift = core->gpu3DBackend->isHighRes();
 
         // Draw a scanline of 3D pixels
         for (int i = 0; i < 256; i++)
@@ -533,7 +658,7 @@ template <bool gbaMode> void Gpu2D::drawText(int bg, int line)
                 tileAddr += 0x800;
 
             // Get the current tile
-            uint16_t tile = core->memory.read<uint16_t>(gbaMode, tileAddr);
+            uint16_t tile = readVram<gbaMode, uint16_t>(tileAddr);
 
             // Get the tile's palette
             uint8_t *pal;
@@ -554,16 +679,17 @@ template <bool gbaMode> void Gpu2D::drawText(int bg, int line)
 
             // Get the palette indices for the current line of the tile, flipped vertically if enabled
             uint32_t indexAddr = indexBase + (tile & 0x3FF) * 64 + ((tile & BIT(11)) ? (7 - (yOffset & 7)) : (yOffset & 7)) * 8;
-            uint64_t indices = core->memory.read<uint32_t>(gbaMode, indexAddr) |
-                ((uint64_t)core->memory.read<uint32_t>(gbaMode, indexAddr + 4) << 32);
+            uint64_t indices = readVram<gbaMode, uint32_t>(indexAddr) |
+                ((uint64_t)readVram<gbaMode, uint32_t>(indexAddr + 4) << 32);
 
-            // Draw the current line of the tile, flipped horizontally if enabled
-            for (int x = i - (xOffset & 7) + ((tile & BIT(10)) ? 7 : 0); indices != 0; ((tile & BIT(10)) ? x-- : x++), indices >>= 8)
-            {
-                // Draw a pixel if it's visible
-                if (x >= 0 && x < (gbaMode ? 240 : 256) && (indices & 0xFF))
-                    drawBgPixel(bg, line, x, U8TO16(pal, (indices & 0xFF) * 2) | BIT(15));
-            }
+            // Decode the current line of the tile, flipped horizontally if enabled
+            if (!indices) continue;
+            uint32_t pixels[8];
+            for (int j = 0; j < 8; j++, indices >>= 8)
+                pixels[(tile & BIT(10)) ? (7 - j) : j] = (indices & 0xFF) ? (U8TO16(pal, (indices & 0xFF) * 2) | BIT(15)) : 0;
+
+            // Draw the visible part of the tile line
+            drawBgPixels<gbaMode>(bg, line, i - (xOffset & 7), pixels);
         }
     }
     else // 4-bit
@@ -579,7 +705,7 @@ template <bool gbaMode> void Gpu2D::drawText(int bg, int line)
                 tileAddr += 0x800;
 
             // Get the current tile
-            uint16_t tile = core->memory.read<uint16_t>(gbaMode, tileAddr);
+            uint16_t tile = readVram<gbaMode, uint16_t>(tileAddr);
 
             // Get the tile's palette
             // In 4-bit mode, the tile can select from multiple 16-color palettes
@@ -587,19 +713,36 @@ template <bool gbaMode> void Gpu2D::drawText(int bg, int line)
 
             // Get the palette indices for the current line of the tile, flipped vertically if enabled
             uint32_t indexAddr = indexBase + (tile & 0x3FF) * 32 + ((tile & BIT(11)) ? (7 - (yOffset & 7)) : (yOffset & 7)) * 4;
-            uint32_t indices = core->memory.read<uint32_t>(gbaMode, indexAddr);
+            uint32_t indices = readVram<gbaMode, uint32_t>(indexAddr);
 
-            // Draw the current line of the tile, flipped horizontally if enabled
-            for (int x = i - (xOffset & 7) + ((tile & BIT(10)) ? 7 : 0); indices != 0; ((tile & BIT(10)) ? x-- : x++), indices >>= 4)
-            {
-                // Draw a pixel if it's visible
-                if (x >= 0 && x < (gbaMode ? 240 : 256) && (indices & 0xF))
-                    drawBgPixel(bg, line, x, U8TO16(pal, (indices & 0xF) * 2) | BIT(15));
-            }
+            // Decode the current line of the tile, flipped horizontally if enabled
+            if (!indices) continue;
+            uint32_t pixels[8];
+            for (int j = 0; j < 8; j++, indices >>= 4)
+                pixels[(tile & BIT(10)) ? (7 - j) : j] = (indices & 0xF) ? (U8TO16(pal, (indices & 0xF) * 2) | BIT(15)) : 0;
+
+            // Draw the visible part of the tile line
+            drawBgPixels<gbaMode>(bg, line, i - (xOffset & 7), pixels);
         }
     }
 }
 
+template <bool gbaMode> uint8_t *Gpu2D::getVramRow(uint32_t address, uint32_t size)
+{
+    // Get a direct pointer to a range of VRAM, or null if it isn't contiguous in host memory
+    // The flattened DS view is contiguous within each 16KB block, and GBA VRAM is looked up through the ARM7's memory map
+    if (gbaMode) return core->memory.getMappedRange(1, address, size, false);
+    if ((address & 0x3FFF) + size > 0x4000) return nullptr;
+    return core->memory.getVramBlock(address);
+}
+
+template <bool gbaMode> void Gpu2D::drawBgLine(int bg, int line, uint32_t *pixels)
+{
+    // Draw a full line of background pixels, with 0 marking transparent ones, in blocks of 8
+    for (int i = 0; i < (gbaMode ? 240 : 256); i += 8)
+        drawBgPixels<gbaMode>(bg, line, i, &pixels[i]);
+}
+
 template <bool gbaMode> void Gpu2D::drawAffine(int bg, int line)
 {
     // Calculate the base data addresses
@@ -610,38 +753,72 @@ template <bool gbaMode> void Gpu2D::drawAffine(int bg, int line)
     int rotscaleX = internalX[bg - 2] - bgPA[bg - 2];
     int rotscaleY = internalY[bg - 2] - bgPC[bg - 2];
 
-    // Get the background size
+    // Get the background size and whether it wraps around
     int size = 128 << ((bgCnt[bg] & 0xC000) >> 14);
+    bool wrap = (bg < 2 || (bgCnt[bg] & BIT(13)));
 
-    // Draw a line
-    for (int i = 0; i < (gbaMode ? 240 : 256); i++)
-    {
-        // Increment the rotscaled coordinates and remove the fraction
-        int x = (rotscaleX += bgPA[bg - 2]) >> 8;
-        int y = (rotscaleY += bgPC[bg - 2]) >> 8;
+    // Without rotation, every pixel of the line comes from the same row of the background
+    // Look up the row of the tile map directly in that case, if it's visible and contiguous
+    int rowY = internalY[bg - 2] >> 8;
+    if (wrap) rowY &= size - 1;
+    uint8_t *map = (bgPC[bg - 2] == 0 && rowY >= 0 && rowY < size) ?
+        getVramRow<gbaMode>(tileBase + (rowY / 8) * (size / 8), size / 8) : nullptr;
 
-        // Handle display area overflow
-        if (bg < 2 || (bgCnt[bg] & BIT(13))) // Wraparound
+    if (map) // Single row
+    {
+        // Step along the row, collecting the pixels to draw in blocks
+        uint32_t pixels[256] = {};
+        uint32_t rowBase = indexBase + (rowY & 7) * 8;
+        for (int i = 0; i < (gbaMode ? 240 : 256); i++)
         {
-            x &= size - 1;
-            y &= size - 1;
+            // Increment the rotscaled X coordinate and remove the fraction
+            int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+
+            // Handle display area overflow
+            if (wrap)
+                x &= size - 1;
+            else if (x < 0 || x >= size)
+                continue;
+
+            // Read the palette index for the current pixel of the tile, and keep it if it isn't transparent
+            uint8_t index = readVram<gbaMode, uint8_t>(rowBase + map[x / 8] * 64 + (x & 7));
+            if (index)
+                pixels[i] = U8TO16(palette, index * 2) | BIT(15);
         }
-        else if (x < 0 || x >= size || y < 0 || y >= size) // Transparent
+        drawBgLine<gbaMode>(bg, line, pixels);
+    }
+    else // Rotated
+    {
+        // Draw a line
+        for (int i = 0; i < (gbaMode ? 240 : 256); i++)
         {
-            continue;
-        }
+            // Increment the rotscaled coordinates and remove the fraction
+            int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+            int y = (rotscaleY += bgPC[bg - 2]) >> 8;
+
+            // Handle display area overflow
+            if (wrap) // Wraparound
+            {
+                x &= size - 1;
+                y &= size - 1;
+            }
+            else if (x < 0 || x >= size || y < 0 || y >= size) // Transparent
+            {
+                continue;
+            }
 
-        // Read the current tile
-        uint32_t tileAddr = tileBase + (y / 8) * (size / 8) + (x / 8);
-        uint8_t tile = core->memory.read<uint8_t>(gbaMode, tileAddr);
+            // Read the current tile
+            uint32_t tileAddr = tileBase + (y / 8) * (size / 8) + (x / 8);
+            uint8_t tile = readVram<gbaMode, uint8_t>(tileAddr);
 
-        // Read the palette index for the current pixel of the tile
-        uint32_t indexAddr = indexBase + tile * 64 + (y & 7) * 8 + (x & 7);
-        uint8_t index = core->memory.read<uint8_t>(gbaMode, indexAddr);
+            // Read the palette index for the current pixel of the tile
+            uint32_t indexAddr = indexBase + tile * 64 + (y & 7) * 8 + (x & 7);
+            uint8_t index = readVram<gbaMode, uint8_t>(indexAddr);
 
-        // Draw a pixel if it isn't transparent
-        if (index)
-            drawBgPixel(bg, line, i, U8TO16(palette, index * 2) | BIT(15));
+            // Draw a pixel if it isn't transparent
+            if (index)
+                drawBgPixel(bg, line, i, U8TO16(palette, index * 2) | BIT(15));
+        }
     }
 
     // Increment the internal registers at the end of the scanline
@@ -654,6 +831,7 @@ void Gpu2D::drawExtended(int bg, int line)
     // Set the initial rotscale coordinates
     int rotscaleX = internalX[bg - 2] - bgPA[bg - 2];
     int rotscaleY = internalY[bg - 2] - bgPC[bg - 2];
+    bool wrap = (bgCnt[bg] & BIT(13));
 
     if (bgCnt[bg] & BIT(7)) // Bitmap
     {
@@ -670,7 +848,43 @@ void Gpu2D::drawExtended(int bg, int line)
             case 3: sizeX = 512; sizeY = 512; break;
         }
 
-        if (bgCnt[bg] & BIT(2)) // Direct color bitmap
+        // Without rotation, look up the row of the bitmap directly if it's visible
+        int rowY = internalY[bg - 2] >> 8;
+        if (wrap) rowY &= sizeY - 1;
+        int bytes = (bgCnt[bg] & BIT(2)) ? 2 : 1;
+        uint8_t *row = (bgPC[bg - 2] == 0 && rowY >= 0 && rowY < sizeY) ?
+            getVramRow<false>(dataBase + rowY * sizeX * bytes, sizeX * bytes) : nullptr;
+
+        if (row) // Single row
+        {
+            // Step along the row, collecting the pixels to draw in blocks
+            uint32_t pixels[256] = {};
+            for (int i = 0; i < 256; i++)
+            {
+                // Increment the rotscaled X coordinate and remove the fraction
+                int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+
+                // Handle display area overflow
+                if (wrap)
+                    x &= sizeX - 1;
+                else if (x < 0 || x >= sizeX)
+                    continue;
+
+                // Keep the pixel if it isn't transparent
+                if (bytes == 2) // Direct color bitmap
+                {
+                    uint16_t pixel = U8TO16(row, x * 2);
+                    if (pixel & BIT(15))
+                        pixels[i] = pixel;
+                }
+                else if (uint8_t index = row[x]) // 256 color bitmap
+                {
+                    pixels[i] = U8TO16(palette, index * 2) | BIT(15);
+                }
+            }
+            drawBgLine<false>(bg, line, pixels);
+        }
+        else if (bgCnt[bg] & BIT(2)) // Direct color bitmap
         {
             // Draw a line
             for (int i = 0; i < 256; i++)
@@ -680,7 +894,7 @@ void Gpu2D::drawExtended(int bg, int line)
                 int y = (rotscaleY += bgPC[bg - 2]) >> 8;
 
                 // Handle display area overflow
-                if (bgCnt[bg] & BIT(13)) // Wraparound
+                if (wrap) // Wraparound
                 {
                     x &= sizeX - 1;
                     y &= sizeY - 1;
@@ -691,7 +905,7 @@ void Gpu2D::drawExtended(int bg, int line)
                 }
 
                 // Draw a pixel if it isn't transparent
-                uint16_t pixel = core->memory.read<uint16_t>(0, dataBase + (y * sizeX + x) * 2);
+                uint16_t pixel = core->memory.readVram<uint16_t>(dataBase + (y * sizeX + x) * 2);
                 if (pixel & BIT(15))
                     drawBgPixel(bg, line, i, pixel);
             }
@@ -706,7 +920,7 @@ void Gpu2D::drawExtended(int bg, int line)
                 int y = (rotscaleY += bgPC[bg - 2]) >> 8;
 
                 // Handle display area overflow
-                if (bgCnt[bg] & BIT(13)) // Wraparound
+                if (wrap) // Wraparound
                 {
                     x &= sizeX - 1;
                     y &= sizeY - 1;
@@ -717,7 +931,7 @@ void Gpu2D::drawExtended(int bg, int line)
                 }
 
                 // Read the palette index for the current pixel
-                uint8_t index = core->memory.read<uint8_t>(0, dataBase + y * sizeX + x);
+                uint8_t index = core->memory.readVram<uint8_t>(dataBase + y * sizeX + x);
 
                 // Draw a pixel if it isn't transparent
                 if (index)
@@ -737,44 +951,88 @@ void Gpu2D::drawExtended(int bg, int line)
         // Use the standard palette by default
         uint8_t *pal = palette;
 
-        // Draw a line of the layer
-        for (int i = 0; i < 256; i++)
-        {
-            // Increment the rotscaled coordinates and remove the fraction
-            int x = (rotscaleX += bgPA[bg - 2]) >> 8;
-            int y = (rotscaleY += bgPC[bg - 2]) >> 8;
+        // Without rotation, look up the row of the tile map directly if it's visible
+        int rowY = internalY[bg - 2] >> 8;
+        if (wrap) rowY &= size - 1;
+        uint8_t *map = (bgPC[bg - 2] == 0 && rowY >= 0 && rowY < size) ?
+            getVramRow<false>(tileBase + (rowY / 8) * (size / 8) * 2, (size / 8) * 2) : nullptr;
 
-            // Handle display area overflow
-            if (bgCnt[bg] & BIT(13)) // Wraparound
+        if (map) // Single row
+        {
+            // Step along the row, collecting the pixels to draw in blocks
+            uint32_t pixels[256] = {};
+            for (int i = 0; i < 256; i++)
             {
-                x &= size - 1;
-                y &= size - 1;
+                // Increment the rotscaled X coordinate and remove the fraction
+                int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+
+                // Handle display area overflow
+                if (wrap)
+                    x &= size - 1;
+                else if (x < 0 || x >= size)
+                    continue;
+
+                // Read the current tile
+                uint16_t tile = U8TO16(map, (x / 8) * 2);
+
+                // Switch to an extended palette selected by the tile if enabled
+                if (dispCnt & BIT(30))
+                {
+                    if (!extPalettes[bg]) continue;
+                    pal = &extPalettes[bg][(tile >> 3) & 0x1E00];
+                }
+
+                // Read the palette index for the current pixel, and keep it if it isn't transparent
+                uint32_t indexAddr = indexBase + (tile & 0x3FF) * 64 + // Tile offset
+                    (((tile & BIT(11)) ? (7 - rowY) : rowY) & 7) *  8 + // Vertical offset, flipped if enabled
+                    (((tile & BIT(10)) ? (7 - x) : x) & 7);             // Horizontal offset, flipped if enabled
+                uint8_t index = core->memory.readVram<uint8_t>(indexAddr);
+                if (index)
+                    pixels[i] = U8TO16(pal, index * 2) | BIT(15);
             }
-            else if (x < 0 || x >= size || y < 0 || y >= size) // Transparent
+            drawBgLine<false>(bg, line, pixels);
+        }
+        else // Rotated
+        {
+            // Draw a line of the layer
+            for (int i = 0; i < 256; i++)
             {
-                continue;
-            }
+                // Increment the rotscaled coordinates and remove the fraction
+                int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+                int y = (rotscaleY += bgPC[bg - 2]) >> 8;
 
-            // Read the current tile
-            uint32_t tileAddr = tileBase + ((y / 8) * (size / 8) + (x / 8)) * 2;
-            uint16_t tile = core->memory.read<uint16_t>(0, tileAddr);
+                // Handle display area overflow
+                if (wrap) // Wraparound
+                {
+                    x &= size - 1;
+                    y &= size - 1;
+                }
+                else if (x < 0 || x >= size || y < 0 || y >= size) // Transparent
+                {
+                    continue;
+                }
 
-            // Switch to an extended palette selected by the tile if enabled
-            if (dispCnt & BIT(30))
-            {
-                if (!extPalettes[bg]) continue;
-                pal = &extPalettes[bg][(tile >> 3) & 0x1E00];
-            }
+                // Read the current tile
+                uint32_t tileAddr = tileBase + ((y / 8) * (size / 8) + (x / 8)) * 2;
+                uint16_t tile = core->memory.readVram<uint16_t>(tileAddr);
 
-            // Read the palette index for the current pixel
-            uint32_t indexAddr = indexBase + (tile & 0x3FF) * 64 + // Tile offset
-                (((tile & BIT(11)) ? (7 - y) : y) & 7)      *  8 + // Vertical offset, flipped if enabled
-                (((tile & BIT(10)) ? (7 - x) : x) & 7);            // Horizontal offset, flipped if enabled
-            uint8_t index = core->memory.read<uint8_t>(0, indexAddr);
+                // Switch to an extended palette selected by the tile if enabled
+                if (dispCnt & BIT(30))
+                {
+                    if (!extPalettes[bg]) continue;
+                    pal = &extPalettes[bg][(tile >> 3) & 0x1E00];
+                }
 
-            // Draw the pixel if it isn't transparent
-            if (index)
-                drawBgPixel(bg, line, i, U8TO16(pal, index * 2) | BIT(15));
+                // Read the palette index for the current pixel
+                uint32_t indexAddr = indexBase + (tile & 0x3FF) * 64 + // Tile offset
+                    (((tile & BIT(11)) ? (7 - y) : y) & 7)      *  8 + // Vertical offset, flipped if enabled
+                    (((tile & BIT(10)) ? (7 - x) : x) & 7);            // Horizontal offset, flipped if enabled
+                uint8_t index = core->memory.readVram<uint8_t>(indexAddr);
+
+                // Draw the pixel if it isn't transparent
+                if (index)
+                    drawBgPixel(bg, line, i, U8TO16(pal, index * 2) | BIT(15));
+            }
         }
     }
 
@@ -800,7 +1058,34 @@ void Gpu2D::drawExtendedGba(int bg, int line)
     int sizeX = (mode == 5) ? 160 : 240;
     int sizeY = (mode == 5) ? 128 : 160;
 
-    if (mode == 4) // 256 color bitmap
+    // Without rotation, look up the row of the bitmap directly if it's visible
+    int rowY = internalY[bg - 2] >> 8;
+    int bytes = (mode == 4) ? 1 : 2;
+    uint8_t *row = (bgPC[bg - 2] == 0 && rowY >= 0 && rowY < sizeY) ?
+        getVramRow<true>(dataBase + rowY * sizeX * bytes, sizeX * bytes) : nullptr;
+
+    if (row) // Single row
+    {
+        // Step along the row, collecting the pixels to draw in blocks
+        uint32_t pixels[256] = {};
+        for (int i = 0; i < 240; i++)
+        {
+            // Increment the rotscaled X coordinate and remove the fraction
+            int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+
+            // Don't draw anything on display area overflow
+            if (x < 0 || x >= sizeX)
+                continue;
+
+            // Keep the pixel, ignoring transparency for direct color
+            if (bytes == 2) // Direct color bitmap
+                pixels[i] = U8TO16(row, x * 2) | BIT(15);
+            else if (uint8_t index = row[x]) // 256 color bitmap
+                pixels[i] = U8TO16(palette, index * 2) | BIT(15);
+        }
+        drawBgLine<true>(bg, line, pixels);
+    }
+    else if (mode == 4) // 256 color bitmap
     {
         // Draw a line of the layer
         for (int i = 0; i < 240; i++)
@@ -850,40 +1135,73 @@ void Gpu2D::drawLarge(int bg, int line)
     // Set the initial rotscale coordinates
     int rotscaleX = internalX[bg - 2] - bgPA[bg - 2];
     int rotscaleY = internalY[bg - 2] - bgPC[bg - 2];
+    bool wrap = (bgCnt[bg] & BIT(13));
 
     // Get the bitmap size
     int sizeX = ((bgCnt[bg] >> 14) & 0x3) ? 1024 :  512;
     int sizeY = ((bgCnt[bg] >> 14) & 0x3) ?  512 : 1024;
 
-    // Draw a line of the layer
-    for (int i = 0; i < 256; i++)
-    {
-        // Increment the rotscaled coordinates and remove the fraction
-        int x = (rotscaleX += bgPA[bg - 2]) >> 8;
-        int y = (rotscaleY += bgPC[bg - 2]) >> 8;
+    // Without rotation, look up the row of the bitmap directly if it's visible
+    // A full large bitmap requires 512KB of VRAM, but engine B can only use 128KB
+    // For engine B, wrap the 128KB bitmap 4 times to cover the full area
+    int rowY = internalY[bg - 2] >> 8;
+    if (wrap) rowY &= sizeY - 1;
+    uint8_t *row = (bgPC[bg - 2] == 0 && rowY >= 0 && rowY < sizeY) ?
+        getVramRow<false>(bgVramAddr + (rowY & (engine ? (sizeY / 4 - 1) : (sizeY - 1))) * sizeX, sizeX) : nullptr;
 
-        // Handle display area overflow
-        if (bgCnt[bg] & BIT(13)) // Wraparound
+    if (row) // Single row
+    {
+        // Step along the row, collecting the pixels to draw in blocks
+        uint32_t pixels[256] = {};
+        for (int i = 0; i < 256; i++)
         {
-            x &= sizeX - 1;
-            y &= sizeY - 1;
+            // Increment the rotscaled X coordinate and remove the fraction
+            int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+
+            // Handle display area overflow
+            if (wrap)
+                x &= sizeX - 1;
+            else if (x < 0 || x >= sizeX)
+                continue;
+
+            // Keep the pixel if it isn't transparent
+            if (uint8_t index = row[x])
+                pixels[i] = U8TO16(palette, index * 2) | BIT(15);
         }
-        else if (x < 0 || x >= sizeX || y < 0 || y >= sizeY) // Transparent
+        drawBgLine<false>(bg, line, pixels);
+    }
+    else // Rotated
+    {
+        // Draw a line of the layer
+        for (int i = 0; i < 256; i++)
         {
-            continue;
-        }
+            // Increment the rotscaled coordinates and remove the fraction
+            int x = (rotscaleX += bgPA[bg - 2]) >> 8;
+            int y = (rotscaleY += bgPC[bg - 2]) >> 8;
 
-        // A full large bitmap requires 512KB of VRAM, but engine B can only use 128KB
-        // For engine B, wrap the 128KB bitmap 4 times to cover the full area
-        if (engine == 1)
-            y &= (sizeY / 4) - 1;
+            // Handle display area overflow
+            if (wrap) // Wraparound
+            {
+                x &= sizeX - 1;
+                y &= sizeY - 1;
+            }
+            else if (x < 0 || x >= sizeX || y < 0 || y >= sizeY) // Transparent
+            {
+                continue;
+            }
+
+            // A full large bitmap requires 512KB of VRAM, but engine B can only use 128KB
+            // For engine B, wrap the 128KB bitmap 4 times to cover the full area
+            if (engine == 1)
+                y &= (sizeY / 4) - 1;
 
-        // Read the palette index for the current pixel
-        uint8_t index = core->memory.read<uint8_t>(0, bgVramAddr + y * sizeX + x);
+            // Read the palette index for the current pixel
+            uint8_t index = core->memory.readVram<uint8_t>(bgVramAddr + y * sizeX + x);
 
-        // Draw a pixel if it isn't transparent
-        if (index)
-            drawBgPixel(bg, line, i, U8TO16(palette, index * 2) | BIT(15));
+            // Draw a pixel if it isn't transparent
+            if (index)
+                drawBgPixel(bg, line, i, U8TO16(palette, index * 2) | BIT(15));
+        }
     }
 
     // Increment the internal registers at the end of the scanline
@@ -891,16 +1209,56 @@ void Gpu2D::drawLarge(int bg, int line)
     internalY[bg - 2] += bgPD[bg - 2];
 }
 
-template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
+void Gpu2D::binObjects()
 {
-    // Loop through and draw the 128 sprites in OAM
+    // Keep the per-scanline object lists as long as OAM hasn't changed since they were built
+    // OAM is written directly through the memory maps, so changes are caught by comparing against a copy
+    if (!objDirty && !memcmp(objOam, oam, sizeof(objOam))) return;
+    memcpy(objOam, oam, sizeof(objOam));
+    memset(objCounts, 0, sizeof(objCounts));
+    objDirty = false;
+
+    // Heights of the objects for each shape and size, with 0 for invalid dimensions
+    static const uint8_t heights[16] = { 8, 16, 32, 64, 8, 8, 16, 32, 16, 32, 32, 64, 0, 0, 0, 0 };
+
+    // Add each enabled object to the lists of the scanlines it can appear on, in OAM order
     for (int i = 0; i < 128; i++)
     {
+        uint16_t attrib0 = U8TO16(oam, i * 8 + 0);
+        uint16_t attrib1 = U8TO16(oam, i * 8 + 2);
+        if ((attrib0 & 0x0300) == 0x0200) continue;
+
+        // Get the height of the object, doubled for rotscale objects with the double size bit set
+        int height = heights[((attrib0 >> 12) & 0xC) | ((attrib1 >> 14) & 0x3)];
+        if (!height)
+        {
+            LOG("Unknown object dimensions: shape=%d, size=%d\n", (attrib0 >> 14) & 0x3, (attrib1 >> 14) & 0x3);
+            continue;
+        }
+        if ((attrib0 & 0x0300) == 0x0300) height *= 2;
+
+        // Get the Y coordinate and wrap it around if it exceeds the screen bounds
+        // Vertical mosaic can show an object up to 15 lines past its bottom, so those lines are included too
+        int y = attrib0 & 0xFF;
+        if (y >= 192) y -= 256;
+        int end = std::min(y + height + ((attrib0 & BIT(12)) ? 15 : 0), 192);
+
+        for (int j = std::max(y, 0); j < end; j++)
+            objLists[j][objCounts[j]++] = i;
+    }
+}
+
+template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
+{
+    // Loop through and draw the sprites that can appear on the current scanline
+    for (int k = 0; k < objCounts[line]; k++)
+    {
+        int i = objLists[line][k];
         uint8_t byte = oam[i * 8 + 1];
         uint8_t type = (byte >> 2) & 0x3;
 
-        // Skip objects that are disabled or are/aren't window type
-        if ((byte & 0x3) == 2 || (type == 2) != window)
+        // Skip objects that are/aren't window type
+        if ((type == 2) != window)
             continue;
 
         // Get the current object
@@ -927,11 +1285,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
             case 0x8: width =  8; height = 16; break; // Vertical, 0
             case 0x9: width =  8; height = 32; break; // Vertical, 1
             case 0xA: width = 16; height = 32; break; // Vertical, 2
-            case 0xB: width = 32; height = 64; break; // Vertical, 3
-
-            default:
-                LOG("Unknown object dimensions: shape=%d, size=%d\n", (object[0] >> 14) & 0x3, (object[1] >> 14) & 0x3);
-                continue;
+            default:  width = 32; height = 64; break; // Vertical, 3
         }
 
         // Double the object bounds for rotscale objects with the double size bit set
@@ -1003,7 +1357,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
                     if (rotscaleY < 0 || rotscaleY >= height) continue;
 
                     // Draw a pixel
-                    uint16_t pixel = core->memory.read<uint16_t>(0, dataBase + (rotscaleY * bitmapWidth + rotscaleX) * 2);
+                    uint16_t pixel = core->memory.readVram<uint16_t>(dataBase + (rotscaleY * bitmapWidth + rotscaleX) * 2);
                     if (pixel & BIT(15))
                         drawObjPixel(line, offset, pixel, priority);
                 }
@@ -1021,7 +1375,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
                     if (offset < 0 || offset >= (gbaMode ? 240 : 256)) continue;
 
                     // Draw a pixel
-                    uint16_t pixel = core->memory.read<uint16_t>(0, dataBase + j * 2);
+                    uint16_t pixel = core->memory.readVram<uint16_t>(dataBase + j * 2);
                     if (pixel & BIT(15))
                         drawObjPixel(line, offset, pixel, priority);
                 }
@@ -1086,7 +1440,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
                     if (rotscaleY < 0 || rotscaleY >= height) continue;
 
                     // Get the palette index for the current pixel
-                    uint8_t index = core->memory.read<uint8_t>(gbaMode, tileBase +
+                    uint8_t index = readVram<gbaMode, uint8_t>(tileBase +
                         ((rotscaleY / 8) * mapWidth + rotscaleY % 8) * 8 + (rotscaleX / 8) * 64 + rotscaleX % 8);
 
                     if (index && type == 2) // Object window
@@ -1130,7 +1484,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
                     if (rotscaleY < 0 || rotscaleY >= height) continue;
 
                     // Get the palette index for the current pixel
-                    uint8_t index = core->memory.read<uint8_t>(gbaMode, tileBase +
+                    uint8_t index = readVram<gbaMode, uint8_t>(tileBase +
                         ((rotscaleY / 8) * mapWidth + rotscaleY % 8) * 4 + (rotscaleX / 8) * 32 + (rotscaleX % 8) / 2);
                     index = (rotscaleX & 1) ? ((index & 0xF0) >> 4) : (index & 0x0F);
 
@@ -1183,7 +1537,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
                 if (offset < 0 || offset >= (gbaMode ? 240 : 256)) continue;
 
                 // Get the palette index for the current pixel
-                uint8_t index = core->memory.read<uint8_t>(gbaMode, tileBase + (j / 8) * 64 + j % 8);
+                uint8_t index = readVram<gbaMode, uint8_t>(tileBase + (j / 8) * 64 + j % 8);
 
                 if (index && type == 2) // Object window
                 {
@@ -1224,7 +1578,7 @@ template <bool gbaMode> void Gpu2D::drawObjects(int line, bool window)
                 if (offset < 0 || offset >= (gbaMode ? 240 : 256)) continue;
 
                 // Get the palette index for the current pixel
-                uint8_t index = core->memory.read<uint8_t>(gbaMode, tileBase + (j / 8) * 32 + (j % 8) / 2);
+                uint8_t index = readVram<gbaMode, uint8_t>(tileBase + (j / 8) * 32 + (j % 8) / 2);
                 index = (j & 1) ? ((index & 0xF0) >> 4) : (index & 0x0F);
 
                 if (index && type == 2) // Object window
@@ -1397,3 +1751,35 @@ void Gpu2D::writeMasterBright(uint16_t mask, uint16_t value)
     mask &= 0xC01F;
     masterBright = (masterBright & ~mask) | (value & mask);
 }
+
+void Gpu2D::syncState(SaveState &state)
+{
+    // Sync the internal affine and window state
+    state.sync(internalX);
+    state.sync(internalY);
+    state.sync(winHFlip);
+    state.sync(winVFlip);
+
+    // Sync the 2D registers
+    state.sync(dispCnt);
+    state.sync(bgCnt);
+    state.sync(bgHOfs);
+    state.sync(bgVOfs);
+    state.sync(bgPA);
+    state.sync(bgPB);
+    state.sync(bgPC);
+    state.sync(bgPD);
+    state.sync(bgX);
+    state.sync(bgY);
+    state.sync(winX1);
+    state.sync(winX2);
+    state.sync(winY1);
+    state.sync(winY2);
+    state.sync(winIn);
+    state.sync(winOut);
+    state.sync(bldCnt);
+    state.sync(mosaic);
+    state.sync(bldAlpha);
+    state.sync(bldY);
+    state.sync(masterBright);
+}
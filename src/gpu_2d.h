@@ -23,15 +23,19 @@
 #include <cstdint>
 
 class Core;
+class SaveState;
 
 class Gpu2D
 {
     public:
         Gpu2D(Core *core, bool engine);
 
+        void syncState(SaveState &state);
+
         void reloadRegisters();
         void drawGbaScanline(int line);
         void drawScanline(int line);
+        void skipScanline();
 
         uint32_t *getFramebuffer() { return framebuffer; }
         uint32_t *getRawLine()     { return layers[0];   }
@@ -77,6 +81,11 @@ class Gpu2D
         int8_t priorities[2][256] = {};
         int8_t blendBits[2][256] = {};
 
+        uint8_t objLists[192][128] = {};
+        uint8_t objCounts[192] = {};
+        uint8_t objOam[0x400] = {};
+        bool objDirty = true;
+
         int internalX[2] = {};
         int internalY[2] = {};
         bool winHFlip[2] = {};
@@ -105,15 +114,22 @@ class Gpu2D
         uint16_t masterBright = 0;
 
         static uint32_t rgb5ToRgb6(uint32_t color);
+        static void blendPixels(uint32_t *dst, uint32_t *src, uint32_t *targets, uint32_t *weights);
+
+        template <bool gbaMode, typename T> T readVram(uint32_t address);
+        template <bool gbaMode> uint8_t *getVramRow(uint32_t address, uint32_t size);
 
         void drawBgPixel(int bg, int line, int x, uint32_t pixel);
+        template <bool gbaMode> void drawBgPixels(int bg, int line, int x, uint32_t *pixels);
         void drawObjPixel(int line, int x, uint32_t pixel, int8_t priority);
+        template <bool gbaMode> void drawBgLine(int bg, int line, uint32_t *pixels);
 
         template <bool gbaMode> void drawText(int bg, int line);
         template <bool gbaMode> void drawAffine(int bg, int line);
         void drawExtended(int bg, int line);
         void drawExtendedGba(int bg, int line);
         void drawLarge(int bg, int line);
+        void binObjects();
         template <bool gbaMode> void drawObjects(int line, bool window);
 };
 
@@ -17,11 +17,55 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstring>
 
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "gpu_3d.h"
 #include "core.h"
 #include "settings.h"
+#include "thread_config.h"
+
+static FORCE_INLINE void multiplyRow(int32_t *out, const int32_t *in, const int32_t *mtx)
+{
+    // Multiply a row of 4 fixed-point values with a matrix, summing 64-bit products and keeping the low 32 bits after the shift
+#if defined(__SSE4_1__)
+    // Multiply even and odd lanes separately into signed 64-bit products, and then blend bits 12-43 of each sum back together
+    // SSE2 alone is left to the scalar path, since emulating signed 64-bit products there is slower than plain multiplies
+    __m128i even = _mm_setzero_si128(), odd = _mm_setzero_si128();
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i a = _mm_set1_epi32(in[i]);
+        __m128i b = _mm_loadu_si128((__m128i*)&mtx[i * 4]);
+        even = _mm_add_epi64(even, _mm_mul_epi32(a, b));
+        odd = _mm_add_epi64(odd, _mm_mul_epi32(a, _mm_srli_epi64(b, 32)));
+    }
+    _mm_storeu_si128((__m128i*)out, _mm_blend_epi16(_mm_srli_epi64(even, 12), _mm_slli_epi64(odd, 20), 0xCC));
+#elif defined(__ARM_NEON)
+    // Accumulate signed 64-bit products in two halves, and narrow them back down with the shift
+    int32x4_t b = vld1q_s32(&mtx[0]);
+    int64x2_t low = vmull_n_s32(vget_low_s32(b), in[0]);
+    int64x2_t high = vmull_n_s32(vget_high_s32(b), in[0]);
+    for (int i = 1; i < 4; i++)
+    {
+        b = vld1q_s32(&mtx[i * 4]);
+        low = vmlal_n_s32(low, vget_low_s32(b), in[i]);
+        high = vmlal_n_s32(high, vget_high_s32(b), in[i]);
+    }
+    vst1q_s32(out, vcombine_s32(vshrn_n_s64(low, 12), vshrn_n_s64(high, 12)));
+#else
+    for (int x = 0; x < 4; x++)
+    {
+        out[x] = ((int64_t)in[0] * mtx[0 + x] + (int64_t)in[1] * mtx[4  + x] +
+                  (int64_t)in[2] * mtx[8 + x] + (int64_t)in[3] * mtx[12 + x]) >> 12;
+    }
+#endif
+}
 
 Matrix Matrix::operator*(Matrix &mtx)
 {
@@ -29,13 +73,7 @@ Matrix Matrix::operator*(Matrix &mtx)
 
     // Multiply 2 matrices
     for (int y = 0; y < 4; y++)
-    {
-        for (int x = 0; x < 4; x++)
-        {
-            result.data[y * 4 + x] = ((int64_t)data[y * 4 + 0] * mtx.data[0 + x] + (int64_t)data[y * 4 + 1] * mtx.data[4  + x] +
-                                      (int64_t)data[y * 4 + 2] * mtx.data[8 + x] + (int64_t)data[y * 4 + 3] * mtx.data[12 + x]) >> 12;
-        }
-    }
+        multiplyRow(&result.data[y * 4], &data[y * 4], mtx.data);
 
     return result;
 }
@@ -50,10 +88,12 @@ Vector Vector::operator*(Matrix &mtx)
 {
     Vector result;
 
-    // Multiply a vector with a matrix
-    result.x = ((int64_t)x * mtx.data[0] + (int64_t)y * mtx.data[4] + (int64_t)z * mtx.data[8])  >> 12;
-    result.y = ((int64_t)x * mtx.data[1] + (int64_t)y * mtx.data[5] + (int64_t)z * mtx.data[9])  >> 12;
-    result.z = ((int64_t)x * mtx.data[2] + (int64_t)y * mtx.data[6] + (int64_t)z * mtx.data[10]) >> 12;
+    // Multiply a vector with a matrix, leaving out the W row
+    int32_t in[4] = { x, y, z, 0 }, out[4];
+    multiplyRow(out, in, mtx.data);
+    result.x = out[0];
+    result.y = out[1];
+    result.z = out[2];
 
     return result;
 }
@@ -63,10 +103,12 @@ Vertex Vertex::operator*(Matrix &mtx)
     Vertex result = *this;
 
     // Multiply a vertex with a matrix
-    result.x = ((int64_t)x * mtx.data[0] + (int64_t)y * mtx.data[4] + (int64_t)z * mtx.data[8]  + (int64_t)w * mtx.data[12]) >> 12;
-    result.y = ((int64_t)x * mtx.data[1] + (int64_t)y * mtx.data[5] + (int64_t)z * mtx.data[9]  + (int64_t)w * mtx.data[13]) >> 12;
-    result.z = ((int64_t)x * mtx.data[2] + (int64_t)y * mtx.data[6] + (int64_t)z * mtx.data[10] + (int64_t)w * mtx.data[14]) >> 12;
-    result.w = ((int64_t)x * mtx.data[3] + (int64_t)y * mtx.data[7] + (int64_t)z * mtx.data[11] + (int64_t)w * mtx.data[15]) >> 12;
+    int32_t in[4] = { x, y, z, w }, out[4];
+    multiplyRow(out, in, mtx.data);
+    result.x = out[0];
+    result.y = out[1];
+    result.z = out[2];
+    result.w = out[3];
 
     return result;
 }
@@ -83,6 +125,25 @@ const uint8_t Gpu3D::paramCounts[] =
     3,  2,  1,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 0x70-0x7F
 };
 
+Gpu3D::Gpu3D(Core *core): core(core)
+{
+    // Start with an empty geometry thread queue
+    running.store(false);
+    sleeping.store(false);
+    queueHead.store(0);
+    queueTail.store(0);
+}
+
+Gpu3D::~Gpu3D()
+{
+    // Clean up the geometry thread and free the vertex and polygon buffers
+    stopThread();
+    delete[] vertices1;
+    delete[] vertices2;
+    delete[] polygons1;
+    delete[] polygons2;
+}
+
 uint32_t Gpu3D::rgb5ToRgb6(uint16_t color)
 {
     // Convert an RGB5 value to an RGB6 value (the way the 3D engine does it)
@@ -122,13 +183,45 @@ bool Gpu3D::clipPolygon(Vertex *unclipped, Vertex *clipped, int *size)
 {
     bool clip = false;
 
-    // Start with the original unclipped vertices
+    // Check which sides of the view volume each of the original vertices is outside of
+    // Bits 0-5 match the order of the sides being clipped against
+    uint8_t inside = 0x3F, outside = 0;
+    for (int j = 0; j < *size; j++)
+    {
+        Vertex *v = &unclipped[j];
+        uint8_t code = ((v->x < -v->w) << 0) | ((-v->x < -v->w) << 1) | ((v->y < -v->w) << 2) |
+            ((-v->y < -v->w) << 3) | ((v->z < -v->w) << 4) | ((-v->z < -v->w) << 5);
+        inside &= code;
+        outside |= code;
+    }
+
+    // Accept polygons that are entirely within the view volume without clipping
+    if (!outside) return false;
+
+    // Vertices are copied for clipping once a side actually changes the polygon
     Vertex vertices[10];
-    memcpy(vertices, unclipped, *size * sizeof(Vertex));
+    bool original = true;
 
     // Clip a polygon using the Sutherland-Hodgman algorithm
     for (int i = 0; i < 6; i++)
     {
+        if (original)
+        {
+            // Skip sides that no original vertex is outside of, since they would leave the polygon as is
+            if (!(outside & BIT(i))) continue;
+
+            // Reject the polygon if all of the original vertices are outside of the side
+            if (inside & BIT(i))
+            {
+                *size = 0;
+                return clip;
+            }
+
+            // Start with the original unclipped vertices
+            memcpy(vertices, unclipped, *size * sizeof(Vertex));
+            original = false;
+        }
+
         int oldSize = *size;
         *size = 0;
 
@@ -176,74 +269,93 @@ bool Gpu3D::clipPolygon(Vertex *unclipped, Vertex *clipped, int *size)
 }
 
 void Gpu3D::runCommand()
+{
+    // Skip the event if stalled writes already ran commands up to a halt
+    if (state == GX_HALTED) return;
+
+    // Execute the next geometry command, along with any that follow while slices are enabled
+    // Commands take 2 cycles each, and a batch stops at the slice length or before any other scheduled event
+    uint32_t cycles = 0;
+    do
+    {
+        executeCommand();
+        cycles += 2;
+    }
+    while (state != GX_HALTED && commandReady() && cycles < (uint32_t)Settings::cpuSlice &&
+        core->events[0].cycles - core->globalCycles > cycles);
+
+    // Keep executing commands as long as they're ready
+    if (state != GX_HALTED)
+    {
+        if (commandReady())
+            core->schedule(GPU3D_COMMAND, cycles);
+        else
+            state = GX_IDLE;
+    }
+}
+
+void Gpu3D::executeCommand()
 {
     // Fetch the next geometry command
     Entry entry = fifo.front();
     int count = paramCounts[entry.command];
-    std::vector<uint32_t> params;
+    uint32_t params[32];
 
     // If the command has multiple parameters, fetch them all
     if (count > 1)
     {
-        params.reserve(count);
         for (int i = 0; i < count; i++)
         {
-            params.push_back(fifo.front().param);
+            params[i] = fifo.front().param;
             fifo.pop();
         }
     }
     else
     {
         count = 1;
+        params[0] = entry.param;
         fifo.pop();
     }
 
-    // Execute the geometry command
+    // Run the command on the geometry thread if enabled, or right away otherwise
+    if (Settings::threadedGeometry)
+    {
+        if (!thread) startThread();
+        queueCommand(entry.command, params, count);
+    }
+    else
+    {
+        if (thread) stopThread();
+        runHandler(entry.command, params);
+    }
+
+    // Handle the parts of commands that affect timing here, whether or not they've actually run yet
     switch (entry.command)
     {
-        case 0x10: mtxModeCmd(entry.param);       break; // MTX_MODE
-        case 0x11: mtxPushCmd();                  break; // MTX_PUSH
-        case 0x12: mtxPopCmd(entry.param);        break; // MTX_POP
-        case 0x13: mtxStoreCmd(entry.param);      break; // MTX_STORE
-        case 0x14: mtxRestoreCmd(entry.param);    break; // MTX_RESTORE
-        case 0x15: mtxIdentityCmd();              break; // MTX_IDENTITY
-        case 0x16: mtxLoad44Cmd(params);          break; // MTX_LOAD_4x4
-        case 0x17: mtxLoad43Cmd(params);          break; // MTX_LOAD_4x3
-        case 0x18: mtxMult44Cmd(params);          break; // MTX_MULT_4x4
-        case 0x19: mtxMult43Cmd(params);          break; // MTX_MULT_4x3
-        case 0x1A: mtxMult33Cmd(params);          break; // MTX_MULT_3x3
-        case 0x1B: mtxScaleCmd(params);           break; // MTX_SCALE
-        case 0x1C: mtxTransCmd(params);           break; // MTX_TRANS
-        case 0x20: colorCmd(entry.param);         break; // COLOR
-        case 0x21: normalCmd(entry.param);        break; // NORMAL
-        case 0x22: texCoordCmd(entry.param);      break; // TEXCOORD
-        case 0x23: vtx16Cmd(params);              break; // VTX_16
-        case 0x24: vtx10Cmd(entry.param);         break; // VTX_10
-        case 0x25: vtxXYCmd(entry.param);         break; // VTX_XY
-        case 0x26: vtxXZCmd(entry.param);         break; // VTX_XZ
-        case 0x27: vtxYZCmd(entry.param);         break; // VTX_YZ
-        case 0x28: vtxDiffCmd(entry.param);       break; // VTX_DIFF
-        case 0x29: polygonAttrCmd(entry.param);   break; // POLYGON_ATTR
-        case 0x2A: texImageParamCmd(entry.param); break; // TEXIMAGE_PARAM
-        case 0x2B: plttBaseCmd(entry.param);      break; // PLTT_BASE
-        case 0x30: difAmbCmd(entry.param);        break; // DIF_AMB
-        case 0x31: speEmiCmd(entry.param);        break; // SPE_EMI
-        case 0x32: lightVectorCmd(entry.param);   break; // LIGHT_VECTOR
-        case 0x33: lightColorCmd(entry.param);    break; // LIGHT_COLOR
-        case 0x34: shininessCmd(params);          break; // SHININESS
-        case 0x40: beginVtxsCmd(entry.param);     break; // BEGIN_VTXS
-        case 0x41:                                break; // END_VTXS
-        case 0x50: swapBuffersCmd(entry.param);   break; // SWAP_BUFFERS
-        case 0x60: viewportCmd(entry.param);      break; // VIEWPORT
-        case 0x70: boxTestCmd(params);            break; // BOX_TEST
-        case 0x71: posTestCmd(params);            break; // POS_TEST
-        case 0x72: vecTestCmd(entry.param);       break; // VEC_TEST
+        case 0x11: case 0x12: // MTX_PUSH, MTX_POP
+            // Clear the busy bit if no more matrix commands are queued
+            if (--matrixQueue == 0)
+                gxStat &= ~BIT(14);
+            commandStatDirty = true;
+            break;
 
-        default:
-        {
-            LOG("Unknown GXFIFO command: 0x%X\n", entry.command);
+        case 0x13: case 0x14: // MTX_STORE, MTX_RESTORE
+            // Mark the stack bits as possibly changed
+            commandStatDirty = true;
+            break;
+
+        case 0x50: // SWAP_BUFFERS
+            // Halt the geometry engine
+            // The buffers will be swapped and the engine unhalted on next V-blank
+            state = GX_HALTED;
+            break;
+
+        case 0x70: case 0x71: case 0x72: // BOX_TEST, POS_TEST, VEC_TEST
+            // Clear the busy bit if no more test commands are queued
+            if ((testQueue -= count) == 0)
+                gxStat &= ~BIT(0);
+            commandStatDirty |= (entry.command == 0x70);
             break;
-        }
     }
 
     // On hardware, FIFO entries are moved into a pipe before being executed
@@ -275,14 +387,56 @@ void Gpu3D::runCommand()
     // Unhalt the CPU if the FIFO was full but now has space free
     if (fifo.size() - pipeSize <= 256)
         core->interpreter[0].unhalt(1);
+}
 
-    // Keep executing commands as long as they're ready
-    if (state != GX_HALTED)
+void Gpu3D::runHandler(uint8_t command, uint32_t *params)
+{
+    // Execute the geometry command
+    switch (command)
     {
-        if (!fifo.empty() && fifo.size() >= paramCounts[fifo.front().command])
-            core->schedule(GPU3D_COMMAND, 2);
-        else
-            state = GX_IDLE;
+        case 0x10: mtxModeCmd(params[0]);       break; // MTX_MODE
+        case 0x11: mtxPushCmd();                break; // MTX_PUSH
+        case 0x12: mtxPopCmd(params[0]);        break; // MTX_POP
+        case 0x13: mtxStoreCmd(params[0]);      break; // MTX_STORE
+        case 0x14: mtxRestoreCmd(params[0]);    break; // MTX_RESTORE
+        case 0x15: mtxIdentityCmd();            break; // MTX_IDENTITY
+        case 0x16: mtxLoad44Cmd(params);        break; // MTX_LOAD_4x4
+        case 0x17: mtxLoad43Cmd(params);        break; // MTX_LOAD_4x3
+        case 0x18: mtxMult44Cmd(params);        break; // MTX_MULT_4x4
+        case 0x19: mtxMult43Cmd(params);        break; // MTX_MULT_4x3
+        case 0x1A: mtxMult33Cmd(params);        break; // MTX_MULT_3x3
+        case 0x1B: mtxScaleCmd(params);         break; // MTX_SCALE
+        case 0x1C: mtxTransCmd(params);         break; // MTX_TRANS
+        case 0x20: colorCmd(params[0]);         break; // COLOR
+        case 0x21: normalCmd(params[0]);        break; // NORMAL
+        case 0x22: texCoordCmd(params[0]);      break; // TEXCOORD
+        case 0x23: vtx16Cmd(params);            break; // VTX_16
+        case 0x24: vtx10Cmd(params[0]);         break; // VTX_10
+        case 0x25: vtxXYCmd(params[0]);         break; // VTX_XY
+        case 0x26: vtxXZCmd(params[0]);         break; // VTX_XZ
+        case 0x27: vtxYZCmd(params[0]);         break; // VTX_YZ
+        case 0x28: vtxDiffCmd(params[0]);       break; // VTX_DIFF
+        case 0x29: polygonAttrCmd(params[0]);   break; // POLYGON_ATTR
+        case 0x2A: texImageParamCmd(params[0]); break; // TEXIMAGE_PARAM
+        case 0x2B: plttBaseCmd(params[0]);      break; // PLTT_BASE
+        case 0x30: difAmbCmd(params[0]);        break; // DIF_AMB
+        case 0x31: speEmiCmd(params[0]);        break; // SPE_EMI
+        case 0x32: lightVectorCmd(params[0]);   break; // LIGHT_VECTOR
+        case 0x33: lightColorCmd(params[0]);    break; // LIGHT_COLOR
+        case 0x34: shininessCmd(params);        break; // SHININESS
+        case 0x40: beginVtxsCmd(params[0]);     break; // BEGIN_VTXS
+        case 0x41:                              break; // END_VTXS
+        case 0x50: swapBuffersCmd(params[0]);   break; // SWAP_BUFFERS
+        case 0x60: viewportCmd(params[0]);      break; // VIEWPORT
+        case 0x70: boxTestCmd(params);          break; // BOX_TEST
+        case 0x71: posTestCmd(params);          break; // POS_TEST
+        case 0x72: vecTestCmd(params[0]);       break; // VEC_TEST
+
+        default:
+        {
+            LOG("Unknown GXFIFO command: 0x%X\n", command);
+            break;
+        }
     }
 }
 
@@ -317,6 +471,9 @@ void Gpu3D::processVertices()
 
 void Gpu3D::swapBuffers()
 {
+    // Make sure the geometry thread has finished the frame
+    finishCommands();
+
     // Process final vertices and reset the count
     processVertices();
     processCount = 0;
@@ -346,6 +503,11 @@ void Gpu3D::swapBuffers()
         }
     }
 
+    // Hash the finished frame, so geometry that matches the last frame doesn't have to be drawn again
+    uint64_t hash = hashFrame();
+    bool changed = (hash != frameHash);
+    frameHash = hash;
+
     // Swap the vertex buffers
     SWAP(verticesOut, verticesIn);
     vertexCountOut = vertexCountIn;
@@ -357,11 +519,12 @@ void Gpu3D::swapBuffers()
     polygonCountOut = polygonCountIn;
     polygonCountIn = 0;
 
-    // Invalidate the 3D so a new frame is drawn
-    core->gpu.invalidate3D();
+    // Invalidate the 3D so a new frame is drawn, unless the last one will look the same
+    // Texture and renderer register changes invalidate the 3D on their own, so only the geometry needs checking
+    if (changed) core->gpu.invalidate3D();
 
     // Unhalt the GXFIFO, and start executing commands if one is ready
-    if (!fifo.empty() && fifo.size() >= paramCounts[fifo.front().command])
+    if (commandReady())
     {
         core->schedule(GPU3D_COMMAND, 2);
         state = GX_RUNNING;
@@ -372,9 +535,61 @@ void Gpu3D::swapBuffers()
     }
 }
 
+uint64_t Gpu3D::hashFrame()
+{
+    // Hash the incoming vertices and polygons with FNV-1a, field by field to skip struct padding
+    // The resolution is included so the frame is redrawn if it changes
+    uint64_t hash = 0xCBF29CE484222325;
+    auto mix = [&hash](uint32_t value) { hash = (hash ^ value) * 0x100000001B3; };
+    mix(Settings::highRes3D);
+    mix(vertexCountIn);
+    mix(polygonCountIn);
+
+    for (int i = 0; i < vertexCountIn; i++)
+    {
+        Vertex *v = &verticesIn[i];
+        mix(v->x);
+        mix(v->y);
+        mix(v->z);
+        mix(v->w);
+        mix((uint16_t)v->s | ((uint16_t)v->t << 16));
+        mix(v->color);
+    }
+
+    for (int i = 0; i < polygonCountIn; i++)
+    {
+        // Polygons point into the vertex buffer, which alternates between frames, so hash the offset instead
+        _Polygon *p = &polygonsIn[i];
+        mix(p->size | (p->vertices - verticesIn) << 8);
+        mix(p->crossed | p->clockwise << 1 | p->transNewDepth << 2 | p->depthTestEqual << 3 | p->fog << 4 |
+            p->repeatS << 5 | p->repeatT << 6 | p->flipS << 7 | p->flipT << 8 | p->transparent0 << 9 |
+            p->wBuffer << 10 | p->mode << 11 | p->textureFmt << 14 | p->alpha << 17 | p->id << 24);
+        mix(p->textureAddr);
+        mix(p->paletteAddr);
+        mix(p->sizeS | p->sizeT << 12 | (p->wShift & 0xFF) << 24);
+    }
+
+    return hash;
+}
+
+void Gpu3D::allocateBuffers()
+{
+    // Allocate the vertex and polygon buffers if they haven't been yet
+    if (vertices1) return;
+    vertices1 = new Vertex[6144];
+    vertices2 = new Vertex[6144];
+    polygons1 = new _Polygon[2048];
+    polygons2 = new _Polygon[2048];
+    verticesIn = vertices1;
+    verticesOut = vertices2;
+    polygonsIn = polygons1;
+    polygonsOut = polygons2;
+}
+
 void Gpu3D::addVertex()
 {
     if (vertexCountIn >= 6144) return;
+    if (!verticesIn) allocateBuffers();
 
     // Set the new vertex
     verticesIn[vertexCountIn] = savedVertex;
@@ -624,16 +839,16 @@ void Gpu3D::mtxPushCmd()
     {
         case 0: // Projection stack
         {
-            if (!(gxStat & BIT(13)))
+            if (!(commandStat & BIT(13)))
             {
                 // Push to the single projection stack slot and increment the pointer
                 projectionStack = projection;
-                gxStat |= BIT(13);
+                commandStat |= BIT(13);
             }
             else
             {
                 // Indicate a matrix stack overflow error
-                gxStat |= BIT(15);
+                commandStat |= BIT(15);
             }
             break;
         }
@@ -641,19 +856,19 @@ void Gpu3D::mtxPushCmd()
         case 1: case 2: // Coordinate and directional stacks
         {
             // Get the stack pointer to push to
-            uint8_t pointer = (gxStat >> 8) & 0x1F;
+            uint8_t pointer = (commandStat >> 8) & 0x1F;
 
             // Indicate a matrix stack overflow error
             // Even though the 31st slot exists, it still causes an overflow error
             if (pointer >= 30)
-                gxStat |= BIT(15);
+                commandStat |= BIT(15);
 
             // Push to the current coordinate and directional stack slots and increment the pointer
             if (pointer < 31)
             {
                 coordinateStack[pointer] = coordinate;
                 directionStack[pointer] = direction;
-                gxStat += BIT(8);
+                commandStat += BIT(8);
             }
             break;
         }
@@ -665,10 +880,6 @@ void Gpu3D::mtxPushCmd()
             break;
         }
     }
-
-    // Clear the busy bit if no more matrix commands are queued
-    if (--matrixQueue == 0)
-        gxStat &= ~BIT(14);
 }
 
 void Gpu3D::mtxPopCmd(uint32_t param)
@@ -678,17 +889,17 @@ void Gpu3D::mtxPopCmd(uint32_t param)
     {
         case 0: // Projection stack
         {
-            if (gxStat & BIT(13))
+            if (commandStat & BIT(13))
             {
                 // Pop from the single projection stack slot and decrement the pointer
-                gxStat &= ~BIT(13);
+                commandStat &= ~BIT(13);
                 projection = projectionStack;
                 clipDirty = true;
             }
             else
             {
                 // Indicate a matrix stack underflow error
-                gxStat |= BIT(15);
+                commandStat |= BIT(15);
             }
             break;
         }
@@ -696,17 +907,17 @@ void Gpu3D::mtxPopCmd(uint32_t param)
         case 1: case 2: // Coordinate and directional stacks
         {
             // Get the stack pointer to pop from
-            uint8_t pointer = ((gxStat >> 8) & 0x1F) - ((int8_t)(param << 2) >> 2);
+            uint8_t pointer = ((commandStat >> 8) & 0x1F) - ((int8_t)(param << 2) >> 2);
 
             // Indicate a matrix stack underflow or overflow error
             // Even though the 31st slot exists, it still causes an overflow error
             if (pointer >= 30)
-                gxStat |= BIT(15);
+                commandStat |= BIT(15);
 
             // Pop from the current coordinate and directional stack slots and update the pointer
             if (pointer < 31)
             {
-                gxStat = (gxStat & ~0x1F00) | (pointer << 8);
+                commandStat = (commandStat & ~0x1F00) | (pointer << 8);
                 coordinate = coordinateStack[pointer];
                 direction = directionStack[pointer];
                 clipDirty = true;
@@ -721,10 +932,6 @@ void Gpu3D::mtxPopCmd(uint32_t param)
             break;
         }
     }
-
-    // Clear the busy bit if no more matrix commands are queued
-    if (--matrixQueue == 0)
-        gxStat &= ~BIT(14);
 }
 
 void Gpu3D::mtxStoreCmd(uint32_t param)
@@ -746,7 +953,7 @@ void Gpu3D::mtxStoreCmd(uint32_t param)
 
             // Indicate a matrix stack overflow error
             // Even though the 31st slot exists, it still causes an overflow error
-            if (address == 31) gxStat |= BIT(15);
+            if (address == 31) commandStat |= BIT(15);
 
             // Store to the current coordinate and directional stack slots
             coordinateStack[address] = coordinate;
@@ -783,7 +990,7 @@ void Gpu3D::mtxRestoreCmd(uint32_t param)
 
             // Indicate a matrix stack overflow error
             // Even though the 31st slot exists, it still causes an overflow error
-            if (address == 31) gxStat |= BIT(15);
+            if (address == 31) commandStat |= BIT(15);
 
             // Restore from the current coordinate and directional stack slots
             coordinate = coordinateStack[address];
@@ -836,7 +1043,7 @@ void Gpu3D::mtxIdentityCmd()
     }
 }
 
-void Gpu3D::mtxLoad44Cmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxLoad44Cmd(uint32_t *params)
 {
     // Convert the parameters to a 4x4 matrix
     Matrix matrix = *(Matrix*)&params[0];
@@ -874,7 +1081,7 @@ void Gpu3D::mtxLoad44Cmd(std::vector<uint32_t> &params)
     }
 }
 
-void Gpu3D::mtxLoad43Cmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxLoad43Cmd(uint32_t *params)
 {
     // Convert the parameters to a 4x3 matrix
     Matrix matrix;
@@ -914,7 +1121,7 @@ void Gpu3D::mtxLoad43Cmd(std::vector<uint32_t> &params)
     }
 }
 
-void Gpu3D::mtxMult44Cmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxMult44Cmd(uint32_t *params)
 {
     // Convert the parameters to a 4x4 matrix
     Matrix matrix = *(Matrix*)&params[0];
@@ -952,7 +1159,7 @@ void Gpu3D::mtxMult44Cmd(std::vector<uint32_t> &params)
     }
 }
 
-void Gpu3D::mtxMult43Cmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxMult43Cmd(uint32_t *params)
 {
     // Convert the parameters to a 4x3 matrix
     Matrix matrix;
@@ -992,7 +1199,7 @@ void Gpu3D::mtxMult43Cmd(std::vector<uint32_t> &params)
     }
 }
 
-void Gpu3D::mtxMult33Cmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxMult33Cmd(uint32_t *params)
 {
     // Convert the parameters to a 3x3 matrix
     Matrix matrix;
@@ -1032,7 +1239,7 @@ void Gpu3D::mtxMult33Cmd(std::vector<uint32_t> &params)
     }
 }
 
-void Gpu3D::mtxScaleCmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxScaleCmd(uint32_t *params)
 {
     // Convert the parameters to a scale matrix
     Matrix matrix;
@@ -1064,7 +1271,7 @@ void Gpu3D::mtxScaleCmd(std::vector<uint32_t> &params)
     }
 }
 
-void Gpu3D::mtxTransCmd(std::vector<uint32_t> &params)
+void Gpu3D::mtxTransCmd(uint32_t *params)
 {
     // Convert the parameters to a translation matrix
     Matrix matrix;
@@ -1215,7 +1422,7 @@ void Gpu3D::texCoordCmd(uint32_t param)
     }
 }
 
-void Gpu3D::vtx16Cmd(std::vector<uint32_t> &params)
+void Gpu3D::vtx16Cmd(uint32_t *params)
 {
     // Set the X, Y, and Z coordinates
     savedVertex.x = (int16_t)(params[0] >>  0);
@@ -1343,7 +1550,7 @@ void Gpu3D::lightColorCmd(uint32_t param)
     lightColor[param >> 30] = rgb5ToRgb6(param);
 }
 
-void Gpu3D::shininessCmd(std::vector<uint32_t> &params)
+void Gpu3D::shininessCmd(uint32_t *params)
 {
     // Set the values of the specular reflection shininess table
     for (int i = 0; i < 32; i++)
@@ -1384,11 +1591,8 @@ void Gpu3D::beginVtxsCmd(uint32_t param)
 void Gpu3D::swapBuffersCmd(uint32_t param)
 {
     // Set the W-buffering toggle
+    // The engine is halted when the command is taken from the FIFO, since that affects timing
     savedPolygon.wBuffer = param & BIT(1);
-
-    // Halt the geometry engine
-    // The buffers will be swapped and the engine unhalted on next V-blank
-    state = GX_HALTED;
 }
 
 void Gpu3D::viewportCmd(uint32_t param)
@@ -1400,7 +1604,7 @@ void Gpu3D::viewportCmd(uint32_t param)
     viewportNext[3] = ((191 - ((param >> 8) & 0xFF)) - viewportNext[1] + 1) & 0xFF;
 }
 
-void Gpu3D::boxTestCmd(std::vector<uint32_t> &params)
+void Gpu3D::boxTestCmd(uint32_t *params)
 {
     // Store the parameters (X-pos, Y-pos, Z-pos, width, height, depth)
     int16_t boxTestCoords[6] =
@@ -1457,10 +1661,6 @@ void Gpu3D::boxTestCmd(std::vector<uint32_t> &params)
         { vertices[1], vertices[5], vertices[7], vertices[4] }
     };
 
-    // Clear the busy bit if no more test commands are queued
-    if ((testQueue -= 3) == 0)
-        gxStat &= ~BIT(0);
-
     // Clip the faces of the box
     // If any of the faces are in view, set the result bit
     for (int i = 0; i < 6; i++)
@@ -1471,16 +1671,16 @@ void Gpu3D::boxTestCmd(std::vector<uint32_t> &params)
 
         if (size > 0)
         {
-            gxStat |= BIT(1);
+            commandStat |= BIT(1);
             return;
         }
     }
 
     // Clear the result bit if none of the faces were in view
-    gxStat &= ~BIT(1);
+    commandStat &= ~BIT(1);
 }
 
-void Gpu3D::posTestCmd(std::vector<uint32_t> &params)
+void Gpu3D::posTestCmd(uint32_t *params)
 {
     // Set the X, Y, and Z coordinates, overwriting the saved vertex
     savedVertex.x = (int16_t)(params[0] >>  0);
@@ -1501,10 +1701,6 @@ void Gpu3D::posTestCmd(std::vector<uint32_t> &params)
     posResult[1] = vertex.y;
     posResult[2] = vertex.z;
     posResult[3] = vertex.w;
-
-    // Clear the busy bit if no more test commands are queued
-    if ((testQueue -= 2) == 0)
-        gxStat &= ~BIT(0);
 }
 
 void Gpu3D::vecTestCmd(uint32_t param)
@@ -1521,14 +1717,20 @@ void Gpu3D::vecTestCmd(uint32_t param)
     vecResult[0] = ((int16_t)(vector.x << 3)) >> 3;
     vecResult[1] = ((int16_t)(vector.y << 3)) >> 3;
     vecResult[2] = ((int16_t)(vector.z << 3)) >> 3;
-
-    // Clear the busy bit if no more test commands are queued
-    if (--testQueue == 0)
-        gxStat &= ~BIT(0);
 }
 
 void Gpu3D::addEntry(Entry entry)
 {
+    // If writes overshoot even the extra space past the full FIFO, stall them by running commands until there's room
+    // This only happens with large transfers that don't wait for the CPU to halt, and an entry is dropped if the engine is halted
+    while (fifo.full() && state != GX_HALTED && commandReady())
+        executeCommand();
+    if (fifo.full())
+    {
+        LOG("GXFIFO overflow, dropping entry\n");
+        return;
+    }
+
     if (fifo.size() - pipeSize == 0 && pipeSize < 4)
     {
         // Move data directly into the pipe if the FIFO is empty and the pipe isn't full
@@ -1572,13 +1774,97 @@ void Gpu3D::addEntry(Entry entry)
     }
 
     // Start executing commands if one is ready
-    if (state == GX_IDLE && fifo.size() >= paramCounts[fifo.front().command])
+    if (state == GX_IDLE && commandReady())
     {
         core->schedule(GPU3D_COMMAND, 2);
         state = GX_RUNNING;
     }
 }
 
+void Gpu3D::startThread()
+{
+    // Start the geometry thread, allocating the buffers it fills first so pointers don't change under the renderer
+    allocateBuffers();
+    running.store(true);
+    thread = new std::thread(&Gpu3D::runThreaded, this);
+}
+
+void Gpu3D::stopThread()
+{
+    // Let the geometry thread finish its commands, and then stop it
+    if (!thread) return;
+    waitThread();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running.store(false);
+        queueCond.notify_one();
+    }
+    thread->join();
+    delete thread;
+    thread = nullptr;
+}
+
+void Gpu3D::runThreaded()
+{
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_RENDER);
+
+    uint32_t params[32];
+
+    while (true)
+    {
+        // Wait for commands, spinning briefly before going to sleep
+        uint32_t head = queueHead.load(std::memory_order_relaxed);
+        for (int i = 0; i < 1000 && queueTail.load(std::memory_order_acquire) == head && running.load(); i++)
+            std::this_thread::yield();
+        if (queueTail.load(std::memory_order_acquire) == head)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true);
+            queueCond.wait(lock, [&] { return queueTail.load() != head || !running.load(); });
+            sleeping.store(false);
+            if (queueTail.load() == head) return;
+        }
+
+        // Take the next command and its parameters from the queue, and run it
+        uint8_t command = queue[head % GX_QUEUE_SIZE].command;
+        int count = std::max<int>(paramCounts[command], 1);
+        for (int i = 0; i < count; i++)
+            params[i] = queue[(head + i) % GX_QUEUE_SIZE].param;
+        runHandler(command, params);
+
+        // Release the entries only once the command is done, so an empty queue means everything has run
+        queueHead.store(head + count, std::memory_order_release);
+    }
+}
+
+void Gpu3D::queueCommand(uint8_t command, uint32_t *params, int count)
+{
+    // Wait for room in the queue if the geometry thread has fallen far behind
+    uint32_t tail = queueTail.load(std::memory_order_relaxed);
+    while (tail + count - queueHead.load(std::memory_order_acquire) > GX_QUEUE_SIZE)
+        std::this_thread::yield();
+
+    // Add the command and its parameters to the queue, and publish them all at once
+    for (int i = 0; i < count; i++)
+        queue[(tail + i) % GX_QUEUE_SIZE] = Entry(command, params[i]);
+    queueTail.store(tail + count);
+
+    // Wake the geometry thread if it went to sleep
+    if (sleeping.load())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queueCond.notify_one();
+    }
+}
+
+void Gpu3D::waitThread()
+{
+    // Wait for the geometry thread to run everything in the queue
+    while (queueHead.load(std::memory_order_acquire) != queueTail.load(std::memory_order_relaxed))
+        std::this_thread::yield();
+}
+
 void Gpu3D::writeGxFifo(uint32_t mask, uint32_t value)
 {
     if (gxFifo == 0)
@@ -1873,22 +2159,40 @@ void Gpu3D::writeGxStat(uint32_t mask, uint32_t value)
 {
     // Clear the error bit and reset the projection stack pointer
     if (value & BIT(15))
-        gxStat &= ~0xA000;
+    {
+        finishCommands();
+        commandStat &= ~0xA000;
+    }
 
     // Write to the GXSTAT register
     mask &= 0xC0000000;
     gxStat = (gxStat & ~mask) | (value & mask);
 }
 
+uint32_t Gpu3D::readGxStat()
+{
+    // Wait for the geometry thread if any commands that set status bits were sent since the last read
+    if (commandStatDirty)
+    {
+        finishCommands();
+        commandStatDirty = false;
+    }
+
+    // Read from the GXSTAT register
+    return gxStat | commandStat;
+}
+
 uint32_t Gpu3D::readRamCount()
 {
     // Read from the RAM_COUNT register
+    finishCommands();
     return (vertexCountIn << 16) | polygonCountIn;
 }
 
 uint32_t Gpu3D::readClipMtxResult(int index)
 {
-    // Update the clip matrix if necessary
+    // Update the clip matrix if necessary, once the geometry thread is done with it
+    finishCommands();
     if (clipDirty)
     {
         clip = coordinate * projection;
@@ -1902,5 +2206,129 @@ uint32_t Gpu3D::readClipMtxResult(int index)
 uint32_t Gpu3D::readVecMtxResult(int index)
 {
     // Read from one of the VECMTX_RESULT registers
+    finishCommands();
     return direction.data[(index / 3) * 4 + index % 3];
 }
+
+void Gpu3D::syncPolygons(SaveState &state, _Polygon *polygons, int count, Vertex *vertices, int vertexCount)
+{
+    for (int i = 0; i < count; i++)
+    {
+        // Sync a polygon, with its vertices stored as an index instead of a pointer
+        int32_t index = polygons[i].vertices - vertices;
+        state.sync(polygons[i]);
+        state.sync(index);
+
+        if (state.isLoading())
+        {
+            // Point the vertices back into the vertex buffer, making sure they're in bounds
+            if (index < 0 || index + polygons[i].size > vertexCount) return state.fail();
+            polygons[i].vertices = &vertices[index];
+        }
+    }
+}
+
+void Gpu3D::syncState(SaveState &state)
+{
+    // Make sure the geometry thread isn't touching anything
+    finishCommands();
+
+    // Sync the geometry engine state and FIFO
+    state.sync(this->state);
+    state.sync(fifo);
+    state.sync(pipeSize);
+    state.sync(testQueue);
+    state.sync(matrixQueue);
+    state.sync(matrixMode);
+    state.sync(clipDirty);
+
+    // Sync the matrices
+    state.sync(projection);
+    state.sync(projectionStack);
+    state.sync(coordinate);
+    state.sync(coordinateStack);
+    state.sync(direction);
+    state.sync(directionStack);
+    state.sync(texture);
+    state.sync(textureStack);
+    state.sync(clip);
+
+    // Sync which buffers are being written to, and how much of them are in use
+    bool swapped = (verticesIn && verticesIn == vertices2);
+    state.sync(swapped);
+    state.sync(vertexCountIn);
+    state.sync(vertexCountOut);
+    state.sync(processCount);
+    state.sync(polygonCountIn);
+    state.sync(polygonCountOut);
+
+    if (state.isLoading())
+    {
+        // Forget the last frame's hash so the next one is always drawn
+        frameHash = 0;
+
+        // Make sure the counts are in bounds, and allocate the buffers if anything is in them
+        if (vertexCountIn < 0 || vertexCountIn > 6144 || vertexCountOut < 0 || vertexCountOut > 6144 ||
+            polygonCountIn < 0 || polygonCountIn > 2048 || polygonCountOut < 0 || polygonCountOut > 2048)
+            return state.fail();
+        if (vertexCountIn || vertexCountOut || polygonCountIn || polygonCountOut)
+            allocateBuffers();
+
+        // Restore the buffer pointers
+        if (vertices1)
+        {
+            verticesIn  = swapped ? vertices2 : vertices1;
+            verticesOut = swapped ? vertices1 : vertices2;
+            polygonsIn  = swapped ? polygons2 : polygons1;
+            polygonsOut = swapped ? polygons1 : polygons2;
+        }
+    }
+
+    // Sync only the used parts of the vertex and polygon buffers
+    state.sync(verticesIn, vertexCountIn * sizeof(Vertex));
+    state.sync(verticesOut, vertexCountOut * sizeof(Vertex));
+    syncPolygons(state, polygonsIn, polygonCountIn, verticesIn, vertexCountIn);
+    syncPolygons(state, polygonsOut, polygonCountOut, verticesOut, vertexCountOut);
+
+    // Sync the vertex and polygon attributes being built
+    // The saved polygon's vertex pointer is always reassigned before use
+    state.sync(savedVertex);
+    state.sync(savedPolygon);
+    state.sync(s);
+    state.sync(t);
+    state.sync(vertexCount);
+    state.sync(clockwise);
+    state.sync(polygonType);
+    state.sync(textureCoordMode);
+    state.sync(polygonAttr);
+    if (state.isLoading()) savedPolygon.vertices = verticesIn;
+
+    // Sync the lighting state
+    state.sync(enabledLights);
+    state.sync(renderBack);
+    state.sync(renderFront);
+    state.sync(diffuseColor);
+    state.sync(ambientColor);
+    state.sync(specularColor);
+    state.sync(emissionColor);
+    state.sync(shininessEnabled);
+    state.sync(lightVector);
+    state.sync(halfVector);
+    state.sync(lightColor);
+    state.sync(shininess);
+
+    // Sync the 3D registers
+    state.sync(viewport);
+    state.sync(viewportNext);
+    state.sync(gxFifo);
+
+    // Sync GXSTAT as one register, splitting out the bits that commands own when loading
+    uint32_t stat = gxStat | commandStat;
+    state.sync(stat);
+    gxStat = stat & ~GX_COMMAND_STAT;
+    commandStat = stat & GX_COMMAND_STAT;
+
+    state.sync(posResult);
+    state.sync(vecResult);
+    state.sync(gxFifoCount);
+}
@@ -20,13 +20,26 @@
 #ifndef GPU_3D_H
 #define GPU_3D_H
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
-#include <queue>
-#include <vector>
+#include <mutex>
+#include <thread>
 
 #include "defines.h"
+#include "ring_buffer.h"
+
+// The hardware FIFO holds 256 entries and the pipe 4, but packed commands and DMA bursts can overshoot before the CPU halts
+#define GX_FIFO_SIZE 1024
+
+// Number of entries the geometry thread can fall behind by before the emulation thread waits for it
+#define GX_QUEUE_SIZE 4096
+
+// GXSTAT bits that are set by the commands themselves, rather than by the FIFO timing
+#define GX_COMMAND_STAT 0xBF02
 
 class Core;
+class SaveState;
 
 enum GXState
 {
@@ -37,10 +50,11 @@ enum GXState
 
 struct Entry
 {
+    Entry() {}
     Entry(uint8_t command, uint32_t param): command(command), param(param) {}
 
-    uint8_t command;
-    uint32_t param;
+    uint8_t command = 0;
+    uint32_t param = 0;
 };
 
 struct Matrix
@@ -102,7 +116,10 @@ struct _Polygon
 class Gpu3D
 {
     public:
-        Gpu3D(Core *core): core(core) {}
+        Gpu3D(Core *core);
+        ~Gpu3D();
+
+        void syncState(SaveState &state);
 
         void runCommand();
         void swapBuffers();
@@ -112,9 +129,11 @@ class Gpu3D
         _Polygon *getPolygons()     { return polygonsOut;     }
         int       getPolygonCount() { return polygonCountOut; }
 
-        uint32_t readGxStat()             { return gxStat;           }
-        uint32_t readPosResult(int index) { return posResult[index]; }
-        uint32_t readVecResult(int index) { return vecResult[index]; }
+        uint32_t getFifoStat() { return gxStat; }
+
+        uint32_t readGxStat();
+        uint32_t readPosResult(int index) { finishCommands(); return posResult[index]; }
+        uint32_t readVecResult(int index) { finishCommands(); return vecResult[index]; }
         uint32_t readRamCount();
         uint32_t readClipMtxResult(int index);
         uint32_t readVecMtxResult(int index);
@@ -164,7 +183,7 @@ class Gpu3D
 
         GXState state = GX_IDLE;
 
-        std::queue<Entry> fifo;
+        RingBuffer<Entry, GX_FIFO_SIZE> fifo;
         size_t pipeSize = 0;
         size_t testQueue = 0;
         size_t matrixQueue = 0;
@@ -180,14 +199,16 @@ class Gpu3D
         Matrix texture, textureStack;
         Matrix clip;
 
-        Vertex vertices1[6144], vertices2[6144];
-        Vertex *verticesIn = vertices1, *verticesOut = vertices2;
+        // Vertex and polygon buffers are allocated on first use, so they aren't wasted in GBA mode
+        Vertex *vertices1 = nullptr, *vertices2 = nullptr;
+        Vertex *verticesIn = nullptr, *verticesOut = nullptr;
         int vertexCountIn = 0, vertexCountOut = 0;
         int processCount = 0;
 
-        _Polygon polygons1[2048], polygons2[2048];
-        _Polygon *polygonsIn = polygons1, *polygonsOut = polygons2;
+        _Polygon *polygons1 = nullptr, *polygons2 = nullptr;
+        _Polygon *polygonsIn = nullptr, *polygonsOut = nullptr;
         int polygonCountIn = 0, polygonCountOut = 0;
+        uint64_t frameHash = 0;
 
         Vertex savedVertex;
         _Polygon savedPolygon;
@@ -219,10 +240,39 @@ class Gpu3D
 
         int gxFifoCount = 0;
 
+        // Status bits owned by the commands, kept apart from the FIFO bits in case they run on the geometry thread
+        uint32_t commandStat = 0;
+        bool commandStatDirty = false;
+
+        // Commands are run on a geometry thread when enabled, handed over through a single-producer queue
+        // The emulation thread keeps the FIFO timing, and waits for the queue to empty before reading anything commands write
+        std::thread *thread = nullptr;
+        std::atomic<bool> running;
+        std::atomic<bool> sleeping;
+        std::atomic<uint32_t> queueHead;
+        std::atomic<uint32_t> queueTail;
+        Entry queue[GX_QUEUE_SIZE];
+        std::mutex mutex;
+        std::condition_variable queueCond;
+
         static uint32_t rgb5ToRgb6(uint16_t color);
         static Vertex intersection(Vertex *vtx1, Vertex *vtx2, int32_t val1, int32_t val2);
+        static void syncPolygons(SaveState &state, _Polygon *polygons, int count, Vertex *vertices, int vertexCount);
         static bool clipPolygon(Vertex *unclipped, Vertex *clipped, int *size);
 
+        bool commandReady() { return !fifo.empty() && fifo.size() >= paramCounts[fifo.front().command]; }
+        void executeCommand();
+        void runHandler(uint8_t command, uint32_t *params);
+
+        void startThread();
+        void stopThread();
+        void runThreaded();
+        void queueCommand(uint8_t command, uint32_t *params, int count);
+        void finishCommands() { if (thread) waitThread(); }
+        void waitThread();
+
+        uint64_t hashFrame();
+        void allocateBuffers();
         void processVertices();
         void addVertex();
         void addPolygon();
@@ -233,17 +283,17 @@ class Gpu3D
         void mtxStoreCmd(uint32_t param);
         void mtxRestoreCmd(uint32_t param);
         void mtxIdentityCmd();
-        void mtxLoad44Cmd(std::vector<uint32_t> &params);
-        void mtxLoad43Cmd(std::vector<uint32_t> &params);
-        void mtxMult44Cmd(std::vector<uint32_t> &params);
-        void mtxMult43Cmd(std::vector<uint32_t> &params);
-        void mtxMult33Cmd(std::vector<uint32_t> &params);
-        void mtxScaleCmd(std::vector<uint32_t> &params);
-        void mtxTransCmd(std::vector<uint32_t> &params);
+        void mtxLoad44Cmd(uint32_t *params);
+        void mtxLoad43Cmd(uint32_t *params);
+        void mtxMult44Cmd(uint32_t *params);
+        void mtxMult43Cmd(uint32_t *params);
+        void mtxMult33Cmd(uint32_t *params);
+        void mtxScaleCmd(uint32_t *params);
+        void mtxTransCmd(uint32_t *params);
         void colorCmd(uint32_t param);
         void normalCmd(uint32_t param);
         void texCoordCmd(uint32_t param);
-        void vtx16Cmd(std::vector<uint32_t> &params);
+        void vtx16Cmd(uint32_t *params);
         void vtx10Cmd(uint32_t param);
         void vtxXYCmd(uint32_t param);
         void vtxXZCmd(uint32_t param);
@@ -256,12 +306,12 @@ class Gpu3D
         void speEmiCmd(uint32_t param);
         void lightVectorCmd(uint32_t param);
         void lightColorCmd(uint32_t param);
-        void shininessCmd(std::vector<uint32_t> &params);
+        void shininessCmd(uint32_t *params);
         void beginVtxsCmd(uint32_t param);
         void swapBuffersCmd(uint32_t param);
         void viewportCmd(uint32_t param);
-        void boxTestCmd(std::vector<uint32_t> &params);
-        void posTestCmd(std::vector<uint32_t> &params);
+        void boxTestCmd(uint32_t *params);
+        void posTestCmd(uint32_t *params);
         void vecTestCmd(uint32_t param);
 
         void addEntry(Entry entry);
@@ -17,32 +17,62 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstring>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "gpu_3d_renderer.h"
 #include "core.h"
 #include "settings.h"
+#include "thread_config.h"
 
 Gpu3DRenderer::Gpu3DRenderer(Core *core): core(core)
 {
-    // Mark the scanlines as ready to start
+    // Mark the scanlines as finished and claimed to start
     // This is mainly in case 3D is requested before the threads have a chance to start
     for (int i = 0; i < 192 * 2; i++)
-        ready[i].store(3);
+        ready[i].store(4);
+    nextLine.store(192 * 2);
+
+    // Allocate native resolution buffers to start
+    resizeBuffers();
 }
 
 Gpu3DRenderer::~Gpu3DRenderer()
 {
-    // Clean up the threads
-    for (int i = 0; i < activeThreads; i++)
+    // Clean up the threads and buffers
+    stopThreads();
+    freeBuffers();
+}
+
+void Gpu3DRenderer::resizeBuffers()
+{
+    // Reallocate the buffers for the current resolution, cleared to zero
+    freeBuffers();
+    // They share one page-aligned block, which comes from the system already zeroed
+    int size = (256 * 192) << (resShift * 2);
+    bufferSize = size * (sizeof(uint32_t) * 6 + sizeof(uint8_t));
+    uint8_t *data = (uint8_t*)Core::allocPages(bufferSize);
+    for (int i = 0; i < 2; i++)
     {
-        if (threads[i]) 
-        {
-            threads[i]->join();
-            delete threads[i];
-        }
+        framebuffer[i] = (uint32_t*)&data[size * 4 * (i * 3 + 0)];
+        depthBuffer[i] = (int32_t*)&data[size * 4 * (i * 3 + 1)];
+        attribBuffer[i] = (uint32_t*)&data[size * 4 * (i * 3 + 2)];
     }
+    stencilBuffer = &data[size * 4 * 6];
+}
+
+void Gpu3DRenderer::freeBuffers()
+{
+    // Free the buffers if they're allocated
+    Core::freePages(framebuffer[0], bufferSize);
+    framebuffer[0] = nullptr;
 }
 
 uint32_t Gpu3DRenderer::rgba5ToRgba6(uint32_t color)
@@ -70,41 +100,32 @@ uint32_t *Gpu3DRenderer::getLine(int line)
 
 uint32_t *Gpu3DRenderer::getLine1(int line)
 {
-    // If a thread is falling behind, see if this thread can help out instead of waiting around
-    // Threads go back for the final pass after drawing their next scanline, so check 2 scanlines ahead
-    if (ready[line].load() < 3 && line + activeThreads * 2 < (192 << resShift))
+    // If the scanline depends on ones that haven't been claimed yet, draw them here instead of waiting around
+    int end = 192 << resShift;
+    while (ready[line].load() < 4 && nextLine.load() <= std::min(line + 1, end - 1))
     {
-        int next = line + activeThreads * 2;
-        switch (ready[next].exchange(1))
-        {
-            case 0:
-                // Draw the scanline if it hasn't been started yet
-                drawScanline1(next);
-                ready[next].store(2);
-                break;
-
-            case 2:
-                // If the thread somehow caught up, restore the scanline's state
-                if (ready[next].exchange(2) == 3)
-                    ready[next].store(3);
-                break;
-
-            case 3:
-                // If the thread somehow caught up, restore the scanline's state
-                ready[next].store(3);
-                break;
-        }
+        int next = claimLine();
+        if (next >= 0) drawClaimed(next);
     }
 
-    // Wait until a scanline is ready, and then return it
-    while (ready[line].load() < 3) std::this_thread::yield();
-    return &framebuffer[0][line * 256 * 2];
+    // Sleep until the scanline is finished, and then return it
+    if (ready[line].load() < 4)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCond.wait(lock, [&] { return ready[line].load() == 4; });
+    }
+    return &framebuffer[0][line << (8 + resShift)];
 }
 
 void Gpu3DRenderer::drawScanline(int line)
 {
+    PROFILE_TIME(core->renderProfile.gpu3DTime);
+
     if (line == 0)
     {
+        // Make sure the last frame is done before anything changes under the threads
+        finishFrame();
+
         // Calculate the scanline bounds for each polygon
         for (int i = 0; i < core->gpu3D.getPolygonCount(); i++)
         {
@@ -123,40 +144,64 @@ void Gpu3DRenderer::drawScanline(int line)
             if (polygonTop[i] == polygonBot[i]) polygonBot[i]++;
         }
 
-        // Update the resolution shift for the next frame
-        resShift = Settings::highRes3D;
+        // Update the resolution shift for the next frame, resizing the buffers if it changed
+        if (resShift != (bool)Settings::highRes3D)
+        {
+            resShift = Settings::highRes3D;
+            resizeBuffers();
+        }
 
-        // Clean up any existing threads
-        for (int i = 0; i < activeThreads; i++)
+        // Sort the polygons into the bands they cover, so scanlines only have to check their own band
+        int shift = BIN_SHIFT + resShift;
+        for (int i = 0; i < BIN_COUNT; i++)
+            bins[i].clear();
+        for (int i = 0; i < core->gpu3D.getPolygonCount(); i++)
         {
-            if (threads[i]) 
-            {
-                threads[i]->join();
-                delete threads[i];
-            }
+            int top = std::max(polygonTop[i], 0) >> shift;
+            int bot = std::min((polygonBot[i] - 1) >> shift, BIN_COUNT - 1);
+            for (int j = top; j <= bot; j++)
+                bins[j].push_back(i);
         }
 
-        // Update the thread count
-        activeThreads = Settings::threaded3D;
-        if (activeThreads > 3) activeThreads = 3;
+        // Look up the decoded textures before any threads start drawing with them
+        prepareTextures();
+
+        // Update the fog densities before any threads start using them
+        updateFogDensity();
+
+        // Restart the threads if the thread count changed
+        int count = std::min(Settings::threaded3D, MAX_3D_THREADS);
+        if (activeThreads != count)
+        {
+            stopThreads();
+            startThreads(count);
+        }
 
         // Set up threaded 3D rendering if enabled
         if (activeThreads > 0)
         {
-            // Mark the scanlines as not ready
+            // Mark the scanlines as waiting, and then let them be claimed
             int end = 192 << resShift;
             for (int i = 0; i < end; i++)
                 ready[i].store(0);
+            nextLine.store(0);
 
-            // Create threads to draw the scanlines
-            for (int i = 0; i < activeThreads; i++)
-                threads[i] = new std::thread(&Gpu3DRenderer::drawThreaded, this, i);
+            // Wake the threads to start drawing the frame
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+            workCond.notify_all();
         }
     }
 
     // Draw scanlines normally when threading is disabled
     if (activeThreads == 0)
     {
+        // Decode textures again if they changed mid-frame, since each scanline is drawn in real time here
+        // The fog densities are rebuilt too if the fog parameters changed
+        if (texVersion != core->memory.getTexVersion())
+            prepareTextures();
+        updateFogDensity();
+
         if (resShift)
         {
             // Draw two scanlines at a time when high-res is enabled
@@ -177,49 +222,115 @@ void Gpu3DRenderer::drawScanline(int line)
     }
 }
 
-void Gpu3DRenderer::drawThreaded(int thread)
+void Gpu3DRenderer::startThreads(int count)
+{
+    // Create a pool of threads that wait for frames to draw
+    running = true;
+    activeThreads = count;
+    for (int i = 0; i < activeThreads; i++)
+        threads[i] = new std::thread(&Gpu3DRenderer::drawThreaded, this);
+}
+
+void Gpu3DRenderer::stopThreads()
+{
+    if (activeThreads == 0) return;
+    finishFrame();
+
+    // Signal the threads to stop and wait for them to exit
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        workCond.notify_all();
+    }
+    for (int i = 0; i < activeThreads; i++)
+    {
+        threads[i]->join();
+        delete threads[i];
+        threads[i] = nullptr;
+    }
+    activeThreads = 0;
+}
+
+void Gpu3DRenderer::finishFrame()
+{
+    if (activeThreads == 0) return;
+
+    // Draw any scanlines that haven't been claimed yet
+    int next;
+    while ((next = claimLine()) >= 0)
+        drawClaimed(next);
+
+    // Wait for the threads to finish the scanlines they claimed
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCond.wait(lock, [&] { return busyThreads == 0; });
+
+    // Close the frame so a late thread can't claim anything while the next one is set up, at either resolution
+    nextLine.store(192 * 2);
+}
+
+void Gpu3DRenderer::drawThreaded()
 {
-    // Draw the 3D scanlines in a threaded sequence
-    // The amount of scanlines skipped per thread depends on the number of active threads
-    // Together, they render the entire 3D image
-    int i, end = 192 << resShift;
-    for (i = thread; i < end; i += activeThreads)
+    // Place the thread the way the thread settings ask for
+    ThreadConfig::apply(THREAD_RENDER);
+
+    uint32_t frame = 0;
+
+    while (true)
     {
-        switch (ready[i].exchange(1))
+        // Sleep until there's a new frame to draw or the threads are stopped
         {
-            case 0:
-                // Draw a scanline if it hasn't been started, save for the final pass
-                drawScanline1(i);
-                ready[i].store(2);
-                break;
-
-            case 2:
-                // Restore the scanline's state if it was already drawn
-                ready[i].store(2);
-                break;
+            std::unique_lock<std::mutex> lock(mutex);
+            workCond.wait(lock, [&] { return !running || generation != frame; });
+            if (!running) return;
+            frame = generation;
+            busyThreads++;
         }
 
-        if (i < activeThreads) continue;
-        int prev = i - activeThreads;
+        // Claim and draw scanlines until there are none left
+        int next;
+        while ((next = claimLine()) >= 0)
+            drawClaimed(next);
 
-        // Wait for this thread's previous scanline and its surrounding scanlines to be drawn
-        while ((prev > 0 && ready[prev - 1].load() < 2) || ready[prev].load() < 2 || ready[prev + 1].load() < 2)
-            std::this_thread::yield();
-
-        // Finish this thread's previous scanline
-        finishScanline(prev);
-        ready[prev].store(3);
+        // Let waiters know once all threads are idle
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyThreads == 0)
+            doneCond.notify_all();
     }
+}
 
-    int prev = i - activeThreads;
+int Gpu3DRenderer::claimLine()
+{
+    // Claim the next scanline, only checking the frame's resolution once the claim is made
+    int line = nextLine++;
+    return (line < (192 << resShift)) ? line : -1;
+}
 
-    // Wait for this thread's final scanline and its surrounding scanlines to be drawn
-    while (ready[prev - 1].load() < 2 || ready[prev].load() < 2 || (prev < 191 && ready[prev + 1].load() < 2))
-        std::this_thread::yield();
+void Gpu3DRenderer::drawClaimed(int line)
+{
+    // Draw a claimed scanline, saving it for the final pass
+    ready[line].store(1);
+    drawScanline1(line);
+    ready[line].store(2);
+
+    // The final pass needs the surrounding scanlines, so finish any of them that are now ready
+    // Whichever thread draws the last of a scanline's neighbours is guaranteed to see them all drawn
+    int end = 192 << resShift;
+    for (int i = std::max(line - 1, 0); i <= std::min(line + 1, end - 1); i++)
+    {
+        if ((i > 0 && ready[i - 1].load() < 2) || (i < end - 1 && ready[i + 1].load() < 2))
+            continue;
 
-    // Finish this thread's final scanline
-    finishScanline(prev);
-    ready[prev].store(3);
+        // Make sure only one thread finishes the scanline
+        int expected = 2;
+        if (!ready[i].compare_exchange_strong(expected, 3))
+            continue;
+        finishScanline(i);
+        ready[i].store(4);
+
+        // Wake anything waiting on the scanline
+        std::lock_guard<std::mutex> lock(mutex);
+        doneCond.notify_all();
+    }
 }
 
 void Gpu3DRenderer::drawScanline1(int line)
@@ -232,7 +343,7 @@ void Gpu3DRenderer::drawScanline1(int line)
         (0x3F << 15) | (((clearColor & 0x001F0000) && ((clearColor & 0x001F0000) >> 16) < 31) << 12);
 
     // Clear the scanline buffers with the clear values
-    int start = line * 256 * 2, end = start + (256 << resShift);
+    int start = line << (8 + resShift), end = start + (256 << resShift);
     for (int i = start; i < end; i++)
     {
         framebuffer[0][i]  = color;
@@ -244,10 +355,12 @@ void Gpu3DRenderer::drawScanline1(int line)
 
     std::vector<int> translucent;
 
-    // Draw the polygons
-    for (int i = 0; i < core->gpu3D.getPolygonCount(); i++)
+    // Draw the polygons from the scanline's band
+    std::vector<int> &bin = bins[line >> (BIN_SHIFT + resShift)];
+    for (unsigned int j = 0; j < bin.size(); j++)
     {
         // Skip polygons that aren't on the current scanline
+        int i = bin[j];
         if (line < polygonTop[i] || line >= polygonBot[i])
             continue;
 
@@ -264,26 +377,97 @@ void Gpu3DRenderer::drawScanline1(int line)
         drawPolygon(line, translucent[i]);
 }
 
+static FORCE_INLINE bool anyFlagged(const uint32_t *attribs, uint32_t mask, uint32_t invert)
+{
+    // Check if any of 8 pixel attributes have a bit in the mask set, after inverting them
+#if defined(__SSE2__)
+    __m128i m = _mm_set1_epi32(mask), v = _mm_set1_epi32(invert);
+    __m128i a = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((__m128i*)&attribs[0]), v), m);
+    __m128i b = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((__m128i*)&attribs[4]), v), m);
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_or_si128(a, b), _mm_setzero_si128())) != 0xFFFF;
+#elif defined(__ARM_NEON)
+    uint32x4_t m = vdupq_n_u32(mask), v = vdupq_n_u32(invert);
+    uint32x4_t a = vorrq_u32(vandq_u32(veorq_u32(vld1q_u32(&attribs[0]), v), m), vandq_u32(veorq_u32(vld1q_u32(&attribs[4]), v), m));
+    uint32x2_t b = vorr_u32(vget_low_u32(a), vget_high_u32(a));
+    return (vget_lane_u32(b, 0) | vget_lane_u32(b, 1)) != 0;
+#else
+    uint32_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (attribs[i] ^ invert) & mask;
+    return value != 0;
+#endif
+}
+
+void Gpu3DRenderer::updateFogDensity()
+{
+    // Rebuild the fog densities if the fog parameters changed since they were built
+    // This doesn't depend on fog being enabled, so the densities are ready if it gets enabled mid-frame
+    int fogStep = 0x400 >> ((disp3DCnt & 0x0F00) >> 8);
+    if (densityValid && densityOffset == fogOffset && densityStep == fogStep &&
+        !memcmp(densityTable, fogTable, sizeof(fogTable)))
+        return;
+
+    densityValid = true;
+    densityOffset = fogOffset;
+    densityStep = fogStep;
+    memcpy(densityTable, fogTable, sizeof(fogTable));
+    for (int i = 0; i < 0x8000; i++)
+        fogDensity[i] = getFogDensity(i << 9);
+}
+
+uint8_t Gpu3DRenderer::getFogDensity(int32_t depth)
+{
+    // Determine the fog table index for a depth
+    int fogStep = 0x400 >> ((disp3DCnt & 0x0F00) >> 8);
+    int32_t offset = ((depth / 0x200) - fogOffset);
+    int n = (fogStep > 0) ? (offset / fogStep - 1) : ((offset > 0) ? 31 : 0);
+
+    // Get the fog density from the table
+    uint8_t density;
+    if (n >= 31) // Maximum
+    {
+        density = fogTable[31];
+    }
+    else if (n < 0 || fogStep == 0) // Minimum
+    {
+        density = fogTable[0];
+    }
+    else // Linear interpolation
+    {
+        int m = offset % fogStep;
+        density = ((m >= 0) ? ((fogTable[n + 1] * m + fogTable[n] * (fogStep - m)) / fogStep) : fogTable[0]);
+    }
+
+    return (density == 127) ? 128 : density;
+}
+
 void Gpu3DRenderer::finishScanline(int line)
 {
     // Perform edge marking if enabled
     if (disp3DCnt & BIT(5))
     {
-        int offset = line * 256 * 2;
+        int offset = line << (8 + resShift);
         int w = (256 << resShift) - 1;
         int h = (192 << resShift) - 1;
 
         for (int i = offset; i <= offset + w; i++)
         {
+            // Skip ahead over blocks of 8 pixels without any edges
+            if (!(i & 7) && !anyFlagged(&attribBuffer[0][i], BIT(14), 0))
+            {
+                i += 7;
+                continue;
+            }
+
             if (attribBuffer[0][i] & BIT(14)) // Edge bit
             {
                 // Get the polygon IDs of the surrounding pixels
                 uint32_t id[4] =
                 {
-                    (((i & w) > 0) ? attribBuffer[0][i -   1] : (clearColor >> 24)) & 0x3F, // Left
-                    (((i & w) < w) ? attribBuffer[0][i +   1] : (clearColor >> 24)) & 0x3F, // Right
-                    ((line    > 0) ? attribBuffer[0][i - 512] : (clearColor >> 24)) & 0x3F, // Up
-                    ((line    < h) ? attribBuffer[0][i + 512] : (clearColor >> 24)) & 0x3F  // Down
+                    (((i & w) > 0) ? attribBuffer[0][i -     1] : (clearColor >> 24)) & 0x3F, // Left
+                    (((i & w) < w) ? attribBuffer[0][i +     1] : (clearColor >> 24)) & 0x3F, // Right
+                    ((line    > 0) ? attribBuffer[0][i - w - 1] : (clearColor >> 24)) & 0x3F, // Up
+                    ((line    < h) ? attribBuffer[0][i + w + 1] : (clearColor >> 24)) & 0x3F  // Down
                 };
 
                 // Get the depth values of the surrounding pixels
@@ -291,8 +475,8 @@ void Gpu3DRenderer::finishScanline(int line)
                 {
                     (((i & w) > 0) ? depthBuffer[0][i -   1] : ((clearDepth == 0x7FFF) ? 0xFFFFFF : (clearDepth << 9))), // Left
                     (((i & w) < w) ? depthBuffer[0][i +   1] : ((clearDepth == 0x7FFF) ? 0xFFFFFF : (clearDepth << 9))), // Right
-                    ((line    > 0) ? depthBuffer[0][i - 512] : ((clearDepth == 0x7FFF) ? 0xFFFFFF : (clearDepth << 9))), // Up
-                    ((line    < h) ? depthBuffer[0][i + 512] : ((clearDepth == 0x7FFF) ? 0xFFFFFF : (clearDepth << 9)))  // Down
+                    ((line    > 0) ? depthBuffer[0][i - w - 1] : ((clearDepth == 0x7FFF) ? 0xFFFFFF : (clearDepth << 9))), // Up
+                    ((line    < h) ? depthBuffer[0][i + w + 1] : ((clearDepth == 0x7FFF) ? 0xFFFFFF : (clearDepth << 9)))  // Down
                 };
 
                 // Check the surrounding pixels, and mark the edge if at least one has a different ID and greater depth
@@ -313,37 +497,24 @@ void Gpu3DRenderer::finishScanline(int line)
     if (disp3DCnt & BIT(7))
     {
         uint32_t fog = rgba5ToRgba6(((fogColor & 0x001F0000) >> 1) | (fogColor & 0x00007FFF));
-        int fogStep = 0x400 >> ((disp3DCnt & 0x0F00) >> 8);
 
         for (int layer = 0; layer < ((disp3DCnt & BIT(4)) ? 2 : 1); layer++) // Apply to the back layer as well if anti-aliased
         {
-            int start = line * 256 * 2, end = start + (256 << resShift);
+            int start = line << (8 + resShift), end = start + (256 << resShift);
             for (int i = start; i < end; i++)
             {
-                if (attribBuffer[layer][i] & BIT(13)) // Fog bit
+                // Skip ahead over blocks of 8 pixels without any fog
+                if (!(i & 7) && !anyFlagged(&attribBuffer[layer][i], BIT(13), 0))
                 {
-                    // Determine the fog table index for the current pixel's depth
-                    int32_t offset = ((depthBuffer[layer][i] / 0x200) - fogOffset);
-                    int n = (fogStep > 0) ? (offset / fogStep - 1) : ((offset > 0) ? 31 : 0);
-
-                    // Get the fog density from the table
-                    uint8_t density;
-                    if (n >= 31) // Maximum
-                    {
-                        density = fogTable[31];
-                    }
-                    else if (n < 0 || fogStep == 0) // Minimum
-                    {
-                        density = fogTable[0];
-                    }
-                    else // Linear interpolation
-                    {
-                        int m = offset % fogStep;
-                        density = ((m >= 0) ? ((fogTable[n + 1] * m + fogTable[n] * (fogStep - m)) / fogStep) : fogTable[0]);
-                    }
+                    i += 7;
+                    continue;
+                }
 
-                    if (density == 127)
-                        density++;
+                if (attribBuffer[layer][i] & BIT(13)) // Fog bit
+                {
+                    // Look up the fog density for the current pixel's depth, calculating it for depths outside the table
+                    int32_t depth = depthBuffer[layer][i];
+                    uint8_t density = ((uint32_t)depth < 0x1000000) ? fogDensity[depth >> 9] : getFogDensity(depth);
 
                     // Blend the fog with the pixel
                     uint8_t a = (((fog >> 18) & 0x3F) * density + ((framebuffer[layer][i] >> 18) & 0x3F) * (128 - density)) / 128;
@@ -366,9 +537,16 @@ void Gpu3DRenderer::finishScanline(int line)
     // Perform anti-aliasing if enabled
     if (disp3DCnt & BIT(4))
     {
-        int start = line * 256 * 2, end = start + (256 << resShift);
+        int start = line << (8 + resShift), end = start + (256 << resShift);
         for (int i = start; i < end; i++)
         {
+            // Skip ahead over blocks of 8 pixels with only opaque edges
+            if (!(i & 7) && !anyFlagged(&attribBuffer[0][i], 0x3F << 15, 0x3F << 15))
+            {
+                i += 7;
+                continue;
+            }
+
             if (((attribBuffer[0][i] >> 15) & 0x3F) < 0x3F) // Edge not opaque
             {
                 // Blend with the lower pixel, or simply set the alpha if the lower pixel has alpha 0
@@ -438,51 +616,244 @@ uint32_t Gpu3DRenderer::interpolateColor(uint32_t c1, uint32_t c2, uint32_t x1,
     return (a << 18) | (b << 12) | (g << 6) | r;
 }
 
-uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
+void Gpu3DRenderer::interpolateSpan(uint32_t *values, uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x2, uint32_t count)
 {
-    // Handle S-coordinate overflows
-    if (polygon->repeatS)
+    // Linearly interpolate values for a span of pixels starting at x1, giving the same results as interpolateLinear
+    // Values are written in groups of 4, so the buffer must have room for the count rounded up
+    if (count == 0) return;
+    uint32_t width = x2 - x1;
+    uint32_t dist = (v1 <= v2) ? (v2 - v1) : (v1 - v2);
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    // Step the quotients and remainders of the interpolation 4 pixels at a time, instead of dividing for each
+    // This only matches if the products don't overflow, and the remainders have to fit in signed lanes
+    if (width < (1 << 30) && (uint64_t)dist * width <= 0xFFFFFFFF)
     {
-        // Flip the S-coordinate every second repeat
-        if (polygon->flipS && (s & polygon->sizeS))
-            s = -1 - s;
+        // Reverse interpolation is the same as subtracting the ceiling of the forward quotient
+        uint32_t stepQ = ((uint64_t)dist * 4) / width;
+        uint32_t stepR = ((uint64_t)dist * 4) % width;
+        uint32_t q[4], r[4];
+        for (int i = 0; i < 4; i++)
+        {
+            q[i] = ((uint64_t)dist * i) / width;
+            r[i] = ((uint64_t)dist * i) % width;
+        }
 
-        // Wrap the S-coordinate
-        s &= polygon->sizeS - 1;
+#if defined(__SSE2__)
+        __m128i quo = _mm_loadu_si128((__m128i*)q);
+        __m128i rem = _mm_loadu_si128((__m128i*)r);
+        __m128i base = _mm_set1_epi32(v1);
+        __m128i wid = _mm_set1_epi32(width);
+        __m128i widM1 = _mm_set1_epi32(width - 1);
+        __m128i zero = _mm_setzero_si128();
+        for (uint32_t i = 0; i < count; i += 4)
+        {
+            __m128i value = (v1 <= v2) ? _mm_add_epi32(base, quo) : _mm_sub_epi32(_mm_sub_epi32(base, quo),
+                _mm_andnot_si128(_mm_cmpeq_epi32(rem, zero), _mm_set1_epi32(1)));
+            _mm_storeu_si128((__m128i*)&values[i], value);
+            rem = _mm_add_epi32(rem, _mm_set1_epi32(stepR));
+            quo = _mm_add_epi32(quo, _mm_set1_epi32(stepQ));
+            __m128i carry = _mm_cmpgt_epi32(rem, widM1);
+            rem = _mm_sub_epi32(rem, _mm_and_si128(carry, wid));
+            quo = _mm_sub_epi32(quo, carry);
+        }
+#else
+        uint32x4_t quo = vld1q_u32(q);
+        uint32x4_t rem = vld1q_u32(r);
+        uint32x4_t base = vdupq_n_u32(v1);
+        uint32x4_t wid = vdupq_n_u32(width);
+        for (uint32_t i = 0; i < count; i += 4)
+        {
+            uint32x4_t value = (v1 <= v2) ? vaddq_u32(base, quo) : vsubq_u32(vsubq_u32(base, quo),
+                vminq_u32(rem, vdupq_n_u32(1)));
+            vst1q_u32(&values[i], value);
+            rem = vaddq_u32(rem, vdupq_n_u32(stepR));
+            quo = vaddq_u32(quo, vdupq_n_u32(stepQ));
+            uint32x4_t carry = vcgeq_u32(rem, wid);
+            rem = vsubq_u32(rem, vandq_u32(carry, wid));
+            quo = vsubq_u32(quo, carry);
+        }
+#endif
+        return;
     }
-    else if (s < 0)
+#endif
+
+    // Fall back to interpolating each pixel separately
+    for (uint32_t i = 0; i < count; i++)
+        values[i] = interpolateLinear(v1, v2, x1, x1 + i, x2);
+}
+
+void Gpu3DRenderer::factorSpan(uint32_t *factors, uint32_t w1, uint32_t w2, uint32_t x1, uint32_t x2, uint32_t count)
+{
+    // Calculate the interpolation factors with a precision of 8 bits for a span of pixels starting at x1
+    // Factors are written in groups of 4, so the buffer must have room for the count rounded up
+    if (count == 0) return;
+    uint32_t width = x2 - x1;
+
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    // Divide 4 pixels at a time in double precision, correcting the quotients so they match integer division exactly
+    // This only matches if the integer calculation doesn't overflow; high-res drops a bit of precision past 256 pixels
+    uint64_t low = (uint64_t)w1 * std::min(count - 1, 255U) << 8;
+    uint64_t high = resShift ? ((uint64_t)w1 * (count - 1) << 7) : 0;
+    if (width < (1 << 30) && (uint64_t)std::max(w1, w2) * width <= 0xFFFFFFFF && std::max(low, high) <= 0xFFFFFFFF)
     {
-        // Clamp the S-coordinate on the left
-        s = 0;
+        for (uint32_t i = 0; i < count; i += 4)
+        {
+            uint32_t s = (resShift & (i >> 8));
+            double k[4] = { (double)i, (double)(i + 1), (double)(i + 2), (double)(i + 3) };
+
+#if defined(__SSE2__)
+            __m128i quo[2];
+            for (int j = 0; j < 2; j++)
+            {
+                __m128d kv = _mm_loadu_pd(&k[j * 2]);
+                __m128d num = _mm_mul_pd(_mm_mul_pd(_mm_set1_pd(w1), kv), _mm_set1_pd(1 << (8 - s)));
+                __m128d den = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(w2), _mm_sub_pd(_mm_set1_pd(width), kv)),
+                    _mm_mul_pd(_mm_set1_pd(w1), kv));
+                __m128d q = _mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_div_pd(num, den)));
+                __m128d rem = _mm_sub_pd(num, _mm_mul_pd(q, den));
+                q = _mm_sub_pd(q, _mm_and_pd(_mm_cmplt_pd(rem, _mm_setzero_pd()), _mm_set1_pd(1)));
+                q = _mm_add_pd(q, _mm_and_pd(_mm_cmpge_pd(rem, den), _mm_set1_pd(1)));
+                quo[j] = _mm_cvttpd_epi32(q);
+            }
+            _mm_storeu_si128((__m128i*)&factors[i], _mm_slli_epi32(_mm_unpacklo_epi64(quo[0], quo[1]), s));
+#else
+            uint32x2_t quo[2];
+            for (int j = 0; j < 2; j++)
+            {
+                float64x2_t kv = vld1q_f64(&k[j * 2]);
+                float64x2_t num = vmulq_f64(vmulq_f64(vdupq_n_f64(w1), kv), vdupq_n_f64(1 << (8 - s)));
+                float64x2_t den = vaddq_f64(vmulq_f64(vdupq_n_f64(w2), vsubq_f64(vdupq_n_f64(width), kv)),
+                    vmulq_f64(vdupq_n_f64(w1), kv));
+                float64x2_t q = vcvtq_f64_s64(vcvtq_s64_f64(vdivq_f64(num, den)));
+                float64x2_t rem = vsubq_f64(num, vmulq_f64(q, den));
+                q = vbslq_f64(vcltq_f64(rem, vdupq_n_f64(0)), vsubq_f64(q, vdupq_n_f64(1)), q);
+                q = vbslq_f64(vcgeq_f64(rem, den), vaddq_f64(q, vdupq_n_f64(1)), q);
+                quo[j] = vmovn_u64(vreinterpretq_u64_s64(vcvtq_s64_f64(q)));
+            }
+            vst1q_u32(&factors[i], vshlq_u32(vcombine_u32(quo[0], quo[1]), vdupq_n_s32(s)));
+#endif
+        }
+
+        // The first pixel is clamped, which also avoids dividing by zero
+        factors[0] = 0;
+        return;
     }
-    else if (s >= polygon->sizeS)
+#endif
+
+    // Fall back to calculating each pixel separately
+    factors[0] = 0;
+    for (uint32_t i = 1; i < count; i++)
     {
-        // Clamp the S-coordinate on the right
-        s = polygon->sizeS - 1;
+        // Adjust interpolation precision to avoid overflow in high-res mode
+        uint32_t s = (resShift & (i >> 8));
+        factors[i] = (((w1 * i) << (8 - s)) / (w2 * (width - i) + w1 * i)) << s;
     }
+}
 
-    // Handle T-coordinate overflows
-    if (polygon->repeatT)
+void Gpu3DRenderer::prepareTextures()
+{
+    // Drop the cache if texture memory changed since it was filled, or if it grew too large
+    uint32_t version = core->memory.getTexVersion();
+    if (texVersion != version || texCacheSize > TEX_CACHE_LIMIT)
     {
-        // Flip the T-coordinate every second repeat
-        if (polygon->flipT && (t & polygon->sizeT))
-            t = -1 - t;
+        texCache.clear();
+        texCacheSize = 0;
+        texVersion = version;
+    }
 
-        // Wrap the T-coordinate
-        t &= polygon->sizeT - 1;
+    // Look up the decoded texture for each polygon, decoding it if it isn't cached yet
+    for (int i = 0; i < core->gpu3D.getPolygonCount(); i++)
+    {
+        _Polygon *polygon = &core->gpu3D.getPolygons()[i];
+        if (polygon->textureFmt == 0)
+        {
+            polygonTex[i] = nullptr;
+            continue;
+        }
+
+        // Pack everything that affects decoding into a key
+        uint64_t key = ((uint64_t)polygon->textureAddr << 43) | ((uint64_t)polygon->paletteAddr << 26) |
+            ((uint64_t)polygon->textureFmt << 23) | (polygon->sizeS << 12) | (polygon->sizeT << 1) | polygon->transparent0;
+
+        auto it = texCache.find(key);
+        if (it == texCache.end())
+        {
+            std::vector<uint32_t> &texture = texCache[key];
+            texture.resize(polygon->sizeS * polygon->sizeT);
+            decodeTexture(polygon, &texture[0]);
+            texCacheSize += texture.size();
+            polygonTex[i] = &texture[0];
+        }
+        else
+        {
+            polygonTex[i] = &it->second[0];
+        }
     }
-    else if (t < 0)
+}
+
+void Gpu3DRenderer::decodeTexture(_Polygon *polygon, uint32_t *texture)
+{
+    if (polygon->textureFmt != 5)
     {
-        // Clamp the T-coordinate on the top
-        t = 0;
+        // Decode the texture one texel at a time
+        for (int t = 0; t < polygon->sizeT; t++)
+            for (int s = 0; s < polygon->sizeS; s++)
+                texture[t * polygon->sizeS + s] = decodeTexel(polygon, s, t);
+        return;
     }
-    else if (t >= polygon->sizeT)
+
+    // Decode a 4x4 compressed texture one tile at a time, so each tile's colors are only worked out once
+    // The palette bases for the tiles are stored in slot 1
+    memset(texture, 0, polygon->sizeS * polygon->sizeT * sizeof(uint32_t));
+    uint32_t address = 0x20000 + (polygon->textureAddr % 0x20000) / 2 + ((polygon->textureAddr / 0x20000 == 2) ? 0x10000 : 0);
+    uint8_t *bases = getTexture(address);
+    if (!bases) return;
+
+    int tilesS = polygon->sizeS / 4;
+    for (int tile = 0; tile < tilesS * (polygon->sizeT / 4); tile++)
     {
-        // Clamp the T-coordinate on the bottom
-        t = polygon->sizeT - 1;
+        // Get the 2-bit palette indices for the tile's rows
+        uint8_t *data = getTexture(polygon->textureAddr + tile * 4);
+        if (!data) continue;
+
+        // Get the palette for the tile
+        uint16_t palBase = U8TO16(bases, tile * 2);
+        uint8_t *palette = getPalette(polygon->paletteAddr + (palBase & 0x3FFF) * 4);
+        if (!palette) continue;
+
+        // Work out the palette colors or transparent or interpolated colors based on the mode
+        uint32_t colors[4];
+        for (int i = 0; i < 4; i++)
+            colors[i] = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, i * 2));
+        switch ((palBase & 0xC000) >> 14) // Interpolation mode
+        {
+            case 0:
+                colors[3] = 0;
+                break;
+
+            case 1:
+                colors[2] = interpolateColor(colors[0], colors[1], 0, 1, 2);
+                colors[3] = 0;
+                break;
+
+            case 3:
+                colors[2] = interpolateColor(colors[0], colors[1], 0, 3, 8);
+                colors[3] = interpolateColor(colors[0], colors[1], 0, 5, 8);
+                break;
+        }
+
+        // Fill in the tile's texels
+        uint32_t *out = &texture[(tile / tilesS) * 4 * polygon->sizeS + (tile % tilesS) * 4];
+        for (int t = 0; t < 4; t++)
+            for (int s = 0; s < 4; s++)
+                out[t * polygon->sizeS + s] = colors[(data[t] >> (s * 2)) & 0x03];
     }
+}
 
-    // Decode a texel
+uint32_t Gpu3DRenderer::decodeTexel(_Polygon *polygon, int s, int t)
+{
+    // Decode a texel, with 4x4 compressed textures being handled separately
     switch (polygon->textureFmt)
     {
         case 1: // A3I5 translucent
@@ -563,86 +934,6 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
             return rgba5ToRgba6((0x1F << 15) | U8TO16(palette, index * 2));
         }
 
-        case 5: // 4x4 compressed
-        {
-            // Get the 2-bit palette index
-            int tile = (t / 4) * (polygon->sizeS / 4) + (s / 4);
-            uint32_t address = polygon->textureAddr + (tile * 4 + t % 4);
-            uint8_t *data = getTexture(address);
-            if (!data) return 0;
-            uint8_t index = (*data >> ((s % 4) * 2)) & 0x03;
-
-            // Get the palette, using the base for the tile stored in slot 1
-            address = 0x20000 + (polygon->textureAddr % 0x20000) / 2 + ((polygon->textureAddr / 0x20000 == 2) ? 0x10000 : 0);
-            if (!(data = getTexture(address))) return 0;
-            uint16_t palBase = U8TO16(data, tile * 2);
-            uint8_t *palette = getPalette(polygon->paletteAddr + (palBase & 0x3FFF) * 4);
-            if (!palette) return 0;
-
-            // Return the palette color or a transparent or interpolated color based on the mode
-            switch ((palBase & 0xC000) >> 14) // Interpolation mode
-            {
-                case 0:
-                {
-                    if (index == 3) return 0;
-                    return rgba5ToRgba6((0x1F << 15) | U8TO16(palette, index * 2));
-                }
-
-                case 1:
-                {
-                    switch (index)
-                    {
-                        case 2:
-                        {
-                            uint32_t c1 = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, 0));
-                            uint32_t c2 = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, 2));
-                            return interpolateColor(c1, c2, 0, 1, 2);
-                        }
-
-                        case 3:
-                        {
-                            return 0;
-                        }
-
-                        default:
-                        {
-                            return rgba5ToRgba6((0x1F << 15) | U8TO16(palette, index * 2));
-                        }
-                    }
-                }
-
-                case 2:
-                {
-                    return rgba5ToRgba6((0x1F << 15) | U8TO16(palette, index * 2));
-                }
-
-                case 3:
-                {
-                    switch (index)
-                    {
-                        case 2:
-                        {
-                            uint32_t c1 = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, 0));
-                            uint32_t c2 = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, 2));
-                            return interpolateColor(c1, c2, 0, 3, 8);
-                        }
-
-                        case 3:
-                        {
-                            uint32_t c1 = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, 0));
-                            uint32_t c2 = rgba5ToRgba6((0x1F << 15) | U8TO16(palette, 2));
-                            return interpolateColor(c1, c2, 0, 5, 8);
-                        }
-
-                        default:
-                        {
-                            return rgba5ToRgba6((0x1F << 15) | U8TO16(palette, index * 2));
-                        }
-                    }
-                }
-            }
-        }
-
         case 6: // A5I3 translucent
         {
             // Get the 8-bit palette index
@@ -675,6 +966,54 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
     }
 }
 
+uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, const uint32_t *texture, int s, int t)
+{
+    // Handle S-coordinate overflows
+    if (polygon->repeatS)
+    {
+        // Flip the S-coordinate every second repeat
+        if (polygon->flipS && (s & polygon->sizeS))
+            s = -1 - s;
+
+        // Wrap the S-coordinate
+        s &= polygon->sizeS - 1;
+    }
+    else if (s < 0)
+    {
+        // Clamp the S-coordinate on the left
+        s = 0;
+    }
+    else if (s >= polygon->sizeS)
+    {
+        // Clamp the S-coordinate on the right
+        s = polygon->sizeS - 1;
+    }
+
+    // Handle T-coordinate overflows
+    if (polygon->repeatT)
+    {
+        // Flip the T-coordinate every second repeat
+        if (polygon->flipT && (t & polygon->sizeT))
+            t = -1 - t;
+
+        // Wrap the T-coordinate
+        t &= polygon->sizeT - 1;
+    }
+    else if (t < 0)
+    {
+        // Clamp the T-coordinate on the top
+        t = 0;
+    }
+    else if (t >= polygon->sizeT)
+    {
+        // Clamp the T-coordinate on the bottom
+        t = polygon->sizeT - 1;
+    }
+
+    // Read a texel from the decoded texture
+    return texture[t * polygon->sizeS + s];
+}
+
 void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
 {
     _Polygon *polygon = &core->gpu3D.getPolygons()[polygonIndex];
@@ -1014,7 +1353,7 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
         // Clear the stencil buffer at the start of a shadow mask polygon group
         if (!stencilClear[line])
         {
-            memset(&stencilBuffer[line * 256 * 2], 0, 256 << resShift);
+            memset(&stencilBuffer[line << (8 + resShift)], 0, 256 << resShift);
             stencilClear[line] = true;
         }
     }
@@ -1044,6 +1383,35 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
     int lastS = 0xFFFF, lastT = 0xFFFF;
     uint32_t texel;
 
+    // Interpolate the values that need division across the visible span up front, so it can be done a few pixels at a time
+    // Factors fall back to linear interpolation if the W values are equal and their lower bits are clear
+    uint32_t count = (x1 < (256U << resShift)) ? (std::min(x4, 256U << resShift) - x1) : 0;
+    bool linear = (we[0] == we[1] && !(we[0] & 0x007F));
+    uint32_t spanFactor[256 * 2], spanDepth[256 * 2];
+    uint32_t spanR[256 * 2], spanG[256 * 2], spanB[256 * 2];
+    uint32_t spanS[256 * 2], spanT[256 * 2];
+
+    if (linear)
+    {
+        if (polygon->wBuffer)
+            interpolateSpan(spanDepth, we[0], we[1], x1, x4, count);
+        interpolateSpan(spanR, re[0], re[1], x1, x4, count);
+        interpolateSpan(spanG, ge[0], ge[1], x1, x4, count);
+        interpolateSpan(spanB, be[0], be[1], x1, x4, count);
+        if (polygon->textureFmt != 0)
+        {
+            interpolateSpan(spanS, se[0] + 0xFFFF, se[1] + 0xFFFF, x1, x4, count);
+            interpolateSpan(spanT, te[0] + 0xFFFF, te[1] + 0xFFFF, x1, x4, count);
+        }
+    }
+    else
+    {
+        factorSpan(spanFactor, we[0], we[1], x1, x4, count);
+    }
+
+    if (!polygon->wBuffer)
+        interpolateSpan(spanDepth, ze[0], ze[1], x1, x4, count);
+
     // Draw a line segment
     for (uint32_t x = x1; x < x4; x++)
     {
@@ -1056,38 +1424,17 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
             break;
 
         bool layer = 0;
-        int i = line * 256 * 2 + x;
+        int i = (line << (8 + resShift)) + x;
 
-        // Calculate the interpolation factor with a precision of 8 bits for polygon fills
-        uint32_t factor;
-        if (we[0] == we[1] && !(we[0] & 0x007F))
-        {
-            // Fall back to linear interpolation if the W values are equal and their lower bits are clear
-            factor = -1;
-        }
-        else if (x <= x1)
-        {
-            // Clamp to the minimum value
-            factor = 0;
-        }
-        else if (x >= x4)
-        {
-            // Clamp to the maximum value
-            factor = (1 << 8);
-        }
-        else
-        {
-            // Adjust interpolation precision to avoid overflow in high-res mode
-            uint32_t s = (resShift & ((x - x1) >> 8));
-            factor = (((we[0] * (x - x1)) << (8 - s)) / (we[1] * (x4 - x) + we[0] * (x - x1))) << s;
-        }
+        // Get the interpolation factor at the current pixel
+        uint32_t k = x - x1;
+        uint32_t factor = linear ? -1 : spanFactor[k];
 
         // Calculate the depth value of the current pixel
         int32_t depth;
         if (polygon->wBuffer)
         {
-            depth = (factor == -1) ? interpolateLinear(we[0], we[1], x1, x, x4) :
-                interpolateFactor(factor, 8, we[0], we[1]);
+            depth = (factor == -1) ? spanDepth[k] : interpolateFactor(factor, 8, we[0], we[1]);
             if (polygon->wShift > 0)
                 depth <<= polygon->wShift;
             else if (polygon->wShift < 0)
@@ -1095,7 +1442,7 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
         }
         else
         {
-            depth = interpolateLinear(ze[0], ze[1], x1, x, x4);
+            depth = spanDepth[k];
         }
 
         // Depth test the pixel on the front layer, and on the back layer if under an anti-aliased edge
@@ -1147,9 +1494,9 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
         uint32_t rv, gv, bv;
         if (factor == -1)
         {
-            rv = interpolateLinear(re[0], re[1], x1, x, x4) >> 3;
-            gv = interpolateLinear(ge[0], ge[1], x1, x, x4) >> 3;
-            bv = interpolateLinear(be[0], be[1], x1, x, x4) >> 3;
+            rv = spanR[k] >> 3;
+            gv = spanG[k] >> 3;
+            bv = spanB[k] >> 3;
         }
         else
         {
@@ -1166,8 +1513,8 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
             int s, t;
             if (factor == -1)
             {
-                s = (int)(interpolateLinear(se[0] + 0xFFFF, se[1] + 0xFFFF, x1, x, x4) - 0xFFFF) >> 4;
-                t = (int)(interpolateLinear(te[0] + 0xFFFF, te[1] + 0xFFFF, x1, x, x4) - 0xFFFF) >> 4;
+                s = (int)(spanS[k] - 0xFFFF) >> 4;
+                t = (int)(spanT[k] - 0xFFFF) >> 4;
             }
             else
             {
@@ -1179,7 +1526,7 @@ void Gpu3DRenderer::drawPolygon(int line, int polygonIndex)
             if (s != lastS || t != lastT)
             {
                 lastS = s; lastT = t;
-                texel = readTexture(polygon, s, t);
+                texel = readTexture(polygon, polygonTex[polygonIndex], s, t);
             }
 
             // Apply texture blending
@@ -1379,3 +1726,21 @@ void Gpu3DRenderer::writeFogTable(int index, uint8_t value)
     fogTable[index] = value & 0x7F;
     core->gpu.invalidate3D();
 }
+
+void Gpu3DRenderer::syncState(SaveState &state)
+{
+    // Sync the rendering registers
+    // The buffers are redrawn from the synced geometry instead of being saved
+    state.sync(disp3DCnt);
+    state.sync(edgeColor);
+    state.sync(clearColor);
+    state.sync(clearDepth);
+    state.sync(fogColor);
+    state.sync(fogOffset);
+    state.sync(fogTable);
+    state.sync(toonTable);
+    if (!state.isLoading()) return;
+
+    // Stop the threads before the state changes under them
+    stopThreads();
+}
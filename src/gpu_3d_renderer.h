@@ -21,22 +21,69 @@
 #define GPU_3D_RENDERER_H
 
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Maximum number of threads that 3D scanlines can be split across
+#define MAX_3D_THREADS 8
+
+// Polygons are binned into bands of 8 scanlines at native resolution
+#define BIN_SHIFT 3
+#define BIN_COUNT (192 >> BIN_SHIFT)
+
+// Number of decoded texels that can be cached before the texture cache is dropped
+#define TEX_CACHE_LIMIT (8 << 20)
 
 class Core;
+class SaveState;
 struct Vertex;
 struct _Polygon;
 
-class Gpu3DRenderer
+// Interface for drawing the polygons from Gpu3D::getPolygons(), so something other than the software renderer can be plugged in
+// Render state comes from the Gpu3DRenderer registers, and output has to match the layout of the software renderer
+class Gpu3DBackend
+{
+    public:
+        virtual ~Gpu3DBackend() {}
+
+        // Called for each 3D scanline ahead of display, with line 0 starting a new frame of polygons
+        virtual void drawScanline(int line) = 0;
+
+        // Wait until the current frame is drawn, before its polygons are swapped out or a state is loaded
+        virtual void finishFrame() = 0;
+
+        // Get a finished scanline of RGBA6 pixels, with bit 26 set where drawn
+        // Scanlines follow each other in one buffer, and are 512 pixels wide when the frame is high-res
+        virtual uint32_t *getLine(int line) = 0;
+
+        // Check if the frame being drawn is high-res, which can lag behind the setting
+        virtual bool isHighRes() = 0;
+};
+
+class Gpu3DRenderer: public Gpu3DBackend
 {
     public:
         Gpu3DRenderer(Core *core);
         ~Gpu3DRenderer();
 
-        void drawScanline(int line);
+        void syncState(SaveState &state);
+
+        virtual void drawScanline(int line);
+        virtual void finishFrame();
+        virtual uint32_t *getLine(int line);
+        virtual bool isHighRes() { return resShift; }
 
-        uint32_t *getLine(int line);
+        uint16_t getEdgeColor(int index) { return edgeColor[index]; }
+        uint32_t getClearColor()         { return clearColor;       }
+        uint16_t getClearDepth()         { return clearDepth;       }
+        uint32_t getFogColor()           { return fogColor;         }
+        uint16_t getFogOffset()          { return fogOffset;        }
+        uint8_t  getFogTable(int index)  { return fogTable[index];  }
+        uint16_t getToonTable(int index) { return toonTable[index]; }
 
         uint16_t readDisp3DCnt() { return disp3DCnt; }
 
@@ -52,19 +99,40 @@ class Gpu3DRenderer
     private:
         Core *core;
 
+        // Buffers are sized for the current resolution, and only grow to high-res when it's enabled
         bool resShift = false;
-        uint32_t framebuffer[2][256 * 192 * 4] = {};
-        int32_t depthBuffer[2][256 * 192 * 4] = {};
-        uint32_t attribBuffer[2][256 * 192 * 4] = {};
-        uint8_t stencilBuffer[256 * 192 * 4] = {};
+        uint32_t *framebuffer[2] = {};
+        int32_t *depthBuffer[2] = {};
+        uint32_t *attribBuffer[2] = {};
+        uint8_t *stencilBuffer = nullptr;
+        size_t bufferSize = 0;
         bool stencilClear[256 * 2] = {};
 
         int polygonTop[2048] = {};
         int polygonBot[2048] = {};
 
+        // Polygons sorted into horizontal bands once per frame, in drawing order
+        std::vector<int> bins[BIN_COUNT];
+
+        // Textures decoded to RGBA6, keyed by their parameters and dropped whenever texture memory is remapped
+        std::unordered_map<uint64_t, std::vector<uint32_t>> texCache;
+        size_t texCacheSize = 0;
+        uint32_t texVersion = -1;
+        const uint32_t *polygonTex[2048] = {};
+
+        // Scanlines are claimed in order from a shared counter, by the worker threads or by the emulation thread
+        // Each scanline goes from 0 (waiting) to 1 (drawing), 2 (drawn), 3 (finishing), and finally 4 (finished)
+        // Threads sleep on condition variables between frames and while waiting for scanlines
         int activeThreads = 0;
-        std::thread *threads[3] = {};
+        int busyThreads = 0;
+        bool running = false;
+        uint32_t generation = 0;
+        std::thread *threads[MAX_3D_THREADS] = {};
         std::atomic<int> ready[192 * 2];
+        std::atomic<int> nextLine;
+        std::mutex mutex;
+        std::condition_variable workCond;
+        std::condition_variable doneCond;
 
         uint16_t disp3DCnt = 0;
         uint16_t edgeColor[8] = {};
@@ -75,13 +143,28 @@ class Gpu3DRenderer
         uint8_t fogTable[32] = {};
         uint16_t toonTable[32] = {};
 
+        // Fog densities for each depth with the bottom 9 bits dropped, and the fog parameters they were built from
+        uint8_t fogDensity[0x8000] = {};
+        bool densityValid = false;
+        uint16_t densityOffset = 0;
+        int densityStep = 0;
+        uint8_t densityTable[32] = {};
+
         static uint32_t rgba5ToRgba6(uint32_t color);
 
         uint32_t *getLine1(int line);
-
-        void drawThreaded(int thread);
+        void resizeBuffers();
+        void freeBuffers();
+
+        void startThreads(int count);
+        void stopThreads();
+        void drawThreaded();
+        int claimLine();
+        void drawClaimed(int line);
         void drawScanline1(int line);
         void finishScanline(int line);
+        void updateFogDensity();
+        uint8_t getFogDensity(int32_t depth);
 
         uint8_t *getTexture(uint32_t address);
         uint8_t *getPalette(uint32_t address);
@@ -90,8 +173,13 @@ class Gpu3DRenderer
         static uint32_t interpolateLinRev(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2);
         static uint32_t interpolateFactor(uint32_t factor, uint32_t shift, uint32_t v1, uint32_t v2);
         static uint32_t interpolateColor(uint32_t c1, uint32_t c2, uint32_t x1, uint32_t x, uint32_t x2);
+        static void interpolateSpan(uint32_t *values, uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x2, uint32_t count);
+        void factorSpan(uint32_t *factors, uint32_t w1, uint32_t w2, uint32_t x1, uint32_t x2, uint32_t count);
 
-        uint32_t readTexture(_Polygon *polygon, int s, int t);
+        void prepareTextures();
+        void decodeTexture(_Polygon *polygon, uint32_t *texture);
+        uint32_t decodeTexel(_Polygon *polygon, int s, int t);
+        uint32_t readTexture(_Polygon *polygon, const uint32_t *texture, int s, int t);
         void drawPolygon(int line, int polygonIndex);
 };
 
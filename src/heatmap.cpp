@@ -0,0 +1,103 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include "heatmap.h"
+
+Heatmap::~Heatmap()
+{
+    // Free the page tables
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < 0x100; j++)
+            delete[] pages[i][j];
+}
+
+uint64_t *Heatmap::allocTable(bool cpu, uint32_t address)
+{
+    // Allocate the counters for a 16MB region on its first access
+    uint64_t *&table = pages[cpu][address >> 24];
+    table = new uint64_t[0x1000 * HEAT_TYPES];
+    memset(table, 0, 0x1000 * HEAT_TYPES * sizeof(uint64_t));
+    return table;
+}
+
+void Heatmap::reset()
+{
+    // Clear all of the counts, keeping the tables that were already allocated
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 0x100; j++)
+        {
+            if (pages[i][j])
+                memset(pages[i][j], 0, 0x1000 * HEAT_TYPES * sizeof(uint64_t));
+        }
+        io[i].clear();
+    }
+}
+
+void Heatmap::dump(FILE *file)
+{
+    // List the pages that were accessed, with the most accessed first
+    fprintf(file, "# cpu page reads writes fallback_reads fallback_writes\n");
+    for (int i = 0; i < 2; i++)
+    {
+        std::vector<std::pair<uint64_t, uint32_t>> order;
+        for (uint32_t j = 0; j < 0x100; j++)
+        {
+            if (!pages[i][j]) continue;
+            for (uint32_t k = 0; k < 0x1000; k++)
+            {
+                uint64_t *counts = &pages[i][j][k * HEAT_TYPES], total = 0;
+                for (int t = 0; t < HEAT_TYPES; t++)
+                    total += counts[t];
+                if (total) order.push_back(std::make_pair(total, (j << 24) | (k << 12)));
+            }
+        }
+
+        std::sort(order.begin(), order.end(), [](const std::pair<uint64_t, uint32_t> &a,
+            const std::pair<uint64_t, uint32_t> &b) { return (a.first != b.first) ? (a.first > b.first) : (a.second < b.second); });
+        for (size_t j = 0; j < order.size(); j++)
+        {
+            uint32_t address = order[j].second;
+            uint64_t *counts = &pages[i][address >> 24][((address >> 12) & 0xFFF) * HEAT_TYPES];
+            fprintf(file, "ARM%d 0x%08X %llu %llu %llu %llu\n", i ? 7 : 9, address, (unsigned long long)counts[0],
+                (unsigned long long)counts[1], (unsigned long long)counts[2], (unsigned long long)counts[3]);
+        }
+    }
+
+    // List the I/O registers that were accessed, with the most accessed first
+    fprintf(file, "# cpu register reads writes\n");
+    for (int i = 0; i < 2; i++)
+    {
+        std::vector<std::pair<uint64_t, uint32_t>> order;
+        for (auto it = io[i].begin(); it != io[i].end(); it++)
+            order.push_back(std::make_pair(it->second.reads + it->second.writes, it->first));
+
+        std::sort(order.begin(), order.end(), [](const std::pair<uint64_t, uint32_t> &a,
+            const std::pair<uint64_t, uint32_t> &b) { return (a.first != b.first) ? (a.first > b.first) : (a.second < b.second); });
+        for (size_t j = 0; j < order.size(); j++)
+        {
+            IoCount &count = io[i][order[j].second];
+            fprintf(file, "ARM%d 0x%08X %llu %llu\n", i ? 7 : 9, order[j].second,
+                (unsigned long long)count.reads, (unsigned long long)count.writes);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "defines.h"
+
+enum HeatmapAccess
+{
+    HEAT_READ = 0,         // Read through the read map
+    HEAT_WRITE,            // Write through the write map
+    HEAT_FALLBACK_READ,    // Read that missed the read map
+    HEAT_FALLBACK_WRITE,   // Write that missed the write map
+    HEAT_TYPES
+};
+
+// Access counts for every 4KB page of the guest address space and every I/O register, for each CPU
+// Pages are counted in tables for each 16MB region, which are only allocated once something in them is accessed
+// The hooks that feed it are only built with HEATMAP defined, so it costs nothing otherwise
+class Heatmap
+{
+    public:
+        Heatmap() {}
+        ~Heatmap();
+
+        // Tables are owned by the heatmap and never copied
+        Heatmap(const Heatmap&) = delete;
+        Heatmap &operator=(const Heatmap&) = delete;
+
+        FORCE_INLINE void countPage(bool cpu, int type, uint32_t address)
+        {
+            // Count an access to the page containing the address
+            uint64_t *table = pages[cpu][address >> 24];
+            if (!table) table = allocTable(cpu, address);
+            table[((address >> 12) & 0xFFF) * HEAT_TYPES + type]++;
+        }
+
+        void countIo(bool cpu, bool write, uint32_t address)
+        {
+            // Count an access to an I/O register
+            IoCount &count = io[cpu][address];
+            (write ? count.writes : count.reads)++;
+        }
+
+        void reset();
+        void dump(FILE *file);
+
+    private:
+        struct IoCount
+        {
+            uint64_t reads = 0;
+            uint64_t writes = 0;
+        };
+
+        uint64_t *pages[2][0x100] = {};
+        std::unordered_map<uint32_t, IoCount> io[2];
+
+        uint64_t *allocTable(bool cpu, uint32_t address);
+};
+
+#endif // HEATMAP_H
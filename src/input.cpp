@@ -17,6 +17,8 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+
 #include "input.h"
 #include "core.h"
 
@@ -49,3 +51,110 @@ void Input::releaseScreen()
     // Set the pen down bit to indicate a touch release
     extKeyIn |= BIT(6);
 }
+
+void Input::queueKey(int key, bool pressed)
+{
+    // Skip events that don't change anything, like the releases some frontends send every frame
+    if (key < 0 || key >= 12) return;
+    uint32_t keys = latestKeys.load(std::memory_order_relaxed);
+    uint32_t value = pressed ? (keys | BIT(key)) : (keys & ~BIT(key));
+    if (value == keys) return;
+
+    // Queue a key press or release from the frontend
+    latestKeys.store(value, std::memory_order_relaxed);
+    pushEvent({ int16_t(key), pressed, 0, 0 });
+}
+
+void Input::queueScreen(bool pressed, int x, int y)
+{
+    // Keep the coordinates in the range of the touch screen
+    x = std::min(std::max(x, 0), 255);
+    y = std::min(std::max(y, 0), 191);
+
+    // Skip events that don't change anything, like repeated releases or touches that didn't move
+    uint32_t value = pressed ? (BIT(16) | (y << 8) | x) : 0;
+    if (value == latestScreen.load(std::memory_order_relaxed)) return;
+
+    // Queue a touch screen press, movement, or release from the frontend
+    latestScreen.store(value, std::memory_order_relaxed);
+    pushEvent({ -1, pressed, uint8_t(x), uint8_t(y) });
+}
+
+void Input::pushEvent(InputEvent event)
+{
+    // Add an event to the queue, or let the core know that it has to catch up if the queue is full
+    uint32_t head = queueHead.load(std::memory_order_relaxed);
+    if (head - queueTail.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+    {
+        overflow.store(true, std::memory_order_release);
+        return;
+    }
+    queue[head & (INPUT_QUEUE_SIZE - 1)] = event;
+    queueHead.store(head + 1, std::memory_order_release);
+}
+
+void Input::applyQueue()
+{
+    // Jump straight to the latest state if events were lost, since the queue can't be trusted anymore
+    if (overflow.exchange(false, std::memory_order_acquire))
+    {
+        queueTail.store(queueHead.load(std::memory_order_acquire), std::memory_order_release);
+        uint32_t keys = latestKeys.load(std::memory_order_relaxed);
+        uint32_t screen = latestScreen.load(std::memory_order_relaxed);
+        for (int i = 0; i < 12; i++)
+            (keys & BIT(i)) ? pressKey(i) : releaseKey(i);
+        applyScreen(screen & BIT(16), screen & 0xFF, (screen >> 8) & 0xFF);
+        return;
+    }
+
+    // Apply the queued events in order, stopping at one that would undo a change from earlier in the batch
+    // This way a press and release that both happen before a frame are still seen, on consecutive frames
+    uint32_t tail = queueTail.load(std::memory_order_relaxed);
+    uint32_t head = queueHead.load(std::memory_order_acquire);
+    uint32_t changed = 0;
+    for (; tail != head; tail++)
+    {
+        InputEvent &event = queue[tail & (INPUT_QUEUE_SIZE - 1)];
+        int index = (event.key < 0) ? 12 : event.key;
+        bool pressed;
+        if (index < 10) // A, B, select, start, right, left, up, down, R, L
+            pressed = !(keyInput & BIT(index));
+        else if (index < 12) // X, Y
+            pressed = !(extKeyIn & BIT(index - 10));
+        else // Touch screen
+            pressed = !(extKeyIn & BIT(6));
+
+        // Touch screen movements are applied as they come, since they don't release anything
+        if (event.pressed != pressed)
+        {
+            if (changed & BIT(index)) break;
+            changed |= BIT(index);
+        }
+        else if (index < 12 || !pressed)
+        {
+            continue;
+        }
+
+        // Apply the event to the input registers
+        if (index < 12)
+            event.pressed ? pressKey(event.key) : releaseKey(event.key);
+        else
+            applyScreen(event.pressed, event.x, event.y);
+    }
+    queueTail.store(tail, std::memory_order_release);
+}
+
+void Input::applyScreen(bool pressed, int x, int y)
+{
+    // Press the touch screen at the given coordinates, or release it
+    if (pressed)
+    {
+        pressScreen();
+        core->spi.setTouch(x, y);
+    }
+    else
+    {
+        releaseScreen();
+        core->spi.clearTouch();
+    }
+}
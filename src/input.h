@@ -20,10 +20,21 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include <atomic>
 #include <cstdint>
 
+// Number of input events that can be waiting for the core, which must be a power of 2
+#define INPUT_QUEUE_SIZE 0x100
+
 class Core;
 
+struct InputEvent
+{
+    int16_t key; // Key index, or -1 for the touch screen
+    bool pressed;
+    uint8_t x, y;
+};
+
 class Input
 {
     public:
@@ -34,14 +45,31 @@ class Input
         void pressScreen();
         void releaseScreen();
 
+        void setKeys(uint16_t keyInput, uint16_t extKeyIn) { this->keyInput = keyInput; this->extKeyIn = extKeyIn; }
+
         uint16_t readKeyInput() { return keyInput; }
         uint16_t readExtKeyIn() { return extKeyIn; }
 
+        void queueKey(int key, bool pressed);
+        void queueScreen(bool pressed, int x = 0, int y = 0);
+        void applyQueue();
+
     private:
         Core *core;
 
         uint16_t keyInput = 0x03FF;
         uint16_t extKeyIn = 0x007F;
+
+        // Events from a frontend thread, which the core applies at the start of each frame
+        // The queue has a single producer and consumer, so it only needs atomic positions to be lock-free
+        // The latest queued state is kept too, so the core can catch up to it if the queue ever overflows
+        InputEvent queue[INPUT_QUEUE_SIZE] = {};
+        std::atomic<uint32_t> queueHead{0}, queueTail{0};
+        std::atomic<uint32_t> latestKeys{0}, latestScreen{0};
+        std::atomic<bool> overflow{false};
+
+        void pushEvent(InputEvent event);
+        void applyScreen(bool pressed, int x, int y);
 };
 
 #endif // INPUT_H
@@ -19,6 +19,7 @@
 
 #include "interpreter.h"
 #include "core.h"
+#include "settings.h"
 
 Interpreter::Interpreter(Core *core, bool arm7): core(core), arm7(arm7)
 {
@@ -27,6 +28,13 @@ Interpreter::Interpreter(Core *core, bool arm7): core(core), arm7(arm7)
         registers[i] = &registersUsr[i & 0xF];
 }
 
+Interpreter::~Interpreter()
+{
+    // Free all of the cached code blocks
+    for (uint32_t i = 0; i < CODE_PAGES; i++)
+        invalidateBlocks(i);
+}
+
 void Interpreter::init()
 {
     // Prepare to boot the BIOS
@@ -59,7 +67,9 @@ void Interpreter::resetCycles()
     cycles -= std::min(core->globalCycles, cycles);
 }
 
-void Interpreter::runNdsFrame(Core &core)
+template void Interpreter::runNdsFrame<false>(Core &core);
+template void Interpreter::runNdsFrame<true>(Core &core);
+template <bool cached> void Interpreter::runNdsFrame(Core &core)
 {
     Interpreter &arm9 = core.interpreter[0];
     Interpreter &arm7 = core.interpreter[1];
@@ -67,19 +77,67 @@ void Interpreter::runNdsFrame(Core &core)
     // Run a frame in NDS mode
     while (core.running.exchange(true))
     {
-        // Run the CPUs until the next scheduled task
-        while (core.events[0].cycles > core.globalCycles)
+        if (Settings::cpuSlice > 0)
         {
-            // Run the ARM9
-            if (!arm9.halted && core.globalCycles >= arm9.cycles)
-                arm9.cycles = core.globalCycles + arm9.runOpcode();
-
-            // Run the ARM7 at half the speed of the ARM9
-            if (!arm7.halted && core.globalCycles >= arm7.cycles)
-                arm7.cycles = core.globalCycles + (arm7.runOpcode() << 1);
-
-            // Count cycles up to the next soonest event
-            core.globalCycles = std::min<uint32_t>((arm9.halted ? -1 : arm9.cycles), (arm7.halted ? -1 : arm7.cycles));
+            // Run the CPUs in slices until the next scheduled task, with the ARM9 running first
+            while (core.events[0].cycles > core.globalCycles)
+            {
+                // Start a slice, ending it early if a task is due first
+                uint32_t start = core.globalCycles;
+                core.sliceEnd = std::min<uint32_t>(core.events[0].cycles, start + Settings::cpuSlice);
+
+                // Run the ARM9 until the end of the slice; sync points and new events can shorten it
+                if (arm9.cycles < start) arm9.cycles = start;
+                while (!arm9.halted && arm9.cycles < std::min(core.sliceEnd, core.events[0].cycles))
+                {
+                    core.globalCycles = arm9.cycles;
+                    arm9.cycles += arm9.template runOpcode<cached>();
+                }
+
+                // Run the ARM7 at half the speed of the ARM9, catching up to where the ARM9 stopped
+                // The end is re-read every opcode, so a sync point hit by the ARM7 hands control back too
+                if (!arm9.halted) core.sliceEnd = arm9.cycles;
+                if (arm7.cycles < start) arm7.cycles = start;
+                while (!arm7.halted && arm7.cycles < std::min(core.sliceEnd, core.events[0].cycles))
+                {
+                    core.globalCycles = arm7.cycles;
+                    arm7.cycles += arm7.template runOpcode<cached>() << 1;
+                }
+
+                // Count cycles up to the soonest CPU
+                core.globalCycles = std::min<uint32_t>((arm9.halted ? -1 : arm9.cycles), (arm7.halted ? -1 : arm7.cycles));
+            }
+        }
+        else
+        {
+            // Run the CPUs until the next scheduled task
+            while (core.events[0].cycles > core.globalCycles)
+            {
+                // Run the ARM9, and keep running it on its own while the ARM7 is halted
+                if (!arm9.halted && core.globalCycles >= arm9.cycles)
+                {
+                    arm9.cycles = core.globalCycles + arm9.template runOpcode<cached>();
+                    while (arm7.halted && !arm9.halted && core.events[0].cycles > arm9.cycles)
+                    {
+                        core.globalCycles = arm9.cycles;
+                        arm9.cycles += arm9.template runOpcode<cached>();
+                    }
+                }
+
+                // Run the ARM7 at half the speed of the ARM9, and keep running it on its own while the ARM9 is halted
+                if (!arm7.halted && core.globalCycles >= arm7.cycles)
+                {
+                    arm7.cycles = core.globalCycles + (arm7.template runOpcode<cached>() << 1);
+                    while (arm9.halted && !arm7.halted && core.events[0].cycles > arm7.cycles)
+                    {
+                        core.globalCycles = arm7.cycles;
+                        arm7.cycles += arm7.template runOpcode<cached>() << 1;
+                    }
+                }
+
+                // Count cycles up to the next soonest event
+                core.globalCycles = std::min<uint32_t>((arm9.halted ? -1 : arm9.cycles), (arm7.halted ? -1 : arm7.cycles));
+            }
         }
 
         // Jump to the next scheduled task
@@ -87,14 +145,13 @@ void Interpreter::runNdsFrame(Core &core)
 
         // Run all tasks that are scheduled now
         while (core.events[0].cycles <= core.globalCycles)
-        {
-            (*core.events[0].task)();
-            core.events.erase(core.events.begin());
-        }
+            core.runEvent();
     }
 }
 
-void Interpreter::runGbaFrame(Core &core)
+template void Interpreter::runGbaFrame<false>(Core &core);
+template void Interpreter::runGbaFrame<true>(Core &core);
+template <bool cached> void Interpreter::runGbaFrame(Core &core)
 {
     Interpreter &arm7 = core.interpreter[1];
 
@@ -104,22 +161,35 @@ void Interpreter::runGbaFrame(Core &core)
         // Run the ARM7 until the next scheduled task
         if (arm7.cycles > core.globalCycles) core.globalCycles = arm7.cycles;
         while (!arm7.halted && core.events[0].cycles > arm7.cycles)
-            arm7.cycles = (core.globalCycles += arm7.runOpcode());
+            arm7.cycles = (core.globalCycles += arm7.template runOpcode<cached>());
 
         // Jump to the next scheduled task
         core.globalCycles = core.events[0].cycles;
 
         // Run all tasks that are scheduled now
         while (core.events[0].cycles <= core.globalCycles)
-        {
-            (*core.events[0].task)();
-            core.events.erase(core.events.begin());
-        }
+            core.runEvent();
     }
 }
 
-FORCE_INLINE int Interpreter::runOpcode()
+template <bool cached> FORCE_INLINE int Interpreter::runOpcode()
 {
+    if (cached)
+    {
+        // Run the next opcode from a cached block if the current one can continue
+        if (curOpcode != endOpcode && *registers[15] == blockPc && (cpsr & BIT(5)) == blockThumb)
+            return runCachedOpcode();
+
+        // Move to a new block, adding any cycles that were skipped by an idle loop
+        int skip = loadBlock();
+        if (skip >= 0)
+            return runCachedOpcode() + skip;
+
+        // Fall back to normal execution if the code can't be cached, filling the pipeline if it was bypassed
+        if (pipelineStale)
+            reloadPipeline();
+    }
+
     // Push the next opcode through the pipeline
     uint32_t opcode = pipeline[0];
     pipeline[0] = pipeline[1];
@@ -128,26 +198,363 @@ FORCE_INLINE int Interpreter::runOpcode()
     if (cpsr & BIT(5)) // THUMB mode
     {
         // Fill the pipeline, incrementing the program counter
+        TRACE_OPCODE((*registers[15] - 2) | BIT(0));
         pipeline[1] = core->memory.read<uint16_t>(arm7, *registers[15] += 2);
+        PROFILE_COUNT(core->profileTotals.opcodes[arm7][1]);
 
         // Execute a THUMB instruction
-        return (this->*thumbInstrs[(opcode >> 6) & 0x3FF])(opcode);
+        return (this->*thumbInstrs[arm7][(opcode >> 6) & 0x3FF])(opcode);
     }
     else // ARM mode
     {
         // Fill the pipeline, incrementing the program counter
+        TRACE_OPCODE(*registers[15] - 4);
         pipeline[1] = core->memory.read<uint32_t>(arm7, *registers[15] += 4);
+        PROFILE_COUNT(core->profileTotals.opcodes[arm7][0]);
 
         // Execute an ARM instruction based on its condition
         switch (condition[((opcode >> 24) & 0xF0) | (cpsr >> 28)])
         {
             case 0:  return 1;                      // False
             case 2:  return handleReserved(opcode); // Reserved
-            default: return (this->*armInstrs[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)])(opcode);
+            default: return (this->*armInstrs[arm7][((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)])(opcode);
         }
     }
 }
 
+FORCE_INLINE int Interpreter::runCachedOpcode()
+{
+    // Get the next opcode, and mark the pipeline as out of date since it's bypassed
+    CachedOpcode *op = curOpcode++;
+    pipelineStale = true;
+    PROFILE_COUNT(core->profileTotals.opcodes[arm7][blockThumb != 0]);
+
+    // Increment the program counter as if the opcode went through the pipeline
+    // The new value is saved to detect when the opcode jumps somewhere else
+    if (blockThumb) // THUMB mode
+    {
+        // Execute a THUMB instruction
+        TRACE_OPCODE((*registers[15] - 2) | BIT(0));
+        blockPc = (*registers[15] += 2);
+        return (this->*op->thumb)(op->opcode);
+    }
+    else // ARM mode
+    {
+        // Execute an ARM instruction based on its condition
+        TRACE_OPCODE(*registers[15] - 4);
+        blockPc = (*registers[15] += 4);
+        switch (condition[op->condition | (cpsr >> 28)])
+        {
+            case 0:  return 1;                          // False
+            case 2:  return handleReserved(op->opcode); // Reserved
+            default: return (this->*op->arm)(op->opcode);
+        }
+    }
+}
+
+int Interpreter::loadBlock()
+{
+    // Run opcodes from the pipeline if they were fetched before their block was invalidated
+    if (pipelineHold)
+    {
+        pipelineHold--;
+        return -1;
+    }
+
+    // Get the block at the program counter, or stop running from blocks if there isn't one
+    CachedOpcode *lastOpcode = curOpcode;
+    CodeBlock *block = getBlock();
+    if (!block)
+    {
+        flushBlock();
+        return -1;
+    }
+
+    // Prepare to run opcodes from the start of the block
+    curOpcode = &block->opcodes[0];
+    endOpcode = curOpcode + block->opcodes.size();
+    blockPc = *registers[15];
+    blockThumb = cpsr & BIT(5);
+
+    // Skip ahead if the block is an idle loop that just branched back to its start
+    if (block->idleLength && lastOpcode == curOpcode + block->idleLength && Settings::idleLoopSkip)
+        return skipIdleLoop(block);
+    return 0;
+}
+
+CodeBlock *Interpreter::getBlock()
+{
+    // Get a pointer to the next opcode, or give up if it isn't in memory that can be cached
+    bool thumb = cpsr & BIT(5);
+    uint32_t address = *registers[15] - (thumb ? 2 : 4);
+    uint8_t *data = core->memory.getCodePointer(arm7, address);
+    if (!data) return nullptr;
+
+    // Look up the block that starts at the opcode, and return it if it was decoded in the current mode
+    uint32_t index = core->memory.getCodeIndex(data);
+    blockPage = index >> 12;
+    if (!blockMap[index >> 12])
+        blockMap[index >> 12] = new CodeBlock*[0x800]();
+    CodeBlock *&block = blockMap[index >> 12][(index & 0xFFF) >> 1];
+    if (block && block->thumb == thumb)
+        return block;
+
+    // Start a new block, replacing one decoded in the other mode if necessary
+    if (!block) block = new CodeBlock();
+    block->thumb = thumb;
+    block->opcodes.clear();
+
+    // Decode opcodes until the end of the host or guest page, the block size limit, or an unconditional branch
+    // Stopping at page boundaries ensures that blocks only need to be invalidated through a single page
+    uint32_t size = std::min(0x1000 - (index & 0xFFF), 0x1000 - (address & 0xFFF));
+    for (uint32_t i = 0; i < size && block->opcodes.size() < 64; i += (thumb ? 2 : 4))
+    {
+        CachedOpcode op;
+
+        if (thumb) // THUMB mode
+        {
+            // Look up the THUMB instruction; these use no condition codes outside of their handlers
+            op.opcode = U8TO16(data, i);
+            op.thumb = thumbInstrs[arm7][(op.opcode >> 6) & 0x3FF];
+            op.condition = 0xE0;
+            block->opcodes.push_back(op);
+
+            // End the block on an unconditional branch or a register jump
+            if ((op.opcode & 0xF800) == 0xE000 || (op.opcode & 0xFF00) == 0x4700)
+                break;
+        }
+        else // ARM mode
+        {
+            // Look up the ARM instruction and save its condition for checking at runtime
+            op.opcode = U8TO32(data, i);
+            op.arm = armInstrs[arm7][((op.opcode >> 16) & 0xFF0) | ((op.opcode >> 4) & 0xF)];
+            op.condition = (op.opcode >> 24) & 0xF0;
+            block->opcodes.push_back(op);
+
+            // End the block on an unconditional branch or register jump
+            if ((op.opcode & 0xFE000000) == 0xEA000000 || (op.opcode & 0xFFFFFFF0) == 0xE12FFF10)
+                break;
+        }
+    }
+
+    // Check if the block starts with a loop that can be skipped
+    detectIdleLoop(block, address);
+
+    // Flag the page as containing code so writes to it will invalidate the block
+    core->memory.markCode(arm7, index >> 12);
+    return block;
+}
+
+void Interpreter::detectIdleLoop(CodeBlock *block, uint32_t address)
+{
+    block->idleLength = 0;
+    block->idleLoads.clear();
+
+    // Look for a short loop at the start of the block and note which registers it reads and writes
+    // Bit 16 stands in for the condition flags, and a load base of 16 means the address is absolute
+    uint32_t reads[8], writes[8], writeMask = 0;
+    uint8_t writeCount[17] = {};
+    std::vector<IdleLoad> loads;
+    size_t length = 0;
+
+    for (size_t i = 0; i < block->opcodes.size() && i < 8 && !length; i++)
+    {
+        uint32_t op = block->opcodes[i].opcode;
+        uint32_t pc = address + (i << (block->thumb ? 1 : 2));
+        reads[i] = writes[i] = 0;
+
+        if (block->thumb) // THUMB mode
+        {
+            if ((op & 0xF000) == 0xD000 && ((op >> 8) & 0xF) < 0xE) // B<cond>
+            {
+                // End the loop on a conditional branch back to the start of the block
+                if (pc + 4 + ((int8_t)op << 1) != address) return;
+                reads[i] = BIT(16);
+                length = i + 1;
+            }
+            else if ((op & 0xF800) == 0xE000) // B
+            {
+                // End the loop on an unconditional branch back to the start of the block
+                if (pc + 4 + ((int16_t)(op << 5) >> 4) != address) return;
+                length = i + 1;
+            }
+            else if ((op & 0xF800) == 0x4800) // LDR Rd,[PC,#i]
+            {
+                loads.push_back({((pc + 4) & ~0x3) + ((op & 0xFF) << 2), 16});
+                writes[i] = BIT((op >> 8) & 0x7);
+            }
+            else if ((op & 0xF800) == 0x6800 || (op & 0xF800) == 0x7800 || (op & 0xF800) == 0x8800) // LDR/LDRB/LDRH Rd,[Rb,#i]
+            {
+                int shift = ((op & 0xF800) == 0x6800) ? 2 : ((op & 0xF800) == 0x8800);
+                loads.push_back({((op >> 6) & 0x1F) << shift, (uint8_t)((op >> 3) & 0x7)});
+                reads[i] = BIT((op >> 3) & 0x7);
+                writes[i] = BIT(op & 0x7);
+            }
+            else if ((op & 0xE000) == 0x2000) // MOV/CMP/ADD/SUB Rd,#i
+            {
+                int sub = (op >> 11) & 0x3;
+                reads[i] = (sub != 0) ? BIT((op >> 8) & 0x7) : 0;
+                writes[i] = ((sub != 1) ? BIT((op >> 8) & 0x7) : 0) | BIT(16);
+            }
+            else if ((op & 0xE000) == 0x0000 && (op & 0x1800) != 0x1800) // LSL/LSR/ASR Rd,Rs,#i
+            {
+                reads[i] = BIT((op >> 3) & 0x7);
+                writes[i] = BIT(op & 0x7) | BIT(16);
+            }
+            else if ((op & 0xFC00) == 0x4000) // ALU operations
+            {
+                int sub = (op >> 6) & 0xF;
+                reads[i] = BIT((op >> 3) & 0x7) | ((sub != 9 && sub != 15) ? BIT(op & 0x7) : 0) |
+                    ((sub == 5 || sub == 6) ? BIT(16) : 0);
+                writes[i] = ((sub != 8 && sub != 10 && sub != 11) ? BIT(op & 0x7) : 0) | BIT(16);
+            }
+            else
+            {
+                return;
+            }
+        }
+        else // ARM mode
+        {
+            if ((op & 0x0F000000) == 0x0A000000 && (op >> 28) != 0xF) // B<cond>
+            {
+                // End the loop on a branch back to the start of the block
+                if (pc + 8 + ((int32_t)(op << 8) >> 6) != address) return;
+                reads[i] = ((op >> 28) != 0xE) ? BIT(16) : 0;
+                length = i + 1;
+                continue;
+            }
+
+            // Only allow unconditional opcodes in the loop body, and never write to the program counter
+            uint32_t rn = (op >> 16) & 0xF, rd = (op >> 12) & 0xF;
+            if ((op >> 28) != 0xE || rd == 15) return;
+
+            if ((op & 0x0F300000) == 0x05100000 && !(op & BIT(25))) // LDR/LDRB Rd,[Rn,#i]
+            {
+                uint32_t offset = (op & BIT(23)) ? (op & 0xFFF) : -(op & 0xFFF);
+                loads.push_back((rn == 15) ? IdleLoad({pc + 8 + offset, 16}) : IdleLoad({offset, (uint8_t)rn}));
+                reads[i] = (rn != 15) ? BIT(rn) : 0;
+                writes[i] = BIT(rd);
+            }
+            else if ((op & 0x0F700090) == 0x01500090 && (op & 0x60)) // LDRH/LDRSB/LDRSH Rd,[Rn,#i]
+            {
+                uint32_t offset = ((op >> 4) & 0xF0) | (op & 0xF);
+                if (!(op & BIT(23))) offset = -offset;
+                loads.push_back((rn == 15) ? IdleLoad({pc + 8 + offset, 16}) : IdleLoad({offset, (uint8_t)rn}));
+                reads[i] = (rn != 15) ? BIT(rn) : 0;
+                writes[i] = BIT(rd);
+            }
+            else if ((op & 0x0C000000) == 0 && ((op & BIT(25)) || !(op & BIT(4)))) // Data processing with an immediate shift
+            {
+                // Reject status register transfers and anything that reads the program counter
+                uint32_t sub = (op >> 21) & 0xF, rm = op & 0xF;
+                if ((sub >> 2) == 2 && !(op & BIT(20))) return;
+                if (rn == 15 || (!(op & BIT(25)) && rm == 15)) return;
+
+                reads[i] = ((sub != 13 && sub != 15) ? BIT(rn) : 0) | (!(op & BIT(25)) ? BIT(rm) : 0) |
+                    ((sub >= 5 && sub <= 7) ? BIT(16) : 0);
+                writes[i] = (((sub >> 2) != 2) ? BIT(rd) : 0) | ((op & BIT(20)) ? BIT(16) : 0);
+            }
+            else
+            {
+                return;
+            }
+        }
+
+        // Track how many times each register is written by the loop
+        writeMask |= writes[i];
+        for (int j = 0; j < 17; j++)
+            writeCount[j] += (writes[i] >> j) & 1;
+    }
+
+    if (!length) return;
+
+    // Make sure every iteration does the same thing, so registers must never be read before the loop writes them
+    // Load bases written during the loop must only be written once, so their current values can be used for checks
+    uint32_t written = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (reads[i] & writeMask & ~written) return;
+        written |= writes[i];
+    }
+    for (size_t i = 0; i < loads.size(); i++)
+        if (loads[i].base != 16 && writeCount[loads[i].base] > 1) return;
+
+    // Mark the loop as idle, keeping its loads so their addresses can be checked when skipping
+    block->idleLength = length;
+    block->idleLoads = loads;
+}
+
+int Interpreter::skipIdleLoop(CodeBlock *block)
+{
+    // Only skip loops that poll I/O registers changed by interrupts or scheduled tasks
+    // Memory and the IPC registers can be changed by the other CPU at any time, so loops that read them aren't idle
+    for (size_t i = 0; i < block->idleLoads.size(); i++)
+    {
+        // Loads relative to the program counter read constants from the code's literal pool
+        IdleLoad &load = block->idleLoads[i];
+        if (load.base == 16) continue;
+
+        uint32_t address = *registers[load.base] + load.offset;
+        if ((address >> 24) != 0x04) return 0;
+
+        switch (address & ~0x3)
+        {
+            case 0x4000004: // DISPSTAT/VCOUNT
+            case 0x4000130: // KEYINPUT
+            case 0x4000134: // EXTKEYIN
+            case 0x4000200: // GBA IE/IF
+            case 0x4000208: // IME
+            case 0x4000210: // IE
+            case 0x4000214: // IF
+                continue;
+
+            default:
+                return 0;
+        }
+    }
+
+    // Count cycles up to the next scheduled task, as if the CPU was halted until then
+    if (core->events[0].cycles <= core->globalCycles) return 0;
+    uint32_t skip = core->events[0].cycles - core->globalCycles;
+    idleCycles += skip;
+
+    // Convert to ARM7 cycles, which run at half the speed of the ARM9 in NDS mode
+    return (arm7 && !core->gbaMode) ? ((skip + 1) >> 1) : skip;
+}
+
+void Interpreter::invalidateBlocks(uint32_t page)
+{
+    if (!blockMap[page]) return;
+
+    // Move the next opcodes of the current block into the pipeline if it's in the page, since they would have already been fetched
+    // This keeps self-modifying code behaving the same as when running without blocks
+    bool current = (curOpcode && page == blockPage);
+    if (current)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (curOpcode + i < endOpcode)
+                pipeline[i] = curOpcode[i].opcode;
+            else if (blockThumb)
+                pipeline[i] = core->memory.read<uint16_t>(arm7, *registers[15] + (i - 1) * 2);
+            else
+                pipeline[i] = core->memory.read<uint32_t>(arm7, *registers[15] + (i - 1) * 4);
+        }
+
+        pipelineStale = false;
+        pipelineHold = 2;
+    }
+
+    // Free all the code blocks decoded from a page
+    for (int i = 0; i < 0x800; i++)
+        delete blockMap[page][i];
+    delete[] blockMap[page];
+    blockMap[page] = nullptr;
+
+    // Stop running from the current block if it was freed
+    if (current) flushBlock();
+}
+
 void Interpreter::sendInterrupt(int bit)
 {
     // Set the interrupt's request bit
@@ -158,9 +565,25 @@ void Interpreter::sendInterrupt(int bit)
     if (ie & irf)
     {
         if (ime && !(cpsr & BIT(7)))
-            core->schedule(SchedTask(ARM9_INTERRUPT + arm7), (arm7 && !core->gbaMode) + 1);
+        {
+            uint32_t delay = (arm7 && !core->gbaMode) + 1;
+            if (halted == BIT(0))
+            {
+                // Take the interrupt right away if the CPU is only halted, since it can't change the conditions
+                // It still resumes after the delay, so this saves a round trip through the scheduler
+                core->unschedule(SchedTask(ARM9_INTERRUPT + arm7));
+                interrupt();
+                cycles = std::max(cycles, core->globalCycles + delay);
+            }
+            else
+            {
+                core->schedule(SchedTask(ARM9_INTERRUPT + arm7), delay);
+            }
+        }
         else if (ime || arm7)
+        {
             halted &= ~BIT(0);
+        }
     }
 }
 
@@ -204,6 +627,27 @@ void Interpreter::flushPipeline()
         pipeline[0] = core->memory.read<uint32_t>(arm7, *registers[15] - 4);
         pipeline[1] = core->memory.read<uint32_t>(arm7, *registers[15]);
     }
+    pipelineStale = false;
+    pipelineHold = 0;
+
+    // Record the jump destination if tracing, with bit 0 set for THUMB code
+    TRACE_BRANCH((*registers[15] - ((cpsr & BIT(5)) ? 2 : 4)) | ((cpsr & BIT(5)) >> 5));
+}
+
+void Interpreter::reloadPipeline()
+{
+    // Refill the pipeline at the current program counter without jumping
+    if (cpsr & BIT(5)) // THUMB mode
+    {
+        pipeline[0] = core->memory.read<uint16_t>(arm7, *registers[15] - 2);
+        pipeline[1] = core->memory.read<uint16_t>(arm7, *registers[15]);
+    }
+    else // ARM mode
+    {
+        pipeline[0] = core->memory.read<uint32_t>(arm7, *registers[15] - 4);
+        pipeline[1] = core->memory.read<uint32_t>(arm7, *registers[15]);
+    }
+    pipelineStale = false;
 }
 
 void Interpreter::setCpsr(uint32_t value, bool save)
@@ -367,6 +811,18 @@ int Interpreter::unkThumb(uint16_t opcode)
     return 1;
 }
 
+int Interpreter::arm9Exclusive(uint32_t opcode)
+{
+    // Ignore an ARM opcode that only exists on the ARM9, which the ARM7 lookup table uses in its place
+    return 1;
+}
+
+int Interpreter::arm9ExclusiveT(uint16_t opcode)
+{
+    // Ignore a THUMB opcode that only exists on the ARM9, which the ARM7 lookup table uses in its place
+    return 1;
+}
+
 void Interpreter::writeIme(uint8_t value)
 {
     // Write to the IME register
@@ -403,3 +859,50 @@ void Interpreter::writePostFlg(uint8_t value)
     postFlg |= value & 0x01;
     if (!arm7) postFlg = (postFlg & ~0x02) | (value & 0x02);
 }
+
+void Interpreter::syncState(SaveState &state)
+{
+    // Sync the pipeline and registers of each CPU mode
+    state.sync(pipeline);
+    state.sync(registersUsr);
+    state.sync(registersFiq);
+    state.sync(registersSvc);
+    state.sync(registersAbt);
+    state.sync(registersIrq);
+    state.sync(registersUnd);
+    state.sync(spsrFiq);
+    state.sync(spsrSvc);
+    state.sync(spsrAbt);
+    state.sync(spsrIrq);
+    state.sync(spsrUnd);
+
+    // Sync the CPSR through a copy, so the banked registers can be switched to match after loading
+    uint32_t value = cpsr;
+    state.sync(value);
+    if (state.isLoading()) setCpsr(value);
+
+    // Sync the CPU state and interrupt registers
+    state.sync(halted);
+    state.sync(cycles);
+    state.sync(ime);
+    state.sync(ie);
+    state.sync(irf);
+    state.sync(postFlg);
+    state.sync(pipelineStale);
+    state.sync(pipelineHold);
+
+    // Sync which HLE BIOS is in use, if any
+    int8_t index = bios ? (bios - core->bios) : -1;
+    state.sync(index);
+    if (state.isLoading())
+        bios = (index >= 0 && index < 3) ? &core->bios[index] : nullptr;
+
+    // Stop running from the current block, so execution resumes the same way after saving or loading
+    // Snapshots don't free the cached blocks, since memory drops the ones in pages that it restores
+    flushBlock();
+    if (!state.isLoading() || state.isSnapshot()) return;
+
+    // Free all cached blocks, since the code they were decoded from may have changed
+    for (uint32_t i = 0; i < CODE_PAGES; i++)
+        invalidateBlocks(i);
+}
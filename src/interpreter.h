@@ -21,23 +21,60 @@
 #define INTERPRETER_H
 
 #include <cstdint>
+#include <vector>
 
 #include "defines.h"
+#include "exec_trace.h"
+#include "memory.h"
 
 class Core;
+class SaveState;
 class Bios;
+class Interpreter;
+
+struct CachedOpcode
+{
+    union
+    {
+        int (Interpreter::*arm)(uint32_t);
+        int (Interpreter::*thumb)(uint16_t);
+    };
+
+    uint32_t opcode;
+    uint8_t condition;
+};
+
+struct IdleLoad
+{
+    uint32_t offset;
+    uint8_t base;
+};
+
+struct CodeBlock
+{
+    bool thumb;
+    uint8_t idleLength;
+    std::vector<CachedOpcode> opcodes;
+    std::vector<IdleLoad> idleLoads;
+};
 
 class Interpreter
 {
     public:
+#ifdef EXEC_TRACE
+        ExecTrace execTrace;
+#endif
+
         Interpreter(Core *core, bool arm7);
+        ~Interpreter();
 
         void init();
         void directBoot();
         void resetCycles();
+        void syncState(SaveState &state);
 
-        static void runNdsFrame(Core &core);
-        static void runGbaFrame(Core &core);
+        template <bool cached> static void runNdsFrame(Core &core);
+        template <bool cached> static void runGbaFrame(Core &core);
 
         void halt(int bit)   { halted |=  BIT(bit); }
         void unhalt(int bit) { halted &= ~BIT(bit); }
@@ -60,6 +97,10 @@ class Interpreter
         void writeIrf(uint32_t mask, uint32_t value);
         void writePostFlg(uint8_t value);
 
+        void invalidateBlocks(uint32_t page);
+        void flushBlock() { curOpcode = endOpcode = nullptr; }
+        uint32_t takeIdleCycles() { uint32_t value = idleCycles; idleCycles = 0; return value; }
+
     private:
         Core *core;
         bool arm7;
@@ -85,13 +126,47 @@ class Interpreter
         uint32_t ie = 0, irf = 0;
         uint8_t postFlg = 0;
 
-        static int (Interpreter::*armInstrs[0x1000])(uint32_t);
-        static int (Interpreter::*thumbInstrs[0x400])(uint16_t);
+        // Tables of decoded blocks for each halfword of the host pages that code was cached from
+        CodeBlock **blockMap[CODE_PAGES] = {};
+        CachedOpcode *curOpcode = nullptr;
+        CachedOpcode *endOpcode = nullptr;
+        uint32_t blockPc = 0;
+        uint32_t blockThumb = 0;
+        uint32_t blockPage = 0;
+        bool pipelineStale = false;
+        uint8_t pipelineHold = 0;
+        uint32_t idleCycles = 0;
+
+        typedef int (Interpreter::*ArmInstr)(uint32_t);
+        typedef int (Interpreter::*ThumbInstr)(uint16_t);
+
+        static ArmInstr const armInstrs[2][0x1000];
+        static ThumbInstr const thumbInstrs[2][0x400];
 
         static const uint8_t condition[0x100];
         static const uint8_t bitCount[0x100];
 
-        int runOpcode();
+        static constexpr ArmInstr armAlu(uint32_t op, bool imm, uint32_t shift);
+        static constexpr ArmInstr armMultiply(uint32_t hi);
+        static constexpr ArmInstr armHalfword(bool arm7, uint32_t hi, uint32_t lo);
+        static constexpr ArmInstr armMisc(bool arm7, uint32_t hi, uint32_t lo);
+        static constexpr ArmInstr armRegister(bool arm7, uint32_t hi, uint32_t lo);
+        static constexpr ArmInstr armImmediate(uint32_t hi);
+        static constexpr ArmInstr armTransfer(uint32_t hi, uint32_t shift);
+        static constexpr ArmInstr armBlock(uint32_t hi);
+        static constexpr ArmInstr decodeArm(bool arm7, uint32_t hi, uint32_t lo);
+        static constexpr ThumbInstr thumbAlu(bool arm7, uint32_t index);
+        static constexpr ThumbInstr thumbTransfer(uint32_t index);
+        static constexpr ThumbInstr thumbBranch(uint32_t index);
+        static constexpr ThumbInstr decodeThumb(bool arm7, uint32_t index);
+
+        template <bool cached> int runOpcode();
+        int runCachedOpcode();
+        int loadBlock();
+        CodeBlock *getBlock();
+        void detectIdleLoop(CodeBlock *block, uint32_t address);
+        int skipIdleLoop(CodeBlock *block);
+        void reloadPipeline();
         int exception(uint8_t vector);
         void flushPipeline();
         void setCpsr(uint32_t value, bool save = false);
@@ -100,6 +175,8 @@ class Interpreter
 
         int unkArm(uint32_t opcode);
         int unkThumb(uint16_t opcode);
+        int arm9Exclusive(uint32_t opcode);
+        int arm9ExclusiveT(uint16_t opcode);
 
         int32_t clampQ(int64_t value);
 
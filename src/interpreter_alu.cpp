@@ -853,7 +853,6 @@ int Interpreter::smlals(uint32_t opcode) // SMLALS RdLo,RdHi,Rm,Rs
 int Interpreter::smulbb(uint32_t opcode) // SMULBB Rd,Rm,Rs
 {
     // Signed half-word multiplication
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF];
@@ -864,7 +863,6 @@ int Interpreter::smulbb(uint32_t opcode) // SMULBB Rd,Rm,Rs
 int Interpreter::smulbt(uint32_t opcode) // SMULBT Rd,Rm,Rs
 {
     // Signed half-word multiplication
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF] >> 16;
@@ -875,7 +873,6 @@ int Interpreter::smulbt(uint32_t opcode) // SMULBT Rd,Rm,Rs
 int Interpreter::smultb(uint32_t opcode) // SMULTB Rd,Rm,Rs
 {
     // Signed half-word multiplication
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF] >> 16;
     int16_t op2 = *registers[(opcode >> 8) & 0xF];
@@ -886,7 +883,6 @@ int Interpreter::smultb(uint32_t opcode) // SMULTB Rd,Rm,Rs
 int Interpreter::smultt(uint32_t opcode) // SMULTT Rd,Rm,Rs
 {
     // Signed half-word multiplication
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF] >> 16;
     int16_t op2 = *registers[(opcode >> 8) & 0xF] >> 16;
@@ -897,7 +893,6 @@ int Interpreter::smultt(uint32_t opcode) // SMULTT Rd,Rm,Rs
 int Interpreter::smulwb(uint32_t opcode) // SMULWB Rd,Rm,Rs
 {
     // Signed word by half-word multiplication
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF];
@@ -908,7 +903,6 @@ int Interpreter::smulwb(uint32_t opcode) // SMULWB Rd,Rm,Rs
 int Interpreter::smulwt(uint32_t opcode) // SMULWT Rd,Rm,Rs
 {
     // Signed word by half-word multiplication
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF] >> 16;
@@ -919,7 +913,6 @@ int Interpreter::smulwt(uint32_t opcode) // SMULWT Rd,Rm,Rs
 int Interpreter::smlabb(uint32_t opcode) // SMLABB Rd,Rm,Rs,Rn
 {
     // Signed half-word multiplication with accumulate and set Q flag
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF];
@@ -933,7 +926,6 @@ int Interpreter::smlabb(uint32_t opcode) // SMLABB Rd,Rm,Rs,Rn
 int Interpreter::smlabt(uint32_t opcode) // SMLABT Rd,Rm,Rs,Rn
 {
     // Signed half-word multiplication with accumulate and set Q flag
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF] >> 16;
@@ -947,7 +939,6 @@ int Interpreter::smlabt(uint32_t opcode) // SMLABT Rd,Rm,Rs,Rn
 int Interpreter::smlatb(uint32_t opcode) // SMLATB Rd,Rm,Rs,Rn
 {
     // Signed half-word multiplication with accumulate and set Q flag
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF] >> 16;
     int16_t op2 = *registers[(opcode >> 8) & 0xF];
@@ -961,7 +952,6 @@ int Interpreter::smlatb(uint32_t opcode) // SMLATB Rd,Rm,Rs,Rn
 int Interpreter::smlatt(uint32_t opcode) // SMLATT Rd,Rm,Rs,Rn
 {
     // Signed half-word multiplication with accumulate and set Q flag
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int16_t op1 = *registers[opcode & 0xF] >> 16;
     int16_t op2 = *registers[(opcode >> 8) & 0xF] >> 16;
@@ -975,7 +965,6 @@ int Interpreter::smlatt(uint32_t opcode) // SMLATT Rd,Rm,Rs,Rn
 int Interpreter::smlawb(uint32_t opcode) // SMLAWB Rd,Rm,Rs,Rn
 {
     // Signed word by half-word multiplication with accumulate and set Q flag
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF];
@@ -989,7 +978,6 @@ int Interpreter::smlawb(uint32_t opcode) // SMLAWB Rd,Rm,Rs,Rn
 int Interpreter::smlawt(uint32_t opcode) // SMLAWT Rd,Rm,Rs,Rn
 {
     // Signed word by half-word multiplication with accumulate and set Q flag
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 16) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int16_t op2 = *registers[(opcode >> 8) & 0xF] >> 16;
@@ -1003,7 +991,6 @@ int Interpreter::smlawt(uint32_t opcode) // SMLAWT Rd,Rm,Rs,Rn
 int Interpreter::smlalbb(uint32_t opcode) // SMLALBB RdLo,RdHi,Rm,Rs
 {
     // Signed long half-word multiplication with accumulate
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     int16_t op2 = *registers[opcode & 0xF];
@@ -1018,7 +1005,6 @@ int Interpreter::smlalbb(uint32_t opcode) // SMLALBB RdLo,RdHi,Rm,Rs
 int Interpreter::smlalbt(uint32_t opcode) // SMLALBT RdLo,RdHi,Rm,Rs
 {
     // Signed long half-word multiplication with accumulate
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     int16_t op2 = *registers[opcode & 0xF];
@@ -1033,7 +1019,6 @@ int Interpreter::smlalbt(uint32_t opcode) // SMLALBT RdLo,RdHi,Rm,Rs
 int Interpreter::smlaltb(uint32_t opcode) // SMLALTB RdLo,RdHi,Rm,Rs
 {
     // Signed long half-word multiplication with accumulate
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     int16_t op2 = *registers[opcode & 0xF] >> 16;
@@ -1048,7 +1033,6 @@ int Interpreter::smlaltb(uint32_t opcode) // SMLALTB RdLo,RdHi,Rm,Rs
 int Interpreter::smlaltt(uint32_t opcode) // SMLALTT RdLo,RdHi,Rm,Rs
 {
     // Signed long half-word multiplication with accumulate
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     int16_t op2 = *registers[opcode & 0xF] >> 16;
@@ -1063,7 +1047,6 @@ int Interpreter::smlaltt(uint32_t opcode) // SMLALTT RdLo,RdHi,Rm,Rs
 int Interpreter::qadd(uint32_t opcode) // QADD Rd,Rm,Rn
 {
     // Signed saturated addition
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int32_t op2 = *registers[(opcode >> 16) & 0xF];
@@ -1074,7 +1057,6 @@ int Interpreter::qadd(uint32_t opcode) // QADD Rd,Rm,Rn
 int Interpreter::qsub(uint32_t opcode) // QSUB Rd,Rm,Rn
 {
     // Signed saturated subtraction
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int32_t op2 = *registers[(opcode >> 16) & 0xF];
@@ -1085,7 +1067,6 @@ int Interpreter::qsub(uint32_t opcode) // QSUB Rd,Rm,Rn
 int Interpreter::qdadd(uint32_t opcode) // QDADD Rd,Rm,Rn
 {
     // Signed saturated double and addition
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int32_t op2 = *registers[(opcode >> 16) & 0xF];
@@ -1096,7 +1077,6 @@ int Interpreter::qdadd(uint32_t opcode) // QDADD Rd,Rm,Rn
 int Interpreter::qdsub(uint32_t opcode) // QDSUB Rd,Rm,Rn
 {
     // Signed saturated double and subtraction
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     int32_t op1 = *registers[opcode & 0xF];
     int32_t op2 = *registers[(opcode >> 16) & 0xF];
@@ -1107,7 +1087,6 @@ int Interpreter::qdsub(uint32_t opcode) // QDSUB Rd,Rm,Rn
 int Interpreter::clz(uint32_t opcode) // CLZ Rd,Rm
 {
     // Count leading zeros
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op0 = registers[(opcode >> 12) & 0xF];
     uint32_t op1 = *registers[opcode & 0xF];
     for (*op0 = 32; op1 != 0; op1 >>= 1, (*op0)--);
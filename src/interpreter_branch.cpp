@@ -33,7 +33,6 @@ int Interpreter::bx(uint32_t opcode) // BX Rn
 int Interpreter::blxReg(uint32_t opcode) // BLX Rn
 {
     // Branch to address with link and switch to THUMB if bit 0 is set
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t op0 = *registers[opcode & 0xF];
     cpsr |= (op0 & BIT(0)) << 5;
     *registers[14] = *registers[15] - 4;
@@ -93,7 +92,6 @@ int Interpreter::bxRegT(uint16_t opcode) // BX Rs
 int Interpreter::blxRegT(uint16_t opcode) // BLX Rs
 {
     // Branch to address with link and switch to ARM mode if bit 0 is cleared (THUMB)
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t op0 = *registers[(opcode >> 3) & 0xF];
     cpsr &= ~((~op0 & BIT(0)) << 5);
     *registers[14] = *registers[15] - 1;
@@ -273,7 +271,6 @@ int Interpreter::blOffT(uint16_t opcode) // BL label
 int Interpreter::blxOffT(uint16_t opcode) // BLX label
 {
     // Long branch to offset with link and switch to ARM mode (THUMB)
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t op0 = (opcode & 0x7FF) << 1;
     cpsr &= ~BIT(5);
     uint32_t ret = *registers[15] - 1;
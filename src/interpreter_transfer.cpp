@@ -251,7 +251,7 @@ FORCE_INLINE int Interpreter::ldrdOf(uint32_t opcode, uint32_t op2) // LDRD Rd,[
 {
     // Double word load, pre-adjust without writeback
     uint8_t op0 = (opcode >> 12) & 0xF;
-    if (arm7 || op0 == 15) return 1; // ARM9 exclusive
+    if (op0 == 15) return 1;
     uint32_t op1 = *registers[(opcode >> 16) & 0xF];
     *registers[op0] = core->memory.read<uint32_t>(arm7, op1 += op2);
     *registers[op0 + 1] = core->memory.read<uint32_t>(arm7, op1 + 4);
@@ -262,7 +262,7 @@ FORCE_INLINE int Interpreter::strdOf(uint32_t opcode, uint32_t op2) // STRD Rd,[
 {
     // Double word store, pre-adjust without writeback
     uint8_t op0 = (opcode >> 12) & 0xF;
-    if (arm7 || op0 == 15) return 1; // ARM9 exclusive
+    if (op0 == 15) return 1;
     uint32_t op1 = *registers[(opcode >> 16) & 0xF];
     core->memory.write<uint32_t>(arm7, op1 += op2, *registers[op0]);
     core->memory.write<uint32_t>(arm7, op1 + 4, *registers[op0 + 1]);
@@ -388,7 +388,7 @@ FORCE_INLINE int Interpreter::ldrdPr(uint32_t opcode, uint32_t op2) // LDRD Rd,[
 {
     // Double word load, pre-adjust with writeback
     uint8_t op0 = (opcode >> 12) & 0xF;
-    if (arm7 || op0 == 15) return 1; // ARM9 exclusive
+    if (op0 == 15) return 1;
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     *registers[op0] = core->memory.read<uint32_t>(arm7, *op1 += op2);
     *registers[op0 + 1] = core->memory.read<uint32_t>(arm7, *op1 + 4);
@@ -399,7 +399,7 @@ FORCE_INLINE int Interpreter::strdPr(uint32_t opcode, uint32_t op2) // STRD Rd,[
 {
     // Double word store, pre-adjust with writeback
     uint8_t op0 = (opcode >> 12) & 0xF;
-    if (arm7 || op0 == 15) return 1; // ARM9 exclusive
+    if (op0 == 15) return 1;
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     core->memory.write<uint32_t>(arm7, *op1 += op2, *registers[op0]);
     core->memory.write<uint32_t>(arm7, *op1 + 4, *registers[op0 + 1]);
@@ -530,7 +530,7 @@ FORCE_INLINE int Interpreter::ldrdPt(uint32_t opcode, uint32_t op2) // LDRD Rd,[
 {
     // Double word load, post-adjust
     uint8_t op0 = (opcode >> 12) & 0xF;
-    if (arm7 || op0 == 15) return 1; // ARM9 exclusive
+    if (op0 == 15) return 1;
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     uint32_t address = (*op1 += op2) - op2;
     *registers[op0] = core->memory.read<uint32_t>(arm7, address);
@@ -542,7 +542,7 @@ FORCE_INLINE int Interpreter::strdPt(uint32_t opcode, uint32_t op2) // STRD Rd,[
 {
     // Double word store, post-adjust
     uint8_t op0 = (opcode >> 12) & 0xF;
-    if (arm7 || op0 == 15) return 1;
+    if (op0 == 15) return 1;
     uint32_t *op1 = registers[(opcode >> 16) & 0xF];
     core->memory.write<uint32_t>(arm7, *op1, *registers[op0]);
     core->memory.write<uint32_t>(arm7, *op1 + 4, *registers[op0 + 1]);
@@ -1286,7 +1286,6 @@ int Interpreter::mrsRs(uint32_t opcode) // MRS Rd,SPSR
 int Interpreter::mrc(uint32_t opcode) // MRC Pn,<cpopc>,Rd,Cn,Cm,<cp>
 {
     // Read from a CP15 register
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t *op2 = registers[(opcode >> 12) & 0xF];
     uint8_t op3 = (opcode >> 16) & 0xF;
     uint8_t op4 = opcode & 0xF;
@@ -1298,7 +1297,6 @@ int Interpreter::mrc(uint32_t opcode) // MRC Pn,<cpopc>,Rd,Cn,Cm,<cp>
 int Interpreter::mcr(uint32_t opcode) // MCR Pn,<cpopc>,Rd,Cn,Cm,<cp>
 {
     // Write to a CP15 register
-    if (arm7) return 1; // ARM9 exclusive
     uint32_t op2 = *registers[(opcode >> 12) & 0xF];
     uint8_t op3 = (opcode >> 16) & 0xF;
     uint8_t op4 = opcode & 0xF;
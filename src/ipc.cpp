@@ -22,6 +22,9 @@
 
 void Ipc::writeIpcSync(bool cpu, uint16_t mask, uint16_t value)
 {
+    // Let the other CPU catch up before it sees the change
+    core->endSlice();
+
     // Write to one of the IPCSYNC registers
     mask &= 0x4F00;
     ipcSync[cpu] = (ipcSync[cpu] & ~mask) | (value & mask);
@@ -40,8 +43,7 @@ void Ipc::writeIpcFifoCnt(bool cpu, uint16_t mask, uint16_t value)
     if ((value & BIT(3)) && !fifos[cpu].empty())
     {
         // Empty the FIFO
-        while (!fifos[cpu].empty())
-            fifos[cpu].pop();
+        fifos[cpu].clear();
         ipcFifoRecv[!cpu] = 0;
 
         // Set the FIFO empty bits and clear the FIFO full bits
@@ -73,9 +75,12 @@ void Ipc::writeIpcFifoCnt(bool cpu, uint16_t mask, uint16_t value)
 
 void Ipc::writeIpcFifoSend(bool cpu, uint32_t mask, uint32_t value)
 {
+    // Let the other CPU catch up before it sees the change
+    core->endSlice();
+
     if (ipcFifoCnt[cpu] & BIT(15)) // FIFO enabled
     {
-        if (fifos[cpu].size() < 16) // FIFO not full
+        if (!fifos[cpu].full()) // FIFO not full
         {
             // Push a word to the FIFO
             fifos[cpu].push(value & mask);
@@ -90,7 +95,7 @@ void Ipc::writeIpcFifoSend(bool cpu, uint32_t mask, uint32_t value)
                 if (ipcFifoCnt[!cpu] & BIT(10))
                     core->interpreter[!cpu].sendInterrupt(18);
             }
-            else if (fifos[cpu].size() == 16)
+            else if (fifos[cpu].full())
             {
                 // If the FIFO is now full, set the full bits
                 ipcFifoCnt[cpu]  |= BIT(1);
@@ -107,6 +112,9 @@ void Ipc::writeIpcFifoSend(bool cpu, uint32_t mask, uint32_t value)
 
 uint32_t Ipc::readIpcFifoRecv(bool cpu)
 {
+    // Let the other CPU catch up before it sees the change
+    core->endSlice();
+
     if (!fifos[!cpu].empty())
     {
         // Receive a word from the FIFO
@@ -143,3 +151,13 @@ uint32_t Ipc::readIpcFifoRecv(bool cpu)
 
     return ipcFifoRecv[cpu];
 }
+
+void Ipc::syncState(SaveState &state)
+{
+    // Sync the FIFOs and IPC registers of both CPUs
+    for (int i = 0; i < 2; i++)
+        state.sync(fifos[i]);
+    state.sync(ipcSync);
+    state.sync(ipcFifoCnt);
+    state.sync(ipcFifoRecv);
+}
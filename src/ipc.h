@@ -21,15 +21,19 @@
 #define IPC_H
 
 #include <cstdint>
-#include <queue>
+
+#include "ring_buffer.h"
 
 class Core;
+class SaveState;
 
 class Ipc
 {
     public:
         Ipc(Core *core): core(core) {}
 
+        void syncState(SaveState &state);
+
         uint16_t readIpcSync(bool cpu)    { return ipcSync[cpu];    }
         uint16_t readIpcFifoCnt(bool cpu) { return ipcFifoCnt[cpu]; }
         uint32_t readIpcFifoRecv(bool cpu);
@@ -41,7 +45,7 @@ class Ipc
     private:
         Core *core;
 
-        std::queue<uint32_t> fifos[2];
+        RingBuffer<uint32_t, 16> fifos[2];
 
         uint16_t ipcSync[2] = {};
         uint16_t ipcFifoCnt[2] = { 0x0101, 0x0101 };
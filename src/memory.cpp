@@ -17,6 +17,7 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstddef>
 #include <cstring>
 
 #include "memory.h"
@@ -67,10 +68,7 @@ template <typename T> T VramMapping::read(uint32_t address)
 
     // Read a value from all the VRAM mappings, ORed together
     for (int m = 0; m < count; m++)
-    {
-        for (unsigned int i = 0; i < sizeof(T); i++)
-            value |= mappings[m][address + i] << (i * 8);
-    }
+        value |= loadLsbFirst<T>(&mappings[m][address]);
 
     return value;
 }
@@ -79,9 +77,80 @@ template <typename T> void VramMapping::write(uint32_t address, T value)
 {
     // Write a value to all the VRAM mappings
     for (int m = 0; m < count; m++)
+        storeLsbFirst<T>(&mappings[m][address], value);
+
+    // Keep the precomposited data in sync, where all the mappings now hold the same value
+    if (composite)
+        storeLsbFirst<T>(&composite[address], value);
+}
+
+void VramMapping::updateComposite()
+{
+    // Precomposite the overlapping mappings by ORing them together
+    memcpy(composite, mappings[0], 0x4000);
+    for (int m = 1; m < count; m++)
     {
-        for (unsigned int i = 0; i < sizeof(T); i++)
-            mappings[m][address + i] = value >> (i * 8);
+        for (int i = 0; i < 0x4000; i++)
+            composite[i] |= mappings[m][i];
+    }
+}
+
+Memory::Memory(Core *core): core(core)
+{
+    // Make sure the page tracking covers everything from the ARM9 BIOS through OAM
+    static_assert(offsetof(Memory, oam) + sizeof(oam) - offsetof(Memory, bios9) <= (CODE_PAGES << 12),
+        "CODE_PAGES doesn't cover the memory that code can be cached from");
+
+    // Start with nothing mapped in the flattened view of VRAM
+    for (int i = 0; i < 0x400; i++)
+        vramMap[i] = vramZero;
+}
+
+void Memory::mapBlock(int map, uint32_t address, uint8_t *read, uint8_t *write)
+{
+    // Leave a region's part of the maps untouched until something is mapped in it, since it's already empty
+    bool &used = usedRegions[map][address >> 24];
+    if (!used)
+    {
+        if (!read && !write) return;
+        used = true;
+    }
+
+    // Map a 4KB block for reading and writing
+    readMap[map][address >> 12] = read;
+    writeMap[map][address >> 12] = write;
+}
+
+void Memory::updateWramMaps()
+{
+    // Shared WRAM mirrors every 32KB for the ARM9 and every 64KB for the ARM7, so only one period has to be looked up
+    // The rest of the mirrors are copied from it, which avoids going through the full mapping logic for each block
+    updateMap9<false>(0x03000000, 0x03008000);
+    for (uint32_t address = 0x03008000; address < 0x04000000; address += 0x1000)
+    {
+        uint32_t block = 0x3000 + ((address >> 12) & 0x7);
+        mapBlock(1, address, readMap[1][block], writeMap[1][block]);
+        mapBlock(0, address, readMap[1][block], writeMap[1][block]);
+    }
+
+    // Put back any TCM that overlaps the mirrors in the TCM map
+    uint32_t dtcmAddr = core->cp15.getDtcmAddr(), dtcmEnd = dtcmAddr + core->cp15.getDtcmSize();
+    if (core->cp15.getItcmSize() > 0x03008000)
+        updateMap9<true>(0x03008000, std::min<uint32_t>(core->cp15.getItcmSize(), 0x04000000));
+    if (dtcmAddr < 0x04000000 && dtcmEnd > 0x03008000)
+        updateMap9<true>(std::max<uint32_t>(dtcmAddr, 0x03008000), std::min<uint32_t>(dtcmEnd, 0x04000000));
+
+    // The ARM7's shared WRAM only covers the lower half of the region, and doesn't exist in GBA mode
+    if (core->gbaMode)
+    {
+        updateMap7(0x03000000, 0x04000000);
+        return;
+    }
+    updateMap7(0x03000000, 0x03010000);
+    for (uint32_t address = 0x03010000; address < 0x03800000; address += 0x1000)
+    {
+        uint32_t block = 0x3000 + ((address >> 12) & 0xF);
+        mapBlock(2, address, readMap[2][block], writeMap[2][block]);
     }
 }
 
@@ -139,15 +208,54 @@ void Memory::copyBiosLogo(uint8_t *logo)
         memcpy(&bios9[0x20], logo, 0x9C);
 }
 
+bool Memory::canMap9(bool tcm, uint32_t address)
+{
+    // Check if any ARM9 memory can be mapped in the 16MB region of an address
+    switch (address & 0xFF000000)
+    {
+        case 0x02000000: case 0x03000000: case 0x06000000:
+        case 0x08000000: case 0x09000000: case 0xFF000000:
+            return true;
+    }
+
+    // Check if the region overlaps TCM, which can be placed almost anywhere
+    if (!tcm) return false;
+    uint64_t start = address & 0xFF000000, end = start + 0x1000000;
+    uint64_t dtcmAddr = core->cp15.getDtcmAddr();
+    return start < core->cp15.getItcmSize() || (start < dtcmAddr + core->cp15.getDtcmSize() && dtcmAddr < end);
+}
+
+bool Memory::canMap7(uint32_t address)
+{
+    // Check if any ARM7 or GBA memory can be mapped in the 16MB region of an address
+    switch (address & 0xFF000000)
+    {
+        case 0x00000000: case 0x04000000:
+            return !core->gbaMode;
+
+        case 0x02000000: case 0x03000000: case 0x06000000:
+        case 0x08000000: case 0x09000000:
+            return true;
+
+        case 0x0A000000: case 0x0B000000: case 0x0C000000:
+            return core->gbaMode;
+    }
+    return false;
+}
+
 template <bool tcm> void Memory::updateMap9(uint32_t start, uint32_t end)
 {
     // Update the ARM9 read and write memory maps in the given range
     for (uint64_t address = start; address < end; address += 0x1000)
     {
-        // Some components can't access TCM, so there are TCM and non-TCM maps
-        uint8_t *&read = (tcm ? readMap9A : readMap9B)[address >> 12];
-        uint8_t *&write = (tcm ? writeMap9A : writeMap9B)[address >> 12];
-        read = write = nullptr;
+        // Skip regions that nothing can be mapped in, as long as nothing was mapped there before
+        if (!usedRegions[!tcm][address >> 24] && !canMap9(tcm, address))
+        {
+            address = (address | 0xFFFFFF) + 1 - 0x1000;
+            continue;
+        }
+
+        uint8_t *read = nullptr, *write = nullptr;
 
         // Map a 4KB block to the corresponding ARM9 memory, excluding special cases
         switch (address & 0xFF000000)
@@ -210,11 +318,17 @@ template <bool tcm> void Memory::updateMap9(uint32_t start, uint32_t end)
                     write = &dataTcm[(address - core->cp15.getDtcmAddr()) & 0x3FFF];
             }
         }
+
+        // Some components can't access TCM, so there are TCM and non-TCM maps
+        mapBlock(!tcm, address, read, write);
     }
 
     // For non-TCM updates, update the TCM map as well
     if (!tcm)
         updateMap9<true>(start, end);
+
+    // Make the ARM9 look up its next block from the updated map
+    core->interpreter[0].flushBlock();
 }
 
 void Memory::updateMap7(uint32_t start, uint32_t end)
@@ -222,9 +336,14 @@ void Memory::updateMap7(uint32_t start, uint32_t end)
     // Update the ARM7 read and write memory maps in the given range
     for (uint64_t address = start; address < end; address += 0x1000)
     {
-        uint8_t *&read = readMap7[address >> 12];
-        uint8_t *&write = writeMap7[address >> 12];
-        read = write = nullptr;
+        // Skip regions that nothing can be mapped in, as long as nothing was mapped there before
+        if (!usedRegions[2][address >> 24] && !canMap7(address))
+        {
+            address = (address | 0xFFFFFF) + 1 - 0x1000;
+            continue;
+        }
+
+        uint8_t *read = nullptr, *write = nullptr;
 
         if (core->gbaMode) // GBA
         {
@@ -300,12 +419,138 @@ void Memory::updateMap7(uint32_t start, uint32_t end)
                     break;
             }
         }
+
+        // Apply the mapping to the ARM7 maps
+        mapBlock(2, address, read, write);
+    }
+
+    // Make the ARM7 look up its next block from the updated map
+    core->interpreter[1].flushBlock();
+}
+
+uint32_t Memory::copyMapped(bool cpu, uint32_t dst, uint32_t src, uint32_t size)
+{
+    uint32_t done = 0;
+
+    // Copy data between memory that's directly mapped without TCM, stopping at anything that needs special handling
+    while (done < size)
+    {
+        // Limit each chunk to the 4KB blocks both addresses are in
+        uint32_t count = std::min(size - done, 0x1000 - std::max(src & 0xFFF, dst & 0xFFF));
+        uint8_t *srcBlock = readMap[mapIndex(cpu, false)][src >> 12];
+        uint8_t *dstBlock = writeMap[mapIndex(cpu, false)][dst >> 12];
+        if (!srcBlock || !dstBlock) break;
+
+        // Leave overlapping chunks to unit copies, since a sequential transfer can repeat data that a memcpy wouldn't
+        uint8_t *srcData = &srcBlock[src & 0xFFF];
+        uint8_t *dstData = &dstBlock[dst & 0xFFF];
+        if (dstData < srcData + count && srcData < dstData + count) break;
+        markWritten(dstData, count);
+        memcpy(dstData, srcData, count);
+
+        src += count;
+        dst += count;
+        done += count;
+    }
+
+    return done;
+}
+
+uint8_t *Memory::getMappedRange(bool cpu, uint32_t address, uint32_t size, bool write)
+{
+    // Reject empty ranges and ones that wrap around the address space
+    if (size == 0 || address + size < address)
+        return nullptr;
+
+    // Get a pointer to a range of memory as a CPU sees it, if every block in it is directly mapped to consecutive host memory
+    uint8_t **map = (write ? writeMap : readMap)[cpu << 1];
+    uint8_t *base = map[address >> 12];
+    if (!base) return nullptr;
+    for (uint32_t i = 1; i <= ((address + size - 1) >> 12) - (address >> 12); i++)
+    {
+        uint32_t block = address + (i << 12);
+        if (map[block >> 12] != base + (i << 12))
+            return nullptr;
+    }
+
+    // Let the SPU mix the samples that are due from a range before it's written through the pointer
+    uint8_t *data = &base[address & 0xFFF];
+    if (write)
+    {
+        for (uint32_t page = (data - bios9) >> 12; page <= (data + size - 1 - bios9) >> 12; page++)
+        {
+            if (codePages[page] & BIT(3))
+            {
+                core->spu.catchUp();
+                break;
+            }
+        }
+    }
+    return data;
+}
+
+void Memory::markWritten(uint8_t *data, uint32_t size)
+{
+    // Mark the pages of a range written through a host pointer as changed, and invalidate any code cached from them
+    if (size == 0) return;
+    for (uint32_t page = (data - bios9) >> 12; page <= (data + size - 1 - bios9) >> 12; page++)
+    {
+        dirtyPages[page] = 1;
+        if (codePages[page]) invalidateCode(page);
+    }
+}
+
+uint8_t *Memory::getCodePointer(bool cpu, uint32_t address)
+{
+    // Get a pointer to the code at an address, if it's in memory that code can be cached from
+    uint8_t *data = readMap[cpu << 1][address >> 12];
+    if (!data || data < bios9 || data >= &oam[sizeof(oam)])
+        return nullptr;
+    return &data[address & 0xFFF];
+}
+
+void Memory::invalidateCode(uint32_t page)
+{
+    // Let the SPU mix the samples that are due from a page before a write to it lands
+    if (codePages[page] & BIT(3))
+        core->spu.catchUp();
+    dropCode(page);
+}
+
+void Memory::dropCode(uint32_t page)
+{
+    // Drop code that either CPU cached from a page of memory that was written to
+    for (int i = 0; i < 2; i++)
+    {
+        if (codePages[page] & BIT(i))
+            core->interpreter[i].invalidateBlocks(page);
+    }
+
+    // Drop ADPCM that the SPU decoded from the page
+    if (codePages[page] & BIT(2))
+        core->spu.invalidateAdpcm(page);
+
+    // Keep the mark of a playing sound, which stays until its channel stops
+    codePages[page] &= BIT(3);
+}
+
+void Memory::invalidateMapping(VramMapping *mapping, uint32_t address)
+{
+    // Mark every VRAM block that a write goes to as changed, and drop any code cached from them before it lands
+    for (int i = 0; i < mapping->getCount(); i++)
+    {
+        uint32_t page = (&mapping->getMapping(i)[address] - bios9) >> 12;
+        dirtyPages[page] = 1;
+        if (codePages[page]) invalidateCode(page);
     }
 }
 
 template <typename T> T Memory::readFallback(bool cpu, uint32_t address)
 {
     uint8_t *data = nullptr;
+    PROFILE_COUNT(core->profileTotals.readFallbacks[cpu][std::min<uint32_t>(address >> 24, 0xF)]);
+    HEATMAP_PAGE(cpu, HEAT_FALLBACK_READ, address);
+    HEATMAP_IO(cpu, false, address);
 
     // Handle special memory reads that can't be done with the read map
     // This includes I/O registers, overlapping VRAM, and areas smaller than 4KB
@@ -406,11 +651,8 @@ template <typename T> T Memory::readFallback(bool cpu, uint32_t address)
 
     if (data)
     {
-        // Form an LSB-first value from the data at the pointer
-        T value = 0;
-        for (size_t i = 0; i < sizeof(T); i++)
-            value |= data[i] << (i * 8);
-        return value;
+        // Read a value from the data at the pointer
+        return loadLsbFirst<T>(data);
     }
 
     if (!core->gbaMode)
@@ -429,6 +671,9 @@ template <typename T> T Memory::readFallback(bool cpu, uint32_t address)
 template <typename T> void Memory::writeFallback(bool cpu, uint32_t address, T value)
 {
     uint8_t *data = nullptr;
+    PROFILE_COUNT(core->profileTotals.writeFallbacks[cpu][std::min<uint32_t>(address >> 24, 0xF)]);
+    HEATMAP_PAGE(cpu, HEAT_FALLBACK_WRITE, address);
+    HEATMAP_IO(cpu, true, address);
 
     // Handle special memory writes that can't be done with the write map
     // This includes I/O registers, overlapping VRAM, and areas smaller than 4KB
@@ -456,6 +701,7 @@ template <typename T> void Memory::writeFallback(bool cpu, uint32_t address, T v
                     default:         mapping =    &lcdc[(address & 0xFFFFF) >> 14]; break;
                 }
                 if (mapping->getCount() == 0) break;
+                invalidateMapping(mapping, address & 0x3FFF);
                 mapping->write<T>(address & 0x3FFF, value);
                 return;
             }
@@ -512,6 +758,7 @@ template <typename T> void Memory::writeFallback(bool cpu, uint32_t address, T v
             {
                 VramMapping *mapping = &vram7[(address & 0x3FFFF) >> 17];
                 if (mapping->getCount() == 0) break;
+                invalidateMapping(mapping, address & 0x1FFFF);
                 mapping->write<T>(address & 0x1FFFF, value);
                 return;
             }
@@ -524,9 +771,9 @@ template <typename T> void Memory::writeFallback(bool cpu, uint32_t address, T v
 
     if (data)
     {
-        // Write an LSB-first value to the data at the pointer
-        for (size_t i = 0; i < sizeof(T); i++)
-            data[i] = value >> (i * 8);
+        // Write a value to the data at the pointer, and mark its page as changed
+        storeLsbFirst<T>(data, value);
+        dirtyPages[(data - bios9) >> 12] = 1;
         return;
     }
 
@@ -536,11 +783,130 @@ template <typename T> void Memory::writeFallback(bool cpu, uint32_t address, T v
         LOG("Unmapped GBA memory write: 0x%X\n", address);
 }
 
+template <typename T> FORCE_INLINE bool Memory::ioReadFast(bool cpu, uint32_t address, T &value)
+{
+    // Read the most frequently accessed DS I/O registers directly when they're accessed at their full size
+    // Anything else returns false and goes through the full register switch
+    switch (address)
+    {
+        case 0x4000004: // DISPSTAT
+            if (sizeof(T) != 2) return false;
+            value = core->gpu.readDispStat(cpu);
+            return true;
+
+        case 0x4000006: // VCOUNT
+            if (sizeof(T) != 2) return false;
+            value = core->gpu.readVCount();
+            return true;
+
+        case 0x4000100: case 0x4000104: case 0x4000108: case 0x400010C: // TMCNT_L
+            if (sizeof(T) != 2) return false;
+            value = core->timers[cpu].readTmCntL((address >> 2) & 0x3);
+            return true;
+
+        case 0x4000130: // KEYINPUT
+            if (sizeof(T) != 2) return false;
+            value = core->input.readKeyInput();
+            return true;
+
+        case 0x4000180: // IPCSYNC
+            if (sizeof(T) != 2) return false;
+            value = core->ipc.readIpcSync(cpu);
+            return true;
+
+        case 0x4000184: // IPCFIFOCNT
+            if (sizeof(T) != 2) return false;
+            value = core->ipc.readIpcFifoCnt(cpu);
+            return true;
+
+        case 0x4000208: // IME (the bytes after it are unused, so any size works)
+            value = core->interpreter[cpu].readIme();
+            return true;
+
+        case 0x4000210: // IE
+            if (sizeof(T) != 4) return false;
+            value = core->interpreter[cpu].readIe();
+            return true;
+
+        case 0x4000214: // IF
+            if (sizeof(T) != 4) return false;
+            value = core->interpreter[cpu].readIrf();
+            return true;
+
+        case 0x4100000: // IPCFIFORECV
+            if (sizeof(T) != 4) return false;
+            value = core->ipc.readIpcFifoRecv(cpu);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+template <typename T> FORCE_INLINE bool Memory::ioWriteFast(bool cpu, uint32_t address, T value)
+{
+    // Write the most frequently accessed DS I/O registers directly when they're accessed at their full size
+    // Anything else returns false and goes through the full register switch
+    switch (address)
+    {
+        case 0x4000004: // DISPSTAT
+            if (sizeof(T) != 2) return false;
+            core->gpu.writeDispStat(cpu, 0xFFFF, value);
+            return true;
+
+        case 0x4000100: case 0x4000104: case 0x4000108: case 0x400010C: // TMCNT_L
+            if (sizeof(T) != 2) return false;
+            core->timers[cpu].writeTmCntL((address >> 2) & 0x3, 0xFFFF, value);
+            return true;
+
+        case 0x4000180: // IPCSYNC
+            if (sizeof(T) != 2) return false;
+            core->ipc.writeIpcSync(cpu, 0xFFFF, value);
+            return true;
+
+        case 0x4000184: // IPCFIFOCNT
+            if (sizeof(T) != 2) return false;
+            core->ipc.writeIpcFifoCnt(cpu, 0xFFFF, value);
+            return true;
+
+        case 0x4000188: // IPCFIFOSEND
+            if (sizeof(T) != 4) return false;
+            core->ipc.writeIpcFifoSend(cpu, 0xFFFFFFFF, value);
+            return true;
+
+        case 0x4000208: // IME (the bytes after it are unused, so any size works)
+            core->interpreter[cpu].writeIme(value);
+            return true;
+
+        case 0x4000210: // IE
+            if (sizeof(T) != 4) return false;
+            core->interpreter[cpu].writeIe(0xFFFFFFFF, value);
+            return true;
+
+        case 0x4000214: // IF
+            if (sizeof(T) != 4) return false;
+            core->interpreter[cpu].writeIrf(0xFFFFFFFF, value);
+            return true;
+
+        case 0x4000400: // GXFIFO (ARM9 only)
+            if (sizeof(T) != 4 || cpu != 0) return false;
+            core->gpu3D.writeGxFifo(0xFFFFFFFF, value);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
 template <typename T> T Memory::ioRead9(uint32_t address)
 {
     T value = 0;
     size_t i = 0;
 
+    // Skip the full register switch for common accesses
+    if (ioReadFast<T>(0, address, value))
+        return value;
+
     // Read a value from one or more ARM9 I/O registers
     while (i < sizeof(T))
     {
@@ -699,6 +1065,10 @@ template <typename T> T Memory::ioRead7(uint32_t address)
     T value = 0;
     size_t i = 0;
 
+    // Skip the full register switch for common accesses
+    if (ioReadFast<T>(1, address, value))
+        return value;
+
     // Read a value from one or more ARM7 I/O registers
     while (i < sizeof(T))
     {
@@ -949,6 +1319,10 @@ template <typename T> void Memory::ioWrite9(uint32_t address, T value)
 {
     size_t i = 0;
 
+    // Skip the full register switch for common accesses
+    if (ioWriteFast<T>(0, address, value))
+        return;
+
     // Write a value to one or more ARM9 I/O registers
     while (i < sizeof(T))
     {
@@ -1246,6 +1620,10 @@ template <typename T> void Memory::ioWrite7(uint32_t address, T value)
 
     size_t i = 0;
 
+    // Skip the full register switch for common accesses
+    if (ioWriteFast<T>(1, address, value))
+        return;
+
     // Write a value to one or more ARM7 I/O registers
     while (i < sizeof(T))
     {
@@ -1598,6 +1976,15 @@ void Memory::writeVramCnt(int index, uint8_t value)
     const uint8_t masks[] = { 0x9B, 0x9B, 0x9F, 0x9F, 0x87, 0x9F, 0x9F, 0x83, 0x83 };
     if ((value & masks[index]) == (vramCnt[index] & masks[index])) return;
     vramCnt[index] = value & masks[index];
+    remapVram();
+}
+
+void Memory::remapVram()
+{
+    // Save the texture mappings, to check if they change
+    uint8_t *tex3DOld[4], *pal3DOld[6];
+    memcpy(tex3DOld, tex3D, sizeof(tex3D));
+    memcpy(pal3DOld, pal3D, sizeof(pal3D));
 
     // Clear the previous mappings
     memset(engABg,     0, sizeof(engABg));
@@ -1885,20 +2272,64 @@ void Memory::writeVramCnt(int index, uint8_t value)
         }
     }
 
+    // Give each mapping with overlapping banks a precomposited buffer
+    VramMapping *groups[] = { engABg, engBBg, engAObj, engBObj, lcdc };
+    int counts[] = { 32, 8, 16, 8, 64 };
+    compositeMappings.clear();
+    for (int i = 0; i < 5; i++)
+    {
+        for (int j = 0; j < counts[i]; j++)
+        {
+            if (groups[i][j].getCount() > 1)
+                compositeMappings.push_back(&groups[i][j]);
+        }
+    }
+    composites.resize(compositeMappings.size() * 0x4000);
+    for (size_t i = 0; i < compositeMappings.size(); i++)
+        compositeMappings[i]->setComposite(&composites[i * 0x4000]);
+    updateComposites();
+
+    // Texture memory can only be written while unmapped, so a change in mappings is the only way textures can change
+    if (memcmp(tex3DOld, tex3D, sizeof(tex3D)) || memcmp(pal3DOld, pal3D, sizeof(pal3D)))
+        texVersion++;
+
+    // Build the flattened view of VRAM, with each region mirrored like in the memory maps
+    flattenVram(engABg,  32, 0x06000000, 0x200000);
+    flattenVram(engBBg,   8, 0x06200000, 0x200000);
+    flattenVram(engAObj, 16, 0x06400000, 0x200000);
+    flattenVram(engBObj,  8, 0x06600000, 0x200000);
+    flattenVram(lcdc,    64, 0x06800000, 0x800000);
+
     // Update the memory maps at the VRAM locations
     updateMap9<false>(0x06000000, 0x07000000);
     updateMap7(0x06000000, 0x07000000);
     core->gpu.invalidate3D();
 }
 
+void Memory::flattenVram(VramMapping *mappings, int count, uint32_t address, uint32_t size)
+{
+    // Point each 16KB block of a VRAM region to its mapped data, or to zeros if nothing is mapped
+    for (uint32_t i = 0; i < (size >> 14); i++)
+    {
+        VramMapping *mapping = &mappings[i % count];
+        vramMap[((address >> 14) & 0x3FF) + i] = mapping->getCount() ? mapping->getFlatMapping() : vramZero;
+    }
+}
+
+void Memory::updateComposites()
+{
+    // Refresh the precomposited VRAM, which can miss writes made to its banks through other mappings
+    for (size_t i = 0; i < compositeMappings.size(); i++)
+        compositeMappings[i]->updateComposite();
+}
+
 void Memory::writeWramCnt(uint8_t value)
 {
     // Write to the WRAMCNT register
+    // Update the memory maps at the WRAM locations if the layout changed
+    if (wramCnt == (value & 0x03)) return;
     wramCnt = value & 0x03;
-
-    // Update the memory maps at the WRAM locations
-    updateMap9<false>(0x03000000, 0x04000000);
-    updateMap7(0x03000000, 0x04000000);
+    updateWramMaps();
 }
 
 void Memory::writeHaltCnt(uint8_t value)
@@ -1931,3 +2362,105 @@ void Memory::writeGbaHaltCnt(uint8_t value)
     if (value & BIT(7)) // Stop
         LOG("Unhandled request for stop mode\n");
 }
+
+void Memory::syncSnapshot(bool loading)
+{
+    // Memory is copied in host pages from the ARM9 BIOS through OAM, where the last page is cut short
+    size_t size = &oam[sizeof(oam)] - bios9;
+
+    if (snapshot.empty())
+    {
+        // Copy all of memory for the first snapshot
+        if (loading) return;
+        snapshot.assign(bios9, bios9 + size);
+        memset(dirtyPages, 0, sizeof(dirtyPages));
+        return;
+    }
+
+    for (uint32_t i = 0; i < CODE_PAGES; i++)
+    {
+        // Only copy the pages that were written since the last snapshot
+        if (!dirtyPages[i]) continue;
+        dirtyPages[i] = 0;
+        size_t count = std::min<size_t>(0x1000, size - (i << 12));
+
+        if (loading)
+        {
+            // Restore a page, dropping any code that was cached from its changed contents
+            // Sounds aren't mixed here, since the SPU is only partly loaded and will mark its pages again
+            memcpy(&bios9[i << 12], &snapshot[i << 12], count);
+            if (codePages[i]) dropCode(i);
+        }
+        else
+        {
+            // Update a page in the snapshot
+            memcpy(&snapshot[i << 12], &bios9[i << 12], count);
+        }
+    }
+}
+
+void Memory::syncState(SaveState &state)
+{
+    // Save the registers that memory is mapped from, to check if they change
+    uint8_t vramCntOld[9];
+    memcpy(vramCntOld, vramCnt, sizeof(vramCnt));
+    uint8_t wramCntOld = wramCnt;
+
+    if (state.isSnapshot())
+    {
+        // Keep the contents of memory in a separate copy, updating only the pages that changed
+        syncSnapshot(state.isLoading());
+    }
+    else
+    {
+        // Sync the contents of writable memory
+        // The BIOS files and ROM come from the host, so they aren't included
+        state.sync(ram);
+        state.sync(wram);
+        state.sync(instrTcm);
+        state.sync(dataTcm);
+        state.sync(wram7);
+        state.sync(wifiRam);
+        state.sync(palette);
+        state.sync(vramA);
+        state.sync(vramB);
+        state.sync(vramC);
+        state.sync(vramD);
+        state.sync(vramE);
+        state.sync(vramF);
+        state.sync(vramG);
+        state.sync(vramH);
+        state.sync(vramI);
+        state.sync(oam);
+
+        // Mark everything as changed after loading, and drop the cached code flags since the CPUs drop their blocks
+        if (state.isLoading())
+        {
+            memset(dirtyPages, 1, sizeof(dirtyPages));
+            memset(codePages, 0, sizeof(codePages));
+        }
+    }
+
+    // Sync the memory registers
+    state.sync(dmaFill);
+    state.sync(vramCnt);
+    state.sync(wramCnt);
+    state.sync(haltCnt);
+
+    // Sync the last GBA BIOS fetch as an offset
+    int32_t offset = lastGbaBios ? (lastGbaBios - gbaBios) : -1;
+    state.sync(offset);
+    if (!state.isLoading()) return;
+    lastGbaBios = (offset >= 0 && offset < 0x4000) ? &gbaBios[offset] : nullptr;
+
+    // Assume textures changed, since the contents of VRAM were replaced
+    texVersion++;
+
+    // Update the VRAM mappings and memory maps if the loaded registers changed them
+    if (memcmp(vramCntOld, vramCnt, sizeof(vramCnt)))
+        remapVram();
+    else
+        updateComposites();
+    if (wramCntOld != wramCnt)
+        updateWramMaps();
+}
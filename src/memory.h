@@ -21,10 +21,47 @@
 #define MEMORY_H
 
 #include <cstdint>
+#include <cstring>
+#include <vector>
 
 #include "defines.h"
+#include "heatmap.h"
+
+// Number of 4KB host pages spanned by memory that code can be cached from (ARM9 BIOS through OAM)
+// The Memory constructor checks this against the layout of its buffers at compile time
+#define CODE_PAGES 0x4DB
 
 class Core;
+class SaveState;
+
+// Access an LSB-first value in emulated memory, which can be done directly when the host byte order matches
+template <typename T> FORCE_INLINE T loadLsbFirst(const uint8_t *data)
+{
+#ifdef LITTLE_ENDIAN_HOST
+    // Load the value directly, since the host already stores it LSB-first
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+#else
+    // Form an LSB-first value from the data at the pointer
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+        value |= data[i] << (i * 8);
+    return value;
+#endif
+}
+
+template <typename T> FORCE_INLINE void storeLsbFirst(uint8_t *data, T value)
+{
+#ifdef LITTLE_ENDIAN_HOST
+    // Store the value directly, since the host already stores it LSB-first
+    memcpy(data, &value, sizeof(T));
+#else
+    // Write an LSB-first value to the data at the pointer
+    for (size_t i = 0; i < sizeof(T); i++)
+        data[i] = value >> (i * 8);
+#endif
+}
 
 class VramMapping
 {
@@ -34,18 +71,30 @@ class VramMapping
         template <typename T> T read(uint32_t address);
         template <typename T> void write(uint32_t address, T value);
 
-        uint8_t *getBaseMapping() { return mappings[0]; }
-        int      getCount()       { return count;       }
+        void setComposite(uint8_t *buffer) { composite = buffer; }
+        void updateComposite();
+
+        uint8_t *getBaseMapping()  { return mappings[0]; }
+        uint8_t *getMapping(int i) { return mappings[i]; }
+        uint8_t *getFlatMapping()  { return composite ? composite : mappings[0]; }
+        int      getCount()        { return count;       }
 
     private:
         uint8_t *mappings[7];
+        uint8_t *composite = nullptr;
         int count = 0;
 };
 
 class Memory
 {
     public:
-        Memory(Core *core): core(core) {};
+#ifdef HEATMAP
+        Heatmap heatmap;
+#endif
+
+        Memory(Core *core);
+
+        void syncState(SaveState &state);
 
         bool loadBios9();
         bool loadBios7();
@@ -58,41 +107,58 @@ class Memory
         template <typename T> T read(bool cpu, uint32_t address, bool tcm = true);
         template <typename T> void write(bool cpu, uint32_t address, T value, bool tcm = true);
 
+        uint32_t copyMapped(bool cpu, uint32_t dst, uint32_t src, uint32_t size);
+        uint8_t *getMappedRange(bool cpu, uint32_t address, uint32_t size, bool write);
+        void markWritten(uint8_t *data, uint32_t size);
+
+        template <typename T> T readVram(uint32_t address);
+        uint8_t *getVramBlock(uint32_t address) { return &vramMap[(address >> 14) & 0x3FF][address & 0x3FFF]; }
+        void updateComposites();
+
+        uint8_t *getCodePointer(bool cpu, uint32_t address);
+        uint32_t getCodeIndex(uint8_t *data) { return data - bios9; }
+        void markCode(int user, uint32_t page) { codePages[page] |= BIT(user); }
+        void unmarkCode(int user, uint32_t page) { codePages[page] &= ~BIT(user); }
+        void invalidateCode(uint32_t page);
+
         uint8_t  *getPalette()    { return palette;    }
         uint8_t  *getOam()        { return oam;        }
         uint8_t **getEngAExtPal() { return engAExtPal; }
         uint8_t **getEngBExtPal() { return engBExtPal; }
         uint8_t **getTex3D()      { return tex3D;      }
         uint8_t **getPal3D()      { return pal3D;      }
+        uint32_t  getTexVersion() { return texVersion; }
 
     private:
         Core *core;
 
-        // 32-bit address space, split into 4KB blocks
-        uint8_t *readMap9A[0x100000]  = {};
-        uint8_t *readMap9B[0x100000]  = {};
-        uint8_t *readMap7[0x100000]   = {};
-        uint8_t *writeMap9A[0x100000] = {};
-        uint8_t *writeMap9B[0x100000] = {};
-        uint8_t *writeMap7[0x100000]  = {};
-
-        uint8_t bios9[0x8000]   = {}; // 32KB ARM9 BIOS
+        // 32-bit address space, split into 4KB blocks, with maps for ARM9 with TCM, ARM9 without TCM, and ARM7
+        // The maps are left out of member initialization like the big buffers below, and only 16MB regions that
+        // have had something mapped are written, so the parts covering empty address space never take up memory
+        uint8_t *readMap[3][0x100000];
+        uint8_t *writeMap[3][0x100000];
+        bool usedRegions[3][0x100] = {};
+
+        // Code and dirty page tracking works in 4KB pages relative to the ARM9 BIOS, so it's kept page-aligned
+        // The biggest buffers are left out of member initialization; cores can only be created zeroed through
+        // Core::create instead, so pages that are never used don't have to be touched at startup
+        alignas(0x1000) uint8_t bios9[0x8000] = {}; // 32KB ARM9 BIOS
         uint8_t bios7[0x4000]   = {}; // 16KB ARM7 BIOS
         uint8_t gbaBios[0x4000] = {}; // 16KB GBA BIOS
 
-        uint8_t ram[0x400000]    = {}; //  4MB main RAM
+        uint8_t ram[0x400000];         //  4MB main RAM
         uint8_t wram[0x8000]     = {}; // 32KB shared WRAM
         uint8_t instrTcm[0x8000] = {}; // 32KB instruction TCM
         uint8_t dataTcm[0x4000]  = {}; // 16KB data TCM
-        uint8_t wram7[0x10000]   = {}; // 64KB ARM7 WRAM
+        uint8_t wram7[0x10000];        // 64KB ARM7 WRAM
         uint8_t wifiRam[0x2000]  = {}; //  8KB WiFi RAM
 
         uint8_t palette[0x800] = {}; //   2KB palette
-        uint8_t vramA[0x20000] = {}; // 128KB VRAM block A
-        uint8_t vramB[0x20000] = {}; // 128KB VRAM block B
-        uint8_t vramC[0x20000] = {}; // 128KB VRAM block C
-        uint8_t vramD[0x20000] = {}; // 128KB VRAM block D
-        uint8_t vramE[0x10000] = {}; //  64KB VRAM block E
+        uint8_t vramA[0x20000];      // 128KB VRAM block A
+        uint8_t vramB[0x20000];      // 128KB VRAM block B
+        uint8_t vramC[0x20000];      // 128KB VRAM block C
+        uint8_t vramD[0x20000];      // 128KB VRAM block D
+        uint8_t vramE[0x10000];      //  64KB VRAM block E
         uint8_t vramF[0x4000]  = {}; //  16KB VRAM block F
         uint8_t vramG[0x4000]  = {}; //  16KB VRAM block G
         uint8_t vramH[0x8000]  = {}; //  32KB VRAM block H
@@ -106,11 +172,28 @@ class Memory
         VramMapping lcdc[64];
         VramMapping vram7[2];
 
+        // Flattened view of VRAM for the renderers, in 16KB blocks with overlapping banks precomposited
+        uint8_t *vramMap[0x400] = {};
+        uint8_t vramZero[0x4000] = {};
+        std::vector<uint8_t> composites;
+        std::vector<VramMapping*> compositeMappings;
+
         uint8_t *engAExtPal[5] = {};
         uint8_t *engBExtPal[5] = {};
         uint8_t *tex3D[4]      = {};
         uint8_t *pal3D[6]      = {};
 
+        // Counter that changes whenever the contents of texture or palette memory could have changed
+        uint32_t texVersion = 0;
+
+        // Flags for host pages that either CPU has cached code from (bits 0-1), the SPU has decoded ADPCM from (bit 2),
+        // or a playing sound channel reads from (bit 3); these are indexed relative to the ARM9 BIOS
+        uint8_t codePages[CODE_PAGES] = {};
+
+        // Flags for host pages that were written since the last snapshot, and a copy of memory from that snapshot
+        uint8_t dirtyPages[CODE_PAGES] = {};
+        std::vector<uint8_t> snapshot;
+
         uint8_t *lastGbaBios = nullptr;
 
         uint32_t dmaFill[4] = {};
@@ -121,7 +204,17 @@ class Memory
 
         template <typename T> T readFallback(bool cpu, uint32_t address);
         template <typename T> void writeFallback(bool cpu, uint32_t address, T value);
-
+        bool canMap9(bool tcm, uint32_t address);
+        bool canMap7(uint32_t address);
+        static int mapIndex(bool cpu, bool tcm) { return (cpu << 1) | (!tcm & !cpu); }
+        void mapBlock(int map, uint32_t address, uint8_t *read, uint8_t *write);
+        void updateWramMaps();
+        void dropCode(uint32_t page);
+        void invalidateMapping(VramMapping *mapping, uint32_t address);
+        void syncSnapshot(bool loading);
+
+        template <typename T> bool ioReadFast(bool cpu, uint32_t address, T &value);
+        template <typename T> bool ioWriteFast(bool cpu, uint32_t address, T value);
         template <typename T> T ioRead9(uint32_t address);
         template <typename T> T ioRead7(uint32_t address);
         template <typename T> T ioReadGba(uint32_t address);
@@ -137,6 +230,8 @@ class Memory
 
         void writeDmaFill(int channel, uint32_t mask, uint32_t value);
         void writeVramCnt(int index, uint8_t value);
+        void remapVram();
+        void flattenVram(VramMapping *mappings, int count, uint32_t address, uint32_t size);
         void writeWramCnt(uint8_t value);
         void writeHaltCnt(uint8_t value);
         void writeGbaHaltCnt(uint8_t value);
@@ -150,22 +245,27 @@ template <typename T> FORCE_INLINE T Memory::read(bool cpu, uint32_t address, bo
     // Align the address
     address &= ~(sizeof(T) - 1);
 
-    uint8_t **readMap = (cpu == 0) ? (tcm ? readMap9A : readMap9B) : readMap7;
-    if (readMap[address >> 12])
+    // Look up the 4KB block mapped to the given address
+    uint8_t *block = readMap[mapIndex(cpu, tcm)][address >> 12];
+    if (block)
     {
-        // Get a pointer to readable memory mapped to the given address
-        uint8_t *data = &readMap[address >> 12][address & 0xFFF];
-
-        // Form an LSB-first value from the data at the pointer
-        T value = 0;
-        for (size_t i = 0; i < sizeof(T); i++)
-            value |= data[i] << (i * 8);
-        return value;
+        // Read a value from readable memory mapped to the given address
+        HEATMAP_PAGE(cpu, HEAT_READ, address);
+        return loadLsbFirst<T>(&block[address & 0xFFF]);
     }
 
     return readFallback<T>(cpu, address);
 }
 
+template <typename T> FORCE_INLINE T Memory::readVram(uint32_t address)
+{
+    // Align the address
+    address &= ~(sizeof(T) - 1);
+
+    // Read a value from the flattened VRAM block at the given address, which is always valid
+    return loadLsbFirst<T>(&vramMap[(address >> 14) & 0x3FF][address & 0x3FFF]);
+}
+
 template void Memory::write(bool cpu, uint32_t address, uint8_t  value, bool tcm);
 template void Memory::write(bool cpu, uint32_t address, uint16_t value, bool tcm);
 template void Memory::write(bool cpu, uint32_t address, uint32_t value, bool tcm);
@@ -174,15 +274,19 @@ template <typename T> FORCE_INLINE void Memory::write(bool cpu, uint32_t address
     // Align the address
     address &= ~(sizeof(T) - 1);
 
-    uint8_t **writeMap = (cpu == 0) ? (tcm ? writeMap9A : writeMap9B) : writeMap7;
-    if (writeMap[address >> 12])
+    // Look up the 4KB block mapped to the given address
+    uint8_t *block = writeMap[mapIndex(cpu, tcm)][address >> 12];
+    if (block)
     {
-        // Get a pointer to writable memory mapped to the given address
-        uint8_t *data = &writeMap[address >> 12][address & 0xFFF];
-
-        // Write an LSB-first value to the data at the pointer
-        for (size_t i = 0; i < sizeof(T); i++)
-            data[i] = value >> (i * 8);
+        // Write a value to writable memory mapped to the given address
+        uint8_t *data = &block[address & 0xFFF];
+        HEATMAP_PAGE(cpu, HEAT_WRITE, address);
+
+        // Invalidate any code that was cached from the page before the write lands, and mark the page as changed
+        uint32_t page = (data - bios9) >> 12;
+        if (codePages[page]) invalidateCode(page);
+        storeLsbFirst<T>(data, value);
+        dirtyPages[page] = 1;
         return;
     }
 
@@ -0,0 +1,196 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctime>
+
+#include "movie.h"
+#include "core.h"
+#include "settings.h"
+
+// Settings that can change how a run plays out, in the order they're stored in the header
+static int *movieSettings[] =
+{
+    &Settings::directBoot,
+    &Settings::cachedInterpreter,
+    &Settings::cpuSlice,
+    &Settings::idleLoopSkip,
+    &Settings::adpcmCache,
+    &Settings::highRes3D,
+    &Settings::runAhead
+};
+
+static const uint32_t settingCount = sizeof(movieSettings) / sizeof(movieSettings[0]);
+
+Movie::~Movie()
+{
+    // Finish the movie file if one is being recorded
+    stop();
+}
+
+bool Movie::record(std::string path, Core *core)
+{
+    // Attempt to open the movie file
+    stop();
+    file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+
+    // Write the header, with the current time for the RTC and the current settings
+    uint32_t magic = MOVIE_MAGIC, version = MOVIE_VERSION;
+    rtcTime = std::time(nullptr);
+    fwrite(&magic, sizeof(magic), 1, file);
+    fwrite(&version, sizeof(version), 1, file);
+    fwrite(&rtcTime, sizeof(rtcTime), 1, file);
+    fwrite(&settingCount, sizeof(settingCount), 1, file);
+    for (uint32_t i = 0; i < settingCount; i++)
+    {
+        int32_t value = *movieSettings[i];
+        fwrite(&value, sizeof(value), 1, file);
+    }
+
+    // Start recording, with the RTC fixed to the saved time so it matches during playback
+    this->core = core;
+    core->rtc.setFixedTime(rtcTime);
+    core->spu.setSampleHash(true);
+    core->spu.takeSampleHash();
+    frames.clear();
+    return true;
+}
+
+bool Movie::load(std::string path)
+{
+    // Attempt to open the movie file
+    stop();
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    // Check the header, and refuse to play movies from a different version
+    uint32_t magic = 0, version = 0, count = 0;
+    fread(&magic, sizeof(magic), 1, file);
+    fread(&version, sizeof(version), 1, file);
+    fread(&rtcTime, sizeof(rtcTime), 1, file);
+    fread(&count, sizeof(count), 1, file);
+    if (magic != MOVIE_MAGIC || version != MOVIE_VERSION || count != settingCount)
+    {
+        LOG("Unsupported movie file\n");
+        fclose(file);
+        return false;
+    }
+
+    // Apply the saved settings, which have to be in place before the core is created
+    for (uint32_t i = 0; i < settingCount; i++)
+    {
+        int32_t value = 0;
+        fread(&value, sizeof(value), 1, file);
+        *movieSettings[i] = value;
+    }
+
+    // Read the frames until the end of the file
+    MovieFrame frame;
+    frames.clear();
+    while (fread(&frame, sizeof(frame), 1, file) == 1)
+        frames.push_back(frame);
+    fclose(file);
+    return true;
+}
+
+void Movie::play(Core *core)
+{
+    // Start playing a loaded movie on a freshly created core
+    this->core = core;
+    core->rtc.setFixedTime(rtcTime);
+    core->spu.setSampleHash(true);
+    core->spu.takeSampleHash();
+    position = 0;
+    mismatches = 0;
+    firstMismatch = -1;
+    playing = !frames.empty();
+}
+
+void Movie::stop()
+{
+    // Stop playing, or close the file if recording
+    playing = false;
+    if (!file) return;
+    fclose(file);
+    file = nullptr;
+}
+
+void Movie::beginFrame()
+{
+    if (file)
+    {
+        // Save the input that the frame will run with
+        MovieFrame frame = {};
+        frame.keyInput = core->input.readKeyInput();
+        frame.extKeyIn = core->input.readExtKeyIn();
+        frame.touch = core->spi.getTouchAdc();
+        frames.push_back(frame);
+    }
+    else if (playing)
+    {
+        // Apply the saved input for the frame
+        MovieFrame &frame = frames[position];
+        core->input.setKeys(frame.keyInput, frame.extKeyIn);
+        core->spi.setTouchAdc(frame.touch);
+    }
+}
+
+void Movie::endFrame()
+{
+    if (file)
+    {
+        // Finish the frame with the hashes of its output, and write it to the file
+        MovieFrame &frame = frames.back();
+        frame.videoHash = hashVideo();
+        frame.audioHash = core->spu.takeSampleHash();
+        fwrite(&frame, sizeof(frame), 1, file);
+    }
+    else if (playing)
+    {
+        // Check the output of the frame against the hashes from the recording
+        MovieFrame &frame = frames[position];
+        uint64_t videoHash = hashVideo();
+        uint64_t audioHash = core->spu.takeSampleHash();
+        if (frame.videoHash != videoHash || frame.audioHash != audioHash)
+        {
+            if (firstMismatch < 0) firstMismatch = position;
+            mismatches++;
+        }
+
+        // Stop once the last frame has been played
+        if (++position == frames.size())
+            playing = false;
+    }
+}
+
+uint64_t Movie::hashVideo()
+{
+    // Fold the framebuffers of the 2D engines into a 64-bit FNV-1a hash
+    uint64_t hash = 0xCBF29CE484222325;
+    for (int i = 0; i < (core->gbaMode ? 1 : 2); i++)
+    {
+        uint32_t *data = core->gpu2D[i].getFramebuffer();
+        for (int j = 0; j < 256 * (core->gbaMode ? 160 : 192); j++)
+        {
+            for (int k = 0; k < 32; k += 8)
+                hash = (hash ^ ((data[j] >> k) & 0xFF)) * 0x100000001B3;
+        }
+    }
+    return hash;
+}
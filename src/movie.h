@@ -0,0 +1,81 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Identifies a movie file, followed by a version that must match for it to be played
+// The version should be incremented whenever the header or frame layout changes
+#define MOVIE_MAGIC 0x564D444E // "NDMV"
+#define MOVIE_VERSION 1
+
+class Core;
+
+// Input and output of a single frame, with the input applied before it runs
+struct MovieFrame
+{
+    uint16_t keyInput;  // KEYINPUT register, with cleared bits for pressed keys
+    uint16_t extKeyIn;  // EXTKEYIN register, including the pen down bit
+    uint32_t touch;     // Touchscreen ADC values, with X in the low half and Y in the high half
+    uint64_t videoHash; // Hash of the 2D engine framebuffers at the end of the frame
+    uint64_t audioHash; // Hash of the audio samples output during the frame
+};
+
+// Recording and playback of input from boot, for replaying the same run across builds
+// Movies also store the RTC time and the settings that affect emulation, so playback is deterministic,
+// and the hashes of each frame's output are checked during playback to catch changes in behavior
+class Movie
+{
+    public:
+        ~Movie();
+
+        bool record(std::string path, Core *core);
+        bool load(std::string path);
+        void play(Core *core);
+        void stop();
+
+        void beginFrame();
+        void endFrame();
+
+        bool isRecording() { return file;          }
+        bool isPlaying()   { return playing;       }
+        size_t getLength() { return frames.size(); }
+        int getMismatches()    { return mismatches;    }
+        int getFirstMismatch() { return firstMismatch; }
+
+    private:
+        Core *core = nullptr;
+        FILE *file = nullptr;
+        bool playing = false;
+
+        int64_t rtcTime = 0;
+        std::vector<MovieFrame> frames;
+        size_t position = 0;
+        int mismatches = 0;
+        int firstMismatch = -1;
+
+        uint64_t hashVideo();
+};
+
+#endif // MOVIE_H
@@ -0,0 +1,64 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <cstdint>
+
+// Fixed-capacity FIFO stored inline, for hardware queues that shouldn't touch the heap
+// The capacity must be a power of 2; pushing to a full buffer drops the value, so callers check first
+template <typename T, uint32_t capacity> class RingBuffer
+{
+    public:
+        uint32_t size()  { return count;             }
+        bool     empty() { return count == 0;        }
+        bool     full()  { return count == capacity; }
+
+        T &front()                { return data[head];                                }
+        T &back()                 { return data[(head + count - 1) & (capacity - 1)]; }
+        T &operator[](uint32_t i) { return data[(head + i) & (capacity - 1)];         }
+
+        void push(const T &value)
+        {
+            // Add a value to the back of the buffer if there's room
+            if (count == capacity) return;
+            data[(head + count++) & (capacity - 1)] = value;
+        }
+
+        void pop()
+        {
+            // Remove the value at the front of the buffer
+            head = (head + 1) & (capacity - 1);
+            count--;
+        }
+
+        void clear()
+        {
+            // Empty the buffer
+            head = count = 0;
+        }
+
+    private:
+        T data[capacity] = {};
+        uint32_t head = 0;
+        uint32_t count = 0;
+};
+
+#endif // RING_BUFFER_H
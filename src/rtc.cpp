@@ -72,9 +72,9 @@ void Rtc::updateRtc(bool cs, bool sck, bool sio)
 
 void Rtc::updateDateTime()
 {
-    // Get the local time
-    std::time_t t = std::time(nullptr);
-    std::tm *time = std::localtime(&t);
+    // Get the local time, or the fixed time if one is set, which is taken as UTC so it doesn't depend on the host
+    std::time_t t = (fixedTime >= 0) ? (std::time_t)fixedTime : std::time(nullptr);
+    std::tm *time = (fixedTime >= 0) ? std::gmtime(&t) : std::localtime(&t);
     time->tm_year %= 100; // The DS only counts years 2000-2099
     time->tm_mon++; // The DS starts month values at 1, not 0
 
@@ -249,4 +249,20 @@ uint16_t Rtc::readGpData()
     bool sio = (gpDirection & BIT(1)) ? 0 : sioCur;
     bool sck = (gpDirection & BIT(0)) ? 0 : sckCur;
     return (cs << 2) | (sio << 1) | (sck << 0);
-}
\ No newline at end of file
+}
+
+void Rtc::syncState(SaveState &state)
+{
+    // Sync the serial transfer state and RTC registers
+    state.sync(gpRtc);
+    state.sync(csCur);
+    state.sync(sckCur);
+    state.sync(sioCur);
+    state.sync(writeCount);
+    state.sync(command);
+    state.sync(control);
+    state.sync(dateTime);
+    state.sync(rtc);
+    state.sync(gpDirection);
+    state.sync(gpControl);
+}
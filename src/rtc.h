@@ -25,14 +25,18 @@
 #include "defines.h"
 
 class Core;
+class SaveState;
 
 class Rtc
 {
     public:
         Rtc(Core *core): core(core) {}
 
+        void syncState(SaveState &state);
+
         void enableGpRtc() { gpRtc = true; }
         void reset();
+        void setFixedTime(int64_t time) { fixedTime = time; }
 
         uint8_t readRtc();
         uint16_t readGpData();
@@ -48,6 +52,9 @@ class Rtc
         Core *core;
         bool gpRtc = false;
 
+        // Time to report instead of the host's, so replays see the same date as the recording; negative if unused
+        int64_t fixedTime = -1;
+
         bool csCur = false;
         bool sckCur = false;
         bool sioCur = false;
@@ -0,0 +1,127 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include "save_state.h"
+
+void SaveState::sync(void *data, size_t size)
+{
+    // Stop transferring data after an error
+    if (failed) return;
+
+    if (file)
+    {
+        // Stream the data directly to or from the file
+        if ((loading ? fread(data, 1, size, file) : fwrite(data, 1, size, file)) != size)
+            failed = true;
+    }
+    else if (loading)
+    {
+        // Copy data out of the buffer, failing if it runs out
+        if (offset + size > buffer->size())
+        {
+            failed = true;
+            return;
+        }
+        memcpy(data, &(*buffer)[offset], size);
+        offset += size;
+    }
+    else
+    {
+        // Append the data to the buffer
+        buffer->insert(buffer->end(), (uint8_t*)data, (uint8_t*)data + size);
+    }
+}
+
+static inline uint8_t deltaByte(std::vector<uint8_t> &base, std::vector<uint8_t> &target, size_t i)
+{
+    // Get the difference between two states at an offset, treating the base as zero past its end
+    return target[i] ^ ((i < base.size()) ? base[i] : 0);
+}
+
+void SaveState::encodeDelta(std::vector<uint8_t> &base, std::vector<uint8_t> &target, std::vector<uint8_t> &delta)
+{
+    // Start the delta with the size of the target state
+    uint32_t size = target.size();
+    delta.clear();
+    delta.insert(delta.end(), (uint8_t*)&size, (uint8_t*)&size + sizeof(size));
+
+    // Encode the XOR of the states as runs of unchanged bytes, each followed by a run of changed literals
+    // Most of a state stays the same between nearby frames, so this shrinks it a lot without a compression library
+    size_t i = 0;
+    while (i < size)
+    {
+        // Count unchanged bytes, comparing 8 bytes at a time while both states have that many left
+        // The rest are finished byte by byte, along with anything past the end of the base
+        size_t start = i;
+        size_t common = std::min<size_t>(size, base.size());
+        while (i + 8 <= common && !memcmp(&target[i], &base[i], 8)) i += 8;
+        while (i < size && !deltaByte(base, target, i)) i++;
+        uint32_t zeros = i - start;
+
+        // Count changed bytes, ending the run once enough unchanged bytes follow to be worth a new record
+        start = i;
+        while (i < size)
+        {
+            size_t j = i;
+            while (j < size && j - i < 8 && !deltaByte(base, target, j)) j++;
+            if (j > i && (j - i == 8 || j == size)) break;
+            i = (j > i) ? j : (i + 1);
+        }
+        uint32_t literals = i - start;
+
+        // Write the record, with the changed bytes stored as differences
+        delta.insert(delta.end(), (uint8_t*)&zeros, (uint8_t*)&zeros + sizeof(zeros));
+        delta.insert(delta.end(), (uint8_t*)&literals, (uint8_t*)&literals + sizeof(literals));
+        for (size_t j = start; j < i; j++)
+            delta.push_back(deltaByte(base, target, j));
+    }
+}
+
+bool SaveState::applyDelta(std::vector<uint8_t> &base, std::vector<uint8_t> &delta, std::vector<uint8_t> &target)
+{
+    // Read the size of the target state
+    uint32_t size;
+    if (delta.size() < sizeof(size)) return false;
+    memcpy(&size, &delta[0], sizeof(size));
+    target.resize(size);
+
+    // Rebuild the target state by applying each record of differences to the base
+    size_t i = 0, pos = sizeof(size);
+    while (i < size)
+    {
+        // Read a record header, failing if it's truncated or runs past the end of the state
+        uint32_t counts[2];
+        if (pos + sizeof(counts) > delta.size()) return false;
+        memcpy(counts, &delta[pos], sizeof(counts));
+        pos += sizeof(counts);
+        if (i + counts[0] + counts[1] > size || pos + counts[1] > delta.size()) return false;
+
+        // Copy the unchanged bytes, and restore the changed bytes from their differences
+        size_t end = i + counts[0], copy = std::min(end, base.size());
+        if (i < copy) memcpy(&target[i], &base[i], copy - i);
+        for (i = std::max(i, copy); i < end; i++)
+            target[i] = 0;
+        for (end = i + counts[1]; i < end; i++, pos++)
+            target[i] = delta[pos] ^ ((i < base.size()) ? base[i] : 0);
+    }
+    return true;
+}
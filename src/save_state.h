@@ -0,0 +1,92 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAVE_STATE_H
+#define SAVE_STATE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "ring_buffer.h"
+
+// Identifies a save state file, followed by a version that must match for it to be loaded
+// The version should be incremented whenever the layout of any component's state changes
+#define STATE_MAGIC 0x5453444E // "NDST"
+#define STATE_VERSION 3
+
+// Streams component state to or from a file or memory buffer
+// Components sync their members in the same order for both directions, so one function handles saving and loading
+// Snapshots are in-memory states that can keep large data elsewhere, like memory tracking its own changed pages
+class SaveState
+{
+    public:
+        SaveState(FILE *file, bool loading): file(file), loading(loading) {}
+        SaveState(std::vector<uint8_t> *buffer, bool loading, bool snapshot = false):
+            buffer(buffer), loading(loading), snapshot(snapshot) {}
+
+        bool isLoading()  { return loading;  }
+        bool isSnapshot() { return snapshot; }
+        bool isFile()     { return file;     }
+        bool isFailed()   { return failed;   }
+        void fail()       { failed = true;   }
+
+        void sync(void *data, size_t size);
+        template <typename T> void sync(T &value) { sync(&value, sizeof(T)); }
+        template <typename T, uint32_t capacity> void sync(RingBuffer<T, capacity> &ring);
+
+        static void encodeDelta(std::vector<uint8_t> &base, std::vector<uint8_t> &target, std::vector<uint8_t> &delta);
+        static bool applyDelta(std::vector<uint8_t> &base, std::vector<uint8_t> &delta, std::vector<uint8_t> &target);
+
+    private:
+        FILE *file = nullptr;
+        std::vector<uint8_t> *buffer = nullptr;
+        size_t offset = 0;
+        bool loading;
+        bool snapshot = false;
+        bool failed = false;
+};
+
+template <typename T, uint32_t capacity> void SaveState::sync(RingBuffer<T, capacity> &ring)
+{
+    // Sync the size of the ring buffer, in the same layout as a queue
+    uint32_t size = ring.size();
+    sync(size);
+
+    if (loading)
+    {
+        // Rebuild the ring buffer from the loaded values, failing if they don't fit
+        ring.clear();
+        if (size > capacity) return fail();
+        for (uint32_t i = 0; i < size && !failed; i++)
+        {
+            T value;
+            sync(value);
+            ring.push(value);
+        }
+    }
+    else
+    {
+        // Save the values in order
+        for (uint32_t i = 0; i < size; i++)
+            sync(ring[i]);
+    }
+}
+
+#endif // SAVE_STATE_H
@@ -22,9 +22,25 @@
 
 int Settings::directBoot = 1;
 int Settings::fpsLimiter = 1;
+int Settings::audioLatency = 50;
+int Settings::adpcmCache = 1;
 int Settings::threaded2D = 1;
 int Settings::threaded3D = 1;
+int Settings::threadedGeometry = 0;
 int Settings::highRes3D = 0;
+int Settings::cachedInterpreter = 0;
+int Settings::cpuSlice = 0;
+int Settings::idleLoopSkip = 0;
+int Settings::runAhead = 0;
+int Settings::rewindLength = 0;
+int Settings::romCacheSize = 0;
+int Settings::mapSdImage = 0;
+int Settings::hugePages = 0;
+int Settings::frameSkip = 3;
+int Settings::emuAffinity = 0;
+int Settings::renderAffinity = 0;
+int Settings::audioAffinity = 0;
+int Settings::threadPriority = 0;
 std::string Settings::bios9Path = "bios9.bin";
 std::string Settings::bios7Path = "bios7.bin";
 std::string Settings::firmwarePath = "firmware.bin";
@@ -35,16 +51,32 @@ std::string Settings::filename = "noods.ini";
 
 std::vector<Setting> Settings::settings =
 {
-    Setting("directBoot",   &directBoot,   false),
-    Setting("fpsLimiter",   &fpsLimiter,   false),
-    Setting("threaded2D",   &threaded2D,   false),
-    Setting("threaded3D",   &threaded3D,   false),
-    Setting("highRes3D",    &highRes3D,    false),
-    Setting("bios9Path",    &bios9Path,    true),
-    Setting("bios7Path",    &bios7Path,    true),
-    Setting("firmwarePath", &firmwarePath, true),
-    Setting("gbaBiosPath",  &gbaBiosPath,  true),
-    Setting("sdImagePath",  &sdImagePath,  true)
+    Setting("directBoot",        &directBoot,        false),
+    Setting("fpsLimiter",        &fpsLimiter,        false),
+    Setting("audioLatency",      &audioLatency,      false),
+    Setting("adpcmCache",        &adpcmCache,        false),
+    Setting("threaded2D",        &threaded2D,        false),
+    Setting("threaded3D",        &threaded3D,        false),
+    Setting("threadedGeometry",  &threadedGeometry,  false),
+    Setting("highRes3D",         &highRes3D,         false),
+    Setting("cachedInterpreter", &cachedInterpreter, false),
+    Setting("cpuSlice",          &cpuSlice,          false),
+    Setting("idleLoopSkip",      &idleLoopSkip,      false),
+    Setting("runAhead",          &runAhead,          false),
+    Setting("rewindLength",      &rewindLength,      false),
+    Setting("romCacheSize",      &romCacheSize,      false),
+    Setting("mapSdImage",        &mapSdImage,        false),
+    Setting("hugePages",         &hugePages,         false),
+    Setting("frameSkip",         &frameSkip,         false),
+    Setting("emuAffinity",       &emuAffinity,       false),
+    Setting("renderAffinity",    &renderAffinity,    false),
+    Setting("audioAffinity",     &audioAffinity,     false),
+    Setting("threadPriority",    &threadPriority,    false),
+    Setting("bios9Path",         &bios9Path,         true),
+    Setting("bios7Path",         &bios7Path,         true),
+    Setting("firmwarePath",      &firmwarePath,      true),
+    Setting("gbaBiosPath",       &gbaBiosPath,       true),
+    Setting("sdImagePath",       &sdImagePath,       true)
 };
 
 void Settings::add(std::vector<Setting> platformSettings)
@@ -38,9 +38,25 @@ class Settings
     public:
         static int directBoot;
         static int fpsLimiter;
+        static int audioLatency;
+        static int adpcmCache;
         static int threaded2D;
         static int threaded3D;
+        static int threadedGeometry;
         static int highRes3D;
+        static int cachedInterpreter;
+        static int cpuSlice;
+        static int idleLoopSkip;
+        static int runAhead;
+        static int rewindLength;
+        static int romCacheSize;
+        static int mapSdImage;
+        static int hugePages;
+        static int frameSkip;
+        static int emuAffinity;
+        static int renderAffinity;
+        static int audioAffinity;
+        static int threadPriority;
         static std::string bios9Path;
         static std::string bios7Path;
         static std::string firmwarePath;
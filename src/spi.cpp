@@ -18,6 +18,8 @@
 */
 
 #include <cstring>
+#include <sys/stat.h>
+#include <vector>
 
 #include "spi.h"
 #include "core.h"
@@ -25,6 +27,35 @@
 
 Language Spi::language = LG_ENGLISH;
 
+// Firmware file contents shared by all cores, so resets and extra instances don't read the file again
+// The file's size and modification time are kept so a changed file gets reloaded
+static std::mutex cacheMutex;
+static std::string cachePath;
+static int64_t cacheSize = -1;
+static time_t cacheTime = 0;
+static std::vector<uint8_t> firmCache;
+
+static bool cacheFirmware(std::string &path)
+{
+    // Check if the firmware file exists, and if the cached copy is still current
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+    if (cachePath == path && cacheSize == info.st_size && cacheTime == info.st_mtime)
+        return true;
+
+    // Read the file into the cache
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    firmCache.resize(info.st_size);
+    firmCache.resize(fread(firmCache.data(), sizeof(uint8_t), firmCache.size(), file));
+    fclose(file);
+    cachePath = path;
+    cacheSize = info.st_size;
+    cacheTime = info.st_mtime;
+    return true;
+}
+
 Spi::~Spi()
 {
     // Free any dynamic memory
@@ -53,15 +84,14 @@ bool Spi::loadFirmware()
     if (firmware)
         delete[] firmware;
 
-    // Load the firmware from a file if it exists
-    if (FILE *file = fopen(Settings::firmwarePath.c_str(), "rb"))
+    // Load the firmware from a file if it exists, reusing the cached copy if the file hasn't changed
+    std::lock_guard<std::mutex> guard(cacheMutex);
+    if (cacheFirmware(Settings::firmwarePath))
     {
-        fseek(file, 0, SEEK_END);
-        firmSize = ftell(file);
-        fseek(file, 0, SEEK_SET);
+        // Give the core its own copy, since it gets tweaked per instance
+        firmSize = firmCache.size();
         firmware = new uint8_t[firmSize];
-        fread(firmware, sizeof(uint8_t), firmSize, file);
-        fclose(file);
+        memcpy(firmware, firmCache.data(), firmSize);
 
         if (core->id > 0)
         {
@@ -323,3 +353,19 @@ void Spi::writeSpiData(uint8_t value)
     if (spiCnt & BIT(14))
         core->interpreter[1].sendInterrupt(23);
 }
+
+void Spi::syncState(SaveState &state)
+{
+    // Sync the serial transfer state and SPI registers
+    // Firmware is left alone, since it's stored like a save file rather than as part of the system state
+    state.sync(micCycles);
+    state.sync(micStep);
+    state.sync(micSample);
+    state.sync(writeCount);
+    state.sync(address);
+    state.sync(command);
+    state.sync(touchX);
+    state.sync(touchY);
+    state.sync(spiCnt);
+    state.sync(spiData);
+}
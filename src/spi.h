@@ -34,6 +34,7 @@ enum Language
 };
 
 class Core;
+class SaveState;
 
 class Spi
 {
@@ -41,11 +42,15 @@ class Spi
         Spi(Core *core): core(core) {}
         ~Spi();
 
+        void syncState(SaveState &state);
+
         bool loadFirmware();
         void directBoot();
 
         void setTouch(int x, int y);
         void clearTouch();
+        uint32_t getTouchAdc() { return (touchY << 16) | touchX; }
+        void setTouchAdc(uint32_t value) { touchX = value; touchY = value >> 16; }
 
         static void setLanguage(Language lang) { language = lang; }
         void sendMicData(const int16_t* samples, size_t count, size_t rate);
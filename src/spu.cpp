@@ -17,8 +17,19 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstring>
+#include <thread>
+
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "spu.h"
 #include "core.h"
@@ -43,85 +54,152 @@ const int16_t Spu::adpcmTable[] =
 
 Spu::Spu(Core *core): core(core)
 {
-    // Mark the buffer as not ready
-    ready.store(false);
+    // Start with an empty ring and no audio output pulling from it
+    ringHead.store(0);
+    ringTail.store(0);
+    playing.store(false);
 }
 
-Spu::~Spu()
+int Spu::latencyTarget()
 {
-    // Free the buffers
-    delete[] bufferIn;
-    delete[] bufferOut;
+    // Convert the latency setting from milliseconds to a number of samples, leaving headroom in the ring
+    int target = Settings::audioLatency * 32768 / 1000;
+    return std::max(256, std::min(target, SPU_RING_SIZE / 2));
 }
 
-uint32_t *Spu::getSamples(int count)
+uint32_t *Spu::getSamples(int count, int rate)
 {
-    // Initialize the buffers
-    if (bufferSize != count)
+    // Let the emulator know an audio output is pulling samples, so the FPS limiter can follow it
+    playing.store(true, std::memory_order_relaxed);
+
+    // Build the filter for a new output rate
+    if (resampleRate != rate)
     {
-        delete[] bufferIn;
-        delete[] bufferOut;
-        bufferIn  = new uint32_t[count];
-        bufferOut = new uint32_t[count];
-        bufferSize = count;
-        bufferPointer = 0;
+        updateFilter(rate);
+        resampleRate = rate;
     }
 
-    bool wait;
-
-    // If FPS limit is enabled, try to wait until the buffer is filled
-    // If the emulation isn't full speed, waiting would starve the audio buffer
-    // So if it's taking too long, just let it play an empty buffer
-    if (Settings::fpsLimiter == 2) // Accurate
+    // Check how many samples are available without waiting for more
+    uint32_t tail = ringTail.load(std::memory_order_relaxed);
+    uint32_t available = ringHead.load(std::memory_order_acquire) - tail;
+
+    // Step through the input at the ratio between the sample rates, adjusted by up to 0.5% to stay near the target latency
+    // This absorbs drift between the host audio clock and the emulated one without audible pitch changes
+    int target = latencyTarget();
+    double ratio = 1.0 + 0.005 * ((double)available - target) / target;
+    double step = 32768.0 / rate * std::max(0.995, std::min(ratio, 1.005));
+
+    // Write to the preallocated output buffer, which stays valid until the next call
+    if ((int)outBuffer.size() < count)
+        outBuffer.resize(count);
+    uint32_t *out = &outBuffer[0];
+    for (int i = 0; i < count; i++)
     {
-        std::chrono::steady_clock::time_point waitTime = std::chrono::steady_clock::now();
-        wait = false;
+        // Find the position of the output sample in the ring
+        double position = ringFraction + i * step;
+        uint32_t index = position;
 
-        // Use a while loop to constantly check if the wait condition has been satisfied
-        // This is wasteful, but ensures a swift break from the wait state
-        while (!ready.load())
+        // Filter the input around the position with the closest phase of the kernel
+        // The ring is mirrored past its end, so the taps can always be read in one piece
+        if (index + SPU_TAPS <= available)
         {
-            if (std::chrono::steady_clock::now() - waitTime > std::chrono::microseconds(1000000 / 60))
-            {
-                wait = true;
-                break;
-            }
+            int phase = (position - index) * SPU_PHASES;
+            lastSample = filterSample(&ring[(tail + index) & (SPU_RING_SIZE - 1)], resampleFilter[phase]);
         }
-    }
-    else // Disabled/Light
-    {
-        // Use a condition variable to save CPU cycles
-        // This might take longer than expected due to the OS scheduler and other factors
-        std::unique_lock<std::mutex> lock(mutex2);
-        wait = !cond2.wait_for(lock, std::chrono::microseconds(1000000 / 60), [&]{ return ready.load(); });
+
+        // Repeat the last played sample to prevent crackles if the emulator is running slow
+        out[i] = lastSample;
     }
 
-    uint32_t *out = new uint32_t[count];
-    
-    if (wait)
+    // Free the consumed samples, keeping the fractional position for next time unless the ring ran dry
+    double end = ringFraction + count * step;
+    uint32_t consumed = end;
+    if (consumed + SPU_TAPS <= available)
     {
-        // Fill the output buffer with the last played sample to prevent crackles when running slow
-        for (int i = 0; i < count; i++)
-            out[i] = bufferOut[count - 1];
+        ringFraction = end - consumed;
     }
     else
     {
-        // Fill the output buffer with new data
-        memcpy(out, bufferOut, count * sizeof(uint32_t));
+        consumed = (available > SPU_TAPS) ? (available - SPU_TAPS) : 0;
+        ringFraction = 0;
     }
+    ringTail.store(tail + consumed, std::memory_order_release);
+    return out;
+}
 
-    // Signal that the buffer was played
+void Spu::updateFilter(int rate)
+{
+    // Cut off just below the lower of the two Nyquist frequencies, relative to the input's
+    double cutoff = std::min(1.0, rate / 32768.0) * 0.9;
+
+    for (int i = 0; i < SPU_PHASES; i++)
     {
-        std::lock_guard<std::mutex> guard(mutex1);
-        ready.store(false);
-        cond1.notify_one();
+        // Calculate a Blackman-windowed sinc kernel for the phase, centered between the middle two taps
+        double values[SPU_TAPS], sum = 0;
+        for (int j = 0; j < SPU_TAPS; j++)
+        {
+            double x = j - (SPU_TAPS / 2 - 1) - (double)i / SPU_PHASES;
+            double sinc = (x == 0) ? 1 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+            double window = 0.42 + 0.5 * cos(2 * M_PI * x / SPU_TAPS) + 0.08 * cos(4 * M_PI * x / SPU_TAPS);
+            values[j] = sinc * window;
+            sum += values[j];
+        }
+
+        // Normalize the kernel to unity gain with 14 fractional bits, putting rounding error on the center tap
+        int total = 0;
+        for (int j = 0; j < SPU_TAPS; j++)
+            total += resampleFilter[i][j] = lround(values[j] / sum * (1 << 14));
+        resampleFilter[i][SPU_TAPS / 2 - 1] += (1 << 14) - total;
     }
+}
 
-    return out;
+FORCE_INLINE uint32_t Spu::filterSample(const uint32_t *data, const int16_t *filter)
+{
+    // Apply the kernel to 8 stereo samples, and return a stereo sample rounded and saturated to 16 bits
+#if defined(__SSE2__)
+    // Split the kernel into left and right halves of each 32-bit sample, so multiply-adds skip the other channel
+    __m128i coefs = _mm_loadu_si128((__m128i*)filter), zero = _mm_setzero_si128();
+    __m128i s0 = _mm_loadu_si128((__m128i*)&data[0]), s1 = _mm_loadu_si128((__m128i*)&data[4]);
+    __m128i l = _mm_add_epi32(_mm_madd_epi16(s0, _mm_unpacklo_epi16(coefs, zero)),
+        _mm_madd_epi16(s1, _mm_unpackhi_epi16(coefs, zero)));
+    __m128i r = _mm_add_epi32(_mm_madd_epi16(s0, _mm_unpacklo_epi16(zero, coefs)),
+        _mm_madd_epi16(s1, _mm_unpackhi_epi16(zero, coefs)));
+
+    // Sum the lanes into one left and right value, then round and pack them
+    __m128i lr = _mm_add_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r));
+    lr = _mm_add_epi32(lr, _mm_srli_si128(lr, 8));
+    lr = _mm_srai_epi32(_mm_add_epi32(lr, _mm_set1_epi32(1 << 13)), 14);
+    return _mm_cvtsi128_si32(_mm_packs_epi32(lr, lr));
+#elif defined(__ARM_NEON)
+    // Load the samples split into left and right channels, and multiply-add them with the kernel
+    int16x4x2_t s0 = vld2_s16((int16_t*)&data[0]), s1 = vld2_s16((int16_t*)&data[4]);
+    int16x4_t c0 = vld1_s16(&filter[0]), c1 = vld1_s16(&filter[4]);
+    int32x4_t l = vmlal_s16(vmull_s16(s0.val[0], c0), s1.val[0], c1);
+    int32x4_t r = vmlal_s16(vmull_s16(s0.val[1], c0), s1.val[1], c1);
+
+    // Sum the lanes into one left and right value, then round and pack them
+    int32x2_t lr = vpadd_s32(vadd_s32(vget_low_s32(l), vget_high_s32(l)), vadd_s32(vget_low_s32(r), vget_high_s32(r)));
+    return vget_lane_u32(vreinterpret_u32_s16(vqrshrn_n_s32(vcombine_s32(lr, lr), 14)), 0);
+#else
+    // Multiply-add each channel separately
+    int32_t l = 0, r = 0;
+    for (int i = 0; i < SPU_TAPS; i++)
+    {
+        l += (int16_t)(data[i] >>  0) * filter[i];
+        r += (int16_t)(data[i] >> 16) * filter[i];
+    }
+
+    // Round and saturate the values
+    l = std::max(-0x8000, std::min((l + (1 << 13)) >> 14, 0x7FFF));
+    r = std::max(-0x8000, std::min((r + (1 << 13)) >> 14, 0x7FFF));
+    return ((uint16_t)r << 16) | (uint16_t)l;
+#endif
 }
 
 void Spu::runGbaSample()
 {
+    PROFILE_TIME(core->profileTotals.spuTime);
+
     int64_t sampleLeft = 0;
     int64_t sampleRight = 0;
 
@@ -378,14 +456,11 @@ void Spu::runGbaSample()
     sampleLeft  = (sampleLeft  - 0x200) << 5;
     sampleRight = (sampleRight - 0x200) << 5;
 
-    if (bufferSize > 0)
+    if (output)
     {
-        // Write the samples to the buffer
-        bufferIn[bufferPointer++] = (sampleRight << 16) | (sampleLeft & 0xFFFF);
-
-        // Handle a full buffer
-        if (bufferPointer == bufferSize)
-            swapBuffers();
+        // Send the samples to the audio output
+        pushSample((sampleRight << 16) | (sampleLeft & 0xFFFF));
+        keepPace();
     }
 
     // Reschedule the task for the next sample
@@ -394,334 +469,492 @@ void Spu::runGbaSample()
 
 void Spu::runSample()
 {
-    int64_t mixerLeft = 0, mixerRight = 0;
-    int64_t channelsLeft[2] = {}, channelsRight[2] = {};
+    // Mix the samples that just became due, and schedule the next ones
+    catchUp();
+    scheduleSample();
+}
 
-    // Mix the sound channels
-    for (int i = 0; i < 16; i++)
+void Spu::scheduleSample()
+{
+    // Schedule the end of the next block, or just the next sample while capturing
+    // Capture writes to memory and channels playing the captured data need to see them on time, so they can't wait for a block
+    int samples = ((sndCapCnt[0] | sndCapCnt[1]) & BIT(7)) ? 1 : SPU_BLOCK;
+    core->schedule(NDS_SPU_SAMPLE, nextSample + 512 * 2 * (samples - 1) - core->globalCycles);
+}
+
+void Spu::resetCycles()
+{
+    // Adjust the next sample cycle for a global cycle reset
+    nextSample -= core->globalCycles;
+}
+
+void Spu::catchUp()
+{
+    // Check if any samples are due, comparing with wraparound in case a cycle reset is pending
+    if ((int32_t)(core->globalCycles - nextSample) < 0)
+        return;
+
+    PROFILE_TIME(core->profileTotals.spuTime);
+
+    // Count the due samples and move to the next one
+    // The SPU runs at 16756991Hz with a sample rate of 32768Hz, so one sample is ~512 SPU cycles or 1024 system cycles
+    int count = (core->globalCycles - nextSample) / (512 * 2) + 1;
+    nextSample += count * 512 * 2;
+
+    // Mix the samples in blocks, or one at a time while capturing so each sample sees the data captured before it
+    while (count > 0)
     {
-        // Skip disabled channels
-        if (!(enabled & BIT(i)))
-            continue;
+        int size = ((sndCapCnt[0] | sndCapCnt[1]) & BIT(7)) ? 1 : std::min(count, SPU_BLOCK);
+        mixSamples(size);
+        count -= size;
+    }
 
-        int format = (soundCnt[i] & 0x60000000) >> 29;
-        int64_t data = 0;
+    // Drop the page marks of channels that stopped while mixing
+    if (enabled != streamChannels)
+        updateStreamPages();
+}
+
+int Spu::runChannel(int channel, int32_t *data, int count)
+{
+    int format = (soundCnt[channel] & 0x60000000) >> 29;
 
+    for (int i = 0; i < count; i++)
+    {
         // Read the sample data
         switch (format)
         {
             case 0: // PCM8
             {
-                data = (int8_t)core->memory.read<uint8_t>(1, soundCurrent[i]) << 8;
+                data[i] = (int8_t)core->memory.read<uint8_t>(1, soundCurrent[channel]) << 8;
                 break;
             }
 
             case 1: // PCM16
             {
-                data = (int16_t)core->memory.read<uint16_t>(1, soundCurrent[i]);
+                data[i] = (int16_t)core->memory.read<uint16_t>(1, soundCurrent[channel]);
                 break;
             }
 
             case 2: // ADPCM
             {
-                data = adpcmValue[i];
+                data[i] = adpcmValue[channel];
                 break;
             }
 
             case 3: // Pulse/Noise
             {
-                if (i >= 8 && i <= 13) // Pulse waves
+                if (channel >= 8 && channel <= 13) // Pulse waves
                 {
                     // Set the sample to low or high depending on the position in the duty cycle
-                    int duty = 7 - ((soundCnt[i] & 0x07000000) >> 24);
-                    data = (dutyCycles[i - 8] < duty) ? -0x7FFF : 0x7FFF;
+                    int duty = 7 - ((soundCnt[channel] & 0x07000000) >> 24);
+                    data[i] = (dutyCycles[channel - 8] < duty) ? -0x7FFF : 0x7FFF;
                 }
-                else if (i >= 14) // Noise
+                else if (channel >= 14) // Noise
                 {
                     // Set the sample to low or high depending on the carry bit (saved as bit 15)
-                    data = (noiseValues[i - 14] & BIT(15)) ? -0x7FFF : 0x7FFF;
+                    data[i] = (noiseValues[channel - 14] & BIT(15)) ? -0x7FFF : 0x7FFF;
+                }
+                else
+                {
+                    data[i] = 0;
                 }
                 break;
             }
         }
 
         // Increment the timer for the length of a sample
-        // The SPU runs at 16756991Hz with a sample rate of 32768Hz
-        // 16756991 / 32768 = ~512 cycles per sample
-        soundTimers[i] += 512;
-        bool overflow = (soundTimers[i] < 512);
+        soundTimers[channel] += 512;
+        bool overflow = (soundTimers[channel] < 512);
 
         // Handle timer overflow
         while (overflow)
         {
             // Reload the timer
-            soundTimers[i] += soundTmr[i];
-            overflow = (soundTimers[i] < soundTmr[i]);
+            soundTimers[channel] += soundTmr[channel];
+            overflow = (soundTimers[channel] < soundTmr[channel]);
 
             switch (format)
             {
                 case 0: case 1: // PCM8/PCM16
                 {
                     // Increment the data pointer by the size of one sample
-                    soundCurrent[i] += 1 + format;
+                    soundCurrent[channel] += 1 + format;
                     break;
                 }
 
                 case 2: // ADPCM
                 {
                     // Save the ADPCM values at the loop position
-                    if (soundCurrent[i] == soundSad[i] + soundPnt[i] * 4 && !adpcmToggle[i])
+                    if (soundCurrent[channel] == soundSad[channel] + soundPnt[channel] * 4 && !adpcmToggle[channel])
                     {
-                        adpcmLoopValue[i] = adpcmValue[i];
-                        adpcmLoopIndex[i] = adpcmIndex[i];
+                        adpcmLoopValue[channel] = adpcmValue[channel];
+                        adpcmLoopIndex[channel] = adpcmIndex[channel];
                     }
 
-                    // Get the 4-bit ADPCM data
-                    uint8_t adpcmData = core->memory.read<uint8_t>(1, soundCurrent[i]);
-                    adpcmData = adpcmToggle[i] ? ((adpcmData & 0xF0) >> 4) : (adpcmData & 0x0F);
-
-                    // Calculate the sample difference
-                    int32_t diff = adpcmTable[adpcmIndex[i]] / 8;
-                    if (adpcmData & BIT(0)) diff += adpcmTable[adpcmIndex[i]] / 4;
-                    if (adpcmData & BIT(1)) diff += adpcmTable[adpcmIndex[i]] / 2;
-                    if (adpcmData & BIT(2)) diff += adpcmTable[adpcmIndex[i]] / 1;
-
-                    // Apply the sample difference to the sample
-                    if (adpcmData & BIT(3))
+                    // Look up the nibble in the cache, which is only valid if it was decoded from the same state
+                    AdpcmBlock *block = adpcmBlocks[channel];
+                    uint32_t nibble = (soundCurrent[channel] - soundSad[channel] - 4) * 2 + adpcmToggle[channel];
+                    uint32_t state = (adpcmIndex[channel] << 16) | (uint16_t)adpcmValue[channel];
+                    if (block && nibble < block->states.size() - 1 && block->states[nibble] == state)
                     {
-                        adpcmValue[i] += diff;
-                        if (adpcmValue[i] > 0x7FFF) adpcmValue[i] = 0x7FFF;
+                        // Use the cached result
+                        state = block->states[nibble + 1];
+                        adpcmValue[channel] = (int16_t)state;
+                        adpcmIndex[channel] = state >> 16;
                     }
                     else
                     {
-                        adpcmValue[i] -= diff;
-                        if (adpcmValue[i] < -0x7FFF) adpcmValue[i] = -0x7FFF;
+                        // Get the 4-bit ADPCM data
+                        uint8_t adpcmData = core->memory.read<uint8_t>(1, soundCurrent[channel]);
+                        adpcmData = adpcmToggle[channel] ? ((adpcmData & 0xF0) >> 4) : (adpcmData & 0x0F);
+
+                        // Calculate the sample difference
+                        int32_t diff = adpcmTable[adpcmIndex[channel]] / 8;
+                        if (adpcmData & BIT(0)) diff += adpcmTable[adpcmIndex[channel]] / 4;
+                        if (adpcmData & BIT(1)) diff += adpcmTable[adpcmIndex[channel]] / 2;
+                        if (adpcmData & BIT(2)) diff += adpcmTable[adpcmIndex[channel]] / 1;
+
+                        // Apply the sample difference to the sample
+                        if (adpcmData & BIT(3))
+                        {
+                            adpcmValue[channel] += diff;
+                            if (adpcmValue[channel] > 0x7FFF) adpcmValue[channel] = 0x7FFF;
+                        }
+                        else
+                        {
+                            adpcmValue[channel] -= diff;
+                            if (adpcmValue[channel] < -0x7FFF) adpcmValue[channel] = -0x7FFF;
+                        }
+
+                        // Calculate the next index
+                        adpcmIndex[channel] += indexTable[adpcmData & 0x7];
+                        if (adpcmIndex[channel] <  0) adpcmIndex[channel] =  0;
+                        if (adpcmIndex[channel] > 88) adpcmIndex[channel] = 88;
+
+                        // Add the result to the cache if it continues where the cache left off
+                        if (block && nibble == block->states.size() - 1 && block->states[nibble] == state &&
+                            soundCurrent[channel] < block->end)
+                        {
+                            block->states.push_back((adpcmIndex[channel] << 16) | (uint16_t)adpcmValue[channel]);
+                            adpcmCacheSize++;
+                        }
                     }
 
-                    // Calculate the next index
-                    adpcmIndex[i] += indexTable[adpcmData & 0x7];
-                    if (adpcmIndex[i] <  0) adpcmIndex[i] =  0;
-                    if (adpcmIndex[i] > 88) adpcmIndex[i] = 88;
-
                     // Move to the next 4-bit ADPCM data
-                    adpcmToggle[i] = !adpcmToggle[i];
-                    if (!adpcmToggle[i]) soundCurrent[i]++;
+                    adpcmToggle[channel] = !adpcmToggle[channel];
+                    if (!adpcmToggle[channel]) soundCurrent[channel]++;
 
                     break;
                 }
 
                 case 3: // Pulse/Noise
                 {
-                    if (i >= 8 && i <= 13) // Pulse waves
+                    if (channel >= 8 && channel <= 13) // Pulse waves
                     {
                         // Increment the duty cycle counter
-                        dutyCycles[i - 8] = (dutyCycles[i - 8] + 1) % 8;
+                        dutyCycles[channel - 8] = (dutyCycles[channel - 8] + 1) % 8;
                     }
-                    else if (i >= 14) // Noise
+                    else if (channel >= 14) // Noise
                     {
                         // Clear the previous saved carry bit
-                        noiseValues[i - 14] &= ~BIT(15);
- 
+                        noiseValues[channel - 14] &= ~BIT(15);
+
                         // Advance the random generator and save the carry bit to bit 15
-                        if (noiseValues[i - 14] & BIT(0))
-                            noiseValues[i - 14] = BIT(15) | ((noiseValues[i - 14] >> 1) ^ 0x6000);
+                        if (noiseValues[channel - 14] & BIT(0))
+                            noiseValues[channel - 14] = BIT(15) | ((noiseValues[channel - 14] >> 1) ^ 0x6000);
                         else
-                            noiseValues[i - 14] >>= 1;
+                            noiseValues[channel - 14] >>= 1;
                     }
                     break;
                 }
             }
 
             // Repeat or end the sound if the end of the data is reached
-            if (format != 3 && soundCurrent[i] >= soundSad[i] + (soundPnt[i] + soundLen[i]) * 4)
+            if (format != 3 && soundCurrent[channel] >= soundSad[channel] + (soundPnt[channel] + soundLen[channel]) * 4)
             {
-                if ((soundCnt[i] & 0x18000000) >> 27 == 1) // Loop infinite
+                if ((soundCnt[channel] & 0x18000000) >> 27 == 1) // Loop infinite
                 {
-                    soundCurrent[i] = soundSad[i] + soundPnt[i] * 4;
+                    soundCurrent[channel] = soundSad[channel] + soundPnt[channel] * 4;
 
                     // Restore the ADPCM values from the loop position
                     if (format == 2)
                     {
-                        adpcmValue[i] = adpcmLoopValue[i];
-                        adpcmIndex[i] = adpcmLoopIndex[i];
-                        adpcmToggle[i] = false;
+                        adpcmValue[channel] = adpcmLoopValue[channel];
+                        adpcmIndex[channel] = adpcmLoopIndex[channel];
+                        adpcmToggle[channel] = false;
                     }
                 }
                 else // One-shot
                 {
-                    soundCnt[i] &= ~BIT(31);
-                    enabled &= ~BIT(i);
-                    break;
+                    // End the sound, still playing the sample that was just read
+                    soundCnt[channel] &= ~BIT(31);
+                    enabled &= ~BIT(channel);
+                    return i + 1;
                 }
             }
         }
+    }
+
+    return count;
+}
+
+void Spu::mixChannel(int32_t *data, int count, int volume, int pan, int32_t *left, int32_t *right)
+{
+    // Apply the volume to a block of samples and add them to the left and right outputs, rounded to 8 fractional bits
+    // The volume includes the divider, leaving 11 fractional bits; panning divides towards zero without going over 32 bits
+    int i = 0;
+
+#if defined(__SSE4_1__)
+    // Process 4 samples at a time, splitting the magnitude so the pan multiplication can't overflow
+    __m128i vol = _mm_set1_epi32(volume), panL = _mm_set1_epi32(128 - pan), panR = _mm_set1_epi32(pan);
+    __m128i low = _mm_set1_epi32(0x7F);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i value = _mm_mullo_epi32(_mm_loadu_si128((__m128i*)&data[i]), vol);
+        __m128i mag = _mm_abs_epi32(value), hi = _mm_srli_epi32(mag, 7), lo = _mm_and_si128(mag, low);
+        __m128i l = _mm_add_epi32(_mm_mullo_epi32(hi, panL), _mm_srli_epi32(_mm_mullo_epi32(lo, panL), 7));
+        __m128i r = _mm_add_epi32(_mm_mullo_epi32(hi, panR), _mm_srli_epi32(_mm_mullo_epi32(lo, panR), 7));
+        l = _mm_srai_epi32(_mm_sign_epi32(l, value), 3);
+        r = _mm_srai_epi32(_mm_sign_epi32(r, value), 3);
+        _mm_storeu_si128((__m128i*)&left[i], _mm_add_epi32(_mm_loadu_si128((__m128i*)&left[i]), l));
+        _mm_storeu_si128((__m128i*)&right[i], _mm_add_epi32(_mm_loadu_si128((__m128i*)&right[i]), r));
+    }
+#elif defined(__ARM_NEON)
+    // Process 4 samples at a time, splitting the magnitude so the pan multiplication can't overflow
+    int32x4_t panL = vdupq_n_s32(128 - pan), panR = vdupq_n_s32(pan), low = vdupq_n_s32(0x7F);
+    for (; i + 4 <= count; i += 4)
+    {
+        int32x4_t value = vmulq_n_s32(vld1q_s32(&data[i]), volume);
+        int32x4_t mag = vabsq_s32(value), hi = vshrq_n_s32(mag, 7), lo = vandq_s32(mag, low);
+        int32x4_t l = vaddq_s32(vmulq_s32(hi, panL), vshrq_n_s32(vmulq_s32(lo, panL), 7));
+        int32x4_t r = vaddq_s32(vmulq_s32(hi, panR), vshrq_n_s32(vmulq_s32(lo, panR), 7));
+        uint32x4_t neg = vcltq_s32(value, vdupq_n_s32(0));
+        l = vshrq_n_s32(vbslq_s32(neg, vnegq_s32(l), l), 3);
+        r = vshrq_n_s32(vbslq_s32(neg, vnegq_s32(r), r), 3);
+        vst1q_s32(&left[i], vaddq_s32(vld1q_s32(&left[i]), l));
+        vst1q_s32(&right[i], vaddq_s32(vld1q_s32(&right[i]), r));
+    }
+#endif
 
-        // Apply the volume divider
-        // The sample now has 4 fractional bits
+    // Process the remaining samples one at a time
+    for (; i < count; i++)
+    {
+        int32_t value = data[i] * volume;
+        int32_t mag = (value < 0) ? -value : value;
+        int32_t l = (mag >> 7) * (128 - pan) + (((mag & 0x7F) * (128 - pan)) >> 7);
+        int32_t r = (mag >> 7) * pan + (((mag & 0x7F) * pan) >> 7);
+        left[i]  += ((value < 0) ? -l : l) >> 3;
+        right[i] += ((value < 0) ? -r : r) >> 3;
+    }
+}
+
+void Spu::mixSamples(int count)
+{
+    int32_t mixerLeft[SPU_BLOCK] = {}, mixerRight[SPU_BLOCK] = {};
+    int32_t channelsLeft[2][SPU_BLOCK] = {}, channelsRight[2][SPU_BLOCK] = {};
+
+    // Mix the sound channels
+    for (int i = 0; i < 16; i++)
+    {
+        // Skip disabled channels
+        if (!(enabled & BIT(i)))
+            continue;
+
+        // Generate the channel's samples, which might end early if a one-shot sound finishes
+        int32_t data[SPU_BLOCK];
+        int size = runChannel(i, data, count);
+
+        // Combine the volume divider and factor, giving the samples 11 fractional bits
         int divShift = (soundCnt[i] & 0x00000300) >> 8;
         if (divShift == 3) divShift++;
-        data <<= 4 - divShift;
-
-        // Apply the volume factor
-        // The sample now has 11 fractional bits
         int mulFactor = (soundCnt[i] & 0x0000007F);
         if (mulFactor == 127) mulFactor++;
-        data = (data << 7) * mulFactor / 128;
+        int volume = mulFactor << (4 - divShift);
 
-        // Apply panning
-        // The samples are now rounded to 8 fractional bits
+        // Get the panning value
         int panValue = (soundCnt[i] & 0x007F0000) >> 16;
         if (panValue == 127) panValue++;
-        int64_t dataLeft  = (data * (128 - panValue) / 128) >> 3;
-        int64_t dataRight = (data *        panValue  / 128) >> 3;
 
         // Redirect channels 1 and 3 if enabled
         if (i == 1 || i == 3)
         {
-            channelsLeft[i >> 1]  = dataLeft;
-            channelsRight[i >> 1] = dataRight;
+            int32_t *left = channelsLeft[i >> 1], *right = channelsRight[i >> 1];
+            mixChannel(data, size, volume, panValue, left, right);
             if (mainSoundCnt & BIT(12 + (i >> 1)))
                 continue;
+
+            for (int j = 0; j < size; j++)
+            {
+                mixerLeft[j]  += left[j];
+                mixerRight[j] += right[j];
+            }
+            continue;
         }
 
         // Add the channel to the mixer
-        mixerLeft  += dataLeft;
-        mixerRight += dataRight;
+        mixChannel(data, size, volume, panValue, mixerLeft, mixerRight);
     }
 
-    // Capture sound
-    for (int i = 0; i < 2; i++)
+    for (int j = 0; j < count; j++)
     {
-        // Skip disabled capture channels
-        if (!(sndCapCnt[i] & BIT(7)))
-            continue;
-
-        // Increment the timer for the length of a sample
-        sndCapTimers[i] += 512;
-        bool overflow = (sndCapTimers[i] < 512);
-
-        // Handle timer overflow
-        while (overflow)
+        // Capture sound
+        for (int i = 0; i < 2; i++)
         {
-            // Reload the timer
-            sndCapTimers[i] += soundTmr[1 + (i << 1)];
-            overflow = (sndCapTimers[i] < soundTmr[1 + (i << 1)]);
+            // Skip disabled capture channels
+            if (!(sndCapCnt[i] & BIT(7)))
+                continue;
 
-            // Get a sample from the mixer, clamped to be within range
-            int64_t sample = ((i == 0) ? mixerLeft : mixerRight);
-            if (sample >  0x7FFFFF) sample =  0x7FFFFF;
-            if (sample < -0x800000) sample = -0x800000;
+            // Increment the timer for the length of a sample
+            sndCapTimers[i] += 512;
+            bool overflow = (sndCapTimers[i] < 512);
 
-            // Write a sample to the buffer
-            if (sndCapCnt[i] & BIT(3)) // PCM8
+            // Handle timer overflow
+            while (overflow)
             {
-                core->memory.write<uint8_t>(1, sndCapCurrent[i], sample >> 16);
-                sndCapCurrent[i]++;
-            }
-            else // PCM16
-            {
-                core->memory.write<uint16_t>(1, sndCapCurrent[i], sample >> 8);
-                sndCapCurrent[i] += 2;
-            }
+                // Reload the timer
+                sndCapTimers[i] += soundTmr[1 + (i << 1)];
+                overflow = (sndCapTimers[i] < soundTmr[1 + (i << 1)]);
 
-            // Repeat or end the capture if the end of the buffer is reached
-            if (sndCapCurrent[i] >= sndCapDad[i] + sndCapLen[i] * 4)
-            {
-                if (sndCapCnt[i] & BIT(2)) // One-shot
+                // Get a sample from the mixer, clamped to be within range
+                int32_t sample = ((i == 0) ? mixerLeft[j] : mixerRight[j]);
+                if (sample >  0x7FFFFF) sample =  0x7FFFFF;
+                if (sample < -0x800000) sample = -0x800000;
+
+                // Write a sample to the buffer
+                if (sndCapCnt[i] & BIT(3)) // PCM8
                 {
-                    sndCapCnt[i] &= ~BIT(7);
-                    continue;
+                    core->memory.write<uint8_t>(1, sndCapCurrent[i], sample >> 16);
+                    sndCapCurrent[i]++;
                 }
-                else // Loop
+                else // PCM16
                 {
-                    sndCapCurrent[i] = sndCapDad[i];
+                    core->memory.write<uint16_t>(1, sndCapCurrent[i], sample >> 8);
+                    sndCapCurrent[i] += 2;
+                }
+
+                // Repeat or end the capture if the end of the buffer is reached
+                if (sndCapCurrent[i] >= sndCapDad[i] + sndCapLen[i] * 4)
+                {
+                    if (sndCapCnt[i] & BIT(2)) // One-shot
+                    {
+                        sndCapCnt[i] &= ~BIT(7);
+                        continue;
+                    }
+                    else // Loop
+                    {
+                        sndCapCurrent[i] = sndCapDad[i];
+                    }
                 }
             }
         }
-    }
-
-    // Get the left output sample
-    int64_t sampleLeft;
-    switch ((mainSoundCnt & 0x0300) >> 8) // Left output selection
-    {
-        case 0: sampleLeft = mixerLeft;                         break; // Mixer
-        case 1: sampleLeft = channelsLeft[0];                   break; // Channel 1
-        case 2: sampleLeft = channelsLeft[1];                   break; // Channel 3
-        case 3: sampleLeft = channelsLeft[0] + channelsLeft[1]; break; // Channel 1 + 3
-    }
 
-    // Get the right output sample
-    int64_t sampleRight;
-    switch ((mainSoundCnt & 0x0C00) >> 10) // Right output selection
-    {
-        case 0: sampleRight = mixerRight;                          break; // Mixer
-        case 1: sampleRight = channelsRight[0];                    break; // Channel 1
-        case 2: sampleRight = channelsRight[1];                    break; // Channel 3
-        case 3: sampleRight = channelsRight[0] + channelsRight[1]; break; // Channel 1 + 3
-    }
+        // Get the left output sample
+        int64_t sampleLeft;
+        switch ((mainSoundCnt & 0x0300) >> 8) // Left output selection
+        {
+            case 0: sampleLeft = mixerLeft[j];                            break; // Mixer
+            case 1: sampleLeft = channelsLeft[0][j];                      break; // Channel 1
+            case 2: sampleLeft = channelsLeft[1][j];                      break; // Channel 3
+            case 3: sampleLeft = channelsLeft[0][j] + channelsLeft[1][j]; break; // Channel 1 + 3
+        }
 
-    // Apply the master volume
-    // The samples are now rounded to no fractional bits
-    int masterVol = (mainSoundCnt & 0x007F);
-    if (masterVol == 127) masterVol++;
-    sampleLeft  = (sampleLeft  * masterVol / 128) >> 8;
-    sampleRight = (sampleRight * masterVol / 128) >> 8;
+        // Get the right output sample
+        int64_t sampleRight;
+        switch ((mainSoundCnt & 0x0C00) >> 10) // Right output selection
+        {
+            case 0: sampleRight = mixerRight[j];                             break; // Mixer
+            case 1: sampleRight = channelsRight[0][j];                       break; // Channel 1
+            case 2: sampleRight = channelsRight[1][j];                       break; // Channel 3
+            case 3: sampleRight = channelsRight[0][j] + channelsRight[1][j]; break; // Channel 1 + 3
+        }
 
-    // Convert to 10-bit and apply the sound bias
-    sampleLeft  = (sampleLeft  >> 6) + soundBias;
-    sampleRight = (sampleRight >> 6) + soundBias;
+        // Apply the master volume
+        // The samples are now rounded to no fractional bits
+        int masterVol = (mainSoundCnt & 0x007F);
+        if (masterVol == 127) masterVol++;
+        sampleLeft  = (sampleLeft  * masterVol / 128) >> 8;
+        sampleRight = (sampleRight * masterVol / 128) >> 8;
+
+        // Convert to 10-bit and apply the sound bias
+        sampleLeft  = (sampleLeft  >> 6) + soundBias;
+        sampleRight = (sampleRight >> 6) + soundBias;
+
+        // Apply clipping
+        if (sampleLeft  < 0x000) sampleLeft  = 0x000;
+        if (sampleLeft  > 0x3FF) sampleLeft  = 0x3FF;
+        if (sampleRight < 0x000) sampleRight = 0x000;
+        if (sampleRight > 0x3FF) sampleRight = 0x3FF;
+
+        // Expand the samples to signed 16-bit values
+        sampleLeft  = (sampleLeft  - 0x200) << 5;
+        sampleRight = (sampleRight - 0x200) << 5;
+
+        // Send the samples to the audio output
+        if (output)
+            pushSample((sampleRight << 16) | (sampleLeft & 0xFFFF));
+    }
 
-    // Apply clipping
-    if (sampleLeft  < 0x000) sampleLeft  = 0x000;
-    if (sampleLeft  > 0x3FF) sampleLeft  = 0x3FF;
-    if (sampleRight < 0x000) sampleRight = 0x000;
-    if (sampleRight > 0x3FF) sampleRight = 0x3FF;
+    // Wait for the audio output if it's behind, once per block
+    if (output)
+        keepPace();
+}
 
-    // Expand the samples to signed 16-bit values and return them
-    sampleLeft  = (sampleLeft  - 0x200) << 5;
-    sampleRight = (sampleRight - 0x200) << 5;
+uint64_t Spu::takeSampleHash()
+{
+    // Return the hash of the samples output since the last call, and start over
+    uint64_t hash = sampleHash;
+    sampleHash = 0xCBF29CE484222325;
+    return hash;
+}
 
-    if (bufferSize > 0)
+void Spu::pushSample(uint32_t sample)
+{
+    // Fold the sample into a 64-bit FNV-1a hash if enabled
+    if (hashSamples)
     {
-        // Write the samples to the buffer
-        bufferIn[bufferPointer++] = (sampleRight << 16) | (sampleLeft & 0xFFFF);
-
-        // Handle a full buffer
-        if (bufferPointer == bufferSize)
-            swapBuffers();
+        for (int i = 0; i < 32; i += 8)
+            sampleHash = (sampleHash ^ ((sample >> i) & 0xFF)) * 0x100000001B3;
     }
 
-    // Reschedule the task for the next sample
-    core->schedule(NDS_SPU_SAMPLE, 512 * 2);
+    // Add a sample to the ring, or drop it if the audio output has fallen too far behind
+    uint32_t head = ringHead.load(std::memory_order_relaxed);
+    if (head - ringTail.load(std::memory_order_acquire) >= SPU_RING_SIZE) return;
+    uint32_t index = head & (SPU_RING_SIZE - 1);
+    ring[index] = sample;
+
+    // Mirror the start of the ring past its end, so the resampler can read across the wrap
+    if (index < SPU_TAPS)
+        ring[index + SPU_RING_SIZE] = sample;
+    ringHead.store(head + 1, std::memory_order_release);
 }
 
-void Spu::swapBuffers()
+void Spu::keepPace()
 {
-    // Wait until the buffer has been played, keeping the emulator throttled to 60 FPS
-    // Synchronizing to the audio eliminites the potential for nasty audio crackles
-    if (Settings::fpsLimiter == 2) // Accurate
-    {
-        std::chrono::steady_clock::time_point waitTime = std::chrono::steady_clock::now();
-        while (ready.load() && std::chrono::steady_clock::now() - waitTime <= std::chrono::microseconds(1000000));
-    }
-    else if (Settings::fpsLimiter == 1) // Light
+    // Frontends pace frames themselves, and the output resampler absorbs small drift from the audio clock
+    // This only holds the emulator back if audio builds up well past the target latency, to avoid overruns
+    if (!Settings::fpsLimiter || !playing.load(std::memory_order_relaxed))
+        return;
+
+    // Wait until the buffered audio is back down to twice the target latency
+    uint32_t target = latencyTarget() * 2;
+    if (ringHead.load(std::memory_order_relaxed) - ringTail.load(std::memory_order_acquire) <= target)
+        return;
+    std::chrono::steady_clock::time_point waitTime = std::chrono::steady_clock::now();
+    while (ringHead.load(std::memory_order_relaxed) - ringTail.load(std::memory_order_acquire) > target)
     {
-        std::unique_lock<std::mutex> lock(mutex1);
-        cond1.wait_for(lock, std::chrono::microseconds(1000000), [&]{ return !ready.load(); });
-    }
-
-    // Swap the buffers
-    SWAP(bufferOut, bufferIn);
+        // Stop following the output if it hasn't pulled samples in a while, until it does again
+        if (std::chrono::steady_clock::now() - waitTime > std::chrono::microseconds(1000000 / 60))
+        {
+            playing.store(false, std::memory_order_relaxed);
+            return;
+        }
 
-    // Signal that the buffer is ready to play
-    {
-        std::lock_guard<std::mutex> guard(mutex2);
-        ready.store(true);
-        cond2.notify_one();
+        // Spin for accurate timing, or sleep to save CPU cycles
+        if (Settings::fpsLimiter == 2) // Accurate
+            std::this_thread::yield();
+        else // Light
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
-
-    // Reset the buffer pointer
-    bufferPointer = 0;
 }
 
 void Spu::startChannel(int channel)
@@ -741,6 +974,9 @@ void Spu::startChannel(int channel)
             if (adpcmIndex[channel] > 88) adpcmIndex[channel] = 88;
             adpcmToggle[channel] = false;
             soundCurrent[channel] += 4;
+
+            // Use the cache for the sound if it's enabled
+            adpcmBlocks[channel] = Settings::adpcmCache ? getAdpcmBlock(channel) : nullptr;
             break;
         }
 
@@ -755,8 +991,128 @@ void Spu::startChannel(int channel)
         }
     }
 
-    // Enable the channel
+    // Enable the channel, and mark the pages it reads from
     enabled |= BIT(channel);
+    updateStreamPages();
+}
+
+bool Spu::getPages(uint32_t start, uint32_t end, std::vector<uint32_t> &pages)
+{
+    // Add the tracking pages that a range of ARM7 memory is in, returning false if any of it can't be tracked
+    // Guest pages don't always line up with tracking pages, like in VRAM after the 2KB palette, so one can span two
+    bool tracked = true;
+    for (uint32_t address = start; address < end; address = (address & ~0xFFF) + 0x1000)
+    {
+        uint8_t *data = core->memory.getCodePointer(1, address);
+        if (!data)
+        {
+            tracked = false;
+            continue;
+        }
+
+        uint32_t index = core->memory.getCodeIndex(data);
+        uint32_t size = std::min(end - address, 0x1000 - (address & 0xFFF));
+        for (uint32_t page = index >> 12; page <= (index + size - 1) >> 12; page++)
+        {
+            if (pages.empty() || pages.back() != page)
+                pages.push_back(page);
+        }
+    }
+    return tracked;
+}
+
+void Spu::updateStreamPages()
+{
+    // Clear the marks from the last update
+    for (size_t i = 0; i < streamPages.size(); i++)
+        core->memory.unmarkCode(3, streamPages[i]);
+    streamPages.clear();
+    streamChannels = enabled;
+
+    // Find the pages that playing channels read sound data from, limited to 4MB since main RAM mirrors past that
+    for (int i = 0; i < 16; i++)
+    {
+        // Skip disabled channels, and pulse and noise channels since they don't read memory
+        if (!(enabled & BIT(i)) || ((soundCnt[i] & 0x60000000) >> 29) == 3)
+            continue;
+
+        uint32_t size = std::min((soundPnt[i] + soundLen[i]) * 4, 0x400000U);
+        getPages(soundSad[i], soundSad[i] + size, streamPages);
+    }
+
+    // Mark the pages so writes to them mix the samples that are due first, since blocks are otherwise mixed late
+    for (size_t i = 0; i < streamPages.size(); i++)
+        core->memory.markCode(3, streamPages[i]);
+}
+
+AdpcmBlock *Spu::getAdpcmBlock(int channel)
+{
+    // Find the range of the sound, including the header
+    uint32_t start = soundSad[channel];
+    uint32_t end = start + (soundPnt[channel] + soundLen[channel]) * 4;
+    if ((end - start) * 2 > ADPCM_BLOCK_LIMIT)
+        return nullptr;
+
+    // Reuse a cached block if it covers the sound and starts with the same header
+    uint32_t header = (adpcmIndex[channel] << 16) | (uint16_t)adpcmValue[channel];
+    auto it = adpcmCache.find(start);
+    if (it != adpcmCache.end())
+    {
+        if (it->second.end >= end && it->second.states[0] == header)
+            return &it->second;
+        dropAdpcmBlock(start);
+    }
+
+    // Drop the whole cache if it's grown too large
+    if (adpcmCacheSize > ADPCM_CACHE_LIMIT)
+    {
+        for (int i = 0; i < 16; i++)
+            adpcmBlocks[i] = nullptr;
+        adpcmCache.clear();
+        adpcmCacheSize = 0;
+    }
+
+    // Find the tracking pages of the sound, which must all be in memory that writes can be tracked in
+    AdpcmBlock block;
+    block.end = end;
+    if (!getPages(start, end, block.pages))
+        return nullptr;
+
+    // Mark the pages so the block is dropped if they're written to, and add the block to the cache
+    for (size_t i = 0; i < block.pages.size(); i++)
+        core->memory.markCode(2, block.pages[i]);
+    block.states.push_back(header);
+    adpcmCacheSize++;
+    return &(adpcmCache[start] = block);
+}
+
+void Spu::dropAdpcmBlock(uint32_t start)
+{
+    // Stop any channels from using a block, and remove it from the cache
+    auto it = adpcmCache.find(start);
+    for (int i = 0; i < 16; i++)
+    {
+        if (adpcmBlocks[i] == &it->second)
+            adpcmBlocks[i] = nullptr;
+    }
+    adpcmCacheSize -= it->second.states.size();
+    adpcmCache.erase(it);
+}
+
+void Spu::invalidateAdpcm(uint32_t page)
+{
+    // Find cached blocks that were decoded from a page of memory that was written to
+    std::vector<uint32_t> dropped;
+    for (auto it = adpcmCache.begin(); it != adpcmCache.end(); it++)
+    {
+        std::vector<uint32_t> &pages = it->second.pages;
+        if (std::find(pages.begin(), pages.end(), page) != pages.end())
+            dropped.push_back(it->first);
+    }
+
+    // Drop the blocks
+    for (size_t i = 0; i < dropped.size(); i++)
+        dropAdpcmBlock(dropped[i]);
 }
 
 void Spu::gbaFifoTimer(int timer)
@@ -867,17 +1223,11 @@ void Spu::writeGbaMainSoundCntH(uint16_t mask, uint16_t value)
 
     // Empty FIFO A if requested
     if (value & BIT(11))
-    {
-        while (!gbaFifoA.empty())
-            gbaFifoA.pop();
-    }
+        gbaFifoA.clear();
 
     // Empty FIFO B if requested
     if (value & BIT(15))
-    {
-        while (!gbaFifoB.empty())
-            gbaFifoB.pop();
-    }
+        gbaFifoB.clear();
 }
 
 void Spu::writeGbaMainSoundCntX(uint8_t value)
@@ -918,7 +1268,7 @@ void Spu::writeGbaFifoA(uint32_t mask, uint32_t value)
     // Push PCM8 data to the GBA sound FIFO A
     for (int i = 0; i < 32; i += 8)
     {
-        if (gbaFifoA.size() < 32 && (mask & (0xFF << i)))
+        if (!gbaFifoA.full() && (mask & (0xFF << i)))
             gbaFifoA.push(value >> i);
     }
 }
@@ -928,13 +1278,16 @@ void Spu::writeGbaFifoB(uint32_t mask, uint32_t value)
     // Push PCM8 data to the GBA sound FIFO B
     for (int i = 0; i < 32; i += 8)
     {
-        if (gbaFifoB.size() < 32 && (mask & (0xFF << i)))
+        if (!gbaFifoB.full() && (mask & (0xFF << i)))
             gbaFifoB.push(value >> i);
     }
 }
 
 void Spu::writeSoundCnt(int channel, uint32_t mask, uint32_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     bool enable = (!(soundCnt[channel] & BIT(31)) && (value & BIT(31)));
 
     // Write to one of the SOUNDCNT registers
@@ -950,6 +1303,9 @@ void Spu::writeSoundCnt(int channel, uint32_t mask, uint32_t value)
 
 void Spu::writeSoundSad(int channel, uint32_t mask, uint32_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to one of the SOUNDSAD registers
     mask &= 0x07FFFFFC;
     soundSad[channel] = (soundSad[channel] & ~mask) | (value & mask);
@@ -966,25 +1322,45 @@ void Spu::writeSoundSad(int channel, uint32_t mask, uint32_t value)
 
 void Spu::writeSoundTmr(int channel, uint16_t mask, uint16_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to one of the SOUNDTMR registers
     soundTmr[channel] = (soundTmr[channel] & ~mask) | (value & mask);
 }
 
 void Spu::writeSoundPnt(int channel, uint16_t mask, uint16_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to one of the SOUNDPNT registers
     soundPnt[channel] = (soundPnt[channel] & ~mask) | (value & mask);
+
+    // Update the marked pages if the sound's length changed while playing
+    if (enabled & BIT(channel))
+        updateStreamPages();
 }
 
 void Spu::writeSoundLen(int channel, uint32_t mask, uint32_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to one of the SOUNDLEN registers
     mask &= 0x003FFFFF;
     soundLen[channel] = (soundLen[channel] & ~mask) | (value & mask);
+
+    // Update the marked pages if the sound's length changed while playing
+    if (enabled & BIT(channel))
+        updateStreamPages();
 }
 
 void Spu::writeMainSoundCnt(uint16_t mask, uint16_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     bool enable = (!(mainSoundCnt & BIT(15)) && (value & BIT(15)));
 
     // Write to the main SOUNDCNT register
@@ -1009,6 +1385,9 @@ void Spu::writeMainSoundCnt(uint16_t mask, uint16_t value)
 
 void Spu::writeSoundBias(uint16_t mask, uint16_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to the SOUNDBIAS register
     mask &= 0x03FF;
     soundBias = (soundBias & ~mask) | (value & mask);
@@ -1016,6 +1395,9 @@ void Spu::writeSoundBias(uint16_t mask, uint16_t value)
 
 void Spu::writeSndCapCnt(int channel, uint8_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Start the capture if the enable bit changes from 0 to 1
     if (!(sndCapCnt[channel] & BIT(7)) && (value & BIT(7)))
     {
@@ -1023,12 +1405,18 @@ void Spu::writeSndCapCnt(int channel, uint8_t value)
         sndCapTimers[channel] = soundTmr[1 + (channel << 1)];
     }
 
-    // Write to one of the SNDCAPCNT registers
+    // Write to one of the SNDCAPCNT registers, switching between block and per-sample mixing if capturing changed
+    bool capturing = (sndCapCnt[0] | sndCapCnt[1]) & BIT(7);
     sndCapCnt[channel] = (value & 0x8F);
+    if (capturing != bool((sndCapCnt[0] | sndCapCnt[1]) & BIT(7)))
+        scheduleSample();
 }
 
 void Spu::writeSndCapDad(int channel, uint32_t mask, uint32_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to one of the SNDCAPDAD registers
     mask &= 0x07FFFFFC;
     sndCapDad[channel] = (sndCapDad[channel] & ~mask) | (value & mask);
@@ -1040,10 +1428,27 @@ void Spu::writeSndCapDad(int channel, uint32_t mask, uint32_t value)
 
 void Spu::writeSndCapLen(int channel, uint16_t mask, uint16_t value)
 {
+    // Mix samples up to now before the change takes effect
+    catchUp();
+
     // Write to one of the SNDCAPLEN registers
     sndCapLen[channel] = (sndCapLen[channel] & ~mask) | (value & mask);
 }
 
+uint32_t Spu::readSoundCnt(int channel)
+{
+    // Mix samples up to now, since one-shot sounds clear their busy bit when they end
+    catchUp();
+    return soundCnt[channel];
+}
+
+uint8_t Spu::readSndCapCnt(int channel)
+{
+    // Mix samples up to now, since one-shot captures clear their busy bit when they end
+    catchUp();
+    return sndCapCnt[channel];
+}
+
 uint8_t Spu::readGbaSoundCntL(int channel)
 {
     // Read from one of the GBA SOUNDCNT_L registers
@@ -1070,3 +1475,74 @@ uint8_t Spu::readGbaWaveRam(int index)
     // Read from the currently inactive GBA wave RAM bank
     return gbaWaveRam[!(gbaSoundCntL[1] & BIT(6))][index];
 }
+
+void Spu::syncState(SaveState &state)
+{
+    // Sync the GBA channel state
+    // The output buffers only hold samples already mixed for the host, so they aren't included
+    state.sync(gbaFrameSequencer);
+    state.sync(gbaSoundTimers);
+    state.sync(gbaEnvelopes);
+    state.sync(gbaEnvTimers);
+    state.sync(gbaSweepTimer);
+    state.sync(gbaWaveDigit);
+    state.sync(gbaNoiseValue);
+    state.sync(gbaWaveRam);
+    state.sync(gbaFifoA);
+    state.sync(gbaFifoB);
+    state.sync(gbaSampleA);
+    state.sync(gbaSampleB);
+
+    // Sync the NDS channel state
+    // Samples that are due but not mixed yet stay pending, since the cycle of the next one is included
+    state.sync(nextSample);
+    state.sync(enabled);
+    state.sync(adpcmValue);
+    state.sync(adpcmLoopValue);
+    state.sync(adpcmIndex);
+    state.sync(adpcmLoopIndex);
+    state.sync(adpcmToggle);
+    state.sync(dutyCycles);
+    state.sync(noiseValues);
+    state.sync(soundCurrent);
+    state.sync(soundTimers);
+    state.sync(sndCapCurrent);
+    state.sync(sndCapTimers);
+
+    // Sync the sound registers
+    state.sync(gbaSoundCntL);
+    state.sync(gbaSoundCntH);
+    state.sync(gbaSoundCntX);
+    state.sync(gbaMainSoundCntL);
+    state.sync(gbaMainSoundCntH);
+    state.sync(gbaMainSoundCntX);
+    state.sync(gbaSoundBias);
+    state.sync(soundCnt);
+    state.sync(soundSad);
+    state.sync(soundTmr);
+    state.sync(soundPnt);
+    state.sync(soundLen);
+    state.sync(mainSoundCnt);
+    state.sync(soundBias);
+    state.sync(sndCapCnt);
+    state.sync(sndCapDad);
+    state.sync(sndCapLen);
+    if (!state.isLoading()) return;
+
+    // Drop the ADPCM cache if all of memory was replaced; snapshots drop only blocks from pages that changed
+    if (!state.isSnapshot())
+    {
+        adpcmCache.clear();
+        adpcmCacheSize = 0;
+    }
+
+    // Reconnect the channels to any blocks that are still cached for their sounds
+    for (int i = 0; i < 16; i++)
+    {
+        auto it = adpcmCache.find(soundSad[i]);
+        adpcmBlocks[i] = (it != adpcmCache.end()) ? &it->second : nullptr;
+    }
+
+    // Mark the pages that the loaded channels read from
+    updateStreamPages();
+}
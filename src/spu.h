@@ -21,23 +21,56 @@
 #define SPU_H
 
 #include <atomic>
-#include <condition_variable>
 #include <cstdint>
-#include <queue>
-#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "ring_buffer.h"
+
+// Number of samples the SPU mixes at a time, unless something accesses the sound registers sooner
+#define SPU_BLOCK 32
+
+// Number of samples the ring between the emulator and the audio output can hold, about 250ms at 32768Hz
+#define SPU_RING_SIZE 0x2000
+
+// Size of the windowed-sinc kernel used to resample the output, and the number of sub-sample phases it's built for
+#define SPU_TAPS   8
+#define SPU_PHASES 64
+
+// Number of decoded ADPCM states that can be cached before the cache is dropped, and the most from one sound
+#define ADPCM_CACHE_LIMIT (4 << 20)
+#define ADPCM_BLOCK_LIMIT (1 << 20)
 
 class Core;
+class SaveState;
+
+// Decoded states of an ADPCM sound, each packed as the index in the high half and the value in the low half
+// The first is the header, and each nibble's result follows the state it was decoded from
+struct AdpcmBlock
+{
+    uint32_t end = 0;
+    std::vector<uint32_t> pages;
+    std::vector<uint32_t> states;
+};
 
 class Spu
 {
     public:
         Spu(Core *core);
-        ~Spu();
 
-        uint32_t *getSamples(int count);
+        void syncState(SaveState &state);
+
+        uint32_t *getSamples(int count, int rate = 32768);
+        void setOutput(bool enabled) { output = enabled; }
+        void setSampleHash(bool enabled) { hashSamples = enabled; }
+        uint64_t takeSampleHash();
+        uint32_t getBufferedSamples() { return ringHead.load(std::memory_order_relaxed) - ringTail.load(std::memory_order_acquire); }
         void runGbaSample();
         void runSample();
+        void resetCycles();
         void gbaFifoTimer(int timer);
+        void invalidateAdpcm(uint32_t page);
+        void catchUp();
 
         uint8_t  readGbaSoundCntL(int channel);
         uint16_t readGbaSoundCntH(int channel);
@@ -48,10 +81,10 @@ class Spu
         uint16_t readGbaSoundBias()     { return gbaSoundBias;     }
         uint8_t  readGbaWaveRam(int index);
 
-        uint32_t readSoundCnt(int channel)  { return soundCnt[channel];  }
+        uint32_t readSoundCnt(int channel);
         uint16_t readMainSoundCnt()         { return mainSoundCnt;       }
         uint16_t readSoundBias()            { return soundBias;          }
-        uint8_t  readSndCapCnt(int channel) { return sndCapCnt[channel]; }
+        uint8_t  readSndCapCnt(int channel);
         uint32_t readSndCapDad(int channel) { return sndCapDad[channel]; }
 
         void writeGbaSoundCntL(int channel, uint8_t value);
@@ -79,12 +112,24 @@ class Spu
     private:
         Core *core;
 
-        uint32_t *bufferIn = nullptr, *bufferOut = nullptr;
-        int bufferSize = 0, bufferPointer = 0;
-
-        std::condition_variable cond1, cond2;
-        std::mutex mutex1, mutex2;
-        std::atomic<bool> ready;
+        // Mixed samples are handed to the audio thread through a single-producer single-consumer ring
+        // Neither side takes a lock; the emulator only waits, with a time limit, when the FPS limiter needs it to
+        uint32_t ring[SPU_RING_SIZE + SPU_TAPS] = {};
+        std::atomic<uint32_t> ringHead, ringTail;
+        std::atomic<bool> playing;
+        bool output = true;
+
+        // Running hash of output samples for checking replays, taken before they can be dropped by the ring
+        bool hashSamples = false;
+        uint64_t sampleHash = 0xCBF29CE484222325;
+
+        // Playback state owned by the audio thread
+        // The output buffer is allocated up front and only grows, so the audio callback doesn't allocate
+        uint32_t lastSample = 0;
+        std::vector<uint32_t> outBuffer = std::vector<uint32_t>(4096);
+        double ringFraction = 0;
+        int16_t resampleFilter[SPU_PHASES][SPU_TAPS] = {};
+        int resampleRate = 0;
 
         int gbaFrameSequencer = 0;
         int gbaSoundTimers[4] = {};
@@ -95,11 +140,17 @@ class Spu
         uint16_t gbaNoiseValue = 0;
 
         uint8_t gbaWaveRam[2][16] = {};
-        std::queue<int8_t> gbaFifoA, gbaFifoB;
+        RingBuffer<int8_t, 32> gbaFifoA, gbaFifoB;
         int8_t gbaSampleA = 0, gbaSampleB = 0;
 
+        // Samples are mixed lazily, catching up to the current cycle when the sound registers are accessed
+        uint32_t nextSample = 512 * 2;
         uint16_t enabled = 0;
 
+        // Host pages that playing channels read from, which are marked so writes to them mix the samples due before they land
+        std::vector<uint32_t> streamPages;
+        uint16_t streamChannels = 0;
+
         static const int indexTable[8];
         static const int16_t adpcmTable[89];
 
@@ -107,6 +158,11 @@ class Spu
         int adpcmIndex[16] = {}, adpcmLoopIndex[16] = {};
         bool adpcmToggle[16] = {};
 
+        // Sounds that were decoded before are replayed from the cache, keyed by their start address
+        std::unordered_map<uint32_t, AdpcmBlock> adpcmCache;
+        AdpcmBlock *adpcmBlocks[16] = {};
+        size_t adpcmCacheSize = 0;
+
         int dutyCycles[6] = {};
         uint16_t noiseValues[2] = {};
         uint32_t soundCurrent[16] = {};
@@ -133,8 +189,21 @@ class Spu
         uint32_t sndCapDad[2] = {};
         uint16_t sndCapLen[2] = {};
 
-        void swapBuffers();
+        void scheduleSample();
+        int runChannel(int channel, int32_t *data, int count);
+        static void mixChannel(int32_t *data, int count, int volume, int pan, int32_t *left, int32_t *right);
+        void mixSamples(int count);
+
+        static int latencyTarget();
+        void updateFilter(int rate);
+        static uint32_t filterSample(const uint32_t *data, const int16_t *filter);
+        void pushSample(uint32_t sample);
+        void keepPace();
         void startChannel(int channel);
+        bool getPages(uint32_t start, uint32_t end, std::vector<uint32_t> &pages);
+        void updateStreamPages();
+        AdpcmBlock *getAdpcmBlock(int channel);
+        void dropAdpcmBlock(uint32_t start);
 };
 
 #endif // SPU_H
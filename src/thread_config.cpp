@@ -0,0 +1,91 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdint>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__SWITCH__)
+#include <switch.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "thread_config.h"
+#include "defines.h"
+#include "settings.h"
+
+void ThreadConfig::apply(ThreadRole role)
+{
+    // Get the cores a thread can run on, with 0 leaving it up to the host
+    uint32_t mask;
+    switch (role)
+    {
+        case THREAD_EMU:    mask = Settings::emuAffinity;    break;
+        case THREAD_RENDER: mask = Settings::renderAffinity; break;
+        case THREAD_AUDIO:  mask = Settings::audioAffinity;  break;
+        default:            mask = 0;                        break;
+    }
+
+#if defined(_WIN32)
+    // Pin the thread and set its priority on Windows
+    if (mask)
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+    if (Settings::threadPriority)
+    {
+        const int priorities[] = { THREAD_PRIORITY_HIGHEST, THREAD_PRIORITY_ABOVE_NORMAL,
+            THREAD_PRIORITY_TIME_CRITICAL, THREAD_PRIORITY_BELOW_NORMAL };
+        SetThreadPriority(GetCurrentThread(), priorities[role]);
+    }
+#elif defined(__SWITCH__)
+    // Pin the thread and set its priority on the Switch, where lower values run first
+    if (mask)
+        svcSetThreadCoreMask(CUR_THREAD_HANDLE, __builtin_ctz(mask), mask);
+    if (Settings::threadPriority)
+    {
+        const int priorities[] = { 0x2B, 0x2C, 0x2A, 0x3B };
+        svcSetThreadPriority(CUR_THREAD_HANDLE, priorities[role]);
+    }
+#elif defined(__linux__)
+    // Pin the thread and set its nice value on Linux and Android, where each thread has its own
+    // Raising priority needs permission on desktop Linux, so it only takes effect where it's allowed
+    if (mask)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = 0; i < 32; i++)
+        {
+            if (mask & BIT(i))
+                CPU_SET(i, &set);
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    if (Settings::threadPriority)
+    {
+        const int priorities[] = { -8, -4, -16, 10 };
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), priorities[role]);
+    }
+#else
+    // Thread placement isn't supported on this host
+    (void)mask;
+#endif
+}
@@ -0,0 +1,42 @@
+/*
+    Copyright 2019-2023 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREAD_CONFIG_H
+#define THREAD_CONFIG_H
+
+enum ThreadRole
+{
+    THREAD_EMU = 0,   // Thread that runs the core
+    THREAD_RENDER,    // Worker threads that draw 2D and 3D graphics
+    THREAD_AUDIO,     // Thread that feeds samples to the audio output
+    THREAD_BACKGROUND // Threads for saving and other housekeeping
+};
+
+// Placement of threads on the host's CPU cores, configured by the thread settings
+// Each thread applies its role to itself when it starts, and anything the host doesn't support is ignored
+class ThreadConfig
+{
+    public:
+        static void apply(ThreadRole role);
+
+    private:
+        ThreadConfig() {} // Private to prevent instantiation
+};
+
+#endif // THREAD_CONFIG_H
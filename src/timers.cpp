@@ -20,11 +20,55 @@
 #include "timers.h"
 #include "core.h"
 
+bool Timers::isCounting(int timer)
+{
+    // Check if a timer is enabled and counts on its own, rather than in count-up mode
+    return (tmCntH[timer] & BIT(7)) && (timer == 0 || !(tmCntH[timer] & BIT(2)));
+}
+
+bool Timers::needsOverflow(int timer)
+{
+    // Check if anything reacts to a timer's overflows, which are only scheduled when that's the case
+    // Otherwise the counter can be worked out from the end cycle when it's read, saving events for fast timers
+    return isCounting(timer) && ((tmCntH[timer] & BIT(6)) || (timer < 3 && (tmCntH[timer + 1] & BIT(2))) ||
+        (core->gbaMode && timer < 2));
+}
+
+void Timers::update(int timer)
+{
+    // Move the end cycle of a timer past the current cycle if it overflowed without a scheduled event
+    if (!isCounting(timer) || needsOverflow(timer) || (int32_t)(core->globalCycles - endCycles[timer]) < 0)
+        return;
+
+    // Count all of the overflows that passed at once, each of which reloads the timer
+    uint32_t period = (0x10000 - tmCntL[timer]) << shifts[timer];
+    endCycles[timer] += ((core->globalCycles - endCycles[timer]) / period + 1) * period;
+    timers[timer] = tmCntL[timer];
+}
+
+void Timers::scheduleOverflow(int timer, bool wasLazy, bool wasScheduled, bool dirty)
+{
+    // Schedule the next overflow if something reacts to it and it changed or was running without events
+    if (needsOverflow(timer))
+    {
+        if (dirty || wasLazy)
+            core->schedule(SchedTask(TIMER9_OVERFLOW0 + (cpu << 2) + timer), endCycles[timer] - core->globalCycles);
+    }
+    else if (wasScheduled && isCounting(timer))
+    {
+        // Stop scheduling overflows that nothing reacts to anymore
+        core->unschedule(SchedTask(TIMER9_OVERFLOW0 + (cpu << 2) + timer));
+    }
+}
+
 void Timers::resetCycles()
 {
     // Adjust timer end cycles for a global cycle reset
     for (int i = 0; i < 4; i++)
+    {
+        update(i);
         endCycles[i] -= core->globalCycles;
+    }
 }
 
 void Timers::overflow(int timer)
@@ -34,12 +78,14 @@ void Timers::overflow(int timer)
     if (!(tmCntH[timer] & BIT(7)) || ((timer == 0 || !(tmCntH[timer] & BIT(2))) && endCycles[timer] != core->globalCycles))
         return;
 
-    // Reload the timer and schedule another overflow if not in count-up mode
+    // Reload the timer and set the next overflow if not in count-up mode
+    // It's only scheduled if something reacts to it; otherwise reads will count the overflows
     timers[timer] = tmCntL[timer];
     if (timer == 0 || !(tmCntH[timer] & BIT(2)))
     {
-        core->schedule(SchedTask(TIMER9_OVERFLOW0 + (cpu << 2) + timer), (0x10000 - timers[timer]) << shifts[timer]);
         endCycles[timer] = core->globalCycles + ((0x10000 - timers[timer]) << shifts[timer]);
+        if (needsOverflow(timer))
+            core->schedule(SchedTask(TIMER9_OVERFLOW0 + (cpu << 2) + timer), (0x10000 - timers[timer]) << shifts[timer]);
     }
 
     // Trigger a timer overflow IRQ if enabled
@@ -60,6 +106,8 @@ void Timers::writeTmCntL(int timer, uint16_t mask, uint16_t value)
 {
     // Write to one of the TMCNT_L registers
     // This value doesn't affect the current counter, and is instead used as the reload value
+    // Overflows that weren't scheduled are caught up first, so the ones that already passed use the old value
+    update(timer);
     tmCntL[timer] = (tmCntL[timer] & ~mask) | (value & mask);
 }
 
@@ -67,6 +115,15 @@ void Timers::writeTmCntH(int timer, uint16_t mask, uint16_t value)
 {
     bool dirty = false;
 
+    // Catch up on unscheduled overflows, since the write can change which timers need them scheduled
+    // The previous timer is included because the count-up bit decides if its overflows are needed
+    update(timer);
+    if (timer > 0) update(timer - 1);
+    bool wasLazy = isCounting(timer) && !needsOverflow(timer);
+    bool wasScheduled = needsOverflow(timer);
+    bool prevLazy = (timer > 0 && isCounting(timer - 1) && !needsOverflow(timer - 1));
+    bool prevScheduled = (timer > 0 && needsOverflow(timer - 1));
+
     // Update the current timer value if it's running on the scheduler
     if ((tmCntH[timer] & BIT(7)) && (timer == 0 || !(value & BIT(2))))
         timers[timer] = 0x10000 - ((endCycles[timer] - core->globalCycles) >> shifts[timer]);
@@ -94,18 +151,36 @@ void Timers::writeTmCntH(int timer, uint16_t mask, uint16_t value)
     mask &= 0x00C7;
     tmCntH[timer] = (tmCntH[timer] & ~mask) | (value & mask);
 
-    // Schedule a timer overflow if the timer changed and isn't in count-up mode
-    if (dirty && (tmCntH[timer] & BIT(7)) && (timer == 0 || !(tmCntH[timer] & BIT(2))))
-    {
-        core->schedule(SchedTask(TIMER9_OVERFLOW0 + (cpu << 2) + timer), (0x10000 - timers[timer]) << shifts[timer]);
+    // Set a new end cycle if the timer changed and isn't in count-up mode
+    if (dirty && isCounting(timer))
         endCycles[timer] = core->globalCycles + ((0x10000 - timers[timer]) << shifts[timer]);
-    }
+
+    // Schedule overflows for the timers that now need them, and stop the ones that don't
+    scheduleOverflow(timer, wasLazy, wasScheduled, dirty);
+    if (timer > 0) scheduleOverflow(timer - 1, prevLazy, prevScheduled, false);
+
+    // Cancel a pending overflow if the timer was disabled
+    if (!(tmCntH[timer] & BIT(7)))
+        core->unschedule(SchedTask(TIMER9_OVERFLOW0 + (cpu << 2) + timer));
 }
 
 uint16_t Timers::readTmCntL(int timer)
 {
     // Read the current timer value, updating it if it's running on the scheduler
     if ((tmCntH[timer] & BIT(7)) && (timer == 0 || !(tmCntH[timer] & BIT(2))))
+    {
+        update(timer);
         timers[timer] = 0x10000 - ((endCycles[timer] - core->globalCycles) >> shifts[timer]);
+    }
     return timers[timer];
 }
+
+void Timers::syncState(SaveState &state)
+{
+    // Sync the timer counters and registers
+    state.sync(timers);
+    state.sync(shifts);
+    state.sync(endCycles);
+    state.sync(tmCntL);
+    state.sync(tmCntH);
+}
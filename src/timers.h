@@ -23,12 +23,15 @@
 #include <cstdint>
 
 class Core;
+class SaveState;
 
 class Timers
 {
     public:
         Timers(Core *core, bool cpu): core(core), cpu(cpu) {}
 
+        void syncState(SaveState &state);
+
         void resetCycles();
         void overflow(int timer);
 
@@ -48,6 +51,11 @@ class Timers
 
         uint16_t tmCntL[4] = {};
         uint16_t tmCntH[4] = {};
+
+        bool isCounting(int timer);
+        bool needsOverflow(int timer);
+        void update(int timer);
+        void scheduleOverflow(int timer, bool wasLazy, bool wasScheduled, bool dirty);
 };
 
 #endif // TIMERS_H
@@ -18,13 +18,15 @@
 */
 
 #include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include "wifi.h"
 #include "core.h"
 
 #define MS_CYCLES 34418
 
-Wifi::Wifi(Core *core): core(core)
+Wifi::Wifi(Core *core): core(core), msCount(0)
 {
     // Set some default BB register values
     bbRegisters[0x00] = 0x6D;
@@ -34,14 +36,19 @@ Wifi::Wifi(Core *core): core(core)
 
 void Wifi::addConnection(Core *core)
 {
+    // Line up the cores' millisecond counts from this point, since they could have been running for different times
+    int64_t count = msCount, otherCount = core->wifi.msCount;
+    int64_t offset = otherCount - count;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
     // Add an external core to this one's connection list
     mutex.lock();
-    connections.push_back(&core->wifi);
+    connections.push_back({ &core->wifi, offset, otherCount, now, false });
     mutex.unlock();
 
     // Add this core to the external one's connection list
     core->wifi.mutex.lock();
-    core->wifi.connections.push_back(this);
+    core->wifi.connections.push_back({ this, -offset, count, now, false });
     core->wifi.mutex.unlock();
 }
 
@@ -49,14 +56,22 @@ void Wifi::remConnection(Core *core)
 {
     // Remove an external core from this one's connection list
     mutex.lock();
-    auto position = std::find(connections.begin(), connections.end(), &core->wifi);
-    connections.erase(position);
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+        if (connections[i].wifi != &core->wifi) continue;
+        connections.erase(connections.begin() + i);
+        break;
+    }
     mutex.unlock();
 
     // Remove this core from the external one's connection list
     core->wifi.mutex.lock();
-    position = std::find(core->wifi.connections.begin(), core->wifi.connections.end(), this);
-    core->wifi.connections.erase(position);
+    for (size_t i = 0; i < core->wifi.connections.size(); i++)
+    {
+        if (core->wifi.connections[i].wifi != this) continue;
+        core->wifi.connections.erase(core->wifi.connections.begin() + i);
+        break;
+    }
     core->wifi.mutex.unlock();
 }
 
@@ -69,9 +84,14 @@ void Wifi::scheduleInit()
 
 void Wifi::countMs()
 {
-    // Process any queued packets
-    if (!packets.empty())
+    // Advance the emulated time, staying close to connected cores, and receive packets that have arrived by now
+    // Frames that will be rolled back skip this, so they don't count towards the time or take packets meant for later
+    if (output)
+    {
+        msCount++;
+        syncConnections();
         processPackets();
+    }
 
     if (wUsCountcnt) // Counter enable
     {
@@ -121,19 +141,97 @@ void Wifi::sendInterrupt(int bit)
     }
 }
 
-void Wifi::processPackets()
+void Wifi::syncConnections()
+{
+    while (true)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int64_t count = msCount;
+        int64_t slowest = count;
+        std::vector<WifiConnection> resumed;
+        mutex.lock();
+
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            // Mark a connected core as stalled if its time hasn't changed in a while, such as when it's paused
+            WifiConnection &conn = connections[i];
+            int64_t otherCount = conn.wifi->msCount;
+            if (otherCount == conn.lastCount)
+            {
+                if (now - conn.lastChange > std::chrono::milliseconds(WIFI_SYNC_TIMEOUT))
+                    conn.stalled = true;
+            }
+            else
+            {
+                // Line the cores up again once a stalled core resumes, since this one kept going without it
+                if (conn.stalled)
+                {
+                    conn.offset = otherCount - count;
+                    conn.stalled = false;
+                    resumed.push_back(conn);
+                }
+                conn.lastCount = otherCount;
+                conn.lastChange = now;
+            }
+
+            // Find the emulated time of the active core that's furthest behind, in terms of this core's time
+            if (!conn.stalled)
+                slowest = std::min(slowest, otherCount - conn.offset);
+        }
+
+        mutex.unlock();
+
+        // Update the resumed cores' offsets to match, once this core's mutex is no longer held
+        for (size_t i = 0; i < resumed.size(); i++)
+            resumed[i].wifi->rebaseConnection(this, -resumed[i].offset);
+
+        // Wait for the other cores if this one is too far ahead
+        if (count - slowest <= WIFI_SYNC_WINDOW)
+            return;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+void Wifi::rebaseConnection(Wifi *wifi, int64_t offset)
 {
+    // Update the offset to another core after it lines itself up with this one
     mutex.lock();
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+        if (connections[i].wifi != wifi) continue;
+        connections[i].offset = offset;
+        break;
+    }
+    mutex.unlock();
+}
 
-    // Write all queued packets to the circular buffer
-    for (size_t i = 0; i < packets.size(); i++)
+void Wifi::processPackets()
+{
+    // Take the packets that are due, leaving any that were sent at a later time for another core
+    std::vector<WifiPacket> due;
+    packetMutex.lock();
+    for (size_t i = 0; i < packets.size();)
     {
-        uint16_t size = (packets[i][4] + 12) / 2;
+        if (packets[i].time > msCount)
+        {
+            i++;
+            continue;
+        }
+        due.push_back(std::move(packets[i]));
+        packets.erase(packets.begin() + i);
+    }
+    packetMutex.unlock();
+
+    // Write the packets to the circular buffer
+    for (size_t i = 0; i < due.size(); i++)
+    {
+        std::vector<uint16_t> &data = due[i].data;
+        size_t size = std::min<size_t>((data[4] + 12) / 2, data.size());
 
         for (size_t j = 0; j < size; j++)
         {
             // Write a half-word of the packet to memory
-            core->memory.write<uint16_t>(1, 0x4804000 + wRxbufWrcsr, packets[i][j]);
+            core->memory.write<uint16_t>(1, 0x4804000 + wRxbufWrcsr, data[j]);
 
             // Increment the circular buffer address
             wRxbufWrcsr += 2;
@@ -142,14 +240,9 @@ void Wifi::processPackets()
             wRxbufWrcsr &= 0x1FFE;
         }
 
-        delete[] packets[i];
-
         // Trigger a receive complete interrupt
         sendInterrupt(0);
     }
-
-    packets.clear();
-    mutex.unlock();
 }
 
 void Wifi::transfer(int index)
@@ -158,22 +251,24 @@ void Wifi::transfer(int index)
     uint16_t size = core->memory.read<uint16_t>(1, 0x4804000 + address + 0x0A) + 8;
     LOG("Sending packet on channel %d with size 0x%X\n", index, size);
 
+    // Read the packet from memory, and set its size in the outgoing header
+    WifiPacket packet;
+    packet.data.resize(std::max((size + 1) / 2, 5));
+    for (size_t j = 0; j < size; j += 2)
+        packet.data[j / 2] = core->memory.read<uint16_t>(1, 0x4804000 + address + j);
+    packet.data[4] = size - 12;
+
+    // Only send packets from frames that won't be rolled back
     mutex.lock();
 
-    for (size_t i = 0; i < connections.size(); i++)
+    for (size_t i = 0; output && i < connections.size(); i++)
     {
-        // Read the packet from memory
-        uint16_t *data = new uint16_t[size / 2];
-        for (size_t j = 0; j < size; j += 2)
-            data[j / 2] = core->memory.read<uint16_t>(1, 0x4804000 + address + j);
-
-        // Set the packet size in the outgoing header
-        data[4] = size - 12;
-
-        // Add the packet to the queue
-        connections[i]->mutex.lock();
-        connections[i]->packets.push_back(data);
-        connections[i]->mutex.unlock();
+        // Add the packet to each connected core's queue, timed for when it was sent in their terms
+        packet.time = msCount + connections[i].offset;
+        Wifi *wifi = connections[i].wifi;
+        wifi->packetMutex.lock();
+        wifi->packets.push_back(packet);
+        wifi->packetMutex.unlock();
     }
 
     mutex.unlock();
@@ -510,3 +605,46 @@ uint16_t Wifi::readWRxbufRdData()
 
     return value;
 }
+
+void Wifi::syncState(SaveState &state)
+{
+    // Sync whether the timer task is scheduled, since the scheduler is synced along with it
+    state.sync(scheduled);
+
+    // Sync the baseband and WiFi registers
+    // Connections and queued packets belong to the host session, so they aren't included
+    state.sync(bbRegisters);
+    state.sync(wModeWep);
+    state.sync(wIrf);
+    state.sync(wIe);
+    state.sync(wMacaddr);
+    state.sync(wBssid);
+    state.sync(wAidFull);
+    state.sync(wRxcnt);
+    state.sync(wPowerstate);
+    state.sync(wPowerforce);
+    state.sync(wRxbufBegin);
+    state.sync(wRxbufEnd);
+    state.sync(wRxbufWrcsr);
+    state.sync(wRxbufWrAddr);
+    state.sync(wRxbufRdAddr);
+    state.sync(wRxbufReadcsr);
+    state.sync(wRxbufGap);
+    state.sync(wRxbufGapdisp);
+    state.sync(wTxbufLoc);
+    state.sync(wBeaconInt);
+    state.sync(wTxreqRead);
+    state.sync(wUsCountcnt);
+    state.sync(wUsComparecnt);
+    state.sync(wPreBeacon);
+    state.sync(wBeaconCount);
+    state.sync(wRxbufCount);
+    state.sync(wTxbufWrAddr);
+    state.sync(wTxbufCount);
+    state.sync(wTxbufGap);
+    state.sync(wTxbufGapdisp);
+    state.sync(wPostBeacon);
+    state.sync(wBbWrite);
+    state.sync(wBbRead);
+    state.sync(wConfig);
+}
@@ -20,23 +20,52 @@
 #ifndef WIFI_H
 #define WIFI_H
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <mutex>
 #include <vector>
 
+// How many milliseconds of emulated time a connected core can run ahead of the others before it waits for them
+// Cores that don't advance for a real-time timeout are treated as stalled, so a paused core doesn't hold the others back
+#define WIFI_SYNC_WINDOW 8
+#define WIFI_SYNC_TIMEOUT 50
+
 class Core;
+class SaveState;
+
+// Link to another core, with the offset from this core's millisecond count to theirs
+// Their last seen count and when it changed are tracked to tell when they've stalled
+struct WifiConnection
+{
+    class Wifi *wifi;
+    int64_t offset;
+    int64_t lastCount;
+    std::chrono::steady_clock::time_point lastChange;
+    bool stalled;
+};
+
+// Packet sent by another core, delivered once this core reaches the millisecond it was sent at
+struct WifiPacket
+{
+    std::vector<uint16_t> data;
+    int64_t time;
+};
 
 class Wifi
 {
     public:
         Wifi(Core *core);
 
+        void syncState(SaveState &state);
+
         void addConnection(Core *core);
         void remConnection(Core *core);
 
         bool shouldSchedule() { return (!connections.empty() || wUsCountcnt) && !scheduled; }
         void scheduleInit();
         void countMs();
+        void setOutput(bool enabled) { output = enabled; }
 
         uint16_t readWModeWep()           { return wModeWep;         }
         uint16_t readWIrf()               { return wIrf;             }
@@ -111,10 +140,16 @@ class Wifi
     private:
         Core *core;
 
-        std::vector<Wifi*> connections;
-        std::vector<uint16_t*> packets;
+        // Connections are guarded by one mutex, and incoming packets by another that's never held while locking others
+        // Cores run on their own threads, and each one's emulated time is counted so they can keep pace with each other
+        // Only milliseconds with output enabled are counted, so frames emulated for run-ahead and rolled back don't count
+        std::vector<WifiConnection> connections;
+        std::vector<WifiPacket> packets;
         std::mutex mutex;
+        std::mutex packetMutex;
+        std::atomic<int64_t> msCount;
         bool scheduled = false;
+        bool output = true;
 
         uint8_t bbRegisters[0x100] = {};
 
@@ -159,6 +194,8 @@ class Wifi
         };
 
         void sendInterrupt(int bit);
+        void syncConnections();
+        void rebaseConnection(Wifi *wifi, int64_t offset);
         void processPackets();
         void transfer(int index);
 };